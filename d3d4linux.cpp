@@ -10,6 +10,7 @@
 //  See http://www.wtfpl.net/ for more details.
 //
 
+#include <new>
 #include <string>
 #include <vector>
 
@@ -20,6 +21,7 @@
 #include <d3dcompiler.h>
 
 #include <d3d4linux_common.h>
+#include <d3d4linux_snapshot.h>
 
 /* Allow multiple definitions of this GUID depending on whether we are using
  * d3dcompiler_43.dll or d3dcompiler_47.dll. Microsoft states that the GUID
@@ -33,266 +35,939 @@ D3D4LINUX_GUID(IID_ID3D11ShaderReflection_43,
 D3D4LINUX_GUID(IID_ID3D11ShaderReflection_47,
   0x8d536ca1, 0x0cca, 0x4956, 0xa8, 0x37, 0x78, 0x69, 0x63, 0x75, 0x55, 0x84);
 
-int main(void)
+/* Entry points of one compiler DLL, resolved once at startup */
+struct compiler
 {
-    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
-    int verbose = verbose_var && *verbose_var == '1';
+    int version;
+    HMODULE lib;
+
+    HRESULT (*compile)(void const *pSrcData, size_t SrcDataSize,
+                       char const *pFileName,
+                       D3D_SHADER_MACRO const *pDefines,
+                       ID3DInclude *pInclude,
+                       char const *pEntrypoint, char const *pTarget,
+                       uint32_t Flags1, uint32_t Flags2,
+                       ID3DBlob **ppCode, ID3DBlob **ppErrorMsgs);
+    HRESULT (*reflect)(void const *pSrcData,
+                       size_t SrcDataSize,
+                       REFIID pInterface,
+                       void **ppReflector);
+    HRESULT (*strip)(void const *pShaderBytecode,
+                     size_t BytecodeLength,
+                     uint32_t uStripFlags,
+                     ID3DBlob **ppStrippedBlob);
+    HRESULT (*disas)(void const *pSrcData,
+                     size_t SrcDataSize,
+                     uint32_t Flags,
+                     char const *szComments,
+                     ID3DBlob **ppDisassembly);
+    HRESULT (*preprocess)(void const *pSrcData, size_t SrcDataSize,
+                          char const *pSourceName,
+                          D3D_SHADER_MACRO const *pDefines,
+                          ID3DInclude *pInclude,
+                          ID3DBlob **ppCodeText, ID3DBlob **ppErrorMsgs);
+    HRESULT (*compress)(UINT uNumShaders, D3D_SHADER_DATA *pShaderData,
+                        UINT uFlags, ID3DBlob **ppCompressedData);
+    HRESULT (*decompress)(void const *pSrcData, size_t SrcDataSize,
+                          UINT uNumShaders, UINT uStartIndex, UINT *pIndices,
+                          UINT uFlags, ID3DBlob **ppShaders, UINT *pTotalShaders);
+};
+
+/* An include handler that asks the client for every file; the client
+ * numbers files in the order we opened them. Files are read into the
+ * buffers given, which are kept from one request to the next. */
+struct forwarded_include : ID3DInclude
+{
+    forwarded_include(interop &p, std::vector<interop_buffer> &files)
+      : m_p(p),
+        m_files(files),
+        m_count(0)
+    {}
+
+    HRESULT STDMETHODCALLTYPE Open(D3D_INCLUDE_TYPE IncludeType, LPCSTR pFileName,
+                                   LPCVOID pParentData, LPCVOID *ppData, UINT *pBytes)
+    {
+        m_p.write_i64(D3D4LINUX_OP_INCLUDE_OPEN);
+        m_p.write_i64(IncludeType);
+        m_p.write_string(pFileName);
+        m_p.write_i64(find(pParentData));
+        m_p.write_i64(D3D4LINUX_FINISHED);
+
+        if (m_count == m_files.size())
+            m_files.emplace_back();
+        interop_buffer &data = m_files[m_count];
+
+        /* The client’s HRESULT may be 64-bit wide */
+        HRESULT ret = (HRESULT)(int32_t)m_p.read_i64();
+        bool has_data = SUCCEEDED(ret) && m_p.read_data(data);
+        if (m_p.read_i64() != D3D4LINUX_FINISHED || (SUCCEEDED(ret) && !has_data))
+            return E_FAIL;
+
+        if (SUCCEEDED(ret))
+        {
+            ++m_count;
+            *ppData = data.data();
+            *pBytes = (UINT)data.size();
+        }
+        return ret;
+    }
 
-    char const *dll_var = getenv("D3D4LINUX_DLL");
-    dll_var = dll_var ? dll_var : "d3dcompiler_47.dll";
+    HRESULT STDMETHODCALLTYPE Close(LPCVOID pData)
+    {
+        int64_t id = find(pData);
+        if (id < 0)
+            return E_FAIL;
+
+        m_p.write_i64(D3D4LINUX_OP_INCLUDE_CLOSE);
+        m_p.write_i64(id);
+        m_p.write_i64(D3D4LINUX_FINISHED);
+        return S_OK;
+    }
 
-    HMODULE lib = LoadLibrary(dll_var);
+private:
+    int64_t find(LPCVOID data) const
+    {
+        for (size_t i = 0; i < m_count; ++i)
+            if (data == m_files[i].data())
+                return (int64_t)i;
+        return -1;
+    }
 
-    /* Ensure stdout is in binary mode */
-    setmode(fileno(stdout), O_BINARY);
-    setmode(fileno(stdin), O_BINARY);
+    interop &m_p;
+    std::vector<interop_buffer> &m_files;
+    size_t m_count;
+};
 
-    interop p(stdin, stdout);
+/* Load every DLL listed in D3D4LINUX_DLL, separated by semicolons. The
+ * version of each DLL is deduced from its name. */
+static std::vector<compiler> load_compilers(char const *dll_var, int verbose)
+{
+    std::vector<compiler> ret;
 
-    while (!feof(stdin))
+    for (char const *start = dll_var; *start; )
     {
-        int syscall = p.read_i64();
-        int marker = 0;
+        char const *end = strchr(start, ';');
+        std::string name(start, end ? end - start : strlen(start));
+        start += name.size() + (end ? 1 : 0);
+        if (name.empty())
+            continue;
+
+        compiler c;
+        char const *pos = strstr(name.c_str(), "d3dcompiler_");
+        c.version = pos ? atoi(pos + strlen("d3dcompiler_")) : 47;
+        c.lib = LoadLibrary(name.c_str());
+        if (!c.lib)
+        {
+            fprintf(stderr, "[D3D4LINUX] cannot load %s\n", name.c_str());
+            continue;
+        }
+
+        c.compile = (decltype(c.compile))GetProcAddress(c.lib, "D3DCompile");
+        c.reflect = (decltype(c.reflect))GetProcAddress(c.lib, "D3DReflect");
+        c.strip = (decltype(c.strip))GetProcAddress(c.lib, "D3DStripShader");
+        c.disas = (decltype(c.disas))GetProcAddress(c.lib, "D3DDisassemble");
+        c.preprocess = (decltype(c.preprocess))GetProcAddress(c.lib, "D3DPreprocess");
+        c.compress = (decltype(c.compress))GetProcAddress(c.lib, "D3DCompressShaders");
+        c.decompress = (decltype(c.decompress))GetProcAddress(c.lib, "D3DDecompressShaders");
+
+        if (verbose)
+            fprintf(stderr, "[D3D4LINUX] loaded %s (version %d)\n", name.c_str(), c.version);
+
+        ret.push_back(c);
+    }
+
+    return ret;
+}
+
+/* Pick the compiler matching a requested version; version 0, or a version
+ * we do not have, means the first DLL in the list. */
+static compiler const &find_compiler(std::vector<compiler> const &compilers, int version)
+{
+    for (size_t i = 0; i < compilers.size(); ++i)
+        if (compilers[i].version == version)
+            return compilers[i];
+    return compilers[0];
+}
+
+/* Append the shader desc, and the few values that go in the header */
+static void write_desc(d3d4linux_snapshot::writer &w, ID3D11ShaderReflection *reflector,
+                       D3D11_SHADER_DESC &shader_desc)
+{
+    reflector->GetDesc(&shader_desc);
+    uint32_t desc = w.add(shader_desc, shader_desc.Creator);
+    w.head().desc = desc;
+
+    UINT x = 0, y = 0, z = 0;
+    w.head().thread_group_size = reflector->GetThreadGroupSize(&x, &y, &z);
+    w.head().thread_group[0] = x;
+    w.head().thread_group[1] = y;
+    w.head().thread_group[2] = z;
+
+    D3D_FEATURE_LEVEL level = (D3D_FEATURE_LEVEL)0;
+    reflector->GetMinFeatureLevel(&level);
+    w.head().min_feature_level = level;
+}
+
+/* Append the input and output parameters, and the resource bindings */
+static void write_signatures(d3d4linux_snapshot::writer &w, ID3D11ShaderReflection *reflector,
+                             D3D11_SHADER_DESC const &shader_desc)
+{
+    D3D11_SIGNATURE_PARAMETER_DESC param_desc;
+    D3D11_SHADER_INPUT_BIND_DESC bind_desc;
+
+    w.head().inputs = w.size();
+    for (uint32_t i = 0; i < shader_desc.InputParameters; ++i)
+    {
+        reflector->GetInputParameterDesc(i, &param_desc);
+        w.add(param_desc, param_desc.SemanticName);
+    }
+
+    w.head().outputs = w.size();
+    for (uint32_t i = 0; i < shader_desc.OutputParameters; ++i)
+    {
+        reflector->GetOutputParameterDesc(i, &param_desc);
+        w.add(param_desc, param_desc.SemanticName);
+    }
+
+    w.head().binds = w.size();
+    for (uint32_t i = 0; i < shader_desc.BoundResources; ++i)
+    {
+        reflector->GetResourceBindingDesc(i, &bind_desc);
+        w.add(bind_desc, bind_desc.Name);
+    }
+}
+
+/* Append a type record, then the types of its members */
+static uint32_t write_type(d3d4linux_snapshot::writer &w, ID3D11ShaderReflectionType *type)
+{
+    typedef d3d4linux_snapshot::record<D3D11_SHADER_TYPE_DESC> record;
+    typedef d3d4linux_snapshot::member member;
+
+    D3D11_SHADER_TYPE_DESC type_desc;
+    type->GetDesc(&type_desc);
+    uint32_t offset = w.add(type_desc, type_desc.Name);
+    if (!type_desc.Members)
+        return offset;
+
+    uint32_t table = w.reserve(type_desc.Members * sizeof(member));
+    w.point(offset, offset + offsetof(record, m_extra), table);
+    for (uint32_t i = 0; i < type_desc.Members; ++i)
+    {
+        uint32_t entry = table + i * sizeof(member);
+        w.add_string(entry, entry + offsetof(member, m_name), type->GetMemberTypeName(i));
+        ID3D11ShaderReflectionType *member_type = type->GetMemberTypeByIndex(i);
+        if (member_type)
+            w.point(entry, entry + offsetof(member, m_type), write_type(w, member_type));
+    }
+    return offset;
+}
+
+/* Append the variables of a constant buffer, then their types */
+static void write_variables(d3d4linux_snapshot::writer &w,
+                            ID3D11ShaderReflectionConstantBuffer *cbuffer, uint32_t buffer)
+{
+    typedef d3d4linux_snapshot::record<D3D11_SHADER_VARIABLE_DESC> record;
+
+    D3D11_SHADER_BUFFER_DESC buffer_desc;
+    D3D11_SHADER_VARIABLE_DESC variable_desc;
+    cbuffer->GetDesc(&buffer_desc);
+
+    uint32_t first = w.size();
+    w.point(buffer, buffer + offsetof(d3d4linux_snapshot::record<D3D11_SHADER_BUFFER_DESC>,
+                                      m_extra), first);
+
+    for (uint32_t j = 0; j < buffer_desc.Variables; ++j)
+    {
+        cbuffer->GetVariableByIndex(j)->GetDesc(&variable_desc);
+        uint32_t v = w.add(variable_desc, variable_desc.Name);
+        if (variable_desc.DefaultValue)
+            w.add_data(v, v + offsetof(record, m_extra), variable_desc.DefaultValue,
+                       variable_desc.Size);
+        w.clear(v, variable_desc, variable_desc.DefaultValue);
+    }
+
+    for (uint32_t j = 0; j < buffer_desc.Variables; ++j)
+    {
+        ID3D11ShaderReflectionType *type = cbuffer->GetVariableByIndex(j)->GetType();
+        uint32_t v = first + j * sizeof(record);
+        if (type)
+            w.point(v, v + offsetof(record, m_type), write_type(w, type));
+    }
+}
+
+/* Append everything after the shader desc, for eager reflection */
+static void write_buffers(d3d4linux_snapshot::writer &w, ID3D11ShaderReflection *reflector,
+                          D3D11_SHADER_DESC const &shader_desc)
+{
+    write_signatures(w, reflector, shader_desc);
+
+    /* All buffer records come first, so that they form an array */
+    uint32_t buffers = w.head().buffers = w.size();
+    for (uint32_t i = 0; i < shader_desc.ConstantBuffers; ++i)
+    {
+        D3D11_SHADER_BUFFER_DESC buffer_desc;
+        reflector->GetConstantBufferByIndex(i)->GetDesc(&buffer_desc);
+        w.add(buffer_desc, buffer_desc.Name);
+    }
+
+    typedef d3d4linux_snapshot::record<D3D11_SHADER_BUFFER_DESC> record;
+    for (uint32_t i = 0; i < shader_desc.ConstantBuffers; ++i)
+        write_variables(w, reflector->GetConstantBufferByIndex(i),
+                        buffers + i * (uint32_t)sizeof(record));
+}
+
+/* The reflection interface the client asks for, as the DLL knows it */
+static bool find_iid(compiler const &dll, int iid_code, IID &iid, char const *&iid_name)
+{
+    if (iid_code != D3D4LINUX_IID_SHADER_REFLECTION)
+        return false;
+
+    if (dll.version >= 47)
+    {
+        memcpy(&iid, &IID_ID3D11ShaderReflection_47, sizeof(iid));
+        iid_name = "IID_ID3D11ShaderReflection [47]";
+    }
+    else
+    {
+        memcpy(&iid, &IID_ID3D11ShaderReflection_43, sizeof(iid));
+        iid_name = "IID_ID3D11ShaderReflection [43]";
+    }
+    return true;
+}
+
+//
+// Everything that requests are read into or built in, kept from one
+// request to the next, so that once the buffers have grown large enough
+// handling a request makes no heap allocation of ours.
+//
+struct arena
+{
+    interop_buffer source, file, entry, target, comments, name, data;
+
+    /* D3DPreprocess() defines, and the files the client sends us */
+    std::vector<interop_buffer> define_strings;
+    std::vector<D3D_SHADER_MACRO> defines;
+    std::vector<interop_buffer> files;
+
+    /* Shader libraries: the shaders to compress, or the indices and the
+     * shaders of a decompression */
+    std::vector<interop_buffer> shaders;
+    std::vector<D3D_SHADER_DATA> shader_data;
+    std::vector<UINT> indices;
+    std::vector<ID3DBlob *> blobs;
+
+    d3d4linux_snapshot::writer writer;
+
+    /* Reflectors kept alive for lazy reflection, by handle minus one,
+     * and the slots that were freed */
+    std::vector<ID3D11ShaderReflection *> reflectors;
+    std::vector<int64_t> free_reflectors;
+};
+
+struct request
+{
+    interop &p;
+    arena &a;
+    compiler const &dll;
+    int op, marker, verbose;
+};
+
+/* Read the end of a request */
+static bool finished(request &r)
+{
+    r.marker = (int)r.p.read_i64();
+    return r.marker == D3D4LINUX_FINISHED;
+}
+
+//
+// Our own heap allocations, counted so that D3D4LINUX_VERBOSE reports the
+// requests that made some. What the DLLs allocate is none of our business.
+//
+static size_t g_allocations = 0;
+static int g_in_dll = 0;
+
+struct dll_call
+{
+    dll_call() { ++g_in_dll; }
+    ~dll_call() { --g_in_dll; }
+};
 
-        if (syscall == D3D4LINUX_OP_COMPILE)
+void *operator new(size_t size)
+{
+    if (!g_in_dll)
+        ++g_allocations;
+    void *ret = malloc(size ? size : 1);
+    if (!ret)
+        throw std::bad_alloc();
+    return ret;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+/* Run the steps that the client asked for along with a compilation,
+ * so that it need not send the bytecode back to us */
+static void run_composite(request &r, ID3DBlob *code, int steps, uint32_t strip_flags)
+{
+    interop &p = r.p;
+    compiler const &dll = r.dll;
+    void const *data = code->GetBufferPointer();
+    size_t size = code->GetBufferSize();
+
+    if (steps & D3D4LINUX_COMPOSITE_REFLECT)
+    {
+        char const *iid_name = "";
+        IID iid;
+        find_iid(dll, D3D4LINUX_IID_SHADER_REFLECTION, iid, iid_name);
+
+        void *object;
+        HRESULT ret;
         {
-            HRESULT (*compile)(void const *pSrcData, size_t SrcDataSize,
-                               char const *pFileName,
-                               D3D_SHADER_MACRO const *pDefines,
-                               ID3DInclude *pInclude,
-                               char const *pEntrypoint, char const *pTarget,
-                               uint32_t Flags1, uint32_t Flags2,
-                               ID3DBlob **ppCode, ID3DBlob **ppErrorMsgs);
-            compile = (decltype(compile))GetProcAddress(lib, "D3DCompile");
-
-            /* This is a D3DCompile() call */
-            std::string shader_source = p.read_string();
-
-            int has_filename = (int)p.read_i64();
-            std::string shader_file;
-            if (has_filename)
-                shader_file = p.read_string();
-
-            std::string shader_main = p.read_string();
-            std::string shader_type = p.read_string();
-            uint32_t flags1 = (uint32_t)p.read_i64();
-            uint32_t flags2 = (uint32_t)p.read_i64();
-            marker = (int)p.read_i64();
-            if (marker != D3D4LINUX_FINISHED)
-                goto error;
-
-            ID3DBlob *shader_blob = nullptr, *error_blob = nullptr;
-            HRESULT ret = compile(shader_source.c_str(), shader_source.size(),
-                                  shader_file.c_str(),
-                                  nullptr, /* unimplemented */
-                                  nullptr, /* unimplemented */
-                                  shader_main.c_str(),
-                                  shader_type.c_str(),
-                                  flags1, flags2, &shader_blob, &error_blob);
-            if (verbose)
-                fprintf(stderr, "[D3D4LINUX] D3DCompile([%d bytes], \"%s\", ?, ?, \"%s\", \"%s\", %04x, %04x ) = 0x%x\n",
-                        (int)shader_source.size(), has_filename ? shader_file.c_str() : "(nullptr)", shader_main.c_str(), shader_type.c_str(),
-                        flags1, flags2, (int)ret);
-
-            p.write_i64(ret);
-            p.write_blob(shader_blob);
-            p.write_blob(error_blob);
-            p.write_i64(D3D4LINUX_FINISHED);
-
-            if (shader_blob)
-                shader_blob->Release();
-            if (error_blob)
-                error_blob->Release();
+            dll_call call;
+            ret = dll.reflect(data, size, iid, &object);
         }
-        else if (syscall == D3D4LINUX_OP_REFLECT)
+        p.write_i64(ret);
+        if (SUCCEEDED(ret))
         {
-            HRESULT (*reflect)(void const *pSrcData,
-                               size_t SrcDataSize,
-                               REFIID pInterface,
-                               void **ppReflector);
-            reflect = (decltype(reflect))GetProcAddress(lib, "D3DReflect");
-
-            std::vector<uint8_t> *data = p.read_data();
-            int iid_code = p.read_i64();
-            marker = (int)p.read_i64();
-            if (marker != D3D4LINUX_FINISHED)
-                goto error;
-
-            char const *iid_name = "";
-            IID iid;
-            switch (iid_code)
-            {
-            case D3D4LINUX_IID_SHADER_REFLECTION:
-                if (strstr(dll_var, "d3dcompiler_47"))
-                {
-                    memcpy(&iid, &IID_ID3D11ShaderReflection_47, sizeof(iid));
-                    iid_name = "IID_ID3D11ShaderReflection [47]";
-                }
-                else
-                {
-                    memcpy(&iid, &IID_ID3D11ShaderReflection_43, sizeof(iid));
-                    iid_name = "IID_ID3D11ShaderReflection [43]";
-                }
-                break;
-            default:
-                fprintf(stderr, "[D3D4LINUX] unknown iid_code %d\n", iid_code);
-                goto error;
-            }
+            ID3D11ShaderReflection *reflector = (ID3D11ShaderReflection *)object;
+            d3d4linux_snapshot::writer &w = r.a.writer;
+            D3D11_SHADER_DESC shader_desc;
+            w.clear();
+            write_desc(w, reflector, shader_desc);
+            write_buffers(w, reflector, shader_desc);
+            reflector->Release();
+
+            std::vector<uint8_t> &snapshot = w.finish();
+            p.write_i64(snapshot.size());
+            p.write_raw(snapshot.data(), snapshot.size());
+        }
+        else
+            p.write_i64(-1);
+    }
 
-            void *object;
-            HRESULT ret = reflect(data ? data->data() : nullptr,
-                                  data ? data->size() : 0,
-                                  iid, &object);
-            if (verbose)
-                fprintf(stderr, "[D3D4LINUX] D3DReflect([%d bytes], %s) = 0x%x\n",
-                        data ? (int)data->size() : 0, iid_name, (int)ret);
+    if (steps & D3D4LINUX_COMPOSITE_STRIP)
+    {
+        ID3DBlob *strip_blob = nullptr;
+        HRESULT ret;
+        {
+            dll_call call;
+            ret = dll.strip(data, size, strip_flags, &strip_blob);
+        }
+        p.write_i64(ret);
+        p.write_blob(strip_blob);
+        if (strip_blob)
+            strip_blob->Release();
+    }
 
-            p.write_i64(ret);
+    if (steps & D3D4LINUX_COMPOSITE_DISASSEMBLE)
+    {
+        ID3DBlob *disas_blob = nullptr;
+        HRESULT ret;
+        {
+            dll_call call;
+            ret = dll.disas(data, size, 0, nullptr, &disas_blob);
+        }
+        p.write_i64(ret);
+        p.write_blob(disas_blob);
+        if (disas_blob)
+            disas_blob->Release();
+    }
+
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] composite steps %x, strip flags %04x\n",
+                steps, strip_flags);
+}
+
+/* This is a D3DCompile() call */
+static bool handle_compile(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    p.read_string(a.source);
+    int has_filename = (int)p.read_i64();
+    if (has_filename)
+        p.read_string(a.file);
+    p.read_string(a.entry);
+    p.read_string(a.target);
+    uint32_t flags1 = (uint32_t)p.read_i64();
+    uint32_t flags2 = (uint32_t)p.read_i64();
+    int steps = (int)p.read_i64();
+    uint32_t strip_flags = (uint32_t)p.read_i64();
+    if (!finished(r))
+        return false;
+
+    ID3DBlob *shader_blob = nullptr, *error_blob = nullptr;
+    HRESULT ret;
+    {
+        dll_call call;
+        ret = r.dll.compile(a.source.data(), a.source.size(),
+                            has_filename ? a.file.data() : "",
+                            nullptr, /* unimplemented */
+                            nullptr, /* unimplemented */
+                            a.entry.data(), a.target.data(),
+                            flags1, flags2, &shader_blob, &error_blob);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DCompile([%d bytes], \"%s\", ?, ?, \"%s\", \"%s\", %04x, %04x ) = 0x%x\n",
+                (int)a.source.size(), has_filename ? a.file.data() : "(nullptr)",
+                a.entry.data(), a.target.data(), flags1, flags2, (int)ret);
+
+    p.write_i64(ret);
+    p.write_blob(shader_blob);
+    p.write_blob(error_blob);
+    if (SUCCEEDED(ret) && shader_blob && steps)
+        run_composite(r, shader_blob, steps, strip_flags);
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    if (shader_blob)
+        shader_blob->Release();
+    if (error_blob)
+        error_blob->Release();
+    return true;
+}
 
-            if (SUCCEEDED(ret) && iid_code == D3D4LINUX_IID_SHADER_REFLECTION)
+/* D3DReflect(), either whole or lazily */
+static bool handle_reflect(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    bool has_data = p.read_data(a.data);
+    int iid_code = p.read_i64();
+    if (!finished(r))
+        return false;
+
+    char const *iid_name = "";
+    IID iid;
+    if (!find_iid(r.dll, iid_code, iid, iid_name))
+    {
+        fprintf(stderr, "[D3D4LINUX] unknown iid_code %d\n", iid_code);
+        return false;
+    }
+
+    void *object;
+    HRESULT ret;
+    {
+        dll_call call;
+        ret = r.dll.reflect(has_data ? a.data.data() : nullptr,
+                            has_data ? a.data.size() : 0, iid, &object);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DReflect([%d bytes], %s) = 0x%x\n",
+                has_data ? (int)a.data.size() : 0, iid_name, (int)ret);
+
+    p.write_i64(ret);
+
+    if (SUCCEEDED(ret) && iid_code == D3D4LINUX_IID_SHADER_REFLECTION)
+    {
+        ID3D11ShaderReflection *reflector = (ID3D11ShaderReflection *)object;
+        d3d4linux_snapshot::writer &w = a.writer;
+        D3D11_SHADER_DESC shader_desc;
+        w.clear();
+        write_desc(w, reflector, shader_desc);
+
+        if (r.op == D3D4LINUX_OP_REFLECT_OPEN)
+        {
+            /* Keep the reflector until the client closes it */
+            int64_t handle;
+            if (a.free_reflectors.empty())
+            {
+                a.reflectors.push_back(reflector);
+                handle = (int64_t)a.reflectors.size();
+            }
+            else
             {
-                D3D11_SIGNATURE_PARAMETER_DESC param_desc;
-                D3D11_SHADER_INPUT_BIND_DESC bind_desc;
-                D3D11_SHADER_VARIABLE_DESC variable_desc;
-                D3D11_SHADER_BUFFER_DESC buffer_desc;
-                D3D11_SHADER_DESC shader_desc;
-
-                ID3D11ShaderReflection *reflector = (ID3D11ShaderReflection *)object;
-
-                /* Serialise D3D11_SHADER_DESC */
-                reflector->GetDesc(&shader_desc);
-                p.write_raw(&shader_desc, sizeof(shader_desc));
-                p.write_string(shader_desc.Creator);
-
-                /* Serialize all InputParameterDesc */
-                for (uint32_t i = 0; i < shader_desc.InputParameters; ++i)
-                {
-                    reflector->GetInputParameterDesc(i, &param_desc);
-                    p.write_raw(&param_desc, sizeof(param_desc));
-                    p.write_string(param_desc.SemanticName);
-                }
-
-                /* Serialize all OutParameterDesc */
-                for (uint32_t i = 0; i < shader_desc.OutputParameters; ++i)
-                {
-                    reflector->GetOutputParameterDesc(i, &param_desc);
-                    p.write_raw(&param_desc, sizeof(param_desc));
-                    p.write_string(param_desc.SemanticName);
-                }
-
-                /* Serialize all ResourceBindingDesc */
-                for (uint32_t i = 0; i < shader_desc.BoundResources; ++i)
-                {
-                    reflector->GetResourceBindingDesc(i, &bind_desc);
-                    p.write_raw(&bind_desc, sizeof(bind_desc));
-                    p.write_string(bind_desc.Name);
-                }
-
-                /* Serialize all ConstantBuffer */
-                for (uint32_t i = 0; i < shader_desc.ConstantBuffers; ++i)
-                {
-                    ID3D11ShaderReflectionConstantBuffer *cbuffer
-                            = reflector->GetConstantBufferByIndex(i);
-
-                    /* Serialize D3D11_SHADER_BUFFER_DESC */
-                    cbuffer->GetDesc(&buffer_desc);
-                    p.write_raw(&buffer_desc, sizeof(buffer_desc));
-                    p.write_string(buffer_desc.Name);
-
-                    /* Serialize all Variable */
-                    for (uint32_t j = 0; j < buffer_desc.Variables; ++j)
-                    {
-                        ID3D11ShaderReflectionVariable *var
-                                = cbuffer->GetVariableByIndex(j);
-
-                        /* Serialize D3D11_SHADER_VARIABLE_DESC */
-                        var->GetDesc(&variable_desc);
-                        p.write_raw(&variable_desc, sizeof(variable_desc));
-                        p.write_string(variable_desc.Name);
-                        p.write_i64(variable_desc.DefaultValue ? 1 : 0);
-                        if (variable_desc.DefaultValue)
-                            p.write_raw(variable_desc.DefaultValue, variable_desc.Size);
-                    }
-                }
+                handle = a.free_reflectors.back();
+                a.free_reflectors.pop_back();
+                a.reflectors[handle - 1] = reflector;
             }
+            p.write_i64(handle);
+        }
+        else
+        {
+            write_buffers(w, reflector, shader_desc);
+            reflector->Release();
+        }
+
+        std::vector<uint8_t> &snapshot = w.finish();
+        p.write_i64(snapshot.size());
+        p.write_raw(snapshot.data(), snapshot.size());
+    }
+
+    p.write_i64(D3D4LINUX_FINISHED);
+    return true;
+}
 
-            p.write_i64(D3D4LINUX_FINISHED);
+static ID3D11ShaderReflection *find_reflector(arena const &a, int64_t handle)
+{
+    return handle > 0 && handle <= (int64_t)a.reflectors.size()
+         ? a.reflectors[handle - 1] : nullptr;
+}
 
-            delete data;
+/* Part of a reflector kept by D3D4LINUX_OP_REFLECT_OPEN */
+static bool handle_reflect_query(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    int64_t handle = p.read_i64();
+    int64_t query = p.read_i64();
+    int64_t index = p.read_i64();
+    p.read_string(a.name);
+    if (!finished(r))
+        return false;
+
+    ID3D11ShaderReflection *reflector = find_reflector(a, handle);
+    D3D11_SHADER_DESC shader_desc;
+    if (reflector)
+        reflector->GetDesc(&shader_desc);
+
+    d3d4linux_snapshot::writer &w = a.writer;
+    HRESULT ret = reflector ? S_OK : E_FAIL;
+    w.clear();
+
+    if (!reflector)
+        ;
+    else if (query == D3D4LINUX_QUERY_SIGNATURES)
+        write_signatures(w, reflector, shader_desc);
+    else if (query == D3D4LINUX_QUERY_BUFFER || query == D3D4LINUX_QUERY_BUFFER_BY_NAME)
+    {
+        D3D11_SHADER_BUFFER_DESC buffer_desc;
+        for (uint32_t i = 0; query == D3D4LINUX_QUERY_BUFFER_BY_NAME
+                              && i < shader_desc.ConstantBuffers; ++i)
+        {
+            reflector->GetConstantBufferByIndex(i)->GetDesc(&buffer_desc);
+            if (!strcmp(a.name.data(), buffer_desc.Name))
+                index = i;
         }
-        else if (syscall == D3D4LINUX_OP_STRIP)
+
+        if (index >= 0 && index < (int64_t)shader_desc.ConstantBuffers)
         {
-            HRESULT (*strip)(void const *pShaderBytecode,
-                             size_t BytecodeLength,
-                             uint32_t uStripFlags,
-                             ID3DBlob **ppStrippedBlob);
-            strip = (decltype(strip))GetProcAddress(lib, "D3DStripShader");
-
-            std::vector<uint8_t> *data = p.read_data();
-            uint32_t flags = (uint32_t)p.read_i64();
-            marker = (int)p.read_i64();
-            if (marker != D3D4LINUX_FINISHED)
-                goto error;
-
-            ID3DBlob *strip_blob = nullptr;
-            HRESULT ret = strip(data ? data->data() : nullptr,
-                                data ? data->size() : 0,
-                                flags, &strip_blob);
-            if (verbose)
-                fprintf(stderr, "[D3D4LINUX] D3DStripShader([%d bytes], %04x) = 0x%x\n",
-                        data ? (int)data->size() : 0, flags, (int)ret);
-
-            p.write_i64(ret);
-            p.write_blob(strip_blob);
-            p.write_i64(D3D4LINUX_FINISHED);
-
-            if (strip_blob)
-                strip_blob->Release();
+            ID3D11ShaderReflectionConstantBuffer *cbuffer
+                    = reflector->GetConstantBufferByIndex((uint32_t)index);
+            cbuffer->GetDesc(&buffer_desc);
+            uint32_t buffer = w.add(buffer_desc, buffer_desc.Name);
+            w.head().buffers = buffer;
+            write_variables(w, cbuffer, buffer);
         }
-        else if (syscall == D3D4LINUX_OP_DISASSEMBLE)
+        else
+            ret = E_FAIL;
+    }
+    else
+        ret = E_FAIL;
+
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] reflector %d query %x(%d) = 0x%x\n",
+                (int)handle, (int)query, (int)index, (int)ret);
+
+    p.write_i64(ret);
+    if (SUCCEEDED(ret))
+    {
+        std::vector<uint8_t> &snapshot = w.finish();
+        p.write_i64(index);
+        p.write_i64(snapshot.size());
+        p.write_raw(snapshot.data(), snapshot.size());
+    }
+    p.write_i64(D3D4LINUX_FINISHED);
+    return true;
+}
+
+static bool handle_reflect_close(request &r)
+{
+    arena &a = r.a;
+
+    int64_t handle = r.p.read_i64();
+    if (!finished(r))
+        return false;
+
+    ID3D11ShaderReflection *reflector = find_reflector(a, handle);
+    if (reflector)
+    {
+        reflector->Release();
+        a.reflectors[handle - 1] = nullptr;
+        a.free_reflectors.push_back(handle);
+    }
+    return true;
+}
+
+static bool handle_strip(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    bool has_data = p.read_data(a.data);
+    uint32_t flags = (uint32_t)p.read_i64();
+    if (!finished(r))
+        return false;
+
+    ID3DBlob *strip_blob = nullptr;
+    HRESULT ret;
+    {
+        dll_call call;
+        ret = r.dll.strip(has_data ? a.data.data() : nullptr,
+                          has_data ? a.data.size() : 0, flags, &strip_blob);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DStripShader([%d bytes], %04x) = 0x%x\n",
+                has_data ? (int)a.data.size() : 0, flags, (int)ret);
+
+    p.write_i64(ret);
+    p.write_blob(strip_blob);
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    if (strip_blob)
+        strip_blob->Release();
+    return true;
+}
+
+static bool handle_disassemble(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    bool has_data = p.read_data(a.data);
+    uint32_t flags = (uint32_t)p.read_i64();
+    int has_comments = (int)p.read_i64();
+    if (has_comments)
+        p.read_string(a.comments);
+    if (!finished(r))
+        return false;
+
+    ID3DBlob *disas_blob = nullptr;
+    HRESULT ret;
+    {
+        dll_call call;
+        ret = r.dll.disas(has_data ? a.data.data() : nullptr,
+                          has_data ? a.data.size() : 0, flags,
+                          has_comments ? a.comments.data() : nullptr, &disas_blob);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DDisassemble([%d bytes], %04x, %s) = 0x%x\n",
+                has_data ? (int)a.data.size() : 0, flags,
+                has_comments ? "[comments]" : "(nullptr)", (int)ret);
+
+    p.write_i64(ret);
+    p.write_blob(disas_blob);
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    if (disas_blob)
+        disas_blob->Release();
+    return true;
+}
+
+static bool handle_preprocess(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    p.read_string(a.source);
+    int has_filename = (int)p.read_i64();
+    if (has_filename)
+        p.read_string(a.file);
+
+    /* Names and definitions, then the array pointing to them */
+    int define_count = (int)p.read_i64();
+    if (a.define_strings.size() < (size_t)define_count * 2)
+        a.define_strings.resize(define_count * 2);
+    if (a.defines.size() < (size_t)define_count + 1)
+        a.defines.resize(define_count + 1);
+    for (int i = 0; i < define_count; ++i)
+    {
+        p.read_string(a.define_strings[i * 2]);
+        a.defines[i].Name = a.define_strings[i * 2].data();
+        a.defines[i].Definition = nullptr;
+        if (p.read_i64())
         {
-            HRESULT (*disas)(void const *pSrcData,
-                             size_t SrcDataSize,
-                             uint32_t Flags,
-                             char const *szComments,
-                             ID3DBlob **ppDisassembly);
-            disas = (decltype(disas))GetProcAddress(lib, "D3DDisassemble");
-
-            std::vector<uint8_t> *data = p.read_data();
-            uint32_t flags = (uint32_t)p.read_i64();
-            int has_comments = (int)p.read_i64();
-            std::string comments;
-            if (has_comments)
-                comments = p.read_string();
-            marker = (int)p.read_i64();
-            if (marker != D3D4LINUX_FINISHED)
-                goto error;
-
-            ID3DBlob *disas_blob = nullptr;
-            HRESULT ret = disas(data ? data->data() : nullptr,
-                                data ? data->size() : 0,
-                                flags,
-                                has_comments ? comments.c_str() : nullptr,
-                                &disas_blob);
-            if (verbose)
-                fprintf(stderr, "[D3D4LINUX] D3DDisassemble([%d bytes], %04x, %s) = 0x%x\n",
-                        data ? (int)data->size() : 0, flags, has_comments ? "[comments]" : "(nullptr)", (int)ret);
-
-            p.write_i64(ret);
-            p.write_blob(disas_blob);
-            p.write_i64(D3D4LINUX_FINISHED);
-
-            if (disas_blob)
-                disas_blob->Release();
+            p.read_string(a.define_strings[i * 2 + 1]);
+            a.defines[i].Definition = a.define_strings[i * 2 + 1].data();
         }
+    }
+    a.defines[define_count].Name = a.defines[define_count].Definition = nullptr;
 
-        continue;
+    int include_mode = (int)p.read_i64();
+    if (!finished(r))
+        return false;
 
-    error:
-        if (verbose)
-            fprintf(stderr, "[D3D4LINUX] Bad message received: 0x%x 0x%x\n", syscall, marker);
+    forwarded_include forwarded(p, a.files);
+    ID3DInclude *include = include_mode == 1 ? D3D_COMPILE_STANDARD_FILE_INCLUDE
+                         : include_mode == 2 ? &forwarded : nullptr;
+
+    ID3DBlob *text_blob = nullptr, *error_blob = nullptr;
+    HRESULT ret = E_FAIL;
+    if (r.dll.preprocess)
+    {
+        dll_call call;
+        ret = r.dll.preprocess(a.source.data(), a.source.size(),
+                               has_filename ? a.file.data() : nullptr,
+                               a.defines.data(), include, &text_blob, &error_blob);
     }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DPreprocess([%d bytes], \"%s\", [%d defines], %d) = 0x%x\n",
+                (int)a.source.size(), has_filename ? a.file.data() : "(nullptr)",
+                define_count, include_mode, (int)ret);
+
+    p.write_i64(D3D4LINUX_OP_PREPROCESS);
+    p.write_i64(ret);
+    p.write_blob(text_blob);
+    p.write_blob(error_blob);
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    if (text_blob)
+        text_blob->Release();
+    if (error_blob)
+        error_blob->Release();
+    return true;
+}
 
-    return EXIT_SUCCESS;
+static bool handle_compress_shaders(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    int64_t count = p.read_i64();
+    if (count < 0 || count > 0xffffffff)
+        return false;
+    if (a.shaders.size() < (size_t)count)
+        a.shaders.resize((size_t)count);
+    a.shader_data.resize((size_t)count);
+    for (int64_t i = 0; i < count; ++i)
+    {
+        bool has_data = p.read_data(a.shaders[i]);
+        a.shader_data[i].pBytecode = has_data ? a.shaders[i].data() : nullptr;
+        a.shader_data[i].BytecodeLength = has_data ? a.shaders[i].size() : 0;
+    }
+    uint32_t flags = (uint32_t)p.read_i64();
+    if (!finished(r))
+        return false;
+
+    ID3DBlob *library_blob = nullptr;
+    HRESULT ret = E_FAIL;
+    if (r.dll.compress)
+    {
+        dll_call call;
+        ret = r.dll.compress((UINT)count, a.shader_data.data(), flags, &library_blob);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DCompressShaders(%d, [shaders], %04x) = 0x%x\n",
+                (int)count, flags, (int)ret);
+
+    p.write_i64(ret);
+    p.write_blob(library_blob);
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    if (library_blob)
+        library_blob->Release();
+    return true;
+}
+
+static bool handle_decompress_shaders(request &r)
+{
+    interop &p = r.p;
+    arena &a = r.a;
+
+    bool has_data = p.read_data(a.data);
+    int64_t count = p.read_i64();
+    if (count < 0 || count > 0xffffffff)
+        return false;
+    uint32_t start = (uint32_t)p.read_i64();
+    int has_indices = (int)p.read_i64();
+    a.indices.resize(has_indices ? (size_t)count : 0);
+    for (size_t i = 0; i < a.indices.size(); ++i)
+        a.indices[i] = (UINT)p.read_i64();
+    uint32_t flags = (uint32_t)p.read_i64();
+    if (!finished(r))
+        return false;
+
+    a.blobs.assign((size_t)count, nullptr);
+    UINT total = 0;
+    HRESULT ret = E_FAIL;
+    if (r.dll.decompress)
+    {
+        dll_call call;
+        ret = r.dll.decompress(has_data ? a.data.data() : nullptr,
+                               has_data ? a.data.size() : 0, (UINT)count, start,
+                               has_indices ? a.indices.data() : nullptr, flags,
+                               a.blobs.data(), &total);
+    }
+    if (r.verbose)
+        fprintf(stderr, "[D3D4LINUX] D3DDecompressShaders([%d bytes], %d, %d, %s, %04x) = 0x%x\n",
+                has_data ? (int)a.data.size() : 0, (int)count, (int)start,
+                has_indices ? "[indices]" : "(nullptr)", flags, (int)ret);
+
+    p.write_i64(ret);
+    p.write_i64(total);
+    for (size_t i = 0; i < a.blobs.size(); ++i)
+    {
+        p.write_blob(a.blobs[i]);
+        if (a.blobs[i])
+            a.blobs[i]->Release();
+    }
+    p.write_i64(D3D4LINUX_FINISHED);
+    return true;
 }
 
+/* Request handlers, by op, from D3D4LINUX_OP_COMPILE on */
+static bool (* const handlers[])(request &) =
+{
+    handle_compile,            /* D3D4LINUX_OP_COMPILE */
+    handle_reflect,            /* D3D4LINUX_OP_REFLECT */
+    handle_strip,              /* D3D4LINUX_OP_STRIP */
+    handle_disassemble,        /* D3D4LINUX_OP_DISASSEMBLE */
+    handle_preprocess,         /* D3D4LINUX_OP_PREPROCESS */
+    handle_reflect,            /* D3D4LINUX_OP_REFLECT_OPEN */
+    handle_reflect_query,      /* D3D4LINUX_OP_REFLECT_QUERY */
+    handle_reflect_close,      /* D3D4LINUX_OP_REFLECT_CLOSE */
+    handle_compress_shaders,   /* D3D4LINUX_OP_COMPRESS_SHADERS */
+    handle_decompress_shaders, /* D3D4LINUX_OP_DECOMPRESS_SHADERS */
+};
+
+int main(void)
+{
+    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+    int verbose = verbose_var && *verbose_var == '1';
+
+    char const *dll_var = getenv("D3D4LINUX_DLL");
+    dll_var = dll_var ? dll_var : "d3dcompiler_47.dll";
+
+    std::vector<compiler> compilers = load_compilers(dll_var, verbose);
+    if (compilers.empty())
+        return EXIT_FAILURE;
+
+    /* Ensure stdout is in binary mode */
+    setmode(fileno(stdout), O_BINARY);
+    setmode(fileno(stdin), O_BINARY);
+
+    interop p(stdin, stdout);
+    arena a;
+
+    /* Tell the client that we are ready */
+    p.write_i64(D3D4LINUX_FINISHED);
+
+    for (;;)
+    {
+        int syscall = p.read_i64();
+        if (feof(stdin))
+            break;
+        size_t allocations = g_allocations;
+
+        /* Every request starts with the compiler version it targets */
+        int version = (int)p.read_i64();
+        request r = { p, a, find_compiler(compilers, version), syscall, 0, verbose };
+
+        size_t op = (size_t)(syscall - D3D4LINUX_OP_COMPILE);
+        if (op >= sizeof(handlers) / sizeof(*handlers))
+            continue;
+
+        if (!handlers[op](r) && verbose)
+            fprintf(stderr, "[D3D4LINUX] Bad message received: 0x%x 0x%x\n", syscall, r.marker);
+
+        if (verbose && g_allocations != allocations)
+            fprintf(stderr, "[D3D4LINUX] request 0x%x made %d allocations\n",
+                    syscall, (int)(g_allocations - allocations));
+    }
+
+    return EXIT_SUCCESS;
+}
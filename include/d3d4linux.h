@@ -38,6 +38,121 @@
 #   define D3D4LINUX_WINE "/usr/bin/wine64"
 #endif
 
+#if !defined D3D4LINUX_SERVERS
+    // Maximum number of servers shared by all threads; 0 means one per CPU.
+#   define D3D4LINUX_SERVERS 0
+#endif
+
+#if !defined D3D4LINUX_RESERVED
+    // Number of servers that background requests leave to the others.
+#   define D3D4LINUX_RESERVED 1
+#endif
+
+#if !defined D3D4LINUX_PRIORITY
+    // Priority of requests, unless the calling thread sets its own; the
+    // environment variable also takes "interactive", "normal" or
+    // "background".
+#   define D3D4LINUX_PRIORITY D3D4LINUX_PRIORITY_NORMAL
+#endif
+
+#if !defined D3D4LINUX_DAEMON
+    // Socket of a tools/daemon process whose servers are shared by all
+    // processes; empty means that each process has its own servers.
+#   define D3D4LINUX_DAEMON ""
+#endif
+
+#if !defined D3D4LINUX_CAPTURE
+    // File that every request to a server is appended to, for
+    // tools/replay; empty means no capture.
+#   define D3D4LINUX_CAPTURE ""
+#endif
+
+#if !defined D3D4LINUX_PREFIXES
+    // Number of Wine prefixes, each with its own wineserver, that servers
+    // are spread over.
+#   define D3D4LINUX_PREFIXES 1
+#endif
+
+#if !defined D3D4LINUX_PREFIX_TEMPLATE
+    // Wine prefix to copy for each of the above; empty means that they are
+    // created by Wine, or, with only one, that the user's prefix is used.
+#   define D3D4LINUX_PREFIX_TEMPLATE ""
+#endif
+
+#if !defined D3D4LINUX_PREFIX_DIR
+    // Where to keep these prefixes; empty means $TMPDIR/d3d4linux-<uid>.
+#   define D3D4LINUX_PREFIX_DIR ""
+#endif
+
+#if !defined D3D4LINUX_CACHE_REMOTE
+    // Address of a shared compile cache server as "host:port"; empty
+    // means no remote cache.
+#   define D3D4LINUX_CACHE_REMOTE ""
+#endif
+
+#if !defined D3D4LINUX_CACHE_DIR
+    // Directory of the local compile cache; empty means no local cache.
+#   define D3D4LINUX_CACHE_DIR ""
+#endif
+
+#if !defined D3D4LINUX_CACHE_SIZE
+    // Size of the local compile cache in MiB; 0 means unbounded.
+#   define D3D4LINUX_CACHE_SIZE 4096
+#endif
+
+#if !defined D3D4LINUX_COST_MODEL
+    // File that keeps how long shaders take to compile across runs; empty
+    // means a file in D3D4LINUX_CACHE_DIR, if any.
+#   define D3D4LINUX_COST_MODEL ""
+#endif
+
+#if !defined D3D4LINUX_CANONICALIZE
+    // Set to 1 to compute cache keys from the token stream of the source,
+    // so that changes to comments or to the amount of whitespace still
+    // hit the cache.
+#   define D3D4LINUX_CANONICALIZE 0
+#endif
+
+#if !defined D3D4LINUX_COMPOSITE
+    // Steps to run on the server right after each successful compilation,
+    // so that the D3DReflect(), D3DStripShader() or D3DDisassemble() call
+    // that follows on the same thread is answered without a round trip:
+    // any of D3D4LINUX_COMPOSITE_REFLECT, D3D4LINUX_COMPOSITE_STRIP and
+    // D3D4LINUX_COMPOSITE_DISASSEMBLE.
+#   define D3D4LINUX_COMPOSITE 0
+#endif
+
+#if !defined D3D4LINUX_COMPOSITE_STRIP_FLAGS
+    // Flags for the composite D3DStripShader() step; other flags will
+    // still go through the server.
+#   define D3D4LINUX_COMPOSITE_STRIP_FLAGS (D3DCOMPILER_STRIP_REFLECTION_DATA \
+                                          | D3DCOMPILER_STRIP_DEBUG_INFO \
+                                          | D3DCOMPILER_STRIP_TEST_BLOBS)
+#endif
+
+#if !defined D3D4LINUX_LAZY_REFLECT
+    // Set to 1 to keep reflectors on the server and only fetch the parts
+    // of them that are actually used.
+#   define D3D4LINUX_LAZY_REFLECT 0
+#endif
+
+#if !defined D3D4LINUX_IDLE_TIMEOUT
+    // Seconds after which an idle server is shut down; 0 means never.
+#   define D3D4LINUX_IDLE_TIMEOUT 60
+#endif
+
+#if !defined D3D4LINUX_MAX_REQUESTS
+    // Number of requests after which a server is replaced with a fresh
+    // one; 0 means never.
+#   define D3D4LINUX_MAX_REQUESTS 0
+#endif
+
+#if !defined D3D4LINUX_MAX_RSS
+    // Resident memory in MiB above which a server is replaced with a fresh
+    // one; 0 means no limit.
+#   define D3D4LINUX_MAX_RSS 2048
+#endif
+
 /*
  * Types and macros that come from Windows
  */
@@ -55,6 +170,8 @@ typedef GUID REFIID; /* FIXME */
 #define S_FALSE ((HRESULT)1)
 #define S_OK ((HRESULT)0)
 #define E_FAIL ((HRESULT)0x80004005)
+#define E_INVALIDARG ((HRESULT)0x80070057)
+#define D3DERR_INVALIDCALL ((HRESULT)0x8876086c)
 
 #define SUCCEEDED(x) ((HRESULT)(x) == S_OK)
 #define FAILED(x) (!SUCCEEDED(x))
@@ -75,121 +192,284 @@ typedef GUID REFIID; /* FIXME */
 
 #include <d3d4linux_enums.h>
 #include <d3d4linux_types.h>
+#include <d3d4linux_snapshot.h>
 
 struct ID3DInclude
 {
-    // FIXME: unimplemented
+    virtual HRESULT Open(D3D_INCLUDE_TYPE IncludeType, char const *pFileName,
+                         void const *pParentData, void const **ppData,
+                         uint32_t *pBytes) = 0;
+    virtual HRESULT Close(void const *pData) = 0;
+};
+
+/* Resolve includes relative to the including file, then the current
+ * directory, as d3dcompiler does */
+#define D3D_COMPILE_STANDARD_FILE_INCLUDE ((ID3DInclude *)(uintptr_t)1)
+
+/* These live inside the snapshots sent by the server, see
+ * d3d4linux_snapshot.h, so they must not add any data member */
+struct ID3D11ShaderReflectionType
+  : d3d4linux_snapshot::record<D3D11_SHADER_TYPE_DESC>
+{
+    HRESULT GetDesc(D3D11_SHADER_TYPE_DESC *desc)
+    {
+        *desc = m_desc;
+        desc->Name = string(m_name);
+        return S_OK;
+    }
+
+    struct ID3D11ShaderReflectionType *GetMemberTypeByIndex(uint32_t index)
+    {
+        d3d4linux_snapshot::member const *m = member(index);
+        return m ? (ID3D11ShaderReflectionType *)m->at(m->m_type) : nullptr;
+    }
+
+    struct ID3D11ShaderReflectionType *GetMemberTypeByName(char const *name)
+    {
+        for (uint32_t i = 0; i < m_desc.Members; ++i)
+            if (!strcmp(GetMemberTypeName(i), name))
+                return GetMemberTypeByIndex(i);
+        return nullptr;
+    }
+
+    char const *GetMemberTypeName(uint32_t index)
+    {
+        d3d4linux_snapshot::member const *m = member(index);
+        return m ? m->string(m->m_name) : nullptr;
+    }
+
+private:
+    d3d4linux_snapshot::member const *member(uint32_t index) const
+    {
+        return index < m_desc.Members
+             ? (d3d4linux_snapshot::member const *)at(m_extra) + index : nullptr;
+    }
 };
 
 struct ID3D11ShaderReflectionVariable
+  : d3d4linux_snapshot::record<D3D11_SHADER_VARIABLE_DESC>
 {
     HRESULT GetDesc(D3D11_SHADER_VARIABLE_DESC *desc)
     {
         *desc = m_desc;
-        desc->Name = m_strings[0].c_str();
-        desc->DefaultValue = m_has_default ? m_default_value.data() : nullptr;
+        desc->Name = string(m_name);
+        desc->DefaultValue = (void *)at(m_extra);
         return S_OK;
     }
 
-    D3D11_SHADER_VARIABLE_DESC m_desc;
-    std::vector<std::string> m_strings;
-    int m_has_default;
-    std::vector<uint8_t> m_default_value;
+    struct ID3D11ShaderReflectionType *GetType()
+    {
+        return (ID3D11ShaderReflectionType *)at(m_type);
+    }
 };
 
 struct ID3D11ShaderReflectionConstantBuffer
+  : d3d4linux_snapshot::record<D3D11_SHADER_BUFFER_DESC>
 {
     HRESULT GetDesc(D3D11_SHADER_BUFFER_DESC *desc)
     {
         *desc = m_desc;
-        desc->Name = m_strings[0].c_str();
+        desc->Name = string(m_name);
         return S_OK;
     }
 
     struct ID3D11ShaderReflectionVariable *GetVariableByIndex(uint32_t index)
     {
-        return index < m_variables.size() ? &m_variables[index] : nullptr;
+        return index < m_desc.Variables
+             ? (ID3D11ShaderReflectionVariable *)at(m_extra) + index : nullptr;
     }
 
     struct ID3D11ShaderReflectionVariable *GetVariableByName(char const *name)
     {
-        for (size_t i = 0; i < m_variables.size(); ++i)
-            if (!strcmp(m_variables[i].m_strings[0].c_str(), name))
-                return &m_variables[i];
+        for (uint32_t i = 0; i < m_desc.Variables; ++i)
+        {
+            ID3D11ShaderReflectionVariable *var = GetVariableByIndex(i);
+            if (!strcmp(var->string(var->m_name), name))
+                return var;
+        }
 
         return nullptr;
     }
-
-    D3D11_SHADER_BUFFER_DESC m_desc;
-    std::vector<ID3D11ShaderReflectionVariable> m_variables;
-    std::vector<std::string> m_strings;
 };
 
+//
+// A reflector is a snapshot built by the server. With lazy reflection,
+// that first snapshot only has the shader desc, and the rest is fetched
+// from the server one constant buffer at a time when first asked for.
+//
 struct ID3D11ShaderReflection
 {
-    ID3D11ShaderReflection() : m_refcount(1) {}
+    ID3D11ShaderReflection(std::vector<uint8_t> &snapshot,
+                           d3d4linux_snapshot::source *source = nullptr)
+      : m_lazy(source != nullptr),
+        m_source(source),
+        m_refcount(1)
+    {
+        m_snapshot.swap(snapshot);
+        m_signatures = m_lazy ? nullptr : head();
+        if (m_lazy)
+            m_buffers.resize(shader_desc().ConstantBuffers);
+    }
+
+    ~ID3D11ShaderReflection()
+    {
+        delete m_source;
+    }
 
     HRESULT GetDesc(D3D11_SHADER_DESC *Desc)
     {
-        *Desc = m_desc;
-        Desc->Creator = m_strings[0].c_str();
+        auto r = records<D3D11_SHADER_DESC>(head(), head()->desc);
+        *Desc = r->m_desc;
+        Desc->Creator = r->string(r->m_name);
         return S_OK;
     }
 
     HRESULT GetInputParameterDesc(uint32_t index, D3D11_SIGNATURE_PARAMETER_DESC *desc)
     {
-        if (index >= m_input_params.size())
-            return E_FAIL;
-
-        *desc = m_input_params[index];
-        desc->SemanticName = m_strings[1 + index].c_str();
-        return S_OK;
+        return param_desc(&d3d4linux_snapshot::header::inputs,
+                          shader_desc().InputParameters, index, desc);
     }
 
     HRESULT GetOutputParameterDesc(uint32_t index, D3D11_SIGNATURE_PARAMETER_DESC *desc)
     {
-        if (index >= m_output_params.size())
-            return E_FAIL;
-
-        *desc = m_output_params[index];
-        desc->SemanticName = m_strings[1 + m_input_params.size() + index].c_str();
-        return S_OK;
+        return param_desc(&d3d4linux_snapshot::header::outputs,
+                          shader_desc().OutputParameters, index, desc);
     }
 
     HRESULT GetResourceBindingDesc(uint32_t index, D3D11_SHADER_INPUT_BIND_DESC *desc)
     {
-        if (index >= m_binds.size())
+        if (index >= shader_desc().BoundResources || !signatures())
             return E_FAIL;
 
-        *desc = m_binds[index];
-        desc->Name = m_strings[1 + m_input_params.size() + m_output_params.size() + index].c_str();
+        auto r = records<D3D11_SHADER_INPUT_BIND_DESC>(m_signatures, m_signatures->binds) + index;
+        *desc = r->m_desc;
+        desc->Name = r->string(r->m_name);
         return S_OK;
     }
 
     struct ID3D11ShaderReflectionConstantBuffer *GetConstantBufferByName(char const *name)
     {
-        for (size_t i = 0; i < m_buffers.size(); ++i)
-            if (!strcmp(m_buffers[i].m_strings[0].c_str(), name))
-                return &m_buffers[i];
-        return nullptr;
+        for (uint32_t i = 0; i < shader_desc().ConstantBuffers; ++i)
+        {
+            ID3D11ShaderReflectionConstantBuffer *buf = m_lazy ? m_buffers[i]
+                                                    : GetConstantBufferByIndex(i);
+            if (buf && !strcmp(buf->string(buf->m_name), name))
+                return buf;
+        }
+
+        int64_t index = -1;
+        return m_lazy ? fetch_buffer(D3D4LINUX_QUERY_BUFFER_BY_NAME, index, name)
+                      : nullptr;
     }
 
     struct ID3D11ShaderReflectionConstantBuffer *GetConstantBufferByIndex(uint32_t index)
     {
-        return index < m_buffers.size() ? &m_buffers[index] : nullptr;
+        if (index >= shader_desc().ConstantBuffers)
+            return nullptr;
+
+        if (!m_lazy)
+            return (ID3D11ShaderReflectionConstantBuffer *)records<D3D11_SHADER_BUFFER_DESC>(
+                       head(), head()->buffers) + index;
+
+        int64_t i = index;
+        return m_buffers[index] ? m_buffers[index]
+                                : fetch_buffer(D3D4LINUX_QUERY_BUFFER, i, "");
+    }
+
+    uint32_t GetThreadGroupSize(uint32_t *pSizeX, uint32_t *pSizeY, uint32_t *pSizeZ)
+    {
+        uint32_t *sizes[] = { pSizeX, pSizeY, pSizeZ };
+        for (int i = 0; i < 3; ++i)
+            if (sizes[i])
+                *sizes[i] = head()->thread_group[i];
+        return head()->thread_group_size;
+    }
+
+    HRESULT GetMinFeatureLevel(D3D_FEATURE_LEVEL *pLevel)
+    {
+        *pLevel = (D3D_FEATURE_LEVEL)head()->min_feature_level;
+        return S_OK;
     }
 
     void AddRef() { ++m_refcount; }
-    void Release() { /*if (this && --m_refcount <= 0) delete this;*/ }
 
-    D3D11_SHADER_DESC m_desc;
-    std::vector<D3D11_SIGNATURE_PARAMETER_DESC> m_input_params;
-    std::vector<D3D11_SIGNATURE_PARAMETER_DESC> m_output_params;
-    std::vector<D3D11_SHADER_INPUT_BIND_DESC> m_binds;
-    std::vector<ID3D11ShaderReflectionConstantBuffer> m_buffers;
-    std::vector<std::string> m_strings;
+    /* Like with the DLL, buffers, variables and types that the reflector
+     * handed out go away with it, and so does what the server keeps for
+     * us */
+    void Release()
+    {
+        if (--m_refcount <= 0)
+            delete this;
+    }
 
 private:
+    d3d4linux_snapshot::header const *head() const
+    {
+        return (d3d4linux_snapshot::header const *)m_snapshot.data();
+    }
+
+    template<typename T>
+    static d3d4linux_snapshot::record<T> const *records(d3d4linux_snapshot::header const *h,
+                                                        uint32_t offset)
+    {
+        return (d3d4linux_snapshot::record<T> const *)((uint8_t const *)h + offset);
+    }
+
+    D3D11_SHADER_DESC const &shader_desc() const
+    {
+        return records<D3D11_SHADER_DESC>(head(), head()->desc)->m_desc;
+    }
+
+    HRESULT param_desc(uint32_t d3d4linux_snapshot::header::*array, uint32_t count,
+                       uint32_t index, D3D11_SIGNATURE_PARAMETER_DESC *desc)
+    {
+        if (index >= count || !signatures())
+            return E_FAIL;
+
+        auto r = records<D3D11_SIGNATURE_PARAMETER_DESC>(m_signatures,
+                                                         m_signatures->*array) + index;
+        *desc = r->m_desc;
+        desc->SemanticName = r->string(r->m_name);
+        return S_OK;
+    }
+
+    d3d4linux_snapshot::header const *signatures()
+    {
+        int64_t index = -1;
+        if (!m_signatures)
+            m_signatures = fetch(D3D4LINUX_QUERY_SIGNATURES, index, "");
+        return m_signatures;
+    }
+
+    ID3D11ShaderReflectionConstantBuffer *fetch_buffer(int64_t query, int64_t &index,
+                                                       char const *name)
+    {
+        d3d4linux_snapshot::header const *part = fetch(query, index, name);
+        if (!part || index < 0 || index >= (int64_t)m_buffers.size())
+            return nullptr;
+
+        return m_buffers[index] = (ID3D11ShaderReflectionConstantBuffer *)
+                   records<D3D11_SHADER_BUFFER_DESC>(part, part->buffers);
+    }
+
+    d3d4linux_snapshot::header const *fetch(int64_t query, int64_t &index, char const *name)
+    {
+        std::vector<uint8_t> part;
+        if (!m_source || !m_source->fetch(query, index, name, part))
+            return nullptr;
+
+        /* Moving the outer vector leaves the parts where they are */
+        m_parts.push_back(std::vector<uint8_t>());
+        m_parts.back().swap(part);
+        return (d3d4linux_snapshot::header const *)m_parts.back().data();
+    }
+
+    std::vector<uint8_t> m_snapshot;
+    std::vector<std::vector<uint8_t>> m_parts;
+    d3d4linux_snapshot::header const *m_signatures;
+    std::vector<ID3D11ShaderReflectionConstantBuffer *> m_buffers;
+    bool m_lazy;
+    d3d4linux_snapshot::source *m_source;
     int m_refcount;
 };
 
@@ -209,10 +489,16 @@ private:
 };
 
 /*
- * Helper class
+ * Helper class; with D3D4LINUX_SHARED, only a shim that forwards to
+ * libd3d4linux.so or libd3d4linux.a
  */
 
-#include <d3d4linux_impl.h>
+#if defined D3D4LINUX_SHARED
+#   include <d3d4linux_shim.h>
+#else
+#   include <d3d4linux_impl.h>
+#   include <d3d4linux_async.h>
+#endif
 
 /*
  * Functions that come from D3D
@@ -224,6 +510,46 @@ HRESULT D3DCreateBlob(size_t Size, ID3DBlob **ppBlob)
     return d3d4linux::create_blob(Size, ppBlob);
 }
 
+static inline
+HRESULT D3DGetBlobPart(void const *pSrcData, size_t SrcDataSize,
+                       D3D_BLOB_PART Part, uint32_t Flags,
+                       ID3DBlob **ppPart)
+{
+    return d3d4linux::get_blob_part(pSrcData, SrcDataSize, Part, Flags, ppPart);
+}
+
+static inline
+HRESULT D3DSetBlobPart(void const *pSrcData, size_t SrcDataSize,
+                       D3D_BLOB_PART Part, uint32_t Flags,
+                       void const *pPart, size_t PartSize,
+                       ID3DBlob **ppNewShader)
+{
+    return d3d4linux::set_blob_part(pSrcData, SrcDataSize, Part, Flags,
+                                    pPart, PartSize, ppNewShader);
+}
+
+static inline
+HRESULT D3DCompressShaders(uint32_t uNumShaders,
+                           D3D_SHADER_DATA *pShaderData,
+                           uint32_t uFlags,
+                           ID3DBlob **ppCompressedData)
+{
+    return d3d4linux::compress_shaders(uNumShaders, pShaderData,
+                                       uFlags, ppCompressedData);
+}
+
+static inline
+HRESULT D3DDecompressShaders(void const *pSrcData, size_t SrcDataSize,
+                             uint32_t uNumShaders, uint32_t uStartIndex,
+                             uint32_t *pIndices, uint32_t uFlags,
+                             ID3DBlob **ppShaders, uint32_t *pTotalShaders)
+{
+    return d3d4linux::decompress_shaders(pSrcData, SrcDataSize,
+                                         uNumShaders, uStartIndex,
+                                         pIndices, uFlags,
+                                         ppShaders, pTotalShaders);
+}
+
 static inline
 HRESULT D3DCompile(void const *pSrcData, size_t SrcDataSize,
                    char const *pFileName,
@@ -233,9 +559,24 @@ HRESULT D3DCompile(void const *pSrcData, size_t SrcDataSize,
                    uint32_t Flags1, uint32_t Flags2,
                    ID3DBlob **ppCode, ID3DBlob **ppErrorMsgs)
 {
-    return d3d4linux::compile(pSrcData, SrcDataSize, pFileName, pDefines,
-                              pInclude, pEntrypoint, pTarget, Flags1,
-                              Flags2, ppCode, ppErrorMsgs);
+    return d3d4linux::versioned<0>::compile(pSrcData, SrcDataSize, pFileName,
+                                            pDefines, pInclude, pEntrypoint,
+                                            pTarget, Flags1, Flags2, ppCode,
+                                            ppErrorMsgs);
+}
+
+static inline
+HRESULT D3DPreprocess(void const *pSrcData, size_t SrcDataSize,
+                      char const *pSourceName,
+                      D3D_SHADER_MACRO const *pDefines,
+                      ID3DInclude *pInclude,
+                      ID3DBlob **ppCodeText,
+                      ID3DBlob **ppErrorMsgs)
+{
+    return d3d4linux::versioned<0>::preprocess(pSrcData, SrcDataSize,
+                                               pSourceName, pDefines,
+                                               pInclude, ppCodeText,
+                                               ppErrorMsgs);
 }
 
 static inline
@@ -245,8 +586,8 @@ HRESULT D3DDisassemble(void const *pSrcData,
                        char const *szComments,
                        ID3DBlob **ppDisassembly)
 {
-    return d3d4linux::disassemble(pSrcData, SrcDataSize, Flags,
-                                  szComments, ppDisassembly);
+    return d3d4linux::versioned<0>::disassemble(pSrcData, SrcDataSize, Flags,
+                                                szComments, ppDisassembly);
 }
 
 static inline
@@ -255,7 +596,8 @@ HRESULT D3DReflect(void const *pSrcData,
                    REFIID pInterface,
                    void **ppReflector)
 {
-    return d3d4linux::reflect(pSrcData, SrcDataSize, pInterface, ppReflector);
+    return d3d4linux::versioned<0>::reflect(pSrcData, SrcDataSize, pInterface,
+                                            ppReflector);
 }
 
 static inline
@@ -264,55 +606,57 @@ HRESULT D3DStripShader(void const *pShaderBytecode,
                        uint32_t uStripFlags,
                        ID3DBlob **ppStrippedBlob)
 {
-    return d3d4linux::strip_shader(pShaderBytecode, BytecodeLength,
-                                   uStripFlags, ppStrippedBlob);
+    return d3d4linux::versioned<0>::strip_shader(pShaderBytecode, BytecodeLength,
+                                                 uStripFlags, ppStrippedBlob);
 }
 
 /*
  * Only Compile, Disassemble and Preprocess have associated types
  */
 
-typedef decltype(&d3d4linux::compile) pD3DCompile;
-typedef decltype(&d3d4linux::disassemble) pD3DDisassemble;
+typedef decltype(&d3d4linux::versioned<0>::compile) pD3DCompile;
+typedef decltype(&d3d4linux::versioned<0>::disassemble) pD3DDisassemble;
+typedef decltype(&d3d4linux::versioned<0>::preprocess) pD3DPreprocess;
 
 /*
  * Helper functions for Windows
  */
 
+/* The module handle is the compiler version, so that GetProcAddress() can
+ * return entry points that target that specific DLL. */
 static inline HMODULE LoadLibrary(char const *name)
 {
     static char const *prefix = "d3dcompiler_";
     char const *pos = strstr(name, prefix);
-    if (pos)
-        d3d4linux::compiler_version() = atoi(pos + strlen(prefix));
-    return (HMODULE)1;
+    if (!pos)
+        return (HMODULE)1;
+    d3d4linux::compiler_version() = atoi(pos + strlen(prefix));
+    return (HMODULE)d3d4linux::compiler_version();
 }
 
 static inline HMODULE LoadLibrary(wchar_t const *name)
 {
     static wchar_t const *prefix = L"d3dcompiler_";
     wchar_t const *pos = wcsstr(name, prefix);
-    if (pos)
-        d3d4linux::compiler_version() = wcstol(pos + wcslen(prefix), nullptr, 10);
-    return (HMODULE)1;
+    if (!pos)
+        return (HMODULE)1;
+    d3d4linux::compiler_version() = wcstol(pos + wcslen(prefix), nullptr, 10);
+    return (HMODULE)d3d4linux::compiler_version();
 }
 
 static inline void FreeLibrary(HMODULE handle)
 {
 }
 
-static void *GetProcAddress(HMODULE, char const *name)
+static inline void *GetProcAddress(HMODULE handle, char const *name)
 {
-    if (!strcmp(name, "D3DCompile"))
-        return (void *)&d3d4linux::compile;
-    if (!strcmp(name, "D3DReflect"))
-        return (void *)&d3d4linux::reflect;
-    if (!strcmp(name, "D3DDisassemble"))
-        return (void *)&d3d4linux::disassemble;
-    if (!strcmp(name, "D3DStripShader"))
-        return (void *)&d3d4linux::strip_shader;
-    if (!strcmp(name, "D3DCreateBlob"))
-        return (void *)&d3d4linux::create_blob;
-    return nullptr;
+    switch (handle)
+    {
+    case 43:
+        return d3d4linux::versioned<43>::proc_address(name);
+    case 47:
+        return d3d4linux::versioned<47>::proc_address(name);
+    default:
+        return d3d4linux::versioned<0>::proc_address(name);
+    }
 }
-
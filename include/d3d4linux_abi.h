@@ -0,0 +1,127 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <stddef.h> /* for size_t */
+#include <stdint.h> /* for uint32_t */
+
+//
+// The C interface of libd3d4linux.so and libd3d4linux.a, which hold the
+// whole client: server pool, caches, cost model. With D3D4LINUX_SHARED,
+// d3d4linux.h forwards the D3D functions to these instead of building a
+// client into every program that includes it (see d3d4linux_shim.h).
+//
+// Only plain C types cross this boundary, so that the library and its
+// users may be built by different compilers. Results come back in
+// buffers allocated by the library, to be released with d3d4linux_free();
+// a NULL buffer stands for a NULL blob. Return values are HRESULTs.
+//
+// D3D4LINUX_ABI_VERSION changes whenever a signature does; programs that
+// dlopen() the library should compare it with d3d4linux_abi_version().
+//
+#define D3D4LINUX_ABI_VERSION 1
+
+#define D3D4LINUX_API __attribute__((visibility("default")))
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+typedef struct d3d4linux_buffer
+{
+    void *data;
+    size_t size;
+} d3d4linux_buffer;
+
+/* Same layout as D3D_SHADER_MACRO */
+typedef struct d3d4linux_define
+{
+    char const *name;
+    char const *definition;
+} d3d4linux_define;
+
+/* An ID3DInclude, as callbacks; open() and close() return HRESULTs */
+typedef struct d3d4linux_include
+{
+    void *context;
+    long (*open)(void *context, int type, char const *name, void const *parent,
+                 void const **data, uint32_t *bytes);
+    long (*close)(void *context, void const *data);
+} d3d4linux_include;
+
+/* Same as D3D_COMPILE_STANDARD_FILE_INCLUDE */
+#define D3D4LINUX_STANDARD_INCLUDE ((d3d4linux_include const *)(uintptr_t)1)
+
+typedef struct d3d4linux_startup
+{
+    int servers, prefixes;
+    double average_msecs, max_msecs;
+} d3d4linux_startup;
+
+D3D4LINUX_API int d3d4linux_abi_version(void);
+
+/* The compiler version used when none is given, as set by LoadLibrary() */
+D3D4LINUX_API int *d3d4linux_compiler_version(void);
+
+/* The priority of requests from the calling thread, see D3D4LINUX_PRIORITY */
+D3D4LINUX_API int *d3d4linux_priority(void);
+
+D3D4LINUX_API void d3d4linux_free(void *data);
+
+D3D4LINUX_API long d3d4linux_compile(int version, void const *src, size_t size,
+                                     char const *file, d3d4linux_define const *defines,
+                                     d3d4linux_include const *include,
+                                     char const *entry, char const *target,
+                                     uint32_t flags1, uint32_t flags2,
+                                     d3d4linux_buffer *code, d3d4linux_buffer *errors);
+
+D3D4LINUX_API long d3d4linux_preprocess(int version, void const *src, size_t size,
+                                        char const *file, d3d4linux_define const *defines,
+                                        d3d4linux_include const *include,
+                                        d3d4linux_buffer *text, d3d4linux_buffer *errors);
+
+D3D4LINUX_API long d3d4linux_strip(int version, void const *code, size_t size,
+                                   uint32_t flags, d3d4linux_buffer *out);
+
+D3D4LINUX_API long d3d4linux_disassemble(int version, void const *code, size_t size,
+                                         uint32_t flags, char const *comments,
+                                         d3d4linux_buffer *out);
+
+/* The DLL's shader library functions, which the native ones are checked
+ * against. The shaders have the layout of D3D_SHADER_DATA; out holds one
+ * buffer per shader to decompress */
+D3D4LINUX_API long d3d4linux_dll_compress_shaders(int version, uint32_t count,
+                                                  d3d4linux_buffer const *shaders,
+                                                  uint32_t flags, d3d4linux_buffer *out);
+
+D3D4LINUX_API long d3d4linux_dll_decompress_shaders(int version, void const *data, size_t size,
+                                                    uint32_t count, uint32_t start,
+                                                    uint32_t const *indices, uint32_t flags,
+                                                    d3d4linux_buffer *out, uint32_t *total);
+
+/* The reflection is a snapshot (see d3d4linux_snapshot.h); with lazy
+ * reflection, *source is also set to a handle that the rest is fetched
+ * from, and that must be closed. */
+D3D4LINUX_API long d3d4linux_reflect(int version, void const *code, size_t size,
+                                     long iid, d3d4linux_buffer *snapshot, void **source);
+
+D3D4LINUX_API int d3d4linux_reflect_fetch(void *source, int64_t query, int64_t *index,
+                                          char const *name, d3d4linux_buffer *out);
+
+D3D4LINUX_API void d3d4linux_reflect_close(void *source);
+
+D3D4LINUX_API void d3d4linux_server_startup(d3d4linux_startup *stats);
+
+#if defined __cplusplus
+}
+#endif
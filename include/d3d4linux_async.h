@@ -0,0 +1,652 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cerrno> /* for errno */
+#include <cstdint> /* for int64_t */
+#include <cstdio> /* for open_memstream() */
+#include <cstdlib> /* for free() */
+#include <cstring> /* for memcpy() */
+
+#include <unistd.h> /* for read() */
+#include <fcntl.h> /* for O_NONBLOCK */
+#include <sys/epoll.h> /* for epoll_wait() */
+#include <sys/eventfd.h> /* for eventfd() */
+
+#include <atomic> /* for std::atomic */
+#include <condition_variable> /* for std::condition_variable */
+#include <functional> /* for std::function */
+#include <map> /* for std::multimap */
+#include <memory> /* for std::unique_ptr */
+#include <mutex> /* for std::mutex */
+#include <string> /* for std::string */
+#include <thread> /* for std::thread */
+#include <vector> /* for std::vector */
+
+//
+// Asynchronous compilation. D3DCompile() blocks its thread until the
+// server answers, so that many compilations in flight need as many
+// threads. This engine instead drives its own servers from a single
+// thread, through non-blocking pipes and epoll, and hands each result to
+// a callback, run by the given executor.
+//
+// Preprocessing and cache lookups happen in the calling thread, and
+// results are cached as usual; queued requests go to servers by priority
+// lane of the submitting thread (see d3d4linux::priority()), then longest
+// predicted first (see d3d4linux_cost.h). The engine has its own servers,
+// D3D4LINUX_SERVERS of them at most, which are not shared with the
+// blocking calls. Under make -jN, each request also holds a job token
+// while it is on a server, like a blocking call.
+//
+// With D3D4LINUX_COMPOSITE, the extra results of a compilation are kept
+// for the thread that runs its callback, as if it had called D3DCompile()
+// itself.
+//
+struct d3d4linux_async
+{
+    /* Receives the code and error blobs, which it must release */
+    typedef std::function<void (HRESULT, ID3DBlob *, ID3DBlob *)> callback;
+
+    /* Runs a completion; the default runs it on the engine’s thread, in
+     * which case it must not block. */
+    typedef std::function<void (std::function<void ()> const &)> executor;
+
+    explicit d3d4linux_async(executor ex = executor())
+      : m_executor(ex),
+        m_epoll(epoll_create1(EPOLL_CLOEXEC)),
+        m_wake(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+        m_stop(false),
+        m_pending(0),
+        m_starting(0),
+        m_starved(false)
+    {
+        int size = d3d4linux::getenv_int("D3D4LINUX_SERVERS", D3D4LINUX_SERVERS);
+        if (size <= 0)
+            size = (int)std::thread::hardware_concurrency();
+        m_size = size > 0 ? size : 1;
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = nullptr;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wake, &ev);
+        m_thread = std::thread(&d3d4linux_async::loop, this);
+    }
+
+    /* Complete everything that was queued, then stop the servers */
+    ~d3d4linux_async()
+    {
+        wait();
+        m_stop = true;
+        wake();
+        m_thread.join();
+        for (server *s : m_servers)
+        {
+            delete s->in.m_code;
+            delete s->in.m_errors;
+            delete s->process;
+            delete s;
+        }
+        close(m_wake);
+        close(m_epoll);
+    }
+
+    void compile(void const *pSrcData,
+                 size_t SrcDataSize,
+                 char const *pFileName,
+                 D3D_SHADER_MACRO const *pDefines,
+                 ID3DInclude *pInclude,
+                 char const *pEntrypoint,
+                 char const *pTarget,
+                 uint32_t Flags1,
+                 uint32_t Flags2,
+                 callback cb)
+    {
+        int version = d3d4linux::compiler_version();
+        std::unique_ptr<request> r(new request());
+        r->cb = cb;
+        r->steps = d3d4linux::getenv_int("D3D4LINUX_COMPOSITE", D3D4LINUX_COMPOSITE);
+        r->strip_flags = (uint32_t)d3d4linux::getenv_int("D3D4LINUX_COMPOSITE_STRIP_FLAGS",
+                                                         D3D4LINUX_COMPOSITE_STRIP_FLAGS);
+        r->shader = d3d4linux_cost_model::describe(pFileName, pEntrypoint, pTarget,
+                                                   Flags1, Flags2, pDefines, SrcDataSize);
+
+        std::string expanded, key;
+        ID3DBlob *code = nullptr, *errors = nullptr;
+        if (!d3d4linux::prepare(version, pSrcData, SrcDataSize, pFileName, pDefines,
+                                pInclude, pEntrypoint, pTarget, Flags1, Flags2,
+                                expanded, key, &errors))
+        {
+            deliver(cb, E_FAIL, nullptr, errors);
+            return;
+        }
+
+        d3d4linux_cache &cache = d3d4linux_cache::get();
+        r->hash = d3d4linux_cache::hash(key.data(), key.size());
+        std::string value;
+        if (cache.enabled() && cache.lookup(r->hash, value)
+             && d3d4linux::unpack_blobs(value, &code, &errors))
+        {
+            deliver(cb, S_OK, code, errors);
+            return;
+        }
+
+        /* Encode the request exactly like a blocking call would */
+        char *data = nullptr;
+        size_t size = 0;
+        FILE *stream = open_memstream(&data, &size);
+        if (!stream)
+        {
+            deliver(cb, E_FAIL, nullptr, nullptr);
+            return;
+        }
+        interop p(nullptr, stream);
+        d3d4linux::write_compile(p, version, pSrcData, SrcDataSize, pFileName,
+                                 pEntrypoint, pTarget, Flags1, Flags2,
+                                 r->steps, r->strip_flags);
+        p.write_i64(D3D4LINUX_FINISHED);
+        fclose(stream);
+        r->data.assign(data, size);
+        free(data);
+
+        double cost = d3d4linux_cost_model::get().predict(r->shader);
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.insert(std::make_pair(rank(d3d4linux::priority(), -cost), r.release()));
+            ++m_pending;
+        }
+        wake();
+    }
+
+    /* Block until all compilations so far have completed */
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this]() { return m_pending == 0; });
+    }
+
+private:
+    typedef d3d4linux::fork_process fork_process;
+    typedef d3d4linux::jobserver jobserver;
+    typedef d3d4linux::composite_memo composite_memo;
+
+    struct request
+    {
+        request() : retried(false), start(0), token(jobserver::NONE) {}
+
+        callback cb;
+        d3d4linux_cost_model::shader shader;
+        d3d4linux_cache::key hash;
+        std::string data;
+        int steps;
+        uint32_t strip_flags;
+        bool retried;
+        int64_t start;
+        /* Only held while on a server */
+        int token;
+    };
+
+    //
+    // A reply, parsed as bytes arrive: the result, the code blob, the
+    // error blob, the results of the composite steps if the compilation
+    // succeeded, then the end marker. A server that just started only
+    // sends the end marker.
+    //
+    struct reply
+    {
+        enum { RESULT, CODE_SIZE, CODE, ERRORS_SIZE, ERRORS,
+               STEP_RESULT, STEP_SIZE, STEP_DATA, END, DONE };
+
+        explicit reply(int step = RESULT, int steps = 0)
+          : m_step(step), m_have(0), m_left(0), m_ret(E_FAIL),
+            m_code(nullptr), m_errors(nullptr), m_steps(steps), m_result(0)
+        {}
+
+        bool done() const
+        {
+            return m_step == DONE;
+        }
+
+        /* Consume what belongs to this reply; false if it is malformed */
+        bool feed(uint8_t const *&data, size_t &size)
+        {
+            while (size > 0 && m_step != DONE)
+            {
+                if (m_step == CODE || m_step == ERRORS || m_step == STEP_DATA)
+                {
+                    size_t n = size < m_left ? size : m_left;
+                    if (m_step == STEP_DATA)
+                        m_results[m_result].data.append((char const *)data, n);
+                    else
+                    {
+                        ID3DBlob *blob = m_step == CODE ? m_code : m_errors;
+                        memcpy((uint8_t *)blob->GetBufferPointer() + blob->GetBufferSize() - m_left,
+                               data, n);
+                    }
+                    data += n;
+                    size -= n;
+                    m_left -= n;
+                    if (m_left == 0 && m_step == STEP_DATA)
+                    {
+                        ++m_result;
+                        enter(STEP_RESULT);
+                    }
+                    else if (m_left == 0)
+                        enter(m_step + 1);
+                    continue;
+                }
+
+                size_t n = size < sizeof(m_word) - m_have ? size : sizeof(m_word) - m_have;
+                memcpy(m_word + m_have, data, n);
+                data += n;
+                size -= n;
+                m_have += n;
+                if (m_have < sizeof(m_word))
+                    break;
+
+                int64_t x;
+                memcpy(&x, m_word, sizeof(x));
+                m_have = 0;
+                switch (m_step)
+                {
+                case RESULT:
+                    m_ret = (HRESULT)x;
+                    m_step = CODE_SIZE;
+                    break;
+                case CODE_SIZE:
+                case ERRORS_SIZE:
+                    if (x > 0)
+                    {
+                        (m_step == CODE_SIZE ? m_code : m_errors) = new ID3DBlob(x);
+                        m_left = (size_t)x;
+                        enter(m_step + 1);
+                    }
+                    else
+                    {
+                        if (x == 0)
+                            (m_step == CODE_SIZE ? m_code : m_errors) = new ID3DBlob(0);
+                        enter(m_step + 2);
+                    }
+                    break;
+                case STEP_RESULT:
+                    m_results[m_result].ret = (HRESULT)x;
+                    m_step = STEP_SIZE;
+                    break;
+                case STEP_SIZE:
+                    m_results[m_result].has_data = x >= 0;
+                    if (x > 0)
+                    {
+                        m_left = (size_t)x;
+                        m_step = STEP_DATA;
+                    }
+                    else
+                    {
+                        ++m_result;
+                        enter(STEP_RESULT);
+                    }
+                    break;
+                case END:
+                    if (x != D3D4LINUX_FINISHED)
+                        return false;
+                    m_step = DONE;
+                    break;
+                }
+            }
+            return true;
+        }
+
+        /* The server only runs the composite steps on new bytecode */
+        void enter(int step)
+        {
+            m_step = step;
+            if (step != STEP_RESULT)
+                return;
+            while (m_result < 3 && !(m_steps & composite_memo::step(m_result)))
+                ++m_result;
+            if (m_result == 3 || FAILED(m_ret) || !m_code)
+                m_step = END;
+        }
+
+        int m_step;
+        uint8_t m_word[8];
+        size_t m_have, m_left;
+        HRESULT m_ret;
+        ID3DBlob *m_code, *m_errors;
+        int m_steps, m_result;
+        composite_memo::result m_results[3];
+    };
+
+    struct server
+    {
+        server()
+          : process(nullptr), ready(false), dead(false), writing(false),
+            current(nullptr), written(0)
+        {}
+
+        fork_process *process;
+        /* Dead servers are deleted once the current epoll events are
+         * handled, since several of them may point to the same server */
+        bool ready, dead, writing;
+        request *current;
+        size_t written;
+        reply in;
+    };
+
+    void wake()
+    {
+        uint64_t one = 1;
+        while (write(m_wake, &one, sizeof(one)) < 0 && errno == EINTR)
+            ;
+    }
+
+    void deliver(callback const &cb, HRESULT ret, ID3DBlob *code, ID3DBlob *errors,
+                 std::shared_ptr<composite_memo> memo = nullptr)
+    {
+        auto run = [cb, ret, code, errors, memo]()
+        {
+            if (memo)
+                composite_memo::get() = *memo;
+            cb(ret, code, errors);
+        };
+        if (m_executor)
+            m_executor(run);
+        else
+            run();
+    }
+
+    void loop()
+    {
+        /* Writing to a dead server must fail, not kill us */
+        d3d4linux_sys::block_sigpipe();
+
+        epoll_event events[64];
+        while (!m_stop)
+        {
+            dispatch();
+            /* Our implicit token comes back without any event */
+            int n = epoll_wait(m_epoll, events, 64, m_starved ? 100 : -1);
+            for (int i = 0; i < n; ++i)
+            {
+                server *s = (server *)events[i].data.ptr;
+                if (s == (server *)this)
+                    continue;
+                if (!s)
+                {
+                    uint64_t count;
+                    while (read(m_wake, &count, sizeof(count)) > 0)
+                        ;
+                    continue;
+                }
+                if (!s->dead && s->writing && (events[i].events & (EPOLLOUT | EPOLLERR)))
+                    flush(s);
+                if (!s->dead && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                    receive(s);
+            }
+
+            for (server *s : m_dead)
+            {
+                delete s->process;
+                delete s;
+            }
+            m_dead.clear();
+        }
+    }
+
+    /* Hand queued requests to ready servers, each with a job token, and
+     * start new servers for the requests that are left */
+    void dispatch()
+    {
+        jobserver &js = jobserver::get();
+        std::vector<server *> busy;
+        bool starved = false;
+        std::unique_lock<std::mutex> lock(m_mutex);
+        for (server *s : m_servers)
+        {
+            if (m_queue.empty())
+                break;
+            if (s->ready && !s->current)
+            {
+                int token = js.try_acquire();
+                if (token == jobserver::BUSY)
+                {
+                    starved = true;
+                    break;
+                }
+                s->current = m_queue.begin()->second;
+                m_queue.erase(m_queue.begin());
+                s->written = 0;
+                s->in = reply(reply::RESULT, s->current->steps);
+                s->current->start = d3d4linux_sys::now();
+                s->current->token = token;
+                busy.push_back(s);
+            }
+        }
+        int waiting = (int)m_queue.size() - m_starting;
+        lock.unlock();
+
+        /* Wait for make to have a token again */
+        if (starved != m_starved)
+        {
+            epoll_event ev = {};
+            ev.events = EPOLLIN;
+            ev.data.ptr = this;
+            epoll_ctl(m_epoll, starved ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, js.fd(), &ev);
+            m_starved = starved;
+        }
+
+        for (server *s : busy)
+            flush(s);
+        while (waiting-- > 0 && (int)m_servers.size() < m_size)
+            spawn();
+    }
+
+    void spawn()
+    {
+        int index = (int)m_servers.size();
+        fork_process *process = new fork_process(d3d4linux::wine_prefixes::get().path(index));
+        if (process->error())
+        {
+            delete process;
+            fail_all();
+            return;
+        }
+
+        fcntl(fileno(process->m_in), F_SETFL, O_NONBLOCK);
+        fcntl(fileno(process->m_out), F_SETFL, O_NONBLOCK);
+
+        server *s = new server();
+        s->process = process;
+        s->in = reply(reply::END);
+        m_servers.push_back(s);
+        ++m_starting;
+
+        epoll_event ev = {};
+        ev.events = EPOLLIN;
+        ev.data.ptr = s;
+        epoll_ctl(m_epoll, EPOLL_CTL_ADD, fileno(process->m_in), &ev);
+    }
+
+    /* Write as much of the current request as the pipe takes, and only
+     * poll the pipe while some is left */
+    void flush(server *s)
+    {
+        request *r = s->current;
+        int fd = fileno(s->process->m_out);
+        while (s->written < r->data.size())
+        {
+            ssize_t n = write(fd, r->data.data() + s->written, r->data.size() - s->written);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                break;
+            if (n < 0)
+                return lose(s);
+            s->written += n;
+        }
+
+        bool writing = s->written < r->data.size();
+        if (writing != s->writing)
+        {
+            epoll_event ev = {};
+            ev.events = EPOLLOUT;
+            ev.data.ptr = s;
+            epoll_ctl(m_epoll, writing ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, fd, &ev);
+            s->writing = writing;
+        }
+    }
+
+    void receive(server *s)
+    {
+        uint8_t buf[65536];
+        while (!s->dead)
+        {
+            ssize_t n = read(fileno(s->process->m_in), buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && errno == EAGAIN)
+                return;
+            if (n <= 0)
+                return lose(s);
+
+            uint8_t const *data = buf;
+            size_t size = (size_t)n;
+            while (size > 0)
+            {
+                /* Bytes that no request asked for mean a desync */
+                if ((s->ready && !s->current) || !s->in.feed(data, size))
+                    return lose(s);
+                if (!s->in.done())
+                    break;
+
+                if (!s->ready)
+                {
+                    s->ready = true;
+                    --m_starting;
+                }
+                else
+                    complete(s);
+                s->in = reply();
+            }
+            dispatch();
+        }
+    }
+
+    void complete(server *s)
+    {
+        request *r = s->current;
+        s->current = nullptr;
+
+        HRESULT ret = s->in.m_ret;
+        ID3DBlob *code = s->in.m_code, *errors = s->in.m_errors;
+        d3d4linux_cost_model::get().record(r->shader, (double)(d3d4linux_sys::now() - r->start));
+        d3d4linux_cache &cache = d3d4linux_cache::get();
+        if (SUCCEEDED(ret) && cache.enabled())
+            cache.store(r->hash, d3d4linux::pack_blobs(code, errors));
+
+        std::shared_ptr<composite_memo> memo;
+        if (r->steps && SUCCEEDED(ret) && code)
+        {
+            memo = std::make_shared<composite_memo>();
+            memo->assign(code, r->steps, r->strip_flags, s->in.m_results);
+        }
+        finish(r, ret, code, errors, memo);
+    }
+
+    void finish(request *r, HRESULT ret, ID3DBlob *code, ID3DBlob *errors,
+                std::shared_ptr<composite_memo> memo = nullptr)
+    {
+        jobserver::get().release(r->token);
+        deliver(r->cb, ret, code, errors, memo);
+        delete r;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_pending == 0)
+            m_idle.notify_all();
+    }
+
+    /* A server died or went out of sync; its request gets one more try */
+    void lose(server *s)
+    {
+        if (s->dead)
+            return;
+        s->dead = true;
+        m_dead.push_back(s);
+        for (size_t i = 0; i < m_servers.size(); ++i)
+            if (m_servers[i] == s)
+                m_servers.erase(m_servers.begin() + i);
+
+        epoll_ctl(m_epoll, EPOLL_CTL_DEL, fileno(s->process->m_in), nullptr);
+        if (s->writing)
+            epoll_ctl(m_epoll, EPOLL_CTL_DEL, fileno(s->process->m_out), nullptr);
+        delete s->in.m_code;
+        delete s->in.m_errors;
+
+        request *r = s->current;
+        if (r && !r->retried)
+        {
+            jobserver::get().release(r->token);
+            r->token = jobserver::NONE;
+            r->retried = true;
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_queue.insert(std::make_pair(rank(-1, 0.0), r));
+        }
+        else if (r)
+        {
+            static char const *error_msg = "Lost the server in d3d4linux::compile()";
+            finish(r, E_FAIL, nullptr, d3d4linux::make_blob(error_msg, strlen(error_msg)));
+        }
+
+        /* A server that could not even start will not do better next
+         * time; do not keep spawning new ones */
+        if (!s->ready)
+        {
+            --m_starting;
+            fail_all();
+        }
+    }
+
+    /* No server can be started: fail everything that waits for one,
+     * unless some other server is alive */
+    void fail_all()
+    {
+        std::multimap<rank, request *> queue;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (server *s : m_servers)
+                if (s->ready)
+                    return;
+            queue.swap(m_queue);
+        }
+        static char const *error_msg = "Cannot fork in d3d4linux::compile()";
+        for (auto const &q : queue)
+            finish(q.second, E_FAIL, nullptr, d3d4linux::make_blob(error_msg, strlen(error_msg)));
+    }
+
+    executor m_executor;
+    int m_epoll, m_wake, m_size;
+    std::atomic<bool> m_stop;
+    std::thread m_thread;
+
+    /* Queued requests by lane, then longest predicted first; retries
+     * come before any lane */
+    typedef std::pair<int, double> rank;
+    std::mutex m_mutex;
+    std::condition_variable m_idle;
+    std::multimap<rank, request *> m_queue;
+    int m_pending;
+
+    /* Only used by the engine’s thread */
+    std::vector<server *> m_servers, m_dead;
+    int m_starting;
+    /* Whether requests wait for a job token */
+    bool m_starved;
+};
@@ -0,0 +1,1116 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint32_t */
+#include <cstring> /* for memcpy() */
+
+#include <algorithm> /* for std::min() */
+#include <atomic> /* for std::atomic */
+#include <string> /* for std::string */
+#include <thread> /* for std::thread */
+#include <vector> /* for std::vector */
+
+//
+// Microsoft cabinet files, which is what shader libraries are made of:
+//
+//   header:  "MSCF", u32 0, u32 cabinet size, u32 0, u32 offset of the
+//            first file, u32 0, u8 3, u8 1, u16 folder count, u16 file
+//            count, u16 flags, u16 set ID, u16 cabinet number, then
+//            reserved space if flags has 4
+//   folders: u32 offset of the first block, u16 block count,
+//            u16 compression type
+//   files:   u32 size, u32 offset in the folder, u16 folder, u16 date,
+//            u16 time, u16 attributes, name
+//   blocks:  u32 checksum, u16 stored size, u16 size, data
+//
+// The files of a folder are one stream, cut into blocks of 32 KiB that
+// are compressed as a whole. We only write one MSZIP folder, and each of
+// its blocks is a deflate stream of its own so that they compress in
+// parallel. Reading also supports stored and LZX folders; LZX is what
+// the compiler DLL writes on Windows.
+//
+struct d3d4linux_cab
+{
+    struct file
+    {
+        std::string name;
+        std::string data;
+    };
+
+    static bool write(std::vector<file> const &files, std::string &out)
+    {
+        std::string stream;
+        size_t names = 0;
+        for (auto const &f : files)
+        {
+            stream += f.data;
+            names += f.name.size() + 1;
+        }
+
+        size_t block_count = (stream.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        if (files.size() > 0xffff || block_count > 0xffff || stream.size() > 0x7fffffffu)
+            return false;
+
+        std::vector<std::string> blocks(block_count);
+        parallel(block_count, stream.size(), [&](size_t i)
+        {
+            size_t size = std::min<size_t>(BLOCK_SIZE, stream.size() - i * BLOCK_SIZE);
+            blocks[i] = "CK";
+            deflate((uint8_t const *)stream.data() + i * BLOCK_SIZE, size, blocks[i]);
+        });
+
+        size_t data_offset = HEADER_SIZE + FOLDER_SIZE + files.size() * FILE_SIZE + names;
+        size_t total = data_offset;
+        for (auto const &b : blocks)
+            total += BLOCK_HEADER_SIZE + b.size();
+        if (total > 0x7fffffffu)
+            return false;
+
+        out.assign(HEADER_SIZE + FOLDER_SIZE, '\0');
+        memcpy(&out[0], "MSCF", 4);
+        write32(&out[8], (uint32_t)total);
+        write32(&out[16], HEADER_SIZE + FOLDER_SIZE);
+        out[24] = 3;
+        out[25] = 1;
+        write16(&out[26], 1);
+        write16(&out[28], (uint16_t)files.size());
+        write32(&out[HEADER_SIZE], (uint32_t)data_offset);
+        write16(&out[HEADER_SIZE + 4], (uint16_t)block_count);
+        write16(&out[HEADER_SIZE + 6], TYPE_MSZIP);
+
+        uint32_t offset = 0;
+        for (auto const &f : files)
+        {
+            char entry[FILE_SIZE] = { 0 };
+            write32(entry, (uint32_t)f.data.size());
+            write32(entry + 4, offset);
+            out.append(entry, FILE_SIZE);
+            out.append(f.name.c_str(), f.name.size() + 1);
+            offset += (uint32_t)f.data.size();
+        }
+
+        for (size_t i = 0; i < block_count; ++i)
+        {
+            char header[BLOCK_HEADER_SIZE];
+            write16(header + 4, (uint16_t)blocks[i].size());
+            write16(header + 6, (uint16_t)std::min<size_t>(BLOCK_SIZE, stream.size() - i * BLOCK_SIZE));
+            uint32_t sum = checksum((uint8_t const *)blocks[i].data(), blocks[i].size(), 0);
+            write32(header, checksum((uint8_t const *)header + 4, 4, sum));
+            out.append(header, BLOCK_HEADER_SIZE);
+            out += blocks[i];
+        }
+        return true;
+    }
+
+    static bool read(void const *data, size_t size, std::vector<file> &files)
+    {
+        uint8_t const *p = (uint8_t const *)data;
+        if (size < HEADER_SIZE || memcmp(p, "MSCF", 4) || p[25] != 1)
+            return false;
+
+        /* Cabinets that span several files are not for us */
+        uint16_t flags = read16(p + 30);
+        if (flags & 3)
+            return false;
+
+        size = std::min<size_t>(size, read32(p + 8));
+        size_t pos = HEADER_SIZE, folder_reserve = 0, block_reserve = 0;
+        if (flags & 4)
+        {
+            if (size < HEADER_SIZE + 4)
+                return false;
+            folder_reserve = p[HEADER_SIZE + 2];
+            block_reserve = p[HEADER_SIZE + 3];
+            pos += 4 + read16(p + HEADER_SIZE);
+        }
+
+        uint16_t folder_count = read16(p + 26), file_count = read16(p + 28);
+        if (pos > size || folder_count > (size - pos) / (FOLDER_SIZE + folder_reserve))
+            return false;
+
+        std::vector<std::string> folders(folder_count);
+        std::vector<uint8_t const *> folder_headers;
+        size_t bytes = 0;
+        for (uint16_t i = 0; i < folder_count; ++i, pos += FOLDER_SIZE + folder_reserve)
+        {
+            folder_headers.push_back(p + pos);
+            bytes += (size_t)read16(p + pos + 4) * BLOCK_SIZE;
+        }
+
+        std::atomic<bool> ok(true);
+        parallel(folder_count, bytes, [&](size_t i)
+        {
+            if (!read_folder(p, size, folder_headers[i], block_reserve, folders[i]))
+                ok = false;
+        });
+        if (!ok)
+            return false;
+
+        files.clear();
+        for (pos = read32(p + 16); file_count > 0; --file_count)
+        {
+            if (pos > size || size - pos < FILE_SIZE)
+                return false;
+
+            uint8_t const *name = p + pos + FILE_SIZE;
+            uint8_t const *end = (uint8_t const *)memchr(name, '\0', p + size - name);
+            uint32_t file_size = read32(p + pos), offset = read32(p + pos + 4);
+            uint16_t folder = read16(p + pos + 8);
+            if (!end || folder >= folder_count || offset > folders[folder].size()
+                 || file_size > folders[folder].size() - offset)
+                return false;
+
+            file f = { std::string((char const *)name, end - name),
+                       folders[folder].substr(offset, file_size) };
+            files.push_back(f);
+            pos = end + 1 - p;
+        }
+        return true;
+    }
+
+    /* Threads are only worth it past a few hundred kilobytes */
+    template<typename T>
+    static void parallel(size_t count, size_t bytes, T const &fn)
+    {
+        size_t threads = std::min<size_t>(count, std::thread::hardware_concurrency());
+        if (threads < 2 || bytes < (256 << 10))
+        {
+            for (size_t i = 0; i < count; ++i)
+                fn(i);
+            return;
+        }
+
+        std::atomic<size_t> next(0);
+        std::vector<std::thread> workers;
+        for (size_t t = 0; t < threads; ++t)
+            workers.push_back(std::thread([&]()
+            {
+                for (size_t i = next++; i < count; i = next++)
+                    fn(i);
+            }));
+        for (auto &w : workers)
+            w.join();
+    }
+
+private:
+    enum
+    {
+        HEADER_SIZE = 36,
+        FOLDER_SIZE = 8,
+        FILE_SIZE = 16,
+        BLOCK_HEADER_SIZE = 8,
+        BLOCK_SIZE = 32768,
+    };
+
+    enum
+    {
+        TYPE_NONE = 0,
+        TYPE_MSZIP = 1,
+        TYPE_LZX = 3,
+    };
+
+    static uint16_t read16(void const *p)
+    {
+        uint16_t x;
+        memcpy(&x, p, 2);
+        return x;
+    }
+
+    static uint32_t read32(void const *p)
+    {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        return x;
+    }
+
+    static void write16(void *p, uint16_t x)
+    {
+        memcpy(p, &x, 2);
+    }
+
+    static void write32(void *p, uint32_t x)
+    {
+        memcpy(p, &x, 4);
+    }
+
+    /* XOR of little-endian words, where the trailing bytes go in the
+     * opposite order; 0 in a block header means no checksum */
+    static uint32_t checksum(uint8_t const *p, size_t size, uint32_t sum)
+    {
+        for (; size >= 4; p += 4, size -= 4)
+            sum ^= read32(p);
+
+        uint32_t tail = 0;
+        for (; size > 0; --size)
+            tail |= (uint32_t)*p++ << (8 * (size - 1));
+        return sum ^ tail;
+    }
+
+    struct block
+    {
+        uint8_t const *data;
+        size_t stored, size;
+    };
+
+    static bool read_folder(uint8_t const *p, size_t size, uint8_t const *header,
+                            size_t reserve, std::string &out)
+    {
+        size_t pos = read32(header);
+        uint16_t count = read16(header + 4), type = read16(header + 6);
+
+        std::vector<block> blocks;
+        size_t total = 0;
+        for (uint16_t i = 0; i < count; ++i)
+        {
+            if (pos > size || size - pos < BLOCK_HEADER_SIZE + reserve)
+                return false;
+
+            block b = { p + pos + BLOCK_HEADER_SIZE + reserve, read16(p + pos + 4),
+                        read16(p + pos + 6) };
+            if (b.stored > size - pos - BLOCK_HEADER_SIZE - reserve)
+                return false;
+
+            uint32_t sum = read32(p + pos);
+            if (sum && checksum(p + pos + 4, 4 + reserve, checksum(b.data, b.stored, 0)) != sum)
+                return false;
+
+            blocks.push_back(b);
+            total += b.size;
+            pos += BLOCK_HEADER_SIZE + reserve + b.stored;
+        }
+
+        out.clear();
+        out.reserve(total);
+        switch (type & 0xf)
+        {
+        case TYPE_NONE:
+            for (auto const &b : blocks)
+            {
+                if (b.stored != b.size)
+                    return false;
+                out.append((char const *)b.data, b.size);
+            }
+            return true;
+
+        case TYPE_MSZIP:
+            /* Blocks may refer to the data of the previous ones */
+            for (auto const &b : blocks)
+            {
+                size_t end = out.size() + b.size;
+                if (b.stored < 2 || memcmp(b.data, "CK", 2)
+                     || !inflate(b.data + 2, b.stored - 2, out, end) || out.size() != end)
+                    return false;
+            }
+            return true;
+
+        case TYPE_LZX:
+            return unlzx(blocks, (type >> 8) & 0x1f, out);
+
+        default:
+            return false;
+        }
+    }
+
+    //
+    // Canonical Huffman codes, decoded one bit at a time in the manner of
+    // zlib’s puff.c, which is fast enough for shaders. T is the bit reader.
+    //
+    struct huffman
+    {
+        bool build(uint8_t const *lengths, int n)
+        {
+            memset(count, 0, sizeof(count));
+            for (int i = 0; i < n; ++i)
+                ++count[lengths[i]];
+            count[0] = 0;
+
+            /* Incomplete codes are fine, as long as they are not used */
+            int left = 1;
+            for (int len = 1; len <= MAX_BITS; ++len)
+            {
+                left = left * 2 - count[len];
+                if (left < 0)
+                    return false;
+            }
+
+            int offsets[MAX_BITS + 1] = { 0 };
+            for (int len = 1; len < MAX_BITS; ++len)
+                offsets[len + 1] = offsets[len] + count[len];
+            symbols.assign(n, 0);
+            for (int i = 0; i < n; ++i)
+                if (lengths[i])
+                    symbols[offsets[lengths[i]]++] = i;
+            return true;
+        }
+
+        template<typename T> int decode(T &in) const
+        {
+            int code = 0, first = 0, index = 0;
+            for (int len = 1; len <= MAX_BITS; ++len)
+            {
+                code |= in.get(1);
+                if (code - count[len] < first)
+                    return symbols[index + code - first];
+                index += count[len];
+                first = (first + count[len]) << 1;
+                code <<= 1;
+            }
+            return -1;
+        }
+
+        enum { MAX_BITS = 16 };
+        int count[MAX_BITS + 1];
+        std::vector<uint16_t> symbols;
+    };
+
+    //
+    // Deflate (RFC 1951), the codec inside MSZIP blocks
+    //
+    struct deflate_in
+    {
+        uint8_t const *p, *end;
+        uint32_t bits, count;
+        bool error;
+
+        uint32_t get(int n)
+        {
+            while (count < (uint32_t)n)
+            {
+                if (p == end)
+                {
+                    error = true;
+                    return 0;
+                }
+                bits |= (uint32_t)*p++ << count;
+                count += 8;
+            }
+            uint32_t ret = bits & ((1u << n) - 1);
+            bits >>= n;
+            count -= n;
+            return ret;
+        }
+    };
+
+    static uint16_t const *length_base() { static uint16_t const t[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 }; return t; }
+    static uint8_t const *length_extra() { static uint8_t const t[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 }; return t; }
+    static uint16_t const *distance_base() { static uint16_t const t[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 }; return t; }
+    static uint8_t const *distance_extra() { static uint8_t const t[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 }; return t; }
+
+    /* Order in which the code length code lengths are stored */
+    static uint8_t const *length_order() { static uint8_t const t[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 }; return t; }
+
+    static void fixed_lengths(uint8_t lengths[288 + 30])
+    {
+        memset(lengths, 8, 144);
+        memset(lengths + 144, 9, 112);
+        memset(lengths + 256, 7, 24);
+        memset(lengths + 280, 8, 8);
+        memset(lengths + 288, 5, 30);
+    }
+
+    /* Append what src inflates to to out, which must not grow past limit */
+    static bool inflate(uint8_t const *src, size_t size, std::string &out, size_t limit)
+    {
+        deflate_in in = { src, src + size, 0, 0, false };
+        for (bool last = false; !last && !in.error; )
+        {
+            last = in.get(1);
+            int type = in.get(2);
+            if (type == 0)
+            {
+                in.bits = in.count = 0;
+                if (in.end - in.p < 4)
+                    return false;
+                uint16_t len = read16(in.p), nlen = read16(in.p + 2);
+                in.p += 4;
+                if (len != (uint16_t)~nlen || len > in.end - in.p || len > limit - out.size())
+                    return false;
+                out.append((char const *)in.p, len);
+                in.p += len;
+                continue;
+            }
+
+            uint8_t lengths[288 + 30];
+            int nlit = 288, ndist = 30;
+            if (type == 1)
+                fixed_lengths(lengths);
+            else if (type == 2)
+            {
+                nlit = in.get(5) + 257;
+                ndist = in.get(5) + 1;
+                int ncode = in.get(4) + 4;
+                if (nlit > 286 || ndist > 30)
+                    return false;
+
+                uint8_t code_lengths[19] = { 0 };
+                for (int i = 0; i < ncode; ++i)
+                    code_lengths[length_order()[i]] = in.get(3);
+                huffman code;
+                if (!code.build(code_lengths, 19))
+                    return false;
+
+                for (int i = 0; i < nlit + ndist; )
+                {
+                    int sym = code.decode(in), len = 0, repeat;
+                    if (sym < 0)
+                        return false;
+                    if (sym < 16)
+                    {
+                        lengths[i++] = sym;
+                        continue;
+                    }
+                    if (sym == 16)
+                    {
+                        if (i == 0)
+                            return false;
+                        len = lengths[i - 1];
+                        repeat = 3 + in.get(2);
+                    }
+                    else
+                        repeat = sym == 17 ? 3 + in.get(3) : 11 + in.get(7);
+                    if (i + repeat > nlit + ndist)
+                        return false;
+                    while (repeat--)
+                        lengths[i++] = len;
+                }
+                memmove(lengths + 288, lengths + nlit, ndist);
+            }
+            else
+                return false;
+
+            huffman lit, dist;
+            if (!lit.build(lengths, nlit) || !dist.build(lengths + 288, ndist))
+                return false;
+
+            for (;;)
+            {
+                int sym = lit.decode(in);
+                if (sym < 0 || in.error)
+                    return false;
+                if (sym == 256)
+                    break;
+                if (sym < 256)
+                {
+                    if (out.size() >= limit)
+                        return false;
+                    out += (char)sym;
+                    continue;
+                }
+
+                sym -= 257;
+                if (sym >= 29)
+                    return false;
+                size_t len = length_base()[sym] + in.get(length_extra()[sym]);
+                int dsym = dist.decode(in);
+                if (dsym < 0 || dsym >= 30)
+                    return false;
+                size_t d = distance_base()[dsym] + in.get(distance_extra()[dsym]);
+                if (d > out.size() || len > limit - out.size())
+                    return false;
+                for (size_t j = out.size() - d, n = 0; n < len; ++n)
+                    out += out[j + n];
+            }
+        }
+        return !in.error;
+    }
+
+    struct deflate_out
+    {
+        std::string &out;
+        uint64_t bits;
+        int count;
+
+        void put(uint32_t x, int n)
+        {
+            bits |= (uint64_t)x << count;
+            for (count += n; count >= 8; count -= 8, bits >>= 8)
+                out += (char)bits;
+        }
+
+        void flush()
+        {
+            if (count)
+                out += (char)bits;
+            bits = count = 0;
+        }
+    };
+
+    /* Match lengths in the high half, distances in the low half, and
+     * literals with no length */
+    typedef uint32_t token;
+
+    static int length_code(uint32_t len)
+    {
+        int i = 28;
+        while (length_base()[i] > len)
+            --i;
+        return i;
+    }
+
+    static int distance_code(uint32_t d)
+    {
+        int i = 29;
+        while (distance_base()[i] > d)
+            --i;
+        return i;
+    }
+
+    /* LZ77 with hash chains, and a match only taken if the next byte
+     * does not start a longer one */
+    static void find_matches(uint8_t const *src, size_t size, std::vector<token> &tokens)
+    {
+        enum { HASH_BITS = 15, MAX_CHAIN = 128, MIN_MATCH = 3, MAX_MATCH = 258 };
+        std::vector<int32_t> head(1 << HASH_BITS, -1), prev(size, -1);
+
+        auto hash = [&](size_t i)
+        {
+            uint32_t x = src[i] | (src[i + 1] << 8) | (src[i + 2] << 16);
+            return (x * 2654435761u) >> (32 - HASH_BITS);
+        };
+
+        auto insert = [&](size_t i)
+        {
+            if (i + MIN_MATCH <= size)
+            {
+                uint32_t h = hash(i);
+                prev[i] = head[h];
+                head[h] = (int32_t)i;
+            }
+        };
+
+        auto longest = [&](size_t i, uint32_t &dist)
+        {
+            uint32_t best = 0;
+            if (i + MIN_MATCH > size)
+                return best;
+            size_t max = std::min<size_t>(MAX_MATCH, size - i);
+            int32_t j = head[hash(i)];
+            for (int chain = MAX_CHAIN; j >= 0 && chain > 0; j = prev[j], --chain)
+            {
+                if (src[j + best] != src[i + best])
+                    continue;
+                uint32_t len = 0;
+                while (len < max && src[j + len] == src[i + len])
+                    ++len;
+                if (len > best)
+                {
+                    best = len;
+                    dist = (uint32_t)(i - j);
+                    if (len == max)
+                        break;
+                }
+            }
+            return best >= MIN_MATCH ? best : 0;
+        };
+
+        for (size_t i = 0; i < size; )
+        {
+            uint32_t dist = 0, next_dist = 0;
+            uint32_t len = longest(i, dist);
+            insert(i);
+            if (len && len < 32 && longest(i + 1, next_dist) > len)
+                len = 0;
+            if (!len)
+            {
+                tokens.push_back(src[i++]);
+                continue;
+            }
+
+            tokens.push_back((len << 16) | dist);
+            for (size_t end = i + len; ++i < end; )
+                insert(i);
+        }
+    }
+
+    /* Huffman code lengths of at most limit bits; the most frequent
+     * symbols get the shortest codes */
+    static void code_lengths(uint32_t const *freq, size_t n, int limit, uint8_t *lengths)
+    {
+        std::vector<int> syms;
+        for (size_t i = 0; i < n; ++i)
+            if (freq[i])
+                syms.push_back(i);
+        memset(lengths, 0, n);
+        if (syms.size() < 2)
+        {
+            /* A single code still needs one bit */
+            lengths[syms.empty() ? 0 : syms[0]] = 1;
+            return;
+        }
+
+        std::stable_sort(syms.begin(), syms.end(),
+                         [&](int a, int b) { return freq[a] < freq[b]; });
+
+        /* Build the tree with two queues: sorted leaves, then the inner
+         * nodes, which are created in increasing weight order */
+        size_t m = syms.size();
+        std::vector<uint64_t> weight(2 * m - 1);
+        std::vector<size_t> parent(2 * m - 1);
+        for (size_t i = 0; i < m; ++i)
+            weight[i] = freq[syms[i]];
+        size_t leaf = 0, inner = m;
+        for (size_t k = m; k < 2 * m - 1; ++k)
+        {
+            size_t pick[2];
+            for (auto &x : pick)
+                x = leaf < m && (inner >= k || weight[leaf] <= weight[inner]) ? leaf++ : inner++;
+            weight[k] = weight[pick[0]] + weight[pick[1]];
+            parent[pick[0]] = parent[pick[1]] = k;
+        }
+
+        std::vector<int> depth(2 * m - 1, 0), count(std::max<size_t>(m, limit) + 1, 0);
+        for (size_t k = 2 * m - 1; k-- > 0; )
+            depth[k] = k == 2 * m - 2 ? 0 : depth[parent[k]] + 1;
+        for (size_t i = 0; i < m; ++i)
+            ++count[std::min(depth[i], limit)];
+
+        /* Clamping made the code oversubscribed: lengthen codes until it
+         * is complete again */
+        uint32_t total = 0;
+        for (int len = 1; len <= limit; ++len)
+            total += (uint32_t)count[len] << (limit - len);
+        for (; total > (1u << limit); --total)
+        {
+            --count[limit];
+            for (int len = limit - 1; len > 0; --len)
+                if (count[len])
+                {
+                    --count[len];
+                    count[len + 1] += 2;
+                    break;
+                }
+        }
+
+        size_t i = m;
+        for (int len = 1; len <= limit; ++len)
+            for (int k = count[len]; k > 0; --k)
+                lengths[syms[--i]] = len;
+    }
+
+    /* Canonical codes, bit-reversed since deflate sends them MSB first */
+    static void codes(uint8_t const *lengths, int n, uint16_t *out)
+    {
+        int count[16] = { 0 }, next[16] = { 0 };
+        for (int i = 0; i < n; ++i)
+            ++count[lengths[i]];
+        count[0] = 0;
+        for (int len = 1; len < 16; ++len)
+            next[len] = (next[len - 1] + count[len - 1]) << 1;
+        for (int i = 0; i < n; ++i)
+        {
+            if (!lengths[i])
+                continue;
+            uint16_t code = next[lengths[i]]++, rev = 0;
+            for (int b = 0; b < lengths[i]; ++b)
+                rev |= ((code >> b) & 1) << (lengths[i] - 1 - b);
+            out[i] = rev;
+        }
+    }
+
+    /* One final deflate block, whichever of stored, fixed or dynamic
+     * codes is the smallest */
+    static void deflate(uint8_t const *src, size_t size, std::string &out)
+    {
+        std::vector<token> tokens;
+        find_matches(src, size, tokens);
+
+        uint32_t freq[288 + 30] = { 0 };
+        for (token t : tokens)
+        {
+            if (t < 256)
+                ++freq[t];
+            else
+            {
+                ++freq[257 + length_code(t >> 16)];
+                ++freq[288 + distance_code(t & 0xffff)];
+            }
+        }
+        ++freq[256];
+
+        uint8_t fixed[288 + 30], dynamic[288 + 30] = { 0 };
+        fixed_lengths(fixed);
+        code_lengths(freq, 286, 15, dynamic);
+        code_lengths(freq + 288, 30, 15, dynamic + 288);
+
+        /* The header of a dynamic block: both code lengths, run-length
+         * encoded, using a third code */
+        int nlit = 286, ndist = 30;
+        while (nlit > 257 && !dynamic[nlit - 1])
+            --nlit;
+        while (ndist > 1 && !dynamic[288 + ndist - 1])
+            --ndist;
+        uint8_t all[286 + 30];
+        memcpy(all, dynamic, nlit);
+        memcpy(all + nlit, dynamic + 288, ndist);
+
+        std::vector<uint16_t> rle;
+        uint32_t code_freq[19] = { 0 };
+        for (int i = 0, n = nlit + ndist; i < n; )
+        {
+            int run = 1;
+            while (i + run < n && all[i + run] == all[i])
+                ++run;
+            int left = run;
+            if (all[i] == 0)
+            {
+                for (; left >= 11; left -= std::min(left, 138))
+                    rle.push_back(18 | (std::min(left, 138) - 11) << 8);
+                if (left >= 3)
+                {
+                    rle.push_back(17 | (left - 3) << 8);
+                    left = 0;
+                }
+            }
+            else
+            {
+                rle.push_back(all[i]);
+                for (--left; left >= 3; left -= std::min(left, 6))
+                    rle.push_back(16 | (std::min(left, 6) - 3) << 8);
+            }
+            for (; left > 0; --left)
+                rle.push_back(all[i]);
+            i += run;
+        }
+        for (uint16_t x : rle)
+            ++code_freq[x & 0xff];
+
+        uint8_t code_len[19];
+        code_lengths(code_freq, 19, 7, code_len);
+        int ncode = 19;
+        while (ncode > 4 && !code_len[length_order()[ncode - 1]])
+            --ncode;
+
+        size_t fixed_bits = 3, dynamic_bits = 3 + 14 + 3 * ncode;
+        for (uint16_t x : rle)
+            dynamic_bits += code_len[x & 0xff] + ((x & 0xff) == 16 ? 2 : (x & 0xff) == 17 ? 3 : (x & 0xff) == 18 ? 7 : 0);
+        for (int i = 0; i < 288 + 30; ++i)
+        {
+            size_t extra = i >= 257 && i < 286 ? length_extra()[i - 257]
+                         : i >= 288 ? distance_extra()[i - 288] : 0;
+            fixed_bits += freq[i] * (fixed[i] + extra);
+            dynamic_bits += freq[i] * (dynamic[i] + extra);
+        }
+
+        deflate_out bits = { out, 0, 0 };
+        if (size * 8 + 40 <= std::min(fixed_bits, dynamic_bits))
+        {
+            bits.put(1, 3);
+            bits.flush();
+            char header[4];
+            write16(header, (uint16_t)size);
+            write16(header + 2, (uint16_t)~size);
+            out.append(header, 4);
+            out.append((char const *)src, size);
+            return;
+        }
+
+        uint8_t const *lengths = dynamic;
+        if (fixed_bits <= dynamic_bits)
+        {
+            lengths = fixed;
+            bits.put(3, 3);
+        }
+        else
+        {
+            bits.put(5, 3);
+            bits.put(nlit - 257, 5);
+            bits.put(ndist - 1, 5);
+            bits.put(ncode - 4, 4);
+            for (int i = 0; i < ncode; ++i)
+                bits.put(code_len[length_order()[i]], 3);
+
+            uint16_t code[19];
+            codes(code_len, 19, code);
+            for (uint16_t x : rle)
+            {
+                int sym = x & 0xff;
+                bits.put(code[sym], code_len[sym]);
+                if (sym >= 16)
+                    bits.put(x >> 8, sym == 16 ? 2 : sym == 17 ? 3 : 7);
+            }
+        }
+
+        uint16_t code[288 + 30];
+        codes(lengths, 288, code);
+        codes(lengths + 288, 30, code + 288);
+        for (token t : tokens)
+        {
+            if (t < 256)
+            {
+                bits.put(code[t], lengths[t]);
+                continue;
+            }
+
+            uint32_t len = t >> 16, d = t & 0xffff;
+            int lc = length_code(len), dc = distance_code(d);
+            bits.put(code[257 + lc], lengths[257 + lc]);
+            bits.put(len - length_base()[lc], length_extra()[lc]);
+            bits.put(code[288 + dc], lengths[288 + dc]);
+            bits.put(d - distance_base()[dc], distance_extra()[dc]);
+        }
+        bits.put(code[256], lengths[256]);
+        bits.flush();
+    }
+
+    //
+    // LZX, as in [MS-PATCH]: 16-bit little-endian words read from their
+    // most significant bit, and one frame of output per cabinet block,
+    // after which the input goes back to a word boundary
+    //
+    struct lzx_in
+    {
+        uint8_t const *p, *end;
+        uint32_t bits, count;
+        bool error;
+
+        uint32_t get(int n)
+        {
+            if (!n)
+                return 0;
+            while (count < (uint32_t)n)
+            {
+                uint32_t word = 0;
+                if (end - p >= 2)
+                    word = p[0] | (p[1] << 8);
+                else
+                    error = true;
+                p += std::min<ptrdiff_t>(2, end - p);
+                bits |= word << (16 - count);
+                count += 16;
+            }
+            uint32_t ret = bits >> (32 - n);
+            bits <<= n;
+            count -= n;
+            return ret;
+        }
+
+        void align()
+        {
+            bits = count = 0;
+        }
+    };
+
+    /* Tree lengths are sent as differences with the previous ones, with
+     * a small Huffman code of their own */
+    static bool lzx_lengths(lzx_in &in, uint8_t *lengths, int first, int last)
+    {
+        uint8_t pre_lengths[20];
+        for (auto &x : pre_lengths)
+            x = in.get(4);
+        huffman pre;
+        if (!pre.build(pre_lengths, 20))
+            return false;
+
+        for (int i = first; i < last; )
+        {
+            int sym = pre.decode(in), run = 1, len = 0;
+            if (sym == 17 || sym == 18)
+                run = sym == 17 ? 4 + in.get(4) : 20 + in.get(5);
+            else if (sym == 19)
+            {
+                run = 4 + in.get(1);
+                sym = pre.decode(in);
+            }
+            if (sym < 0 || in.error)
+                return false;
+            if (sym < 17)
+                len = (lengths[i] + 17 - sym) % 17;
+
+            /* Runs past the end are allowed, and ignored */
+            for (; run > 0 && i < last; --run)
+                lengths[i++] = len;
+        }
+        return true;
+    }
+
+    static bool unlzx(std::vector<block> const &blocks, int window_bits, std::string &out)
+    {
+        enum { VERBATIM = 1, ALIGNED = 2, UNCOMPRESSED = 3, LENGTHS = 249, MIN_MATCH = 2 };
+        if (window_bits < 15 || window_bits > 21)
+            return false;
+
+        uint32_t base[51], extra[51];
+        for (int i = 0, b = 0; i < 51; b += 1 << extra[i++])
+        {
+            base[i] = b;
+            extra[i] = i < 4 ? 0 : std::min((i - 2) / 2, 17);
+        }
+        int slots = window_bits == 21 ? 50 : window_bits == 20 ? 42 : window_bits * 2;
+
+        std::string stream;
+        for (auto const &b : blocks)
+            stream.append((char const *)b.data, b.stored);
+        lzx_in in = { (uint8_t const *)stream.data(), (uint8_t const *)stream.data() + stream.size(), 0, 0, false };
+
+        uint8_t main_lengths[256 + 50 * 8] = { 0 }, length_lengths[LENGTHS] = { 0 };
+        uint8_t aligned_lengths[8];
+        huffman main_tree, length_tree, aligned_tree;
+        uint32_t r[3] = { 1, 1, 1 };
+        int type = 0;
+        size_t remaining = 0, block_size = 0;
+
+        bool intel_started = false;
+        uint32_t intel_size = 0;
+        if (in.get(1))
+        {
+            intel_size = in.get(16) << 16;
+            intel_size |= in.get(16);
+        }
+        std::vector<bool> translate;
+
+        for (auto const &b : blocks)
+        {
+            size_t frame_end = out.size() + b.size;
+            while (out.size() < frame_end)
+            {
+                if (!remaining)
+                {
+                    /* Odd-sized uncompressed blocks are padded */
+                    if (type == UNCOMPRESSED && (block_size & 1) && in.p < in.end)
+                        ++in.p;
+
+                    type = in.get(3);
+                    block_size = in.get(16) << 8;
+                    block_size |= in.get(8);
+                    remaining = block_size;
+
+                    if (type == ALIGNED)
+                    {
+                        for (auto &x : aligned_lengths)
+                            x = in.get(3);
+                        if (!aligned_tree.build(aligned_lengths, 8))
+                            return false;
+                    }
+
+                    if (type == VERBATIM || type == ALIGNED)
+                    {
+                        if (!lzx_lengths(in, main_lengths, 0, 256)
+                             || !lzx_lengths(in, main_lengths, 256, 256 + slots * 8)
+                             || !main_tree.build(main_lengths, 256 + slots * 8)
+                             || !lzx_lengths(in, length_lengths, 0, LENGTHS)
+                             || !length_tree.build(length_lengths, LENGTHS))
+                            return false;
+                        intel_started |= main_lengths[0xe8] != 0;
+                    }
+                    else if (type == UNCOMPRESSED)
+                    {
+                        intel_started = true;
+                        if (!in.count)
+                            in.get(16);
+                        in.align();
+                        if (in.end - in.p < 12)
+                            return false;
+                        for (int i = 0; i < 3; ++i)
+                            r[i] = read32(in.p + 4 * i);
+                        in.p += 12;
+                    }
+                    else
+                        return false;
+
+                    if (in.error || !remaining)
+                        return false;
+                }
+
+                /* Matches may not cross blocks or frames */
+                size_t run = std::min(remaining, frame_end - out.size());
+                remaining -= run;
+
+                if (type == UNCOMPRESSED)
+                {
+                    if ((size_t)(in.end - in.p) < run)
+                        return false;
+                    out.append((char const *)in.p, run);
+                    in.p += run;
+                    continue;
+                }
+
+                for (size_t stop = out.size() + run; out.size() < stop; )
+                {
+                    int sym = main_tree.decode(in);
+                    if (sym < 0 || in.error)
+                        return false;
+                    if (sym < 256)
+                    {
+                        out += (char)sym;
+                        continue;
+                    }
+
+                    sym -= 256;
+                    size_t len = sym & 7;
+                    if (len == 7)
+                    {
+                        int footer = length_tree.decode(in);
+                        if (footer < 0)
+                            return false;
+                        len += footer;
+                    }
+                    len += MIN_MATCH;
+
+                    uint32_t slot = sym >> 3, offset;
+                    if (slot < 3)
+                    {
+                        offset = r[slot];
+                        r[slot] = r[0];
+                    }
+                    else
+                    {
+                        uint32_t bits = extra[slot];
+                        offset = base[slot] - 2;
+                        if (type == ALIGNED && bits >= 3)
+                        {
+                            offset += in.get(bits - 3) << 3;
+                            int aligned = aligned_tree.decode(in);
+                            if (aligned < 0)
+                                return false;
+                            offset += aligned;
+                        }
+                        else
+                            offset += in.get(bits);
+                        r[2] = r[1];
+                        r[1] = r[0];
+                    }
+                    r[0] = offset;
+
+                    if (in.error || offset > out.size() || len > stop - out.size())
+                        return false;
+                    for (size_t j = out.size() - offset, n = 0; n < len; ++n)
+                        out += out[j + n];
+                }
+            }
+
+            translate.push_back(intel_started && intel_size);
+            in.align();
+        }
+
+        /* Undo the relative CALL translation, now that no match can refer
+         * to the data any more */
+        size_t start = 0;
+        for (size_t f = 0; f < blocks.size(); start += blocks[f++].size)
+        {
+            if (!translate[f] || f >= 32768 || blocks[f].size <= 10)
+                continue;
+            for (size_t i = start, end = start + blocks[f].size - 10; i < end; ++i)
+            {
+                if ((uint8_t)out[i] != 0xe8)
+                    continue;
+                int32_t abs_offset = (int32_t)read32(&out[i + 1]);
+                int32_t pos = (int32_t)i;
+                if (abs_offset >= -pos && abs_offset < (int32_t)intel_size)
+                    write32(&out[i + 1], abs_offset >= 0 ? abs_offset - pos : abs_offset + (int32_t)intel_size);
+                i += 4;
+            }
+        }
+        return true;
+    }
+};
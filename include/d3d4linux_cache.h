@@ -0,0 +1,538 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cerrno> /* for errno */
+#include <cstdint> /* for uint64_t */
+#include <cstdio> /* for FILE */
+#include <cstdlib> /* for getenv(), atexit() */
+#include <cstring> /* for memcpy() */
+
+#include <unistd.h> /* for close() */
+#include <fcntl.h> /* for O_NONBLOCK */
+#include <netdb.h> /* for getaddrinfo() */
+#include <poll.h> /* for poll() */
+#include <sys/socket.h> /* for socket() */
+#include <netinet/in.h> /* for IPPROTO_TCP */
+#include <netinet/tcp.h> /* for TCP_NODELAY */
+
+#include <atomic> /* for std::atomic */
+#include <chrono> /* for std::chrono */
+#include <condition_variable> /* for std::condition_variable */
+#include <deque> /* for std::deque */
+#include <mutex> /* for std::mutex */
+#include <string> /* for std::string */
+#include <thread> /* for std::thread */
+#include <vector> /* for std::vector */
+
+#include <d3d4linux_common.h>
+#include <d3d4linux_pack.h>
+#include <d3d4linux_sys.h>
+
+//
+// Compile cache shared by all threads of the process. Keys are 128-bit
+// hashes of the complete compile inputs; values are the serialized code
+// and error blobs of successful compilations.
+//
+// There are two tiers, each of them optional:
+//  - a local directory of pack files (see d3d4linux_pack.h) configured
+//    with D3D4LINUX_CACHE_DIR, looked up first and written synchronously;
+//  - a remote key/value server (see tools/cache-server.cpp) configured
+//    with D3D4LINUX_CACHE_REMOTE=host:port. Lookups from concurrent
+//    threads are batched into multi-get requests, and stores are written
+//    back asynchronously. Remote hits are copied to the local tier.
+//
+struct d3d4linux_cache
+{
+    struct key
+    {
+        uint64_t h1, h2;
+
+        bool operator ==(key const &k) const { return h1 == k.h1 && h2 == k.h2; }
+        bool operator <(key const &k) const { return h1 < k.h1 || (h1 == k.h1 && h2 < k.h2); }
+    };
+
+    //
+    // 128-bit MurmurHash3 (x64 variant); we only need it to be fast,
+    // well distributed and identical on all machines of a build farm.
+    //
+    static key hash(void const *data, size_t len)
+    {
+        uint8_t const *p = (uint8_t const *)data;
+        size_t const nblocks = len / 16;
+        uint64_t h1 = 0, h2 = 0;
+        uint64_t const c1 = 0x87c37b91114253d5ull, c2 = 0x4cf5ad432745937full;
+
+        for (size_t i = 0; i < nblocks; ++i)
+        {
+            uint64_t k1, k2;
+            memcpy(&k1, p + i * 16, 8);
+            memcpy(&k2, p + i * 16 + 8, 8);
+
+            k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+            h1 = rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52dce729;
+            k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            h2 = rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495ab5;
+        }
+
+        uint8_t const *tail = p + nblocks * 16;
+        uint64_t k1 = 0, k2 = 0;
+        switch (len & 15)
+        {
+        case 15: k2 ^= (uint64_t)tail[14] << 48; /* fall through */
+        case 14: k2 ^= (uint64_t)tail[13] << 40; /* fall through */
+        case 13: k2 ^= (uint64_t)tail[12] << 32; /* fall through */
+        case 12: k2 ^= (uint64_t)tail[11] << 24; /* fall through */
+        case 11: k2 ^= (uint64_t)tail[10] << 16; /* fall through */
+        case 10: k2 ^= (uint64_t)tail[9] << 8; /* fall through */
+        case 9: k2 ^= (uint64_t)tail[8];
+            k2 *= c2; k2 = rotl(k2, 33); k2 *= c1; h2 ^= k2;
+            /* fall through */
+        case 8: k1 ^= (uint64_t)tail[7] << 56; /* fall through */
+        case 7: k1 ^= (uint64_t)tail[6] << 48; /* fall through */
+        case 6: k1 ^= (uint64_t)tail[5] << 40; /* fall through */
+        case 5: k1 ^= (uint64_t)tail[4] << 32; /* fall through */
+        case 4: k1 ^= (uint64_t)tail[3] << 24; /* fall through */
+        case 3: k1 ^= (uint64_t)tail[2] << 16; /* fall through */
+        case 2: k1 ^= (uint64_t)tail[1] << 8; /* fall through */
+        case 1: k1 ^= (uint64_t)tail[0];
+            k1 *= c1; k1 = rotl(k1, 31); k1 *= c2; h1 ^= k1;
+        }
+
+        h1 ^= len; h2 ^= len;
+        h1 += h2; h2 += h1;
+        h1 = fmix(h1); h2 = fmix(h2);
+        h1 += h2; h2 += h1;
+
+        key ret = { h1, h2 };
+        return ret;
+    }
+
+    static d3d4linux_cache &get()
+    {
+        /* Never destroyed: the worker threads may outlive main() */
+        static d3d4linux_cache *cache = new d3d4linux_cache();
+        return *cache;
+    }
+
+    bool enabled() const
+    {
+        return m_local || !m_host.empty();
+    }
+
+    /* Lookups so far, by outcome */
+    struct stats
+    {
+        stats() : local_hits(0), remote_hits(0), misses(0) {}
+
+        std::atomic<int64_t> local_hits, remote_hits, misses;
+    };
+
+    stats const &lookup_stats() const
+    {
+        return m_stats;
+    }
+
+    //
+    // Look up several keys at once; values[i] is left empty on a miss.
+    // Returns the number of hits.
+    //
+    size_t lookup(std::vector<key> const &keys, std::vector<std::string> &values)
+    {
+        values.assign(keys.size(), std::string());
+
+        size_t hits = 0;
+        std::vector<size_t> misses;
+        for (size_t i = 0; i < keys.size(); ++i)
+        {
+            if (m_local && m_local->get(keys[i].h1, keys[i].h2, values[i]))
+                ++hits;
+            else
+                misses.push_back(i);
+        }
+
+        m_stats.local_hits += hits;
+        if (m_host.empty() || misses.empty())
+        {
+            m_stats.misses += misses.size();
+            return hits;
+        }
+
+        std::vector<pending_get> requests(misses.size());
+        std::unique_lock<std::mutex> lock(m_get_mutex);
+        for (size_t i = 0; i < misses.size(); ++i)
+        {
+            requests[i].m_key = keys[misses[i]];
+            m_get_queue.push_back(&requests[i]);
+        }
+        m_get_cond.notify_all();
+
+        for (size_t i = 0; i < misses.size(); ++i)
+        {
+            pending_get &r = requests[i];
+            m_done_cond.wait(lock, [&r]() { return r.m_done; });
+            if (r.m_found)
+            {
+                values[misses[i]].swap(r.m_value);
+                ++hits;
+            }
+        }
+        lock.unlock();
+        size_t remote_hits = hits - (keys.size() - misses.size());
+        m_stats.remote_hits += remote_hits;
+        m_stats.misses += misses.size() - remote_hits;
+
+        for (size_t i = 0; i < misses.size() && m_local; ++i)
+            if (requests[i].m_found)
+                m_local->put(keys[misses[i]].h1, keys[misses[i]].h2, values[misses[i]]);
+        return hits;
+    }
+
+    bool lookup(key const &k, std::string &value)
+    {
+        std::vector<std::string> values;
+        if (!lookup(std::vector<key>(1, k), values))
+            return false;
+        value.swap(values[0]);
+        return true;
+    }
+
+    //
+    // Store a value locally, and queue it for asynchronous write-back. If
+    // the remote server cannot keep up, we drop entries rather than grow
+    // without bound.
+    //
+    void store(key const &k, std::string const &value)
+    {
+        if (m_local)
+            m_local->put(k.h1, k.h2, value);
+        if (m_host.empty())
+            return;
+
+        std::lock_guard<std::mutex> lock(m_put_mutex);
+        if (m_put_queue.size() >= MAX_PENDING_PUTS)
+            return;
+        m_put_queue.push_back(std::make_pair(k, value));
+        m_put_cond.notify_one();
+    }
+
+    //
+    // Wait until all queued stores have been sent, e.g. before exiting, or
+    // for at most timeout_ms milliseconds if it is not negative. Returns
+    // whether everything was sent.
+    //
+    bool flush(int64_t timeout_ms = -1)
+    {
+        std::unique_lock<std::mutex> lock(m_put_mutex);
+        auto flushed = [this]() { return m_put_queue.empty() && !m_put_busy; };
+        if (timeout_ms < 0)
+        {
+            m_flushed_cond.wait(lock, flushed);
+            return true;
+        }
+        return m_flushed_cond.wait_for(lock, std::chrono::milliseconds(timeout_ms), flushed);
+    }
+
+private:
+    enum
+    {
+        MAX_BATCH = 256,
+        MAX_PENDING_PUTS = 4096,
+        TIMEOUT_SECONDS = 10,
+        RETRY_SECONDS = 30,
+        /* The largest value tools/cache-server.cpp stores */
+        MAX_VALUE = 64 << 20,
+    };
+
+    struct pending_get
+    {
+        pending_get() : m_done(false), m_found(false) {}
+
+        key m_key;
+        bool m_done, m_found;
+        std::string m_value;
+    };
+
+    //
+    // One TCP connection to the cache server, speaking the same framing
+    // as the d3d4linux.exe protocol
+    //
+    struct connection : interop
+    {
+        connection(std::string const &host, std::string const &port)
+          : interop(nullptr, nullptr),
+            m_host(host),
+            m_port(port),
+            m_retry_time(0)
+        {}
+
+        ~connection()
+        {
+            disconnect();
+        }
+
+        bool connect()
+        {
+            if (m_in)
+                return true;
+
+            /* Do not hammer an unreachable server */
+            int64_t now = d3d4linux_sys::now() / 1000;
+            if (now < m_retry_time)
+                return false;
+            m_retry_time = now + RETRY_SECONDS;
+
+            addrinfo hints, *res;
+            memset(&hints, 0, sizeof(hints));
+            hints.ai_family = AF_UNSPEC;
+            hints.ai_socktype = SOCK_STREAM;
+            if (getaddrinfo(m_host.c_str(), m_port.c_str(), &hints, &res) != 0)
+                return false;
+
+            int fd = -1;
+            for (addrinfo *ai = res; ai; ai = ai->ai_next)
+            {
+                fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                            ai->ai_protocol);
+                if (fd < 0)
+                    continue;
+                if (connect_within(fd, ai->ai_addr, ai->ai_addrlen))
+                    break;
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(res);
+            if (fd < 0)
+                return false;
+
+            /* A stuck cache server must not stall compilations forever */
+            timeval tv = { TIMEOUT_SECONDS, 0 };
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+            int one = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+            m_in = fdopen(fd, "r");
+            m_out = fdopen(dup(fd), "w");
+            m_retry_time = 0;
+            return true;
+        }
+
+        /* An unreachable host must not stall compilations either; the
+         * socket is made blocking again once connected */
+        static bool connect_within(int fd, sockaddr const *addr, socklen_t len)
+        {
+            if (::connect(fd, addr, len) != 0)
+            {
+                if (errno != EINPROGRESS)
+                    return false;
+                pollfd p = { fd, POLLOUT, 0 };
+                int err = 0;
+                socklen_t err_len = sizeof(err);
+                if (poll(&p, 1, TIMEOUT_SECONDS * 1000) != 1
+                     || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &err_len) != 0 || err)
+                    return false;
+            }
+            int flags = fcntl(fd, F_GETFL);
+            return flags >= 0 && fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) == 0;
+        }
+
+        void disconnect()
+        {
+            if (m_in)
+                fclose(m_in);
+            if (m_out)
+                fclose(m_out);
+            m_in = m_out = nullptr;
+        }
+
+        bool failed()
+        {
+            return ferror(m_in) || feof(m_in) || ferror(m_out);
+        }
+
+        std::string m_host, m_port;
+        int64_t m_retry_time;
+    };
+
+    d3d4linux_cache()
+      : m_local(nullptr),
+        m_put_busy(false)
+    {
+        char const *dir_var = getenv("D3D4LINUX_CACHE_DIR");
+        std::string dir = dir_var ? dir_var : D3D4LINUX_CACHE_DIR;
+        if (!dir.empty())
+        {
+            char const *size_var = getenv("D3D4LINUX_CACHE_SIZE");
+            uint64_t budget = size_var && *size_var ? atoll(size_var) : D3D4LINUX_CACHE_SIZE;
+            m_local = new d3d4linux_pack(dir, budget << 20);
+            if (!m_local->open())
+            {
+                delete m_local;
+                m_local = nullptr;
+            }
+        }
+
+        char const *remote_var = getenv("D3D4LINUX_CACHE_REMOTE");
+        std::string remote = remote_var ? remote_var : D3D4LINUX_CACHE_REMOTE;
+        size_t colon = remote.rfind(':');
+        if (colon == std::string::npos || colon == 0)
+            return;
+
+        m_host = remote.substr(0, colon);
+        m_port = remote.substr(colon + 1);
+        std::thread(&d3d4linux_cache::get_worker, this).detach();
+        std::thread(&d3d4linux_cache::put_worker, this).detach();
+
+        /* Stores still queued at exit would be lost; a dead server gets
+         * the same grace as a single request */
+        atexit([]() { get().flush(TIMEOUT_SECONDS * 1000); });
+    }
+
+    //
+    // Send every queued lookup as one multi-get; lookups that arrive while
+    // a batch is in flight naturally form the next batch.
+    //
+    void get_worker()
+    {
+        /* A cache server that goes away must not kill the whole process */
+        d3d4linux_sys::block_sigpipe();
+        connection c(m_host, m_port);
+        std::vector<pending_get *> batch;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_get_mutex);
+                m_get_cond.wait(lock, [this]() { return !m_get_queue.empty(); });
+                while (!m_get_queue.empty() && batch.size() < MAX_BATCH)
+                {
+                    batch.push_back(m_get_queue.front());
+                    m_get_queue.pop_front();
+                }
+            }
+
+            /* Values are read outside the lock; the waiters only look at
+             * them once m_done is set below. */
+            bool ok = c.connect();
+            if (ok)
+            {
+                c.write_i64(D3D4LINUX_OP_CACHE_GET);
+                c.write_i64(batch.size());
+                for (size_t i = 0; i < batch.size(); ++i)
+                    c.write_raw(&batch[i]->m_key, sizeof(key));
+                c.write_i64(D3D4LINUX_FINISHED);
+
+                /* A length the server would never have stored means the
+                 * stream is garbage; do not allocate it */
+                bool sane = true;
+                for (size_t i = 0; i < batch.size() && sane && !c.failed(); ++i)
+                {
+                    int64_t len = c.read_i64();
+                    sane = len <= MAX_VALUE;
+                    if (len >= 0 && sane && !c.failed())
+                    {
+                        batch[i]->m_value.resize(len);
+                        c.read_raw(&batch[i]->m_value[0], len);
+                        batch[i]->m_found = true;
+                    }
+                }
+
+                ok = sane && c.read_i64() == D3D4LINUX_FINISHED && !c.failed();
+                if (!ok)
+                    c.disconnect();
+            }
+
+            std::lock_guard<std::mutex> lock(m_get_mutex);
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                batch[i]->m_found = batch[i]->m_found && ok;
+                batch[i]->m_done = true;
+            }
+            batch.clear();
+            m_done_cond.notify_all();
+        }
+    }
+
+    void put_worker()
+    {
+        d3d4linux_sys::block_sigpipe();
+        connection c(m_host, m_port);
+        std::vector<std::pair<key, std::string>> batch;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_put_mutex);
+                m_put_busy = false;
+                m_flushed_cond.notify_all();
+                m_put_cond.wait(lock, [this]() { return !m_put_queue.empty(); });
+                while (!m_put_queue.empty() && batch.size() < MAX_BATCH)
+                {
+                    batch.push_back(std::pair<key, std::string>());
+                    batch.back().first = m_put_queue.front().first;
+                    batch.back().second.swap(m_put_queue.front().second);
+                    m_put_queue.pop_front();
+                }
+                m_put_busy = true;
+            }
+
+            /* Write-back is best effort: on failure the batch is lost */
+            if (c.connect())
+            {
+                c.write_i64(D3D4LINUX_OP_CACHE_PUT);
+                c.write_i64(batch.size());
+                for (size_t i = 0; i < batch.size(); ++i)
+                {
+                    c.write_raw(&batch[i].first, sizeof(key));
+                    c.write_i64(batch[i].second.size());
+                    c.write_raw(batch[i].second.data(), batch[i].second.size());
+                }
+                c.write_i64(D3D4LINUX_FINISHED);
+
+                if (c.read_i64() != D3D4LINUX_FINISHED || c.failed())
+                    c.disconnect();
+            }
+
+            batch.clear();
+        }
+    }
+
+    static uint64_t rotl(uint64_t x, int r)
+    {
+        return (x << r) | (x >> (64 - r));
+    }
+
+    static uint64_t fmix(uint64_t k)
+    {
+        k ^= k >> 33;
+        k *= 0xff51afd7ed558ccdull;
+        k ^= k >> 33;
+        k *= 0xc4ceb9fe1a85ec53ull;
+        k ^= k >> 33;
+        return k;
+    }
+
+    d3d4linux_pack *m_local;
+    std::string m_host, m_port;
+    stats m_stats;
+
+    std::mutex m_get_mutex;
+    std::condition_variable m_get_cond, m_done_cond;
+    std::deque<pending_get *> m_get_queue;
+
+    std::mutex m_put_mutex;
+    std::condition_variable m_put_cond, m_flushed_cond;
+    std::deque<std::pair<key, std::string>> m_put_queue;
+    bool m_put_busy;
+};
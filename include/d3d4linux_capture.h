@@ -0,0 +1,217 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cerrno> /* for errno */
+#include <cstdint> /* for int64_t */
+#include <cstdio> /* for FILE */
+#include <cstdlib> /* for getenv() */
+#include <cstring> /* for memcpy() */
+
+#include <unistd.h> /* for write() */
+#include <fcntl.h> /* for open() */
+
+#include <algorithm> /* for std::max() */
+#include <chrono> /* for std::chrono */
+#include <string> /* for std::string */
+
+#include <d3d4linux_common.h>
+#include <d3d4linux_pack.h>
+
+//
+// Request capture, to replay the workload of real cooks offline (see
+// tools/replay.cpp). With D3D4LINUX_CAPTURE set to a file, every request
+// that goes to a server is appended to it: when it arrived, how long it
+// took until the result, the bytes sent to the server, and the result.
+// Several processes may share the file, since each record is appended
+// with a single write().
+//
+// A record is a header, then a body compressed with the codec of
+// d3d4linux_pack.h: the request bytes, the output and the error message,
+// each as an i64 length (-1 for none) followed by the bytes. The output
+// is the code, text or stripped shader, or the reflection snapshot.
+// Lazy reflection queries and shader libraries are not captured.
+//
+struct d3d4linux_capture
+{
+    enum { MAGIC = 0x5234444c }; /* "LD4R" */
+
+    struct header
+    {
+        uint32_t magic, size, raw_size, pid;
+        /* Arrival in microseconds since the epoch, then time to result */
+        int64_t start_us, duration_us;
+        int64_t op, ret;
+    };
+
+    struct record
+    {
+        header h;
+        std::string request, output, errors;
+        bool has_output, has_errors;
+    };
+
+    static d3d4linux_capture &get()
+    {
+        static d3d4linux_capture *capture = new d3d4linux_capture();
+        return *capture;
+    }
+
+    d3d4linux_capture()
+      : m_fd(-1)
+    {
+        char const *path_var = getenv("D3D4LINUX_CAPTURE");
+        std::string path = path_var ? path_var : D3D4LINUX_CAPTURE;
+        if (!path.empty())
+            m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    }
+
+    bool enabled() const
+    {
+        return m_fd >= 0;
+    }
+
+    //
+    // One request: created when it arrives, attached to the server lease
+    // to record what is written to the server, and appended to the file
+    // when its result is known. Nothing is kept for failed leases.
+    //
+    struct request
+    {
+        request()
+          : m_capture(get()),
+            m_interop(nullptr)
+        {
+            if (m_capture.enabled())
+            {
+                m_start_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch()).count();
+                m_start = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~request()
+        {
+            if (m_interop)
+                m_interop->record(nullptr);
+        }
+
+        void attach(interop &p)
+        {
+            if (m_capture.enabled())
+            {
+                m_interop = &p;
+                p.record(&m_request);
+            }
+        }
+
+        void finish(int64_t op, HRESULT ret, void const *output, int64_t output_size,
+                    ID3DBlob *errors = nullptr)
+        {
+            if (!m_interop)
+                return;
+
+            header h;
+            h.magic = MAGIC;
+            h.pid = (uint32_t)getpid();
+            h.start_us = m_start_us;
+            h.duration_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - m_start).count();
+            h.op = op;
+            h.ret = ret;
+
+            std::string body;
+            append(body, m_request.data(), (int64_t)m_request.size());
+            append(body, output, output_size);
+            append(body, errors ? errors->GetBufferPointer() : nullptr,
+                   errors ? (int64_t)errors->GetBufferSize() : -1);
+            m_capture.write(h, body);
+        }
+
+        void finish(int64_t op, HRESULT ret, ID3DBlob *output, ID3DBlob *errors = nullptr)
+        {
+            finish(op, ret, output ? output->GetBufferPointer() : nullptr,
+                   output ? (int64_t)output->GetBufferSize() : -1, errors);
+        }
+
+    private:
+        static void append(std::string &body, void const *data, int64_t size)
+        {
+            body.append((char const *)&size, sizeof(size));
+            if (size > 0)
+                body.append((char const *)data, (size_t)size);
+        }
+
+        d3d4linux_capture &m_capture;
+        interop *m_interop;
+        std::string m_request;
+        int64_t m_start_us;
+        std::chrono::steady_clock::time_point m_start;
+    };
+
+    //
+    // Read the records of a capture file, in the order they were written.
+    // Returns false at the end of the file or at a torn record.
+    //
+    static bool read(FILE *f, record &r)
+    {
+        if (fread(&r.h, sizeof(r.h), 1, f) != 1 || r.h.magic != MAGIC)
+            return false;
+
+        std::string packed(r.h.size, '\0'), body(r.h.raw_size, '\0');
+        if (fread(&packed[0], r.h.size, 1, f) != 1
+             || !d3d4linux_pack::decompress((uint8_t const *)packed.data(), packed.size(),
+                                            (uint8_t *)&body[0], body.size()))
+            return false;
+
+        size_t pos = 0;
+        bool has_request;
+        return extract(body, pos, r.request, has_request)
+                && extract(body, pos, r.output, r.has_output)
+                && extract(body, pos, r.errors, r.has_errors)
+                && pos == body.size();
+    }
+
+private:
+    void write(header &h, std::string const &body)
+    {
+        std::string packed;
+        d3d4linux_pack::compress((uint8_t const *)body.data(), body.size(), packed);
+        h.size = (uint32_t)packed.size();
+        h.raw_size = (uint32_t)body.size();
+
+        std::string buf((char const *)&h, sizeof(h));
+        buf += packed;
+        ssize_t n;
+        while ((n = ::write(m_fd, buf.data(), buf.size())) < 0 && errno == EINTR)
+            ;
+    }
+
+    static bool extract(std::string const &body, size_t &pos, std::string &out, bool &present)
+    {
+        int64_t size;
+        if (body.size() - pos < sizeof(size))
+            return false;
+        memcpy(&size, body.data() + pos, sizeof(size));
+        pos += sizeof(size);
+        present = size >= 0;
+        size = std::max(size, (int64_t)0);
+        if ((int64_t)(body.size() - pos) < size)
+            return false;
+        out.assign(body.data() + pos, (size_t)size);
+        pos += (size_t)size;
+        return true;
+    }
+
+    int m_fd;
+};
@@ -21,9 +21,94 @@
 #define D3D4LINUX_OP_REFLECT     0x42001001
 #define D3D4LINUX_OP_STRIP       0x42001002
 #define D3D4LINUX_OP_DISASSEMBLE 0x42001003
+#define D3D4LINUX_OP_PREPROCESS  0x42001004
+
+/* Lazy reflection: the server keeps the reflector and answers queries */
+#define D3D4LINUX_OP_REFLECT_OPEN  0x42001005
+#define D3D4LINUX_OP_REFLECT_QUERY 0x42001006
+#define D3D4LINUX_OP_REFLECT_CLOSE 0x42001007
+
+/* Shader libraries, in the DLL’s own format */
+#define D3D4LINUX_OP_COMPRESS_SHADERS   0x42001008
+#define D3D4LINUX_OP_DECOMPRESS_SHADERS 0x42001009
 
 #define D3D4LINUX_IID_SHADER_REFLECTION 0x42002000
 
+/* Steps that the server may run on the bytecode right after compiling */
+#define D3D4LINUX_COMPOSITE_REFLECT     0x1
+#define D3D4LINUX_COMPOSITE_STRIP       0x2
+#define D3D4LINUX_COMPOSITE_DISASSEMBLE 0x4
+
+#define D3D4LINUX_OP_CACHE_GET   0x42003000
+#define D3D4LINUX_OP_CACHE_PUT   0x42003001
+
+/* Requests sent back by the server while it runs D3DPreprocess() */
+#define D3D4LINUX_OP_INCLUDE_OPEN  0x42004000
+#define D3D4LINUX_OP_INCLUDE_CLOSE 0x42004001
+
+/* Requests to the daemon that shares servers between processes */
+#define D3D4LINUX_OP_DAEMON_ACQUIRE 0x42006000
+#define D3D4LINUX_OP_DAEMON_RELEASE 0x42006001
+#define D3D4LINUX_OP_DAEMON_REPORT  0x42006002
+#define D3D4LINUX_OP_DAEMON_STATUS  0x42006003
+
+/* Request priorities, most urgent first */
+#define D3D4LINUX_PRIORITY_INTERACTIVE 0
+#define D3D4LINUX_PRIORITY_NORMAL      1
+#define D3D4LINUX_PRIORITY_BACKGROUND  2
+
+//
+// A buffer that messages are read into, kept from one request to the
+// next: it only ever grows, and it is not cleared before being read
+// into. It always ends with a zero, so that strings can be used as is.
+//
+struct interop_buffer
+{
+    interop_buffer()
+      : m_data(nullptr),
+        m_size(0),
+        m_capacity(0)
+    {}
+
+    interop_buffer(interop_buffer &&that) noexcept
+      : m_data(that.m_data),
+        m_size(that.m_size),
+        m_capacity(that.m_capacity)
+    {
+        that.m_data = nullptr;
+        that.m_size = that.m_capacity = 0;
+    }
+
+    interop_buffer(interop_buffer const &) = delete;
+    interop_buffer &operator =(interop_buffer const &) = delete;
+
+    ~interop_buffer()
+    {
+        delete[] m_data;
+    }
+
+    char const *data() const { return m_data ? m_data : ""; }
+    size_t size() const { return m_size; }
+
+    /* Room for “size” bytes; whatever was there is lost */
+    char *reset(size_t size)
+    {
+        if (size + 1 > m_capacity)
+        {
+            delete[] m_data;
+            m_capacity = size + 1 > m_capacity * 2 ? size + 1 : m_capacity * 2;
+            m_data = new char[m_capacity];
+        }
+        m_size = size;
+        m_data[size] = '\0';
+        return m_data;
+    }
+
+private:
+    char *m_data;
+    size_t m_size, m_capacity;
+};
+
 //
 // Support class for low-level serialization through stdio streams.
 //
@@ -37,9 +122,16 @@ struct interop
 {
     interop(FILE *in, FILE *out)
       : m_in(in),
-        m_out(out)
+        m_out(out),
+        m_record(nullptr)
     {}
 
+    /* Also append everything written to a string, or stop if null */
+    void record(std::string *to)
+    {
+        m_record = to;
+    }
+
     //
     // Simple read/write methods for arbitrary data
     //
@@ -52,6 +144,8 @@ struct interop
     void write_raw(void const *data, size_t size)
     {
         fwrite(data, size, 1, m_out);
+        if (m_record)
+            m_record->append((char const *)data, size);
     }
 
     //
@@ -85,6 +179,23 @@ struct interop
         return v;
     }
 
+    /* Same as above, into a buffer that is reused; read_data() returns
+     * false for a null blob */
+    void read_string(interop_buffer &buf)
+    {
+        size_t len = read_i64();
+        read_raw(buf.reset(len), len);
+    }
+
+    bool read_data(interop_buffer &buf)
+    {
+        int64_t len = read_i64();
+        if (len < 0)
+            return false;
+        read_raw(buf.reset((size_t)len), (size_t)len);
+        return true;
+    }
+
     void write_i64(int64_t x)
     {
         write_raw(&x, sizeof(x));
@@ -108,5 +219,6 @@ struct interop
 
 protected:
     FILE *m_in, *m_out;
+    std::string *m_record;
 };
 
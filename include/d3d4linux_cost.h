@@ -0,0 +1,283 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint64_t */
+#include <cstdio> /* for FILE */
+#include <cstdlib> /* for getenv(), atexit() */
+#include <cstring> /* for strlen() */
+
+#include <unistd.h> /* for getpid() */
+#include <fcntl.h> /* for open() */
+#include <sys/file.h> /* for flock() */
+
+#include <map> /* for std::map */
+#include <mutex> /* for std::mutex */
+#include <set> /* for std::set */
+#include <string> /* for std::string */
+
+#include <d3d4linux_cache.h>
+#include <d3d4linux_sys.h>
+
+//
+// Predicted duration of compilations, so that the longest ones can be
+// started first. A shader that was compiled before is expected to take
+// as long as it last did; any other shader is expected to take a time
+// proportional to its source size, at the rate measured for its kind,
+// which is its target and optimization flags.
+//
+// The model is kept in D3D4LINUX_COST_MODEL, or in the local compile
+// cache directory, as a text file with one line per entry:
+//
+//   k <shader key> <msecs>
+//   c <kind> <msecs per KiB>
+//
+// Processes that share the file merge their entries when they save it,
+// which is every SAVE_INTERVAL while they compile, and when they exit.
+// Each process only writes the entries it recorded itself, under a lock
+// on the file's ".lock" companion, so that it does not undo what others
+// learnt in the meantime.
+//
+struct d3d4linux_cost_model
+{
+    struct shader
+    {
+        uint64_t key;
+        std::string kind;
+        size_t size;
+    };
+
+    static d3d4linux_cost_model &get()
+    {
+        /* Never destroyed, like the other process-wide singletons */
+        static d3d4linux_cost_model *model = new d3d4linux_cost_model();
+        return *model;
+    }
+
+    /* Identify a shader from the inputs of D3DCompile(), except for its
+     * contents, which may change from one run to the next. */
+    static shader describe(char const *file, char const *entry, char const *target,
+                           uint32_t flags1, uint32_t flags2,
+                           D3D_SHADER_MACRO const *defines, size_t size)
+    {
+        std::string id;
+        auto add_string = [&id](char const *str)
+        {
+            size_t len = str ? strlen(str) : 0;
+            id.append((char const *)&len, sizeof(len));
+            id.append(str ? str : "", len);
+        };
+
+        add_string(file);
+        add_string(entry);
+        add_string(target);
+        id.append((char const *)&flags1, sizeof(flags1));
+        id.append((char const *)&flags2, sizeof(flags2));
+        for (D3D_SHADER_MACRO const *m = defines; m && m->Name; ++m)
+        {
+            add_string(m->Name);
+            add_string(m->Definition);
+        }
+
+        uint32_t const opt_mask = D3DCOMPILE_DEBUG | D3DCOMPILE_SKIP_OPTIMIZATION
+                                | D3DCOMPILE_OPTIMIZATION_LEVEL2;
+        shader ret;
+        ret.key = d3d4linux_cache::hash(id.data(), id.size()).h1;
+        ret.kind = std::string(target ? target : "") + "/"
+                 + std::to_string(flags1 & opt_mask);
+        ret.size = size;
+        return ret;
+    }
+
+    /* Expected duration in milliseconds */
+    double predict(shader const &s)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_shaders.find(s.key);
+        if (it != m_shaders.end())
+            return it->second;
+
+        auto kind = m_kinds.find(s.kind);
+        double rate = kind != m_kinds.end() ? kind->second : m_rate;
+        return rate * (s.size / 1024.0 + 1.0);
+    }
+
+    void record(shader const &s, double msecs)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        auto it = m_shaders.find(s.key);
+        m_shaders[s.key] = it == m_shaders.end() ? msecs : (it->second + msecs) / 2;
+        m_dirty_shaders.insert(s.key);
+        m_dirty_kinds.insert(s.kind);
+
+        /* Rates move slowly, since they average very different shaders */
+        double rate = msecs / (s.size / 1024.0 + 1.0);
+        auto kind = m_kinds.find(s.kind);
+        m_kinds[s.kind] = kind == m_kinds.end() ? rate : kind->second * 0.8 + rate * 0.2;
+        m_rate = m_rate * 0.8 + rate * 0.2;
+
+        /* Long-lived processes save from time to time */
+        int64_t t = d3d4linux_sys::now();
+        if (m_path.empty() || t - m_last_save < SAVE_INTERVAL)
+            return;
+        m_last_save = t;
+        lock.unlock();
+        save();
+    }
+
+    /* Merge the model with the file; returns false if it could not be
+     * written. */
+    bool save()
+    {
+        if (m_path.empty())
+            return true;
+
+        std::lock_guard<std::mutex> save_lock(m_save_mutex);
+        std::map<uint64_t, double> dirty_shaders;
+        std::map<std::string, double> dirty_kinds;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto key : m_dirty_shaders)
+                dirty_shaders[key] = m_shaders[key];
+            for (auto const &kind : m_dirty_kinds)
+                dirty_kinds[kind] = m_kinds[kind];
+            m_dirty_shaders.clear();
+            m_dirty_kinds.clear();
+        }
+
+        /* The lock is a separate file, since the model itself is replaced
+         * by rename() */
+        bool ok = false;
+        int lock_fd = ::open((m_path + ".lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (lock_fd >= 0)
+        {
+            flock(lock_fd, LOCK_EX);
+            std::map<uint64_t, double> shaders;
+            std::map<std::string, double> kinds;
+            load(shaders, kinds);
+            for (auto const &s : dirty_shaders)
+                shaders[s.first] = s.second;
+            for (auto const &k : dirty_kinds)
+                kinds[k.first] = k.second;
+            ok = write(shaders, kinds);
+            flock(lock_fd, LOCK_UN);
+            close(lock_fd);
+        }
+
+        /* Try again next time */
+        if (!ok)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (auto const &s : dirty_shaders)
+                m_dirty_shaders.insert(s.first);
+            for (auto const &k : dirty_kinds)
+                m_dirty_kinds.insert(k.first);
+        }
+        return ok;
+    }
+
+private:
+    enum { SAVE_INTERVAL = 30000 /* milliseconds */ };
+
+    d3d4linux_cost_model()
+      : m_rate(1.0), /* one second per MiB until we know better */
+        m_last_save(d3d4linux_sys::now())
+    {
+        char const *path_var = getenv("D3D4LINUX_COST_MODEL");
+        m_path = path_var ? path_var : D3D4LINUX_COST_MODEL;
+        if (m_path.empty())
+        {
+            char const *dir_var = getenv("D3D4LINUX_CACHE_DIR");
+            std::string dir = dir_var ? dir_var : D3D4LINUX_CACHE_DIR;
+            if (!dir.empty())
+                m_path = dir + "/cost-model";
+        }
+
+        load(m_shaders, m_kinds);
+        if (!m_kinds.empty())
+        {
+            double total = 0;
+            for (auto const &k : m_kinds)
+                total += k.second;
+            m_rate = total / m_kinds.size();
+        }
+
+        /* Most processes compile for less than SAVE_INTERVAL */
+        if (!m_path.empty())
+            atexit([]() { get().save_if_dirty(); });
+    }
+
+    void save_if_dirty()
+    {
+        bool dirty;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            dirty = !m_dirty_shaders.empty();
+        }
+        if (dirty)
+            save();
+    }
+
+    /* Write a private copy first, so that readers never see half a
+     * file */
+    bool write(std::map<uint64_t, double> const &shaders,
+               std::map<std::string, double> const &kinds)
+    {
+        std::string tmp = m_path + "." + std::to_string(getpid());
+        FILE *f = fopen(tmp.c_str(), "w");
+        if (!f)
+            return false;
+        for (auto const &s : shaders)
+            fprintf(f, "k %016llx %.3f\n", (unsigned long long)s.first, s.second);
+        for (auto const &k : kinds)
+            fprintf(f, "c %s %.6f\n", k.first.c_str(), k.second);
+        bool ok = !ferror(f);
+        ok = fclose(f) == 0 && ok;
+        if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0)
+        {
+            remove(tmp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    void load(std::map<uint64_t, double> &shaders,
+              std::map<std::string, double> &kinds)
+    {
+        FILE *f = m_path.empty() ? nullptr : fopen(m_path.c_str(), "r");
+        if (!f)
+            return;
+
+        char line[256], name[200];
+        while (fgets(line, sizeof(line), f))
+        {
+            unsigned long long key;
+            double value;
+            if (sscanf(line, "k %llx %lf", &key, &value) == 2)
+                shaders[(uint64_t)key] = value;
+            else if (sscanf(line, "c %199s %lf", name, &value) == 2)
+                kinds[name] = value;
+        }
+        fclose(f);
+    }
+
+    std::string m_path;
+    std::map<uint64_t, double> m_shaders;
+    std::map<std::string, double> m_kinds;
+    double m_rate;
+    int64_t m_last_save;
+    /* What was recorded since the last save */
+    std::set<uint64_t> m_dirty_shaders;
+    std::set<std::string> m_dirty_kinds;
+    std::mutex m_mutex, m_save_mutex;
+};
@@ -0,0 +1,547 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint32_t */
+#include <cstring> /* for memcpy() */
+
+#include <algorithm> /* for std::stable_sort() */
+#include <atomic> /* for std::atomic */
+#include <string> /* for std::string */
+#include <vector> /* for std::vector */
+
+#include <d3d4linux_cab.h>
+
+//
+// Native access to DXBC containers, the format of compiled shaders:
+//
+//   header:  "DXBC", 16-byte checksum, u32 1, u32 total size,
+//            u32 chunk count, u32 offset of each chunk
+//   chunks:  u32 FourCC, u32 data size, data
+//
+// The checksum is MD5 over everything after it, except for the final
+// block, which stores the bit count in its first word instead of its
+// last two, and (count >> 2) | 1 in its last word.
+//
+struct d3d4linux_dxbc
+{
+    struct chunk
+    {
+        uint32_t fourcc;
+        uint8_t const *data;
+        uint32_t size;
+    };
+
+    static uint32_t fourcc(char const *s)
+    {
+        return (uint8_t)s[0] | ((uint8_t)s[1] << 8) | ((uint8_t)s[2] << 16)
+                | ((uint32_t)(uint8_t)s[3] << 24);
+    }
+
+    static bool parse(void const *data, size_t size, std::vector<chunk> &chunks)
+    {
+        uint8_t const *p = (uint8_t const *)data;
+        if (size < HEADER_SIZE || memcmp(p, "DXBC", 4) || read32(p + 24) > size)
+            return false;
+
+        uint32_t total = read32(p + 24), count = read32(p + 28);
+        if (total < HEADER_SIZE || count > (total - HEADER_SIZE) / 4)
+            return false;
+
+        chunks.clear();
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint32_t offset = read32(p + HEADER_SIZE + i * 4);
+            if (offset > total - 8 || read32(p + offset + 4) > total - offset - 8)
+                return false;
+
+            chunk c = { read32(p + offset), p + offset + 8, read32(p + offset + 4) };
+            chunks.push_back(c);
+        }
+        return true;
+    }
+
+    static std::string build(std::vector<chunk> const &chunks)
+    {
+        uint32_t offset = HEADER_SIZE + (uint32_t)chunks.size() * 4;
+        std::string ret(offset, '\0');
+        memcpy(&ret[0], "DXBC", 4);
+        write32(&ret[20], 1);
+        write32(&ret[28], (uint32_t)chunks.size());
+
+        for (size_t i = 0; i < chunks.size(); ++i)
+        {
+            write32(&ret[HEADER_SIZE + i * 4], (uint32_t)ret.size());
+            char header[8];
+            write32(header, chunks[i].fourcc);
+            write32(header + 4, chunks[i].size);
+            ret.append(header, 8);
+            ret.append((char const *)chunks[i].data, chunks[i].size);
+        }
+
+        write32(&ret[24], (uint32_t)ret.size());
+        checksum((uint8_t const *)ret.data(), ret.size(), (uint8_t *)&ret[4]);
+        return ret;
+    }
+
+    static void checksum(uint8_t const *data, size_t size, uint8_t digest[16])
+    {
+        uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+        data += 20;
+        size -= 20;
+
+        size_t full = size & ~(size_t)63;
+        for (size_t i = 0; i < full; i += 64)
+            md5_block(h, data + i);
+
+        uint32_t bits = (uint32_t)(size * 8);
+        size_t rest = size - full;
+        uint8_t block[64];
+
+        if (rest >= 56)
+        {
+            memset(block, 0, 64);
+            memcpy(block, data + full, rest);
+            block[rest] = 0x80;
+            md5_block(h, block);
+
+            memset(block, 0, 64);
+            write32(block, bits);
+        }
+        else
+        {
+            memset(block, 0, 64);
+            write32(block, bits);
+            memcpy(block + 4, data + full, rest);
+            block[4 + rest] = 0x80;
+        }
+        write32(block + 60, (bits >> 2) | 1);
+        md5_block(h, block);
+
+        for (int i = 0; i < 4; ++i)
+            write32(digest + i * 4, h[i]);
+    }
+
+    //
+    // D3DGetBlobPart(): signatures come back as a container of their
+    // own, other parts as the raw chunk data.
+    //
+    static HRESULT get_part(void const *data, size_t size, D3D_BLOB_PART part,
+                            uint32_t flags, std::string &out)
+    {
+        std::vector<chunk> chunks, found;
+        if (flags || !parse(data, size, chunks))
+            return E_INVALIDARG;
+
+        bool container = part <= D3D_BLOB_ALL_SIGNATURE_BLOB;
+        for (size_t i = 0; i < chunks.size(); ++i)
+            if (matches(part, chunks[i].fourcc))
+                found.push_back(chunks[i]);
+
+        /* Signatures are either all found or the call fails */
+        size_t expected = part == D3D_BLOB_INPUT_AND_OUTPUT_SIGNATURE_BLOB ? 2
+                        : part == D3D_BLOB_ALL_SIGNATURE_BLOB ? 3 : 1;
+        if (found.size() != expected)
+            return E_FAIL;
+
+        if (container)
+            out = build(found);
+        else
+            out.assign((char const *)found[0].data, found[0].size);
+        return S_OK;
+    }
+
+    //
+    // D3DSetBlobPart(): replace or add one of the parts that hold user
+    // data, and fix up the checksum
+    //
+    static HRESULT set_part(void const *data, size_t size, D3D_BLOB_PART part,
+                            uint32_t flags, void const *part_data, size_t part_size,
+                            std::string &out)
+    {
+        std::vector<chunk> chunks;
+        if (flags || !parse(data, size, chunks) || part_size > 0xffffffffu
+             || (part != D3D_BLOB_PRIVATE_DATA && part != D3D_BLOB_ROOT_SIGNATURE))
+            return E_INVALIDARG;
+
+        chunk c = { part_fourcc(part), (uint8_t const *)part_data, (uint32_t)part_size };
+        size_t i = 0;
+        while (i < chunks.size() && chunks[i].fourcc != c.fourcc)
+            ++i;
+        if (i < chunks.size())
+            chunks[i] = c;
+        else
+            chunks.push_back(c);
+
+        out = build(chunks);
+        return S_OK;
+    }
+
+    //
+    // Shader libraries, as D3DCompressShaders() writes them:
+    //
+    //   header:  "BSCD", u16 1, u16 1, u32 0, u32 shader count,
+    //            16 zero bytes
+    //   data:    a cabinet (see d3d4linux_cab.h) with one file per part,
+    //            named "S", the FourCC, then the shader index in base 64
+    //            from '!', lowest digit first
+    //
+    // Parts that only tools need are left out, unless flags has
+    // D3D_COMPRESS_SHADER_KEEP_ALL_PARTS, and so are empty signatures,
+    // which come back on the way out. Blobs that are not containers are
+    // stored whole, as part "0000". Files come in the DLL's order: grouped
+    // by FourCC, smallest first, which also compresses best.
+    //
+    static HRESULT compress_shaders(D3D_SHADER_DATA const *shaders, uint32_t count,
+                                    uint32_t flags, std::string &out)
+    {
+        if (flags & ~D3D_COMPRESS_SHADER_KEEP_ALL_PARTS)
+            return E_FAIL;
+
+        std::vector<uint32_t> order;
+        std::vector<std::vector<std::pair<uint32_t, chunk>>> groups;
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            uint8_t const *p = (uint8_t const *)shaders[i].pBytecode;
+            size_t size = shaders[i].BytecodeLength;
+            if (!p)
+                return D3DERR_INVALIDCALL;
+            if (size > 0x7fffffffu)
+                return E_FAIL;
+
+            std::vector<chunk> chunks;
+            if (!contiguous(p, size, chunks))
+            {
+                chunk c = { fourcc("0000"), p, (uint32_t)size };
+                chunks.assign(1, c);
+            }
+            else
+            {
+                uint8_t digest[16];
+                checksum(p, size, digest);
+                if (memcmp(digest, p + 4, 16))
+                    return E_FAIL;
+            }
+
+            for (auto const &c : chunks)
+            {
+                if (!(flags & D3D_COMPRESS_SHADER_KEEP_ALL_PARTS) && droppable(c))
+                    continue;
+                size_t g = std::find(order.begin(), order.end(), c.fourcc) - order.begin();
+                if (g == order.size())
+                {
+                    order.push_back(c.fourcc);
+                    groups.resize(g + 1);
+                }
+                groups[g].push_back(std::make_pair(i, c));
+            }
+        }
+
+        std::vector<d3d4linux_cab::file> files;
+        for (auto &group : groups)
+        {
+            /* Parts of the same size go newest first */
+            std::reverse(group.begin(), group.end());
+            std::stable_sort(group.begin(), group.end(),
+                             [](std::pair<uint32_t, chunk> const &a, std::pair<uint32_t, chunk> const &b)
+                             { return a.second.size < b.second.size; });
+            for (auto const &part : group)
+            {
+                d3d4linux_cab::file f = { part_name(part.second.fourcc, part.first),
+                                          std::string((char const *)part.second.data, part.second.size) };
+                files.push_back(f);
+            }
+        }
+
+        std::string cab;
+        if (!d3d4linux_cab::write(files, cab))
+            return E_FAIL;
+
+        out.assign(LIBRARY_HEADER_SIZE, '\0');
+        memcpy(&out[0], "BSCD\1\0\1\0", 8);
+        write32(&out[12], count);
+        out += cab;
+        return S_OK;
+    }
+
+    //
+    // Extract count shaders from a library, either indices[0..count) or,
+    // if indices is null, the ones starting at start; shaders that are not
+    // in the library are left empty. The total number of shaders in the
+    // library is returned as well.
+    //
+    static HRESULT decompress_shaders(void const *data, size_t size, uint32_t count,
+                                      uint32_t start, uint32_t const *indices,
+                                      uint32_t flags, std::vector<std::string> &out,
+                                      uint32_t *total)
+    {
+        uint8_t const *p = (uint8_t const *)data;
+        static uint8_t const zero[20] = { 0 };
+        out.assign(count, std::string());
+        if (!p || flags || size < LIBRARY_HEADER_SIZE || size > 0x7fffffffu
+             || memcmp(p, "BSCD\1\0\1\0", 8) || memcmp(p + 8, zero, 4) || memcmp(p + 16, zero, 16))
+            return E_FAIL;
+
+        std::vector<d3d4linux_cab::file> files;
+        if (!d3d4linux_cab::read(p + LIBRARY_HEADER_SIZE, size - LIBRARY_HEADER_SIZE, files))
+            return E_FAIL;
+
+        /* Parts of each requested shader, the last one read first */
+        std::vector<std::vector<chunk>> parts(count);
+        uint32_t shader_count = 0;
+        size_t bytes = 0;
+        for (auto const &f : files)
+        {
+            uint32_t cc, index;
+            if (!parse_part_name(f.name, cc, index))
+                return E_FAIL;
+            shader_count = std::max(shader_count, index + 1);
+
+            uint32_t slot = 0;
+            if (indices)
+                while (slot < count && indices[slot] != index)
+                    ++slot;
+            else
+                slot = index >= start ? index - start : count;
+            if (slot >= count)
+                continue;
+
+            chunk c = { cc, (uint8_t const *)f.data.data(), (uint32_t)f.data.size() };
+            parts[slot].insert(parts[slot].begin(), c);
+            bytes += f.data.size();
+        }
+        if (total)
+            *total = shader_count;
+
+        std::atomic<bool> ok(true);
+        d3d4linux_cab::parallel(count, bytes, [&](size_t i)
+        {
+            if (parts[i].empty())
+                return;
+
+            bool code = false, input = false, output = false;
+            uint8_t const *raw = nullptr;
+            size_t raw_size = 0;
+            for (auto const &c : parts[i])
+            {
+                code |= c.fourcc == fourcc("SHDR") || c.fourcc == fourcc("SHEX");
+                input |= c.fourcc == fourcc("ISGN");
+                output |= c.fourcc == fourcc("OSGN") || c.fourcc == fourcc("OSG5");
+                if (c.fourcc == fourcc("0000"))
+                {
+                    raw = c.data;
+                    raw_size = c.size;
+                }
+            }
+
+            if (raw && parts[i].size() > 1)
+                ok = false;
+            else if (raw && raw_size)
+                out[i].assign((char const *)raw, raw_size);
+            else
+            {
+                /* An empty raw blob is an empty container */
+                std::vector<chunk> chunks;
+                if (!raw)
+                {
+                    chunks = parts[i];
+                    if (code && !input)
+                        chunks.push_back(empty_signature("ISGN"));
+                    if (!output)
+                        chunks.push_back(empty_signature("OSGN"));
+                }
+                out[i] = build(chunks);
+            }
+        });
+
+        if (!ok)
+        {
+            out.assign(count, std::string());
+            return E_FAIL;
+        }
+        return S_OK;
+    }
+
+private:
+    enum { HEADER_SIZE = 32, LIBRARY_HEADER_SIZE = 32 };
+
+    /* The DLL only takes containers whose chunks follow each other */
+    static bool contiguous(uint8_t const *p, size_t size, std::vector<chunk> &chunks)
+    {
+        if (size < HEADER_SIZE || memcmp(p, "DXBC", 4) || read32(p + 20) != 1
+             || read32(p + 24) != size || read32(p + 28) > (size - HEADER_SIZE) / 4)
+            return false;
+
+        uint32_t count = read32(p + 28);
+        size_t offset = HEADER_SIZE + count * 4;
+        chunks.clear();
+        for (uint32_t i = 0; i < count; ++i)
+        {
+            if (read32(p + HEADER_SIZE + i * 4) != offset || offset > size - 8
+                 || read32(p + offset + 4) > size - offset - 8)
+                return false;
+
+            chunk c = { read32(p + offset), p + offset + 8, read32(p + offset + 4) };
+            chunks.push_back(c);
+            offset += 8 + c.size;
+        }
+        return true;
+    }
+
+    static bool droppable(chunk const &c)
+    {
+        static char const *tools[] = { "RDEF", "STAT", "SDBG", "SDTL", "SMID", "PERF" };
+        for (auto name : tools)
+            if (c.fourcc == fourcc(name))
+                return true;
+
+        bool signature = c.fourcc == fourcc("ISGN") || c.fourcc == fourcc("OSGN");
+        return signature && c.size == 8 && read32(c.data) == 0 && read32(c.data + 4) == 8;
+    }
+
+    /* No elements, and the offset of where they would start */
+    static chunk empty_signature(char const *name)
+    {
+        static uint8_t const data[8] = { 0, 0, 0, 0, 8, 0, 0, 0 };
+        chunk c = { fourcc(name), data, 8 };
+        return c;
+    }
+
+    static std::string part_name(uint32_t cc, uint32_t index)
+    {
+        std::string ret = "S";
+        for (int i = 0; i < 4; ++i)
+            ret += (char)((cc >> (8 * i)) & 0x7f);
+        do
+            ret += (char)('!' + (index & 63));
+        while (index >>= 6);
+        return ret;
+    }
+
+    static bool parse_part_name(std::string const &name, uint32_t &cc, uint32_t &index)
+    {
+        if (name.size() < 6 || name.size() > 11 || name[0] != 'S')
+            return false;
+
+        cc = fourcc(&name[1]);
+        index = 0;
+        for (size_t i = name.size(); i-- > 5; )
+        {
+            uint32_t digit = (uint8_t)name[i] - '!';
+            if (digit >= 64)
+                return false;
+            index = (index << 6) | digit;
+        }
+        return true;
+    }
+
+    static uint32_t part_fourcc(D3D_BLOB_PART part)
+    {
+        switch (part)
+        {
+        case D3D_BLOB_INPUT_SIGNATURE_BLOB: return fourcc("ISGN");
+        case D3D_BLOB_OUTPUT_SIGNATURE_BLOB: return fourcc("OSGN");
+        case D3D_BLOB_PATCH_CONSTANT_SIGNATURE_BLOB: return fourcc("PCSG");
+        case D3D_BLOB_DEBUG_INFO: return fourcc("SDBG");
+        case D3D_BLOB_LEGACY_SHADER: return fourcc("Aon9");
+        case D3D_BLOB_XNA_PREPASS_SHADER: return fourcc("XNAP");
+        case D3D_BLOB_XNA_SHADER: return fourcc("XNAS");
+        case D3D_BLOB_PDB: return fourcc("SPDB");
+        case D3D_BLOB_PRIVATE_DATA: return fourcc("PRIV");
+        case D3D_BLOB_ROOT_SIGNATURE: return fourcc("RTS0");
+        case D3D_BLOB_DEBUG_NAME: return fourcc("ILDN");
+        default: return 0;
+        }
+    }
+
+    static bool matches(D3D_BLOB_PART part, uint32_t cc)
+    {
+        bool input = cc == fourcc("ISGN") || cc == fourcc("ISG1");
+        bool output = cc == fourcc("OSGN") || cc == fourcc("OSG1") || cc == fourcc("OSG5");
+        bool patch = cc == fourcc("PCSG") || cc == fourcc("PSG1");
+
+        switch (part)
+        {
+        case D3D_BLOB_INPUT_SIGNATURE_BLOB: return input;
+        case D3D_BLOB_OUTPUT_SIGNATURE_BLOB: return output;
+        case D3D_BLOB_INPUT_AND_OUTPUT_SIGNATURE_BLOB: return input || output;
+        case D3D_BLOB_PATCH_CONSTANT_SIGNATURE_BLOB: return patch;
+        case D3D_BLOB_ALL_SIGNATURE_BLOB: return input || output || patch;
+        default: return cc == part_fourcc(part) && cc != 0;
+        }
+    }
+
+    static uint32_t read32(void const *p)
+    {
+        uint32_t x;
+        memcpy(&x, p, 4);
+        return x;
+    }
+
+    static void write32(void *p, uint32_t x)
+    {
+        memcpy(p, &x, 4);
+    }
+
+    static uint32_t rotl(uint32_t x, int r)
+    {
+        return (x << r) | (x >> (32 - r));
+    }
+
+    static void md5_block(uint32_t h[4], uint8_t const *block)
+    {
+        static uint32_t const k[64] =
+        {
+            0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a,
+            0xa8304613, 0xfd469501, 0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be,
+            0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821, 0xf61e2562, 0xc040b340,
+            0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+            0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8,
+            0x676f02d9, 0x8d2a4c8a, 0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c,
+            0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70, 0x289b7ec6, 0xeaa127fa,
+            0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+            0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92,
+            0xffeff47d, 0x85845dd1, 0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1,
+            0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391,
+        };
+        static int const r[16] = { 7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21 };
+
+        uint32_t m[16];
+        for (int i = 0; i < 16; ++i)
+            m[i] = read32(block + i * 4);
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3];
+        for (int i = 0; i < 64; ++i)
+        {
+            uint32_t f;
+            int g;
+            switch (i / 16)
+            {
+            case 0: f = (b & c) | (~b & d); g = i; break;
+            case 1: f = (d & b) | (~d & c); g = (5 * i + 1) & 15; break;
+            case 2: f = b ^ c ^ d; g = (3 * i + 5) & 15; break;
+            default: f = c ^ (b | ~d); g = (7 * i) & 15; break;
+            }
+            uint32_t tmp = d;
+            d = c;
+            c = b;
+            b += rotl(a + f + k[i] + m[g], r[(i / 16) * 4 + (i & 3)]);
+            a = tmp;
+        }
+
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+    }
+};
@@ -29,6 +29,14 @@
 #define D3DCOMPILE_OPTIMIZATION_LEVEL2 0xc000
 #define D3DCOMPILE_OPTIMIZATION_LEVEL3 0x8000
 
+#define D3D_COMPRESS_SHADER_KEEP_ALL_PARTS 0x0001
+
+enum D3D_INCLUDE_TYPE
+{
+    D3D_INCLUDE_LOCAL = 0,
+    D3D_INCLUDE_SYSTEM,
+};
+
 /*
  * Enums/macros from D3D10
  */
@@ -61,6 +69,43 @@ typedef enum D3DCOMPILER_STRIP_FLAGS
 }
 D3DCOMPILER_STRIP_FLAGS;
 
+typedef enum D3D_BLOB_PART
+{
+    D3D_BLOB_INPUT_SIGNATURE_BLOB,
+    D3D_BLOB_OUTPUT_SIGNATURE_BLOB,
+    D3D_BLOB_INPUT_AND_OUTPUT_SIGNATURE_BLOB,
+    D3D_BLOB_PATCH_CONSTANT_SIGNATURE_BLOB,
+    D3D_BLOB_ALL_SIGNATURE_BLOB,
+    D3D_BLOB_DEBUG_INFO,
+    D3D_BLOB_LEGACY_SHADER,
+    D3D_BLOB_XNA_PREPASS_SHADER,
+    D3D_BLOB_XNA_SHADER,
+    D3D_BLOB_PDB,
+    D3D_BLOB_PRIVATE_DATA,
+    D3D_BLOB_ROOT_SIGNATURE,
+    D3D_BLOB_DEBUG_NAME,
+
+    D3D_BLOB_TEST_ALTERNATE_SHADER = 0x8000,
+    D3D_BLOB_TEST_COMPILE_DETAILS,
+    D3D_BLOB_TEST_COMPILE_PERF,
+    D3D_BLOB_TEST_COMPILE_REPORT,
+}
+D3D_BLOB_PART;
+
+typedef enum D3D_FEATURE_LEVEL
+{
+    D3D_FEATURE_LEVEL_9_1  = 0x9100,
+    D3D_FEATURE_LEVEL_9_2  = 0x9200,
+    D3D_FEATURE_LEVEL_9_3  = 0x9300,
+    D3D_FEATURE_LEVEL_10_0 = 0xa000,
+    D3D_FEATURE_LEVEL_10_1 = 0xa100,
+    D3D_FEATURE_LEVEL_11_0 = 0xb000,
+    D3D_FEATURE_LEVEL_11_1 = 0xb100,
+    D3D_FEATURE_LEVEL_12_0 = 0xc000,
+    D3D_FEATURE_LEVEL_12_1 = 0xc100,
+}
+D3D_FEATURE_LEVEL;
+
 typedef enum D3D_NAME
 {
     D3D_NAME_UNDEFINED                     = 0,
@@ -12,28 +12,75 @@
 
 #pragma once
 
+#include <cerrno> /* for errno */
 #include <cstdint> /* for uint32_t */
 #include <cstddef> /* for size_t */
 #include <cstdio> /* for FILE */
 #include <cstring> /* for strcmp() */
+#include <cstdlib> /* for getenv() */
+#include <cctype> /* for tolower() */
+
+#include <algorithm> /* for std::sort() */
+#include <atomic> /* for std::atomic */
+#include <chrono> /* for std::chrono */
+#include <condition_variable> /* for std::condition_variable */
+#include <map> /* for std::map */
+#include <memory> /* for std::shared_ptr */
+#include <mutex> /* for std::mutex */
+#include <set> /* for std::set */
+#include <thread> /* for std::thread */
 
 #include <unistd.h> /* for fork() */
 #include <sys/wait.h> /* for waitpid() */
+#include <sys/stat.h> /* for mkdir() */
 #include <fcntl.h> /* for O_WRONLY */
+#include <poll.h> /* for poll() */
+#include <sys/socket.h> /* for recvmsg() */
+#include <sys/un.h> /* for sockaddr_un */
 
 #include <string> /* for std::string */
+#include <vector> /* for std::vector */
 
 #include <d3d4linux_common.h>
+#include <d3d4linux_cache.h>
+#include <d3d4linux_capture.h>
+#include <d3d4linux_cost.h>
+#include <d3d4linux_dxbc.h>
+#include <d3d4linux_native.h>
+#include <d3d4linux_preprocess.h>
+#include <d3d4linux_sys.h>
 
-struct d3d4linux
+struct d3d4linux : d3d4linux_native
 {
+    friend struct d3d4linux_async;
+    friend struct d3d4linux_daemon;
+    friend struct d3d4linux_replay;
+
     static int &compiler_version()
     {
          static int ret = 0;
          return ret;
     }
 
-    static HRESULT compile(void const *pSrcData,
+    //
+    // Priority of the requests made by the calling thread, one of the
+    // D3D4LINUX_PRIORITY_ values; when servers are busy, a more urgent
+    // request gets the next one to be released. Defaults to the
+    // D3D4LINUX_PRIORITY environment variable.
+    //
+    static int &priority()
+    {
+        static thread_local int ret = default_priority();
+        return ret;
+    }
+
+    //
+    // Entry points for a given compiler DLL version, see d3d4linux_native.h
+    //
+    template<int V> using versioned = d3d4linux_versioned<d3d4linux, V>;
+
+    static HRESULT compile(int version,
+                           void const *pSrcData,
                            size_t SrcDataSize,
                            char const *pFileName,
                            D3D_SHADER_MACRO const *pDefines,
@@ -45,126 +92,143 @@ struct d3d4linux
                            ID3DBlob **ppCode,
                            ID3DBlob **ppErrorMsgs)
     {
-        fork_process p;
-        if (p.error())
+        /* Describe the shader before its defines are expanded, the way
+         * schedulers such as tools/batch-compile see it */
+        d3d4linux_cost_model::shader shader
+            = d3d4linux_cost_model::describe(pFileName, pEntrypoint, pTarget,
+                                             Flags1, Flags2, pDefines, SrcDataSize);
+
+        std::string expanded, key;
+        if (!prepare(version, pSrcData, SrcDataSize, pFileName, pDefines, pInclude,
+                     pEntrypoint, pTarget, Flags1, Flags2, expanded, key, ppErrorMsgs))
         {
-            static char const *error_msg = "Cannot fork in d3d4linux::compile()";
-            *ppErrorMsgs = new ID3DBlob(strlen(error_msg));
-            memcpy((*ppErrorMsgs)->GetBufferPointer(), error_msg, (*ppErrorMsgs)->GetBufferSize());
+            *ppCode = nullptr;
             return E_FAIL;
         }
 
-        p.write_i64(D3D4LINUX_OP_COMPILE);
-        p.write_string((char const *)pSrcData);
-        p.write_i64(pFileName ? 1 : 0);
-        p.write_string(pFileName ? pFileName : "");
-        p.write_string(pEntrypoint);
-        p.write_string(pTarget);
-        p.write_i64(Flags1);
-        p.write_i64(Flags2);
-        p.write_i64(D3D4LINUX_FINISHED);
+        /* If the exact same compilation is already running in another
+         * thread, wait for it and share its result. */
+        flight_table &table = flight_table::get();
+        std::unique_lock<std::mutex> lock(table.m_mutex);
 
-        HRESULT ret = p.read_i64();
-        ID3DBlob *code_blob = p.read_blob();
-        ID3DBlob *error_blob = p.read_blob();
-        int end = p.read_i64();
-        if (end != D3D4LINUX_FINISHED)
-            return E_FAIL;
+        auto it = table.m_flights.find(key);
+        if (it != table.m_flights.end())
+        {
+            std::shared_ptr<flight> f = it->second;
+            ++f->m_waiters;
+            f->m_cond.wait(lock, [&f]() { return f->m_done; });
+            *ppCode = f->m_code.copy();
+            *ppErrorMsgs = f->m_errors.copy();
+            return f->m_ret;
+        }
 
-        *ppCode = code_blob;
-        *ppErrorMsgs = error_blob;
+        std::shared_ptr<flight> f = std::make_shared<flight>();
+        table.m_flights[key] = f;
+        lock.unlock();
+
+        /* Only successful compilations are cached, so that a server
+         * failure can never be replayed to other machines. */
+        HRESULT ret;
+        d3d4linux_cache &cache = d3d4linux_cache::get();
+        if (cache.enabled())
+            daemon_client::get(); /* so that it reports our hits at exit */
+        d3d4linux_cache::key hash = d3d4linux_cache::hash(key.data(), key.size());
+        std::string value;
+        if (cache.enabled() && cache.lookup(hash, value)
+             && unpack_blobs(value, ppCode, ppErrorMsgs))
+        {
+            ret = S_OK;
+        }
+        else
+        {
+            ret = compile_remote(version, pSrcData, SrcDataSize,
+                                 pFileName, pEntrypoint, pTarget,
+                                 Flags1, Flags2, shader, ppCode, ppErrorMsgs);
+            if (SUCCEEDED(ret) && cache.enabled())
+                cache.store(hash, pack_blobs(*ppCode, *ppErrorMsgs));
+        }
+
+        lock.lock();
+        table.m_flights.erase(key);
+        if (f->m_waiters > 0)
+        {
+            f->m_code.assign(*ppCode);
+            f->m_errors.assign(*ppErrorMsgs);
+        }
+        f->m_ret = ret;
+        f->m_done = true;
+        f->m_cond.notify_all();
         return ret;
     }
 
-    static HRESULT reflect(void const *pSrcData,
+    static HRESULT reflect(int version,
+                           void const *pSrcData,
                            size_t SrcDataSize,
                            REFIID pInterface,
                            void **ppReflector)
     {
-        fork_process p;
-        if (p.error())
-            return E_FAIL;
-
-        p.write_i64(D3D4LINUX_OP_REFLECT);
-        p.write_i64(SrcDataSize);
-        p.write_raw(pSrcData, SrcDataSize);
-        p.write_i64(pInterface);
-        p.write_i64(D3D4LINUX_FINISHED);
-
-        HRESULT ret = p.read_i64();
+        std::vector<uint8_t> snapshot;
+        d3d4linux_snapshot::source *source = nullptr;
+        HRESULT ret = reflect_snapshot(version, pSrcData, SrcDataSize,
+                                       pInterface, snapshot, source);
+        if (!snapshot.empty())
+            *ppReflector = new ID3D11ShaderReflection(snapshot, source);
+        return ret;
+    }
 
-        if (SUCCEEDED(ret) && pInterface == IID_ID3D11ShaderReflection)
+    //
+    // The reflection itself, as a snapshot, and, with lazy reflection,
+    // where to fetch the rest of it from. The snapshot is left empty if
+    // there is no reflector to build.
+    //
+    static HRESULT reflect_snapshot(int version,
+                                    void const *pSrcData,
+                                    size_t SrcDataSize,
+                                    REFIID pInterface,
+                                    std::vector<uint8_t> &snapshot,
+                                    d3d4linux_snapshot::source *&source)
+    {
+        composite_memo::result const *memo
+            = composite_memo::get().find(D3D4LINUX_COMPOSITE_REFLECT, pSrcData, SrcDataSize);
+        if (memo && pInterface == IID_ID3D11ShaderReflection)
         {
-            ID3D11ShaderReflection *r = new ID3D11ShaderReflection;
-
-            p.read_raw(&r->m_desc, sizeof(r->m_desc));
-            r->m_strings.push_back(p.read_string());
-
-            for (uint32_t i = 0; i < r->m_desc.InputParameters; ++i)
-            {
-                r->m_input_params.push_back(D3D11_SIGNATURE_PARAMETER_DESC());
-                p.read_raw(&r->m_input_params.back(), sizeof(r->m_input_params.back()));
-                r->m_strings.push_back(p.read_string());
-            }
-
-            for (uint32_t i = 0; i < r->m_desc.OutputParameters; ++i)
-            {
-                r->m_output_params.push_back(D3D11_SIGNATURE_PARAMETER_DESC());
-                p.read_raw(&r->m_output_params.back(), sizeof(r->m_output_params.back()));
-                r->m_strings.push_back(p.read_string());
-            }
-
-            for (uint32_t i = 0; i < r->m_desc.BoundResources; ++i)
-            {
-                r->m_binds.push_back(D3D11_SHADER_INPUT_BIND_DESC());
-                p.read_raw(&r->m_binds.back(), sizeof(r->m_binds.back()));
-                r->m_strings.push_back(p.read_string());
-            }
-
-            for (uint32_t i = 0; i < r->m_desc.ConstantBuffers; ++i)
-            {
-                r->m_buffers.push_back(ID3D11ShaderReflectionConstantBuffer());
-                ID3D11ShaderReflectionConstantBuffer &buf = r->m_buffers.back();
-
-                p.read_raw(&buf.m_desc, sizeof(buf.m_desc));
-                buf.m_strings.push_back(p.read_string());
-
-                for (uint32_t j = 0; j < buf.m_desc.Variables; ++j)
-                {
-                    buf.m_variables.push_back(ID3D11ShaderReflectionVariable());
-                    ID3D11ShaderReflectionVariable &var = buf.m_variables.back();
-
-                    p.read_raw(&var.m_desc, sizeof(var.m_desc));
-                    var.m_strings.push_back(p.read_string());
-                    var.m_has_default = p.read_i64();
-                    if (var.m_has_default)
-                    {
-                        var.m_default_value.resize(var.m_desc.Size);
-                        p.read_raw(var.m_default_value.data(), var.m_desc.Size);
-                    }
-                }
-            }
-
-            *ppReflector = r;
+            if (SUCCEEDED(memo->ret))
+                snapshot.assign(memo->data.begin(), memo->data.end());
+            return memo->ret;
         }
 
-        int end = p.read_i64();
-        if (end != D3D4LINUX_FINISHED)
-            return E_FAIL;
+        /* Lazy reflectors need their server back, which a daemon cannot
+         * promise */
+        bool lazy = getenv_int("D3D4LINUX_LAZY_REFLECT", D3D4LINUX_LAZY_REFLECT) != 0
+                     && !daemon_client::get().enabled();
 
-        return ret;
+        return reflect_remote(version, pSrcData, SrcDataSize, pInterface, lazy,
+                              snapshot, source);
     }
 
-    static HRESULT strip_shader(void const *pShaderBytecode,
+    static HRESULT strip_shader(int version,
+                                void const *pShaderBytecode,
                                 size_t BytecodeLength,
                                 uint32_t uStripFlags,
                                 ID3DBlob **ppStrippedBlob)
     {
-        fork_process p;
+        composite_memo &memo = composite_memo::get();
+        composite_memo::result const *r
+            = memo.find(D3D4LINUX_COMPOSITE_STRIP, pShaderBytecode, BytecodeLength);
+        if (r && memo.m_strip_flags == uStripFlags)
+        {
+            *ppStrippedBlob = r->has_data ? make_blob(r->data.data(), r->data.size()) : nullptr;
+            return r->ret;
+        }
+
+        d3d4linux_capture::request capture;
+        server_lease p(D3D4LINUX_OP_STRIP);
         if (p.error())
             return E_FAIL;
+        capture.attach(p);
 
         p.write_i64(D3D4LINUX_OP_STRIP);
+        p.write_i64(version);
         p.write_i64(BytecodeLength);
         p.write_raw(pShaderBytecode, BytecodeLength);
         p.write_i64(uStripFlags);
@@ -174,148 +238,2129 @@ struct d3d4linux
         ID3DBlob *strip_blob = p.read_blob();
         int end = p.read_i64();
         if (end != D3D4LINUX_FINISHED)
+        {
+            p.broken();
+            if (strip_blob)
+                strip_blob->Release();
             return E_FAIL;
+        }
 
+        capture.finish(D3D4LINUX_OP_STRIP, ret, strip_blob);
         *ppStrippedBlob = strip_blob;
         return ret;
     }
 
-    static HRESULT disassemble(void const *pSrcData,
+    static HRESULT disassemble(int version,
+                               void const *pSrcData,
                                size_t SrcDataSize,
                                uint32_t Flags,
                                char const *szComments,
                                ID3DBlob **ppDisassembly)
     {
-        fork_process p;
+        composite_memo::result const *r
+            = composite_memo::get().find(D3D4LINUX_COMPOSITE_DISASSEMBLE, pSrcData, SrcDataSize);
+        if (r && Flags == 0 && !szComments)
+        {
+            *ppDisassembly = r->has_data ? make_blob(r->data.data(), r->data.size()) : nullptr;
+            return r->ret;
+        }
+
+        d3d4linux_capture::request capture;
+        server_lease p(D3D4LINUX_OP_DISASSEMBLE);
         if (p.error())
             return E_FAIL;
+        capture.attach(p);
 
         p.write_i64(D3D4LINUX_OP_DISASSEMBLE);
+        p.write_i64(version);
         p.write_i64(SrcDataSize);
         p.write_raw(pSrcData, SrcDataSize);
         p.write_i64(Flags);
         p.write_i64(szComments ? 1 : 0);
-        p.write_string(szComments ? szComments : "");
+        if (szComments)
+            p.write_string(szComments);
         p.write_i64(D3D4LINUX_FINISHED);
 
         HRESULT ret = p.read_i64();
         ID3DBlob *disassembly_blob = p.read_blob();
         int end = p.read_i64();
         if (end != D3D4LINUX_FINISHED)
+        {
+            p.broken();
+            if (disassembly_blob)
+                disassembly_blob->Release();
             return E_FAIL;
+        }
 
+        capture.finish(D3D4LINUX_OP_DISASSEMBLE, ret, disassembly_blob);
         *ppDisassembly = disassembly_blob;
         return ret;
     }
 
-    static HRESULT create_blob(size_t Size,
-                               ID3DBlob **ppBlob)
+    //
+    // The DLL's own D3DCompressShaders() and D3DDecompressShaders(); ours
+    // are native (see d3d4linux_dxbc.h), and these are what they are
+    // checked against. These requests are not captured.
+    //
+    static HRESULT dll_compress_shaders(int version,
+                                        uint32_t uNumShaders,
+                                        D3D_SHADER_DATA *pShaderData,
+                                        uint32_t uFlags,
+                                        ID3DBlob **ppCompressedData)
     {
-        *ppBlob = new ID3DBlob(Size);
-        return S_OK;
+        *ppCompressedData = nullptr;
+
+        server_lease p(D3D4LINUX_OP_COMPRESS_SHADERS);
+        if (p.error())
+            return E_FAIL;
+
+        p.write_i64(D3D4LINUX_OP_COMPRESS_SHADERS);
+        p.write_i64(version);
+        p.write_i64(uNumShaders);
+        for (uint32_t i = 0; i < uNumShaders; ++i)
+        {
+            p.write_i64(pShaderData[i].pBytecode ? (int64_t)pShaderData[i].BytecodeLength : -1);
+            if (pShaderData[i].pBytecode)
+                p.write_raw(pShaderData[i].pBytecode, pShaderData[i].BytecodeLength);
+        }
+        p.write_i64(uFlags);
+        p.write_i64(D3D4LINUX_FINISHED);
+
+        HRESULT ret = p.read_i64();
+        ID3DBlob *library_blob = p.read_blob();
+        int end = p.read_i64();
+        if (end != D3D4LINUX_FINISHED)
+        {
+            p.broken();
+            if (library_blob)
+                library_blob->Release();
+            return E_FAIL;
+        }
+
+        *ppCompressedData = library_blob;
+        return ret;
     }
 
-private:
-    struct fork_process : interop
+    static HRESULT dll_decompress_shaders(int version,
+                                          void const *pSrcData,
+                                          size_t SrcDataSize,
+                                          uint32_t uNumShaders,
+                                          uint32_t uStartIndex,
+                                          uint32_t *pIndices,
+                                          uint32_t uFlags,
+                                          ID3DBlob **ppShaders,
+                                          uint32_t *pTotalShaders)
     {
-    public:
-        fork_process()
-          : interop(nullptr, nullptr),
-            m_pid(-1)
-        {
-            static thread_local pid_t pid = -1;
-            static thread_local int pipe_read[2], pipe_write[2];
-            static thread_local FILE *in, *out;
+        for (uint32_t i = 0; i < uNumShaders; ++i)
+            ppShaders[i] = nullptr;
+
+        server_lease p(D3D4LINUX_OP_DECOMPRESS_SHADERS);
+        if (p.error())
+            return E_FAIL;
+
+        p.write_i64(D3D4LINUX_OP_DECOMPRESS_SHADERS);
+        p.write_i64(version);
+        p.write_i64(SrcDataSize);
+        p.write_raw(pSrcData, SrcDataSize);
+        p.write_i64(uNumShaders);
+        p.write_i64(uStartIndex);
+        p.write_i64(pIndices ? 1 : 0);
+        for (uint32_t i = 0; pIndices && i < uNumShaders; ++i)
+            p.write_i64(pIndices[i]);
+        p.write_i64(uFlags);
+        p.write_i64(D3D4LINUX_FINISHED);
 
-            /* If this is the first run in this thread, then fork a new
-             * child process. */
-            if (pid < 0)
+        HRESULT ret = p.read_i64();
+        uint32_t total = (uint32_t)p.read_i64();
+        for (uint32_t i = 0; i < uNumShaders; ++i)
+            ppShaders[i] = p.read_blob();
+        int end = p.read_i64();
+        if (end != D3D4LINUX_FINISHED)
+        {
+            p.broken();
+            for (uint32_t i = 0; i < uNumShaders; ++i)
             {
-                pipe(pipe_read);
-                pipe(pipe_write);
+                if (ppShaders[i])
+                    ppShaders[i]->Release();
+                ppShaders[i] = nullptr;
+            }
+            return E_FAIL;
+        }
 
-                pid = fork();
+        if (pTotalShaders)
+            *pTotalShaders = total;
+        return ret;
+    }
 
-                if (pid == 0)
-                {
-                    dup2(pipe_write[0], STDIN_FILENO);
-                    dup2(pipe_read[1], STDOUT_FILENO);
+    //
+    // Run the DLL’s own preprocessor, so that callers can hash its exact
+    // output. The server asks us for every include file it needs, which
+    // we get from pInclude. D3D4LINUX_PREPROCESSOR=native uses our own
+    // preprocessor instead.
+    //
+    static HRESULT preprocess(int version,
+                              void const *pSrcData,
+                              size_t SrcDataSize,
+                              char const *pSourceName,
+                              D3D_SHADER_MACRO const *pDefines,
+                              ID3DInclude *pInclude,
+                              ID3DBlob **ppCodeText,
+                              ID3DBlob **ppErrorMsgs)
+    {
+        char const *preprocessor_var = getenv("D3D4LINUX_PREPROCESSOR");
+        if (preprocessor_var && !strcmp(preprocessor_var, "native"))
+            return native_preprocess(pSrcData, SrcDataSize, pSourceName,
+                                     pDefines, pInclude, ppCodeText,
+                                     ppErrorMsgs);
 
-                    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
-                    if (!verbose_var || *verbose_var != '1')
-                        dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+        *ppCodeText = nullptr;
+        if (ppErrorMsgs)
+            *ppErrorMsgs = nullptr;
 
-                    char const *exe_var = getenv("D3D4LINUX_EXE");
-                    if (!exe_var)
-                        exe_var = D3D4LINUX_EXE;
+        d3d4linux_capture::request capture;
+        server_lease p(D3D4LINUX_OP_PREPROCESS);
+        if (p.error())
+            return E_FAIL;
+        capture.attach(p);
 
-                    char const *wine_var = getenv("D3D4LINUX_WINE");
-                    if (!wine_var)
-                        wine_var = D3D4LINUX_WINE;
+        int64_t count = 0;
+        for (D3D_SHADER_MACRO const *m = pDefines; m && m->Name; ++m)
+            ++count;
 
-                    close(pipe_read[0]);
-                    close(pipe_read[1]);
-                    close(pipe_write[0]);
-                    close(pipe_write[1]);
+        p.write_i64(D3D4LINUX_OP_PREPROCESS);
+        p.write_i64(version);
+        p.write_i64(SrcDataSize);
+        p.write_raw(pSrcData, SrcDataSize);
+        p.write_i64(pSourceName ? 1 : 0);
+        if (pSourceName)
+            p.write_string(pSourceName);
+        p.write_i64(count);
+        for (int64_t i = 0; i < count; ++i)
+        {
+            p.write_string(pDefines[i].Name);
+            p.write_i64(pDefines[i].Definition ? 1 : 0);
+            if (pDefines[i].Definition)
+                p.write_string(pDefines[i].Definition);
+        }
+        p.write_i64(!pInclude ? 0 : pInclude == D3D_COMPILE_STANDARD_FILE_INCLUDE ? 1 : 2);
+        p.write_i64(D3D4LINUX_FINISHED);
 
-                    static char *const argv[] = { (char *)"wine", (char *)exe_var, 0 };
-                    execv(wine_var, argv);
-                    /* Never going past here */
+        /* Serve include requests until the result arrives; files are
+         * numbered in the order they were opened. */
+        std::vector<void const *> files;
+        int64_t op;
+        while ((op = p.read_i64()) == D3D4LINUX_OP_INCLUDE_OPEN
+                || op == D3D4LINUX_OP_INCLUDE_CLOSE)
+        {
+            if (op == D3D4LINUX_OP_INCLUDE_OPEN)
+            {
+                D3D_INCLUDE_TYPE type = (D3D_INCLUDE_TYPE)p.read_i64();
+                std::string name = p.read_string();
+                int64_t parent = p.read_i64();
+                if (p.read_i64() != D3D4LINUX_FINISHED)
+                {
+                    p.broken();
+                    return E_FAIL;
                 }
 
-                close(pipe_write[0]);
-                close(pipe_read[1]);
-
-                if (pid > 0)
+                void const *data = nullptr;
+                uint32_t bytes = 0;
+                HRESULT ret = pInclude->Open(type, name.c_str(),
+                                             parent >= 0 && parent < (int64_t)files.size()
+                                                 ? files[parent] : pSrcData,
+                                             &data, &bytes);
+                p.write_i64(ret);
+                if (SUCCEEDED(ret))
+                {
+                    p.write_i64(bytes);
+                    p.write_raw(data, bytes);
+                    files.push_back(data);
+                }
+                p.write_i64(D3D4LINUX_FINISHED);
+            }
+            else
+            {
+                int64_t id = p.read_i64();
+                if (p.read_i64() != D3D4LINUX_FINISHED)
+                {
+                    p.broken();
+                    return E_FAIL;
+                }
+                if (id >= 0 && id < (int64_t)files.size() && files[id])
                 {
-                    in = fdopen(pipe_read[0], "r");
-                    out = fdopen(pipe_write[1], "w");
+                    pInclude->Close(files[id]);
+                    files[id] = nullptr;
                 }
             }
+        }
 
-            m_pid = pid;
-            m_pipe_in = pipe_read[0];
-            m_pipe_out = pipe_write[1];
-            m_in = in;
-            m_out = out;
+        if (op != D3D4LINUX_OP_PREPROCESS)
+        {
+            p.broken();
+            return E_FAIL;
         }
 
-        ~fork_process()
+        HRESULT ret = p.read_i64();
+        ID3DBlob *text_blob = p.read_blob();
+        ID3DBlob *error_blob = p.read_blob();
+        if (p.read_i64() != D3D4LINUX_FINISHED)
         {
-            /* FIXME: we cannot close anything here since the child
-             * process is persistent across calls. */
-#if 0
-            if (m_pid > 0)
-            {
-                waitpid(m_pid, nullptr, 0);
-                fclose(m_in);
-                fclose(m_out);
-            }
+            p.broken();
+            if (text_blob)
+                text_blob->Release();
+            if (error_blob)
+                error_blob->Release();
+            return E_FAIL;
+        }
+
+        capture.finish(D3D4LINUX_OP_PREPROCESS, ret, text_blob, error_blob);
+        *ppCodeText = text_blob;
+        if (ppErrorMsgs)
+            *ppErrorMsgs = error_blob;
+        return ret;
+    }
+
+    static HRESULT native_preprocess(void const *pSrcData,
+                                     size_t SrcDataSize,
+                                     char const *pSourceName,
+                                     D3D_SHADER_MACRO const *pDefines,
+                                     ID3DInclude *pInclude,
+                                     ID3DBlob **ppCodeText,
+                                     ID3DBlob **ppErrorMsgs)
+    {
+        d3d4linux_preprocessor pp(pInclude);
+        for (D3D_SHADER_MACRO const *m = pDefines; m && m->Name; ++m)
+            pp.define(m->Name, m->Definition);
 
-            close(m_pipe_in);
-            close(m_pipe_out);
-#endif
+        std::string text;
+        bool ok = pp.run(pSrcData, SrcDataSize, pSourceName, text);
+
+        /* Like d3dcompiler, the text blob includes its terminating zero */
+        *ppCodeText = ok ? make_blob(text.c_str(), text.size() + 1) : nullptr;
+        if (ppErrorMsgs)
+            *ppErrorMsgs = pp.errors().empty() ? nullptr
+                         : make_blob(pp.errors().data(), pp.errors().size());
+        return ok ? S_OK : E_FAIL;
+    }
+
+    struct startup_stats
+    {
+        int servers, prefixes;
+        double average_msecs, max_msecs;
+    };
+
+    /* How many servers this process started, and how long they took */
+    static startup_stats server_startup()
+    {
+        server_pool::stats const &st = server_pool::get().spawn_stats();
+        int prefixes = wine_prefixes::get().count();
+        startup_stats ret;
+        ret.servers = st.spawns;
+        ret.prefixes = ret.servers < prefixes ? ret.servers : prefixes;
+        ret.average_msecs = ret.servers ? (double)st.total_msecs / ret.servers : 0.0;
+        ret.max_msecs = (double)st.max_msecs;
+        return ret;
+    }
+
+private:
+    static int getenv_int(char const *name, int default_value)
+    {
+        char const *var = getenv(name);
+        return var && *var ? atoi(var) : default_value;
+    }
+
+    static int default_priority()
+    {
+        static char const *names[] = { "interactive", "normal", "background" };
+        char const *var = getenv("D3D4LINUX_PRIORITY");
+        for (int i = 0; var && i < 3; ++i)
+            if (!strcmp(var, names[i]))
+                return i;
+        int ret = getenv_int("D3D4LINUX_PRIORITY", D3D4LINUX_PRIORITY);
+        return std::max(D3D4LINUX_PRIORITY_INTERACTIVE,
+                        std::min(ret, D3D4LINUX_PRIORITY_BACKGROUND));
+    }
+
+    static HRESULT reflect_remote(int version,
+                                  void const *pSrcData,
+                                  size_t SrcDataSize,
+                                  REFIID pInterface,
+                                  bool lazy,
+                                  std::vector<uint8_t> &snapshot,
+                                  d3d4linux_snapshot::source *&source)
+    {
+        d3d4linux_capture::request capture;
+        server_lease p(lazy ? D3D4LINUX_OP_REFLECT_OPEN : D3D4LINUX_OP_REFLECT);
+        if (p.error())
+            return E_FAIL;
+        capture.attach(p);
+
+        p.write_i64(lazy ? D3D4LINUX_OP_REFLECT_OPEN : D3D4LINUX_OP_REFLECT);
+        p.write_i64(version);
+        p.write_i64(SrcDataSize);
+        p.write_raw(pSrcData, SrcDataSize);
+        p.write_i64(pInterface);
+        p.write_i64(D3D4LINUX_FINISHED);
+
+        HRESULT ret = p.read_i64();
+
+        /* The reflection comes as one snapshot that we use as is; a lazy
+         * one only has the shader desc, and a handle for the rest */
+        int64_t handle = -1;
+        std::vector<uint8_t> *data = nullptr;
+        if (SUCCEEDED(ret) && pInterface == IID_ID3D11ShaderReflection)
+        {
+            handle = lazy ? p.read_i64() : 0;
+            data = p.read_data();
+            if (!d3d4linux_snapshot::valid(data))
+                ret = E_FAIL;
         }
 
-        bool error() const
+        int end = p.read_i64();
+        if (end != D3D4LINUX_FINISHED)
         {
-            return m_pid <= 0;
+            p.broken();
+            delete data;
+            return E_FAIL;
         }
 
-        ID3DBlob *read_blob()
+        if (SUCCEEDED(ret) && data)
         {
-            int len = read_i64();
-            if (len < 0)
-                return nullptr;
+            snapshot.swap(*data);
+            source = lazy ? new remote_reflector(version, p, handle) : nullptr;
+        }
+        delete data;
 
-            ID3DBlob *blob = new ID3DBlob(len);
-            read_raw(blob->GetBufferPointer(), len);
-            return blob;
+        capture.finish(D3D4LINUX_OP_REFLECT, ret, snapshot.data(),
+                       snapshot.empty() ? -1 : (int64_t)snapshot.size());
+        return ret;
+    }
+
+    static HRESULT compile_remote(int version,
+                                  void const *pSrcData,
+                                  size_t SrcDataSize,
+                                  char const *pFileName,
+                                  char const *pEntrypoint,
+                                  char const *pTarget,
+                                  uint32_t Flags1,
+                                  uint32_t Flags2,
+                                  d3d4linux_cost_model::shader const &shader,
+                                  ID3DBlob **ppCode,
+                                  ID3DBlob **ppErrorMsgs)
+    {
+        int steps = getenv_int("D3D4LINUX_COMPOSITE", D3D4LINUX_COMPOSITE);
+        uint32_t strip_flags = (uint32_t)getenv_int("D3D4LINUX_COMPOSITE_STRIP_FLAGS",
+                                                    D3D4LINUX_COMPOSITE_STRIP_FLAGS);
+        composite_memo &memo = composite_memo::get();
+        memo.clear();
+
+        d3d4linux_cost_model &model = d3d4linux_cost_model::get();
+        d3d4linux_capture::request capture;
+        server_lease p(D3D4LINUX_OP_COMPILE, model.predict(shader));
+        if (p.error())
+        {
+            static char const *error_msg = "Cannot fork in d3d4linux::compile()";
+            *ppCode = nullptr;
+            *ppErrorMsgs = new ID3DBlob(strlen(error_msg));
+            memcpy((*ppErrorMsgs)->GetBufferPointer(), error_msg, (*ppErrorMsgs)->GetBufferSize());
+            return E_FAIL;
         }
+        capture.attach(p);
 
-    private:
-        int m_pipe_in, m_pipe_out;
-        pid_t m_pid;
-    };
-};
+        write_compile(p, version, pSrcData, SrcDataSize, pFileName, pEntrypoint,
+                      pTarget, Flags1, Flags2, steps, strip_flags);
+
+        /* Only time the server, not the wait for it */
+        auto start = std::chrono::steady_clock::now();
+        p.write_i64(D3D4LINUX_FINISHED);
+
+        HRESULT ret = p.read_i64();
+        ID3DBlob *code_blob = p.read_blob();
+        ID3DBlob *error_blob = p.read_blob();
+        if (SUCCEEDED(ret) && code_blob)
+            memo.read(p, code_blob, steps, strip_flags);
+        int end = p.read_i64();
+        if (end != D3D4LINUX_FINISHED)
+        {
+            p.broken();
+            if (code_blob)
+                code_blob->Release();
+            if (error_blob)
+                error_blob->Release();
+            *ppCode = *ppErrorMsgs = nullptr;
+            return E_FAIL;
+        }
+        model.record(shader, std::chrono::duration<double, std::milli>(
+                                 std::chrono::steady_clock::now() - start).count());
+        capture.finish(D3D4LINUX_OP_COMPILE, ret, code_blob, error_blob);
+
+        *ppCode = code_blob;
+        *ppErrorMsgs = error_blob;
+        return ret;
+    }
+
+    //
+    // Defines and includes are not part of the protocol, so they are
+    // resolved here; the expanded source then also serves as the cache key,
+    // which is unaffected by comments or unused macros. On success, the
+    // source may now point into “expanded”.
+    //
+    static bool prepare(int version,
+                        void const *&pSrcData,
+                        size_t &SrcDataSize,
+                        char const *pFileName,
+                        D3D_SHADER_MACRO const *pDefines,
+                        ID3DInclude *pInclude,
+                        char const *pEntrypoint,
+                        char const *pTarget,
+                        uint32_t Flags1,
+                        uint32_t Flags2,
+                        std::string &expanded,
+                        std::string &key,
+                        ID3DBlob **ppErrorMsgs)
+    {
+        char const *preprocess_var = getenv("D3D4LINUX_PREPROCESS");
+        if (pDefines || pInclude || (preprocess_var && *preprocess_var == '1'))
+        {
+            d3d4linux_preprocessor pp(pInclude);
+            for (D3D_SHADER_MACRO const *m = pDefines; m && m->Name; ++m)
+                pp.define(m->Name, m->Definition);
+            if (!pp.run(pSrcData, SrcDataSize, pFileName, expanded))
+            {
+                *ppErrorMsgs = make_blob(pp.errors().data(), pp.errors().size());
+                return false;
+            }
+            pSrcData = expanded.data();
+            SrcDataSize = expanded.size();
+            pDefines = nullptr;
+        }
+
+        /* The key may ignore comments and layout; the compiler still gets
+         * the original text so that its messages point to the right place. */
+        std::string canonical;
+        if (getenv_int("D3D4LINUX_CANONICALIZE", D3D4LINUX_CANONICALIZE))
+            d3d4linux_preprocessor::canonicalize(pSrcData, SrcDataSize,
+                                                 Flags1 & D3DCOMPILE_DEBUG,
+                                                 canonical);
 
+        key = canonical.empty()
+            ? compile_key(version, pSrcData, SrcDataSize, pFileName, pDefines,
+                          pEntrypoint, pTarget, Flags1, Flags2)
+            : compile_key(version, canonical.data(), canonical.size(), pFileName,
+                          pDefines, pEntrypoint, pTarget, Flags1, Flags2);
+        return true;
+    }
+
+    /* Everything of a compile request but the end marker */
+    static void write_compile(interop &p,
+                              int version,
+                              void const *pSrcData,
+                              size_t SrcDataSize,
+                              char const *pFileName,
+                              char const *pEntrypoint,
+                              char const *pTarget,
+                              uint32_t Flags1,
+                              uint32_t Flags2,
+                              int steps,
+                              uint32_t strip_flags)
+    {
+        p.write_i64(D3D4LINUX_OP_COMPILE);
+        p.write_i64(version);
+        p.write_i64(SrcDataSize);
+        p.write_raw(pSrcData, SrcDataSize);
+        p.write_i64(pFileName ? 1 : 0);
+        if (pFileName)
+            p.write_string(pFileName);
+        p.write_string(pEntrypoint);
+        p.write_string(pTarget);
+        p.write_i64(Flags1);
+        p.write_i64(Flags2);
+        p.write_i64(steps);
+        p.write_i64(strip_flags);
+    }
+
+    //
+    // Build a key that uniquely identifies a compilation from all its
+    // inputs: each field is length-prefixed so that different inputs can
+    // never produce the same key.
+    //
+    static std::string compile_key(int version,
+                                   void const *pSrcData,
+                                   size_t SrcDataSize,
+                                   char const *pFileName,
+                                   D3D_SHADER_MACRO const *pDefines,
+                                   char const *pEntrypoint,
+                                   char const *pTarget,
+                                   uint32_t Flags1,
+                                   uint32_t Flags2)
+    {
+        std::string key;
+        auto add = [&key](void const *data, size_t len)
+        {
+            key.append((char const *)&len, sizeof(len));
+            key.append((char const *)data, len);
+        };
+        auto add_string = [&add](char const *str)
+        {
+            add(str ? str : "", str ? strlen(str) + 1 : 0);
+        };
+
+        /* The version alone does not tell which DLL will compile */
+        d3d4linux_cache::key dll = compiler_identity(version);
+        int64_t header[3] = { D3D4LINUX_OP_COMPILE, Flags1, Flags2 };
+        add(header, sizeof(header));
+        add(&dll, sizeof(dll));
+        add(pSrcData, SrcDataSize);
+        add_string(pFileName);
+        add_string(pEntrypoint);
+        add_string(pTarget);
+        for (D3D_SHADER_MACRO const *m = pDefines; m && m->Name; ++m)
+        {
+            add_string(m->Name);
+            add_string(m->Definition);
+        }
+        return key;
+    }
+
+    //
+    // Identify the DLL that servers use for a compiler version: the one
+    // in D3D4LINUX_DLL whose name has that version, or else the first one,
+    // just like find_compiler() in d3d4linux.cpp. This is a hash of the
+    // DLL file, found through the Wine prefix, so that machines with other
+    // builds of the same DLL do not share cache entries. If the file cannot
+    // be found from here, it is a hash of its name.
+    //
+    static d3d4linux_cache::key compiler_identity(int version)
+    {
+        static std::mutex mutex;
+        static std::map<int, d3d4linux_cache::key> known;
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = known.find(version);
+        if (it != known.end())
+            return it->second;
+
+        char const *dll_var = getenv("D3D4LINUX_DLL");
+        std::string list = dll_var ? dll_var : "d3dcompiler_47.dll";
+        std::string first, match;
+        for (size_t start = 0; start < list.size() && match.empty(); )
+        {
+            size_t end = std::min(list.find(';', start), list.size());
+            std::string name = list.substr(start, end - start);
+            start = end + 1;
+            if (name.empty())
+                continue;
+            size_t pos = name.find("d3dcompiler_");
+            int dll_version = pos != std::string::npos
+                            ? atoi(name.c_str() + pos + strlen("d3dcompiler_")) : 47;
+            if (first.empty())
+                first = name;
+            if (dll_version == version)
+                match = name;
+        }
+        std::string name = match.empty() ? first : match;
+
+        std::string data;
+        bool found = read_dll(name, data);
+        d3d4linux_cache::key ret = found ? d3d4linux_cache::hash(data.data(), data.size())
+                                         : d3d4linux_cache::hash(name.data(), name.size());
+        if (getenv_int("D3D4LINUX_VERBOSE", 0))
+            fprintf(stderr, "[D3D4LINUX] cache keys for version %d use %s%s\n", version,
+                    name.c_str(), found ? "" : " (by name only, file not found)");
+        return known[version] = ret;
+    }
+
+    /* Read a DLL given by its Windows path, the way Wine would find it */
+    static bool read_dll(std::string name, std::string &data)
+    {
+        std::replace(name.begin(), name.end(), '\\', '/');
+
+        char const *prefix_var = getenv("WINEPREFIX");
+        char const *home = getenv("HOME");
+        std::string prefix = prefix_var && *prefix_var ? prefix_var
+                           : std::string(home ? home : "") + "/.wine";
+
+        std::vector<std::string> paths;
+        if (name.size() > 2 && name[1] == ':')
+        {
+            /* Drives are symlinks in the prefix; Z: is the root by default */
+            std::string drive(1, (char)tolower(name[0]));
+            paths.push_back(prefix + "/dosdevices/" + drive + ":" + name.substr(2));
+            if (drive == "z")
+                paths.push_back(name.substr(2));
+        }
+        else if (name.find('/') == std::string::npos)
+        {
+            /* A bare name is looked up next to the server, then in system32 */
+            char const *exe_var = getenv("D3D4LINUX_EXE");
+            std::string exe = exe_var ? exe_var : D3D4LINUX_EXE;
+            paths.push_back(exe.substr(0, exe.rfind('/') + 1) + name);
+            paths.push_back(prefix + "/drive_c/windows/system32/" + name);
+        }
+
+        for (auto const &path : paths)
+        {
+            FILE *f = fopen(path.c_str(), "rb");
+            if (!f)
+                continue;
+            char buf[65536];
+            size_t n;
+            data.clear();
+            while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+                data.append(buf, n);
+            bool ok = !ferror(f);
+            fclose(f);
+            if (ok)
+                return true;
+        }
+        return false;
+    }
+
+    //
+    // Cached values are the code and error blobs, each prefixed with its
+    // length (or -1 for a null blob)
+    //
+    static std::string pack_blobs(ID3DBlob *code, ID3DBlob *errors)
+    {
+        std::string ret;
+        ID3DBlob *blobs[2] = { code, errors };
+        for (int i = 0; i < 2; ++i)
+        {
+            int64_t len = blobs[i] ? (int64_t)blobs[i]->GetBufferSize() : -1;
+            ret.append((char const *)&len, sizeof(len));
+            if (blobs[i])
+                ret.append((char const *)blobs[i]->GetBufferPointer(), len);
+        }
+        return ret;
+    }
+
+    static bool unpack_blobs(std::string const &value, ID3DBlob **ppCode,
+                             ID3DBlob **ppErrorMsgs)
+    {
+        ID3DBlob **blobs[2] = { ppCode, ppErrorMsgs };
+        size_t pos = 0;
+        for (int i = 0; i < 2; ++i)
+        {
+            int64_t len;
+            if (pos + sizeof(len) > value.size())
+                return false;
+            memcpy(&len, &value[pos], sizeof(len));
+            pos += sizeof(len);
+            if (len > (int64_t)(value.size() - pos))
+                return false;
+            *blobs[i] = len < 0 ? nullptr : new ID3DBlob(len);
+            if (len > 0)
+                memcpy((*blobs[i])->GetBufferPointer(), &value[pos], len);
+            pos += len < 0 ? 0 : len;
+        }
+        return pos == value.size();
+    }
+
+    //
+    // The result of a compilation, kept around long enough to be copied
+    // by the threads that were waiting for it
+    //
+    struct saved_blob
+    {
+        saved_blob() : m_valid(false) {}
+
+        void assign(ID3DBlob *blob)
+        {
+            m_valid = blob != nullptr;
+            if (blob)
+                m_data.assign((uint8_t const *)blob->GetBufferPointer(),
+                              (uint8_t const *)blob->GetBufferPointer() + blob->GetBufferSize());
+        }
+
+        ID3DBlob *copy() const
+        {
+            if (!m_valid)
+                return nullptr;
+            ID3DBlob *blob = new ID3DBlob(m_data.size());
+            memcpy(blob->GetBufferPointer(), m_data.data(), m_data.size());
+            return blob;
+        }
+
+        bool m_valid;
+        std::vector<uint8_t> m_data;
+    };
+
+    struct flight
+    {
+        flight() : m_done(false), m_waiters(0), m_ret(E_FAIL) {}
+
+        bool m_done;
+        int m_waiters;
+        HRESULT m_ret;
+        saved_blob m_code, m_errors;
+        std::condition_variable m_cond;
+    };
+
+    //
+    // Compilations currently in progress in this process
+    //
+    struct flight_table
+    {
+        static flight_table &get()
+        {
+            static flight_table *table = new flight_table();
+            return *table;
+        }
+
+        std::mutex m_mutex;
+        std::map<std::string, std::shared_ptr<flight>> m_flights;
+    };
+
+    //
+    // A d3d4linux.exe process running under Wine, and the pipes we use
+    // to talk to it. These are owned by the server pool below and are
+    // persistent across calls.
+    //
+    struct fork_process
+    {
+    public:
+        /* Run the server in the given Wine prefix, or in the one from the
+         * environment if empty */
+        explicit fork_process(std::string const &prefix = std::string())
+          : m_pid(-1),
+            m_in(nullptr),
+            m_out(nullptr)
+        {
+            int pipe_read[2], pipe_write[2];
+
+            /* Use close-on-exec pipes so that other servers spawned later
+             * do not inherit them; otherwise they would keep our pipes
+             * open and the server would never see EOF when reaped. */
+            if (pipe2(pipe_read, O_CLOEXEC) < 0)
+                return;
+            if (pipe2(pipe_write, O_CLOEXEC) < 0)
+            {
+                close(pipe_read[0]);
+                close(pipe_read[1]);
+                return;
+            }
+
+            /* Only call async-signal-safe functions in the child */
+            char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+            bool verbose = verbose_var && *verbose_var == '1';
+
+            char const *exe_var = getenv("D3D4LINUX_EXE");
+            if (!exe_var)
+                exe_var = D3D4LINUX_EXE;
+
+            char const *wine_var = getenv("D3D4LINUX_WINE");
+            if (!wine_var)
+                wine_var = D3D4LINUX_WINE;
+
+            char *const argv[] = { (char *)"wine", (char *)exe_var, 0 };
+
+            /* Servers need neither Mono nor Gecko, nor Wine's debug
+             * messages, unless asked otherwise */
+            std::vector<std::string> env;
+            for (char **e = environ; *e; ++e)
+                if (prefix.empty() || strncmp(*e, "WINEPREFIX=", 11) != 0)
+                    env.push_back(*e);
+            if (!prefix.empty())
+                env.push_back("WINEPREFIX=" + prefix);
+            if (!getenv("WINEDLLOVERRIDES"))
+                env.push_back("WINEDLLOVERRIDES=mscoree,mshtml=");
+            if (!getenv("WINEDEBUG") && !verbose)
+                env.push_back("WINEDEBUG=-all");
+            std::vector<char *> envp;
+            for (auto &e : env)
+                envp.push_back(&e[0]);
+            envp.push_back(nullptr);
+
+            m_pid = fork();
+
+            if (m_pid == 0)
+            {
+                dup2(pipe_write[0], STDIN_FILENO);
+                dup2(pipe_read[1], STDOUT_FILENO);
+
+                if (!verbose)
+                    dup2(open("/dev/null", O_WRONLY), STDERR_FILENO);
+
+                execve(wine_var, argv, envp.data());
+                _exit(EXIT_FAILURE);
+            }
+
+            close(pipe_write[0]);
+            close(pipe_read[1]);
+
+            if (m_pid > 0)
+            {
+                m_in = fdopen(pipe_read[0], "r");
+                m_out = fdopen(pipe_write[1], "w");
+            }
+            else
+            {
+                close(pipe_read[0]);
+                close(pipe_write[1]);
+            }
+        }
+
+        ~fork_process()
+        {
+            /* Closing the server’s stdin makes it exit its main loop */
+            if (m_out)
+                fclose(m_out);
+            if (m_in)
+                fclose(m_in);
+            if (m_pid > 0)
+                waitpid(m_pid, nullptr, 0);
+        }
+
+        bool error() const
+        {
+            return m_pid <= 0 || !m_in || !m_out;
+        }
+
+        /* Block until the server has loaded its DLLs, which it tells by
+         * sending a lone end marker */
+        bool wait_ready()
+        {
+            int64_t marker = 0;
+            return !error() && fread(&marker, sizeof(marker), 1, m_in) == 1
+                    && marker == D3D4LINUX_FINISHED;
+        }
+
+        pid_t m_pid;
+        FILE *m_in, *m_out;
+    };
+
+    //
+    // The Wine prefixes that servers run in. All Wine processes of a prefix
+    // share one wineserver, which handles their system calls one at a
+    // time; with many servers, D3D4LINUX_PREFIXES spreads them over several
+    // prefixes, and thus several wineservers. These prefixes are copies of
+    // D3D4LINUX_PREFIX_TEMPLATE, made once and then only read, which is much
+    // faster than having Wine create or update them.
+    //
+    struct wine_prefixes
+    {
+        static wine_prefixes &get()
+        {
+            static wine_prefixes *prefixes = new wine_prefixes();
+            return *prefixes;
+        }
+
+        wine_prefixes()
+        {
+            int count = getenv_int("D3D4LINUX_PREFIXES", D3D4LINUX_PREFIXES);
+            m_count = count > 0 ? count : 1;
+
+            char const *template_var = getenv("D3D4LINUX_PREFIX_TEMPLATE");
+            m_template = template_var ? template_var : D3D4LINUX_PREFIX_TEMPLATE;
+
+            /* With one prefix and no template, keep the user’s prefix */
+            if (m_count == 1 && m_template.empty())
+                return;
+
+            char const *dir_var = getenv("D3D4LINUX_PREFIX_DIR");
+            m_dir = dir_var ? dir_var : D3D4LINUX_PREFIX_DIR;
+            if (m_dir.empty())
+            {
+                char const *tmp = getenv("TMPDIR");
+                m_dir = std::string(tmp && *tmp ? tmp : "/tmp")
+                      + "/d3d4linux-" + std::to_string(getuid());
+            }
+            m_ready.assign(m_count, false);
+        }
+
+        int count() const
+        {
+            return m_count;
+        }
+
+        /* Prefix for the server in a given pool slot, created if needed;
+         * empty if servers should use the prefix from the environment */
+        std::string path(int slot)
+        {
+            if (m_dir.empty())
+                return std::string();
+
+            int shard = slot % m_count;
+            std::string path = m_dir + "/prefix-" + std::to_string(shard);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_ready[shard])
+                return path;
+
+            /* Another process may be copying the same prefix, so copy to a
+             * private directory and rename it; the loser deletes its copy. */
+            struct stat st;
+            mkdir(m_dir.c_str(), 0700);
+            if (stat(path.c_str(), &st) != 0 && !m_template.empty())
+            {
+                std::string tmp = path + "." + std::to_string(getpid());
+                char const *cp[] = { "cp", "-a", "--reflink=auto",
+                                     m_template.c_str(), tmp.c_str(), nullptr };
+                char const *rm[] = { "rm", "-rf", tmp.c_str(), nullptr };
+                if (!run("/bin/cp", cp) || rename(tmp.c_str(), path.c_str()) != 0)
+                    run("/bin/rm", rm);
+            }
+
+            /* Without a template, Wine creates the prefix on first use */
+            m_ready[shard] = true;
+            return path;
+        }
+
+    private:
+        static bool run(char const *file, char const *argv[])
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                execv(file, (char *const *)argv);
+                _exit(EXIT_FAILURE);
+            }
+            int status = 0;
+            return pid > 0 && waitpid(pid, &status, 0) == pid
+                    && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        }
+
+        int m_count;
+        std::string m_template, m_dir;
+        std::vector<bool> m_ready;
+        std::mutex m_mutex;
+    };
+
+    //
+    // Process-wide pool of servers. Any thread may borrow any idle server;
+    // borrowing and returning a server is a lock-free CAS on its slot. The
+    // mutex and condition variable are only used to park threads while all
+    // servers are busy. Parked threads get servers by priority lane first
+    // (see priority()), then, between client processes sharing the pool
+    // through tools/daemon, to the one holding the fewest servers, then in
+    // order of decreasing predicted cost (see d3d4linux_cost.h), so that
+    // the longest requests do not end up last. Requests are never
+    // interrupted: a lane takes over at the next release. Background
+    // requests leave D3D4LINUX_RESERVED servers to the others, so that an
+    // interactive request finds one without waiting for a whole batch.
+    // Servers are spawned lazily up to the configured size, and a
+    // background thread reaps the ones that stay idle for too long.
+    //
+    struct server_pool
+    {
+        enum { EMPTY, IDLE, BUSY };
+
+        struct slot
+        {
+            slot()
+              : state(EMPTY), last_used(0), generation(0), pins(0),
+                requests(0), pid(0), retiring(false), process(nullptr), spare(nullptr),
+                lane(D3D4LINUX_PRIORITY_NORMAL), owner(0)
+            {}
+
+            std::atomic<int> state;
+            std::atomic<int64_t> last_used;
+            /* Bumped for each new process; pins are lazy reflectors that
+             * live in the current one */
+            std::atomic<uint64_t> generation;
+            std::atomic<int> pins;
+            /* Requests served by the current process, its pid, and whether
+             * it is due to be replaced with the spare */
+            std::atomic<int> requests;
+            std::atomic<pid_t> pid;
+            std::atomic<bool> retiring;
+            fork_process *process;
+            std::atomic<fork_process *> spare;
+            /* Who is using the server, while it is busy */
+            std::atomic<int> lane, owner;
+        };
+
+        /* A queued request */
+        struct ticket
+        {
+            int lane;
+            double cost;
+            uint64_t seq;
+            int owner;
+
+            /* Most urgent lane, then longest predicted, then oldest */
+            bool operator <(ticket const &that) const
+            {
+                if (lane != that.lane)
+                    return lane < that.lane;
+                if (cost != that.cost)
+                    return cost > that.cost;
+                return seq < that.seq;
+            }
+        };
+
+        static server_pool &get()
+        {
+            /* Never destroyed: the reaper thread may outlive main() */
+            static server_pool *pool = new server_pool();
+            return *pool;
+        }
+
+        server_pool()
+          : m_waiters(0),
+            m_queued(0),
+            m_running(0),
+            m_version(0),
+            m_tickets(0),
+            m_next_version(-1)
+        {
+            char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+            m_verbose = verbose_var && *verbose_var == '1';
+
+            int size = getenv_int("D3D4LINUX_SERVERS", D3D4LINUX_SERVERS);
+            if (size <= 0)
+                size = (int)std::thread::hardware_concurrency();
+            m_size = size > 0 ? size : 1;
+            m_slots = new slot[m_size];
+
+            /* Background requests may not take every server */
+            int reserved = getenv_int("D3D4LINUX_RESERVED", D3D4LINUX_RESERVED);
+            m_reserved = std::max(0, std::min(reserved, m_size - 1));
+
+            m_idle_timeout = getenv_int("D3D4LINUX_IDLE_TIMEOUT", D3D4LINUX_IDLE_TIMEOUT);
+            if (m_idle_timeout > 0)
+                std::thread(&server_pool::reaper, this).detach();
+
+            m_max_requests = getenv_int("D3D4LINUX_MAX_REQUESTS", D3D4LINUX_MAX_REQUESTS);
+            m_max_rss = getenv_int("D3D4LINUX_MAX_RSS", D3D4LINUX_MAX_RSS);
+            if (m_max_requests > 0 || m_max_rss > 0)
+                std::thread(&server_pool::recycler, this).detach();
+        }
+
+        /* Return the index of a busy slot that now belongs to the caller,
+         * or -1 if no server could be spawned. The cost is the predicted
+         * duration of the request, the lane its priority, and the owner
+         * the client process it comes from, if it is not ours. */
+        int acquire(double cost = 0, int lane = D3D4LINUX_PRIORITY_NORMAL, int owner = 0)
+        {
+            for (;;)
+            {
+                /* Idle servers go to queued requests first */
+                int index = m_queued.load() == 0 ? try_acquire_idle(lane) : -1;
+                if (index >= 0)
+                    return grant(index, lane, owner);
+
+                /* No idle server: spawn one in an empty slot if possible */
+                index = try_spawn(lane);
+                if (index != NO_SLOT)
+                    return index >= 0 ? grant(index, lane, owner) : -1;
+
+                /* All servers are busy, or all that this lane may use; queue
+                 * up until ours is the next ticket and a server is idle. The
+                 * waiter count is raised before rescanning so that release()
+                 * cannot miss us. */
+                std::unique_lock<std::mutex> lock(m_mutex);
+                auto it = m_queue.insert(ticket { lane, cost, m_tickets++, owner }).first;
+                ++m_version;
+                ++m_queued;
+                ++m_waiters;
+                for (;;)
+                {
+                    if (it == next())
+                    {
+                        index = try_acquire_idle(lane);
+                        /* The reaper may have made room for a new server */
+                        if (index >= 0 || (has_empty() && may_use(lane)))
+                            break;
+                    }
+                    m_cond.wait_for(lock, std::chrono::milliseconds(100));
+                }
+                m_queue.erase(it);
+                ++m_version;
+                --m_queued;
+                --m_waiters;
+
+                /* Let the next in line have a look */
+                m_cond.notify_all();
+                if (index >= 0)
+                    return grant(index, lane, owner);
+            }
+        }
+
+        /* Borrow the server in a given slot, waiting for it if needed, as
+         * long as it is still the process of the given generation */
+        int acquire(int index, uint64_t generation)
+        {
+            slot &s = m_slots[index];
+            for (;;)
+            {
+                int expected = IDLE;
+                if (s.state.compare_exchange_strong(expected, BUSY))
+                {
+                    if (s.generation.load() == generation)
+                        return index;
+                    release(index, true);
+                    return -1;
+                }
+                if (expected == EMPTY || s.generation.load() != generation)
+                    return -1;
+
+                std::unique_lock<std::mutex> lock(m_mutex);
+                ++m_waiters;
+                if (s.state.load() == BUSY)
+                    m_cond.wait_for(lock, std::chrono::milliseconds(100));
+                --m_waiters;
+            }
+        }
+
+        struct stats
+        {
+            stats() : spawns(0), recycles(0), failures(0), total_msecs(0), max_msecs(0) {}
+
+            std::atomic<int> spawns, recycles, failures;
+            std::atomic<int64_t> total_msecs, max_msecs;
+        };
+
+        /* How many servers were started, and how long they took; how many
+         * were replaced by a spare, and how many were lost */
+        stats const &spawn_stats() const
+        {
+            return m_stats;
+        }
+
+        struct usage
+        {
+            int size, busy, idle, spares;
+            int queued[D3D4LINUX_PRIORITY_BACKGROUND + 1];
+        };
+
+        /* What the servers are doing right now, and who waits for them */
+        usage current_usage()
+        {
+            usage ret;
+            memset(&ret, 0, sizeof(ret));
+            ret.size = m_size;
+            for (int i = 0; i < m_size; ++i)
+            {
+                int state = m_slots[i].state.load();
+                ret.busy += state == BUSY;
+                ret.idle += state == IDLE;
+                ret.spares += m_slots[i].spare.load() != nullptr;
+            }
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            for (ticket const &t : m_queue)
+                ++ret.queued[t.lane];
+            return ret;
+        }
+
+        uint64_t generation(int index) const
+        {
+            return m_slots[index].generation.load();
+        }
+
+        void pin(int index, int count)
+        {
+            m_slots[index].pins += count;
+        }
+
+        void release(int index, bool healthy)
+        {
+            slot &s = m_slots[index];
+            if (!healthy)
+            {
+                /* A spare, if any, will take its place at the next spawn */
+                ++m_stats.failures;
+                delete s.process;
+                s.process = nullptr;
+                --m_running;
+                s.state.store(EMPTY);
+            }
+            else
+            {
+                if (m_max_requests > 0 && ++s.requests >= m_max_requests)
+                    retire(index, "requests");
+                if (s.retiring.load() && s.pins.load() == 0)
+                    swap_spare(index);
+                s.last_used.store(d3d4linux_sys::now());
+                s.state.store(IDLE);
+            }
+            ++m_version;
+
+            /* Wake everyone, since some waiters only want this very slot */
+            if (m_waiters.load() > 0)
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_cond.notify_all();
+            }
+        }
+
+        fork_process *process(int index) const
+        {
+            return m_slots[index].process;
+        }
+
+    private:
+        enum { NO_SLOT = -2 };
+
+        int grant(int index, int lane, int owner)
+        {
+            m_slots[index].lane.store(lane);
+            m_slots[index].owner.store(owner);
+            ++m_version;
+            return index;
+        }
+
+        /* Whether a request of that lane may take one more server */
+        bool may_use(int lane) const
+        {
+            if (lane < D3D4LINUX_PRIORITY_BACKGROUND || m_reserved == 0)
+                return true;
+            int background = 0;
+            for (int i = 0; i < m_size; ++i)
+                if (m_slots[i].state.load() == BUSY
+                     && m_slots[i].lane.load() >= D3D4LINUX_PRIORITY_BACKGROUND)
+                    ++background;
+            return background < m_size - m_reserved;
+        }
+
+        /* The queued ticket that gets the next server: the best of the
+         * most urgent lane, except that a client process holding fewer
+         * servers than the others goes first. Called with the mutex held;
+         * the result is kept until the queue or the slots change. */
+        std::set<ticket>::iterator next()
+        {
+            if (m_next_version == m_version.load())
+                return m_next;
+            m_next_version = m_version.load();
+            m_next = m_queue.begin();
+            if (m_next == m_queue.end())
+                return m_next;
+
+            m_owners.clear();
+            for (int i = 0; i < m_size; ++i)
+                if (m_slots[i].state.load() == BUSY)
+                    m_owners.push_back(m_slots[i].owner.load());
+            std::sort(m_owners.begin(), m_owners.end());
+
+            auto held = [this](int owner)
+            {
+                auto range = std::equal_range(m_owners.begin(), m_owners.end(), owner);
+                return range.second - range.first;
+            };
+
+            auto best = held(m_next->owner);
+            for (auto it = m_next; best > 0 && it != m_queue.end()
+                                    && it->lane == m_next->lane; ++it)
+            {
+                auto count = held(it->owner);
+                if (count < best)
+                {
+                    m_next = it;
+                    best = count;
+                }
+            }
+            return m_next;
+        }
+
+        int try_acquire_idle(int lane)
+        {
+            if (!may_use(lane))
+                return -1;
+            for (int i = 0; i < m_size; ++i)
+            {
+                int expected = IDLE;
+                if (m_slots[i].state.load() == IDLE
+                     && m_slots[i].state.compare_exchange_strong(expected, BUSY))
+                    return i;
+            }
+            return -1;
+        }
+
+        /* Return the slot of a new server, -1 if it could not be spawned,
+         * or NO_SLOT if there was no room for it */
+        int try_spawn(int lane)
+        {
+            if (!may_use(lane))
+                return NO_SLOT;
+            for (int i = 0; i < m_size; ++i)
+            {
+                int expected = EMPTY;
+                if (m_slots[i].state.load() == EMPTY
+                     && m_slots[i].state.compare_exchange_strong(expected, BUSY))
+                {
+                    fork_process *process = m_slots[i].spare.exchange(nullptr);
+                    if (!process)
+                        process = spawn(i);
+                    if (!process)
+                    {
+                        m_slots[i].state.store(EMPTY);
+                        return -1;
+                    }
+                    install(i, process);
+                    return i;
+                }
+            }
+            return NO_SLOT;
+        }
+
+        /* Start a server for a slot and wait until it is ready */
+        fork_process *spawn(int index)
+        {
+            wine_prefixes &prefixes = wine_prefixes::get();
+            std::string prefix = prefixes.path(index);
+
+            int64_t start = d3d4linux_sys::now();
+            fork_process *process = new fork_process(prefix);
+            if (!process->wait_ready())
+            {
+                delete process;
+                return nullptr;
+            }
+
+            /* Startup time tells how well Wine copes with the number of
+             * servers per prefix */
+            int64_t elapsed = d3d4linux_sys::now() - start;
+            ++m_stats.spawns;
+            m_stats.total_msecs += elapsed;
+            int64_t max = m_stats.max_msecs.load();
+            while (elapsed > max && !m_stats.max_msecs.compare_exchange_weak(max, elapsed))
+                ;
+            if (m_verbose)
+                fprintf(stderr, "[D3D4LINUX] server %d ready in %d ms (prefix %d/%d, %d running)\n",
+                        index, (int)elapsed, index % prefixes.count(), prefixes.count(),
+                        m_running.load());
+            return process;
+        }
+
+        /* Make a process the server of a slot that the caller owns */
+        void install(int index, fork_process *process)
+        {
+            slot &s = m_slots[index];
+            s.process = process;
+            s.pid.store(process->m_pid);
+            s.requests.store(0);
+            s.retiring.store(false);
+            s.generation.fetch_add(1);
+            ++m_running;
+        }
+
+        //
+        // Recycling: d3dcompiler and Wine leak memory, so a server that
+        // served D3D4LINUX_MAX_REQUESTS requests or grew above
+        // D3D4LINUX_MAX_RSS is retired. The recycler thread starts a spare
+        // server for its slot, which takes over as soon as the slot is
+        // idle and no lazy reflector lives in the old server; the old one
+        // then exits in the background, so that requests never wait.
+        //
+        void retire(int index, char const *reason)
+        {
+            slot &s = m_slots[index];
+            if (s.retiring.exchange(true))
+                return;
+            if (m_verbose)
+                fprintf(stderr, "[D3D4LINUX] retiring server %d (%s)\n", index, reason);
+            std::lock_guard<std::mutex> lock(m_recycle_mutex);
+            m_recycle_cond.notify_one();
+        }
+
+        /* Replace the server of a slot that the caller owns with its spare */
+        void swap_spare(int index)
+        {
+            slot &s = m_slots[index];
+            fork_process *spare = s.spare.exchange(nullptr);
+            if (!spare)
+                return;
+
+            std::lock_guard<std::mutex> lock(m_recycle_mutex);
+            m_graveyard.push_back(s.process);
+            ++m_stats.recycles;
+            --m_running;
+            install(index, spare);
+            m_recycle_cond.notify_one();
+        }
+
+        void recycler()
+        {
+            for (;;)
+            {
+                for (int i = 0; i < m_size; ++i)
+                {
+                    slot &s = m_slots[i];
+                    if (m_max_rss > 0 && s.state.load() != EMPTY && !s.retiring.load()
+                         && resident_mib(s.pid.load()) > m_max_rss)
+                        retire(i, "memory");
+                    if (!s.retiring.load())
+                        continue;
+
+                    /* If no spare can be started, try again later */
+                    if (!s.spare.load())
+                    {
+                        fork_process *spare = spawn(i);
+                        if (!spare)
+                        {
+                            s.retiring.store(false);
+                            continue;
+                        }
+                        s.spare.store(spare);
+                    }
+
+                    /* Idle servers are not released, so swap them here */
+                    int expected = IDLE;
+                    if (s.pins.load() == 0 && s.state.load() == IDLE
+                         && s.state.compare_exchange_strong(expected, BUSY))
+                    {
+                        if (s.retiring.load())
+                            swap_spare(i);
+                        s.state.store(IDLE);
+                    }
+                }
+
+                /* Closing the old servers’ stdin makes them exit */
+                std::unique_lock<std::mutex> lock(m_recycle_mutex);
+                while (!m_graveyard.empty())
+                {
+                    std::vector<fork_process *> dead;
+                    dead.swap(m_graveyard);
+                    lock.unlock();
+                    for (fork_process *process : dead)
+                        delete process;
+                    lock.lock();
+                }
+                m_recycle_cond.wait_for(lock, std::chrono::seconds(1));
+            }
+        }
+
+        static int resident_mib(pid_t pid)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/proc/%d/statm", (int)pid);
+            FILE *f = pid > 0 ? fopen(name, "r") : nullptr;
+            if (!f)
+                return 0;
+            long size = 0, resident = 0;
+            int n = fscanf(f, "%ld %ld", &size, &resident);
+            fclose(f);
+            return n == 2 ? (int)((int64_t)resident * sysconf(_SC_PAGESIZE) >> 20) : 0;
+        }
+
+        bool has_empty() const
+        {
+            for (int i = 0; i < m_size; ++i)
+                if (m_slots[i].state.load() == EMPTY)
+                    return true;
+            return false;
+        }
+
+        void reaper()
+        {
+            int64_t timeout = (int64_t)m_idle_timeout * 1000;
+            for (;;)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout / 4 + 1));
+
+                for (int i = 0; i < m_size; ++i)
+                {
+                    slot &s = m_slots[i];
+                    int expected = IDLE;
+                    if (s.state.load() == IDLE && s.pins.load() == 0
+                         && d3d4linux_sys::now() - s.last_used.load() >= timeout
+                         && s.state.compare_exchange_strong(expected, BUSY))
+                    {
+                        delete s.process;
+                        delete s.spare.exchange(nullptr);
+                        s.process = nullptr;
+                        --m_running;
+                        s.state.store(EMPTY);
+                    }
+                }
+            }
+        }
+
+        int m_size, m_reserved, m_idle_timeout, m_max_requests, m_max_rss;
+        bool m_verbose;
+        slot *m_slots;
+        std::atomic<int> m_waiters, m_queued, m_running;
+        /* Bumped whenever the queue or a slot changes hands */
+        std::atomic<int64_t> m_version;
+        stats m_stats;
+        std::set<ticket> m_queue;
+        uint64_t m_tickets;
+        /* What next() found, and the owners of busy slots, kept sorted */
+        std::set<ticket>::iterator m_next;
+        int64_t m_next_version;
+        std::vector<int> m_owners;
+        /* Retired servers, waiting for the recycler to delete them */
+        std::vector<fork_process *> m_graveyard;
+        std::mutex m_recycle_mutex;
+        std::condition_variable m_recycle_cond;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+    };
+
+    //
+    // Client side of the GNU make jobserver. When running under make -jN,
+    // every request takes a job token before it is dispatched to a server,
+    // so that shader compilation shares the machine fairly with the rest
+    // of the build. Like any make child we own one implicit token, which
+    // is handed out first.
+    //
+    struct jobserver
+    {
+        enum { NONE = -1, BUSY = -2, IMPLICIT = 256 };
+
+        static jobserver &get()
+        {
+            static jobserver *js = new jobserver();
+            return *js;
+        }
+
+        jobserver()
+          : m_read(-1),
+            m_write(-1),
+            m_implicit_used(false)
+        {
+            char const *enable_var = getenv("D3D4LINUX_JOBSERVER");
+            char const *flags = getenv("MAKEFLAGS");
+            if ((enable_var && *enable_var == '0') || !flags)
+                return;
+
+            /* GNU make 4.4 passes a named pipe, older versions a pair of
+             * inherited file descriptors. Only the last option counts. */
+            std::string makeflags(flags), auth;
+            char const *options[] = { "--jobserver-auth=", "--jobserver-fds=" };
+            for (int i = 0; i < 2 && auth.empty(); ++i)
+            {
+                size_t pos = makeflags.rfind(options[i]);
+                if (pos != std::string::npos)
+                {
+                    pos += strlen(options[i]);
+                    auth = makeflags.substr(pos, makeflags.find(' ', pos) - pos);
+                }
+            }
+
+            /* Tokens are read without blocking, so that waiting threads
+             * also notice when our implicit token comes back */
+            if (auth.compare(0, 5, "fifo:") == 0)
+            {
+                m_read = open(auth.c_str() + 5, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+                m_write = m_read < 0 ? -1 : open(auth.c_str() + 5, O_WRONLY | O_CLOEXEC);
+                if (m_write < 0 && m_read >= 0)
+                {
+                    close(m_read);
+                    m_read = -1;
+                }
+            }
+            else if (sscanf(auth.c_str(), "%d,%d", &m_read, &m_write) == 2)
+            {
+                /* make does not pass the pipe to recipes that it does not
+                 * consider recursive; the descriptors are then invalid. */
+                if (fcntl(m_read, F_GETFD) < 0 || fcntl(m_write, F_GETFD) < 0)
+                    m_read = m_write = -1;
+                else
+                {
+                    /* Keep our servers from inheriting the pipe */
+                    fcntl(m_read, F_SETFD, FD_CLOEXEC);
+                    fcntl(m_write, F_SETFD, FD_CLOEXEC);
+
+                    /* The pipe is shared with make, which may not expect
+                     * it to be non-blocking; reopen our own end instead */
+                    char path[64];
+                    snprintf(path, sizeof(path), "/proc/self/fd/%d", m_read);
+                    int fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+                    if (fd >= 0)
+                        m_read = fd;
+                }
+            }
+            else
+                m_read = m_write = -1;
+        }
+
+        /* Block until a job token is available and return it */
+        int acquire()
+        {
+            if (m_read < 0)
+                return NONE;
+
+            for (;;)
+            {
+                if (!m_implicit_used.exchange(true))
+                    return IMPLICIT;
+
+                /* Wake up regularly in case our implicit token came back;
+                 * poll first in case the descriptor is still blocking */
+                pollfd pfd = { m_read, POLLIN, 0 };
+                if (poll(&pfd, 1, 100) <= 0)
+                    continue;
+
+                unsigned char token;
+                ssize_t n = read(m_read, &token, 1);
+                if (n == 1)
+                    return token;
+                if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                    return NONE;
+            }
+        }
+
+        /* Return a job token if one is available right now, BUSY if
+         * not, or NONE if tokens are not needed */
+        int try_acquire()
+        {
+            if (m_read < 0)
+                return NONE;
+            if (!m_implicit_used.exchange(true))
+                return IMPLICIT;
+
+            pollfd pfd = { m_read, POLLIN, 0 };
+            if (poll(&pfd, 1, 0) <= 0)
+                return BUSY;
+            unsigned char token;
+            ssize_t n = read(m_read, &token, 1);
+            if (n == 1)
+                return token;
+            return n == 0 || (errno != EAGAIN && errno != EINTR) ? NONE : BUSY;
+        }
+
+        /* Readable when make may have a token for us */
+        int fd() const
+        {
+            return m_read;
+        }
+
+        void release(int token)
+        {
+            if (token == IMPLICIT)
+                m_implicit_used.store(false);
+            else if (token >= 0)
+            {
+                unsigned char ch = (unsigned char)token;
+                while (write(m_write, &ch, 1) < 0 && errno == EINTR)
+                    ;
+            }
+        }
+
+    private:
+        int m_read, m_write;
+        std::atomic<bool> m_implicit_used;
+    };
+
+    //
+    // Client of tools/daemon, which shares one server pool between all the
+    // processes of a machine, with fair share between them. A lease is a
+    // connection to the daemon: it sends the lane and cost of the request,
+    // and gets back the pipes of a server, over which the request then
+    // goes directly; closing the lease gives the server back. Connections
+    // are kept for the next leases. Our cache statistics go along with
+    // each release, and when the process exits, for the daemon’s metrics.
+    //
+    struct daemon_client
+    {
+        static daemon_client &get()
+        {
+            static daemon_client *client = new daemon_client();
+            return *client;
+        }
+
+        daemon_client()
+        {
+            char const *path_var = getenv("D3D4LINUX_DAEMON");
+            m_path = path_var ? path_var : D3D4LINUX_DAEMON;
+            char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+            m_verbose = verbose_var && *verbose_var == '1';
+            memset(m_reported, 0, sizeof(m_reported));
+            if (enabled())
+                atexit([]() { get().report_exit(); });
+        }
+
+        bool enabled() const
+        {
+            return !m_path.empty();
+        }
+
+        /* Borrow a server for a request; return the connection that holds
+         * it, or -1 if the daemon could not be reached or had no server */
+        int acquire(int op, double cost, int lane, FILE *&in, FILE *&out)
+        {
+            int fd = connection();
+            if (fd < 0)
+                return -1;
+
+            /* The cost goes in microseconds */
+            int64_t request[4] = { D3D4LINUX_OP_DAEMON_ACQUIRE, lane, (int64_t)(cost * 1e3), op };
+            int64_t ret = E_FAIL;
+            int fds[2];
+            if (!d3d4linux_sys::send_all(fd, request, sizeof(request)) || !receive(fd, ret, fds))
+            {
+                close(fd);
+                return -1;
+            }
+            if (FAILED(ret))
+            {
+                recycle(fd);
+                return -1;
+            }
+
+            in = fdopen(fds[0], "r");
+            out = fdopen(fds[1], "w");
+            if (in && out)
+                return fd;
+
+            if (in)
+                fclose(in);
+            else
+                close(fds[0]);
+            if (out)
+                fclose(out);
+            else
+                close(fds[1]);
+            in = out = nullptr;
+            release(fd, false);
+            return -1;
+        }
+
+        void release(int fd, bool healthy)
+        {
+            int64_t request[2] = { D3D4LINUX_OP_DAEMON_RELEASE, healthy };
+            if (d3d4linux_sys::send_all(fd, request, sizeof(request)) && report(fd))
+                recycle(fd);
+            else
+                close(fd);
+        }
+
+    private:
+        /* Send the cache lookups made since the last report */
+        bool report(int fd)
+        {
+            d3d4linux_cache::stats const &st = d3d4linux_cache::get().lookup_stats();
+            int64_t request[4] = { D3D4LINUX_OP_DAEMON_REPORT };
+            int64_t current[3] = { st.local_hits.load(), st.remote_hits.load(),
+                                   st.misses.load() };
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                for (int i = 0; i < 3; ++i)
+                {
+                    request[i + 1] = current[i] - m_reported[i];
+                    m_reported[i] = current[i];
+                }
+            }
+            if (!request[1] && !request[2] && !request[3])
+                return true;
+            return d3d4linux_sys::send_all(fd, request, sizeof(request));
+        }
+
+        void report_exit()
+        {
+            int fd = connection();
+            if (fd >= 0)
+            {
+                report(fd);
+                close(fd);
+            }
+        }
+
+        int connection()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_free.empty())
+                {
+                    int fd = m_free.back();
+                    m_free.pop_back();
+                    return fd;
+                }
+            }
+
+            sockaddr_un addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, m_path.c_str(), sizeof(addr.sun_path) - 1);
+            int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+            if (fd >= 0 && connect(fd, (sockaddr const *)&addr, sizeof(addr)) == 0)
+                return fd;
+
+            if (m_verbose)
+                fprintf(stderr, "[D3D4LINUX] cannot reach daemon at %s: %s\n",
+                        m_path.c_str(), strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            return -1;
+        }
+
+        void recycle(int fd)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(fd);
+        }
+
+        /* The result comes with the server’s stdout and stdin, unless it
+         * failed */
+        static bool receive(int fd, int64_t &ret, int fds[2])
+        {
+            char control[CMSG_SPACE(2 * sizeof(int))];
+            iovec iov = { &ret, sizeof(ret) };
+            msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_iov = &iov;
+            msg.msg_iovlen = 1;
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+
+            ssize_t n;
+            while ((n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+                ;
+            if (n != (ssize_t)sizeof(ret))
+                return false;
+
+            cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+            if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+                 || cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+                return FAILED(ret);
+            memcpy(fds, CMSG_DATA(cmsg), 2 * sizeof(int));
+            return true;
+        }
+
+        std::string m_path;
+        bool m_verbose;
+        std::vector<int> m_free;
+        int64_t m_reported[3];
+        std::mutex m_mutex;
+    };
+
+    //
+    // A server borrowed from the pool for the duration of one request, or
+    // from the daemon if there is one
+    //
+    struct server_lease : interop
+    {
+    public:
+        /* The op is that of the request, for the daemon’s metrics; the
+         * cost is its predicted duration */
+        explicit server_lease(int op, double cost = 0)
+          : interop(nullptr, nullptr),
+            m_token(jobserver::get().acquire()),
+            m_index(-1),
+            m_daemon(-1),
+            m_desync(false)
+        {
+            /* Without a daemon to talk to, use our own servers */
+            daemon_client &daemon = daemon_client::get();
+            if (daemon.enabled())
+                m_daemon = daemon.acquire(op, cost, priority(), m_in, m_out);
+            if (m_daemon < 0)
+            {
+                m_index = server_pool::get().acquire(cost, priority());
+                attach();
+            }
+        }
+
+        /* Lease the very server that an earlier lease had */
+        server_lease(int index, uint64_t generation)
+          : interop(nullptr, nullptr),
+            m_token(jobserver::get().acquire()),
+            m_index(server_pool::get().acquire(index, generation)),
+            m_daemon(-1),
+            m_desync(false)
+        {
+            attach();
+        }
+
+        ~server_lease()
+        {
+            /* A server that hung up, sent a short reply or a reply we did
+             * not expect is out of sync with us; do not hand it to anyone
+             * else. */
+            bool healthy = m_in && m_out && !ferror(m_in) && !feof(m_in) && !ferror(m_out)
+                        && !m_desync;
+            if (m_daemon >= 0)
+            {
+                fclose(m_in);
+                fclose(m_out);
+                daemon_client::get().release(m_daemon, healthy);
+            }
+            else if (m_index >= 0)
+                server_pool::get().release(m_index, healthy);
+            jobserver::get().release(m_token);
+        }
+
+        bool error() const
+        {
+            return m_index < 0 && m_daemon < 0;
+        }
+
+        int index() const
+        {
+            return m_index;
+        }
+
+        /* The reply did not end where it should have: the stream may look
+         * fine, but the rest of it is garbage */
+        void broken()
+        {
+            m_desync = true;
+        }
+
+        ID3DBlob *read_blob()
+        {
+            int len = read_i64();
+            if (len < 0)
+                return nullptr;
+
+            ID3DBlob *blob = new ID3DBlob(len);
+            read_raw(blob->GetBufferPointer(), len);
+            return blob;
+        }
+
+    private:
+        void attach()
+        {
+            if (m_index >= 0)
+            {
+                fork_process *process = server_pool::get().process(m_index);
+                m_in = process->m_in;
+                m_out = process->m_out;
+            }
+        }
+
+        int m_token, m_index, m_daemon;
+        bool m_desync;
+    };
+
+    //
+    // What the server computed from the bytecode of the last compilation
+    // on this thread, on top of compiling it; see D3D4LINUX_COMPOSITE.
+    // Only one compilation is kept, since the calls that use it usually
+    // come right after it.
+    //
+    struct composite_memo
+    {
+        struct result
+        {
+            HRESULT ret;
+            bool has_data;
+            std::string data;
+        };
+
+        composite_memo() : m_strip_flags(0), m_steps(0) {}
+
+        static composite_memo &get()
+        {
+            static thread_local composite_memo memo;
+            return memo;
+        }
+
+        void clear()
+        {
+            m_steps = 0;
+            m_code.clear();
+        }
+
+        /* The steps in the order the server sends their results */
+        static int step(int i)
+        {
+            return i == 0 ? D3D4LINUX_COMPOSITE_REFLECT
+                 : i == 1 ? D3D4LINUX_COMPOSITE_STRIP : D3D4LINUX_COMPOSITE_DISASSEMBLE;
+        }
+
+        void read(server_lease &p, ID3DBlob *code, int steps, uint32_t strip_flags)
+        {
+            result results[3] = {};
+            for (int i = 0; i < 3; ++i)
+            {
+                if (!(steps & step(i)))
+                    continue;
+
+                results[i].ret = p.read_i64();
+                ID3DBlob *blob = p.read_blob();
+                results[i].has_data = blob != nullptr;
+                results[i].data.assign(blob ? (char const *)blob->GetBufferPointer() : "",
+                                       blob ? blob->GetBufferSize() : 0);
+                delete blob;
+            }
+            assign(code, steps, strip_flags, results);
+        }
+
+        /* Keep results that were read elsewhere, e.g. by d3d4linux_async */
+        void assign(ID3DBlob *code, int steps, uint32_t strip_flags, result const *results)
+        {
+            m_steps = steps;
+            m_strip_flags = strip_flags;
+            m_code.assign((char const *)code->GetBufferPointer(), code->GetBufferSize());
+            for (int i = 0; i < 3; ++i)
+                m_results[i] = results[i];
+        }
+
+        result const *find(int step, void const *code, size_t size) const
+        {
+            if (!(m_steps & step) || size != m_code.size() || memcmp(code, m_code.data(), size))
+                return nullptr;
+            return &m_results[step == D3D4LINUX_COMPOSITE_REFLECT ? 0
+                              : step == D3D4LINUX_COMPOSITE_STRIP ? 1 : 2];
+        }
+
+        uint32_t m_strip_flags;
+
+    private:
+        int m_steps;
+        std::string m_code;
+        result m_results[3];
+    };
+
+    //
+    // A reflector kept by the server, for lazy reflection. The server is
+    // pinned so that the reaper leaves it alone; if it goes away anyway,
+    // queries fail and the reflector only knows its shader desc.
+    //
+    struct remote_reflector : d3d4linux_snapshot::source
+    {
+        remote_reflector(int version, server_lease const &lease, int64_t handle)
+          : m_version(version),
+            m_index(lease.index()),
+            m_generation(server_pool::get().generation(lease.index())),
+            m_handle(handle)
+        {
+            server_pool::get().pin(m_index, 1);
+        }
+
+        ~remote_reflector()
+        {
+            {
+                server_lease p(m_index, m_generation);
+                if (!p.error())
+                {
+                    p.write_i64(D3D4LINUX_OP_REFLECT_CLOSE);
+                    p.write_i64(m_version);
+                    p.write_i64(m_handle);
+                    p.write_i64(D3D4LINUX_FINISHED);
+                }
+            }
+            server_pool::get().pin(m_index, -1);
+        }
+
+        virtual bool fetch(int64_t query, int64_t &index, char const *name,
+                           std::vector<uint8_t> &out)
+        {
+            server_lease p(m_index, m_generation);
+            if (p.error())
+                return false;
+
+            p.write_i64(D3D4LINUX_OP_REFLECT_QUERY);
+            p.write_i64(m_version);
+            p.write_i64(m_handle);
+            p.write_i64(query);
+            p.write_i64(index);
+            p.write_string(name);
+            p.write_i64(D3D4LINUX_FINISHED);
+
+            HRESULT ret = p.read_i64();
+            std::vector<uint8_t> *part = nullptr;
+            if (SUCCEEDED(ret))
+            {
+                index = p.read_i64();
+                part = p.read_data();
+            }
+
+            int64_t end = p.read_i64();
+            if (end != D3D4LINUX_FINISHED)
+                p.broken();
+            bool ok = end == D3D4LINUX_FINISHED && d3d4linux_snapshot::valid(part);
+            if (ok)
+                out.swap(*part);
+            delete part;
+            return ok;
+        }
+
+    private:
+        int m_version, m_index;
+        uint64_t m_generation;
+        int64_t m_handle;
+    };
+};
@@ -0,0 +1,209 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint32_t */
+#include <cstring> /* for memcpy() */
+
+#include <string> /* for std::string */
+#include <vector> /* for std::vector */
+
+#include <d3d4linux_dxbc.h>
+
+//
+// What the full client (d3d4linux_impl.h) and the shared library shim
+// (d3d4linux_shim.h) have in common: the entry points that never need a
+// server, and the entry point table built on top of the struct d3d4linux
+// they belong to.
+//
+struct d3d4linux_native
+{
+    static HRESULT create_blob(size_t Size,
+                               ID3DBlob **ppBlob)
+    {
+        *ppBlob = new ID3DBlob(Size);
+        return S_OK;
+    }
+
+    //
+    // Blob parts are plain DXBC container surgery, so there is no need
+    // to bother the server with them.
+    //
+    static HRESULT get_blob_part(void const *pSrcData,
+                                 size_t SrcDataSize,
+                                 D3D_BLOB_PART Part,
+                                 uint32_t Flags,
+                                 ID3DBlob **ppPart)
+    {
+        std::string part;
+        HRESULT ret = d3d4linux_dxbc::get_part(pSrcData, SrcDataSize,
+                                               Part, Flags, part);
+        *ppPart = SUCCEEDED(ret) ? make_blob(part.data(), part.size()) : nullptr;
+        return ret;
+    }
+
+    static HRESULT set_blob_part(void const *pSrcData,
+                                 size_t SrcDataSize,
+                                 D3D_BLOB_PART Part,
+                                 uint32_t Flags,
+                                 void const *pPart,
+                                 size_t PartSize,
+                                 ID3DBlob **ppNewShader)
+    {
+        std::string shader;
+        HRESULT ret = d3d4linux_dxbc::set_part(pSrcData, SrcDataSize, Part,
+                                               Flags, pPart, PartSize, shader);
+        *ppNewShader = SUCCEEDED(ret) ? make_blob(shader.data(), shader.size()) : nullptr;
+        return ret;
+    }
+
+    //
+    // So are shader libraries, which are cabinet files; they are written
+    // and read in the DLL's format (see d3d4linux_dxbc.h), on all cores.
+    //
+    static HRESULT compress_shaders(uint32_t uNumShaders,
+                                    D3D_SHADER_DATA *pShaderData,
+                                    uint32_t uFlags,
+                                    ID3DBlob **ppCompressedData)
+    {
+        std::string library;
+        HRESULT ret = d3d4linux_dxbc::compress_shaders(pShaderData, uNumShaders,
+                                                       uFlags, library);
+        *ppCompressedData = SUCCEEDED(ret) ? make_blob(library.data(), library.size()) : nullptr;
+        return ret;
+    }
+
+    static HRESULT decompress_shaders(void const *pSrcData,
+                                      size_t SrcDataSize,
+                                      uint32_t uNumShaders,
+                                      uint32_t uStartIndex,
+                                      uint32_t *pIndices,
+                                      uint32_t uFlags,
+                                      ID3DBlob **ppShaders,
+                                      uint32_t *pTotalShaders)
+    {
+        std::vector<std::string> shaders;
+        HRESULT ret = d3d4linux_dxbc::decompress_shaders(pSrcData, SrcDataSize, uNumShaders,
+                                                         uStartIndex, pIndices, uFlags,
+                                                         shaders, pTotalShaders);
+        for (uint32_t i = 0; i < uNumShaders; ++i)
+            ppShaders[i] = shaders[i].empty() ? nullptr
+                         : make_blob(shaders[i].data(), shaders[i].size());
+        return ret;
+    }
+
+protected:
+    static ID3DBlob *make_blob(void const *data, size_t size)
+    {
+        ID3DBlob *blob = new ID3DBlob(size);
+        memcpy(blob->GetBufferPointer(), data, size);
+        return blob;
+    }
+};
+
+//
+// Entry points for a given compiler DLL version; these are what
+// GetProcAddress() returns for a LoadLibrary() handle. Version 0
+// means whatever DLL was loaded last.
+//
+template<typename T, int V> struct d3d4linux_versioned
+{
+    static HRESULT compile(void const *pSrcData,
+                           size_t SrcDataSize,
+                           char const *pFileName,
+                           D3D_SHADER_MACRO const *pDefines,
+                           ID3DInclude *pInclude,
+                           char const *pEntrypoint,
+                           char const *pTarget,
+                           uint32_t Flags1,
+                           uint32_t Flags2,
+                           ID3DBlob **ppCode,
+                           ID3DBlob **ppErrorMsgs)
+    {
+        return T::compile(V ? V : T::compiler_version(),
+                          pSrcData, SrcDataSize, pFileName,
+                          pDefines, pInclude, pEntrypoint,
+                          pTarget, Flags1, Flags2, ppCode,
+                          ppErrorMsgs);
+    }
+
+    static HRESULT reflect(void const *pSrcData,
+                           size_t SrcDataSize,
+                           REFIID pInterface,
+                           void **ppReflector)
+    {
+        return T::reflect(V ? V : T::compiler_version(),
+                          pSrcData, SrcDataSize, pInterface,
+                          ppReflector);
+    }
+
+    static HRESULT strip_shader(void const *pShaderBytecode,
+                                size_t BytecodeLength,
+                                uint32_t uStripFlags,
+                                ID3DBlob **ppStrippedBlob)
+    {
+        return T::strip_shader(V ? V : T::compiler_version(),
+                               pShaderBytecode, BytecodeLength,
+                               uStripFlags, ppStrippedBlob);
+    }
+
+    static HRESULT disassemble(void const *pSrcData,
+                               size_t SrcDataSize,
+                               uint32_t Flags,
+                               char const *szComments,
+                               ID3DBlob **ppDisassembly)
+    {
+        return T::disassemble(V ? V : T::compiler_version(),
+                              pSrcData, SrcDataSize, Flags,
+                              szComments, ppDisassembly);
+    }
+
+    static HRESULT preprocess(void const *pSrcData,
+                              size_t SrcDataSize,
+                              char const *pSourceName,
+                              D3D_SHADER_MACRO const *pDefines,
+                              ID3DInclude *pInclude,
+                              ID3DBlob **ppCodeText,
+                              ID3DBlob **ppErrorMsgs)
+    {
+        return T::preprocess(V ? V : T::compiler_version(),
+                             pSrcData, SrcDataSize, pSourceName,
+                             pDefines, pInclude, ppCodeText,
+                             ppErrorMsgs);
+    }
+
+    static void *proc_address(char const *name)
+    {
+        if (!strcmp(name, "D3DCompile"))
+            return (void *)&compile;
+        if (!strcmp(name, "D3DReflect"))
+            return (void *)&reflect;
+        if (!strcmp(name, "D3DDisassemble"))
+            return (void *)&disassemble;
+        if (!strcmp(name, "D3DStripShader"))
+            return (void *)&strip_shader;
+        if (!strcmp(name, "D3DCreateBlob"))
+            return (void *)&T::create_blob;
+        if (!strcmp(name, "D3DPreprocess"))
+            return (void *)&preprocess;
+        if (!strcmp(name, "D3DGetBlobPart"))
+            return (void *)&T::get_blob_part;
+        if (!strcmp(name, "D3DSetBlobPart"))
+            return (void *)&T::set_blob_part;
+        if (!strcmp(name, "D3DCompressShaders"))
+            return (void *)&T::compress_shaders;
+        if (!strcmp(name, "D3DDecompressShaders"))
+            return (void *)&T::decompress_shaders;
+        return nullptr;
+    }
+};
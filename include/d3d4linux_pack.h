@@ -0,0 +1,725 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint64_t */
+#include <cstdio> /* for snprintf() */
+#include <cstring> /* for memcpy() */
+#include <ctime> /* for time() */
+
+#include <unistd.h> /* for close() */
+#include <dirent.h> /* for opendir() */
+#include <fcntl.h> /* for open() */
+#include <sys/file.h> /* for flock() */
+#include <sys/mman.h> /* for mmap() */
+#include <sys/stat.h> /* for fstat() */
+
+#include <algorithm> /* for std::min() */
+#include <atomic> /* for std::atomic */
+#include <chrono> /* for std::chrono */
+#include <map> /* for std::map */
+#include <memory> /* for std::shared_ptr */
+#include <mutex> /* for std::mutex */
+#include <string> /* for std::string */
+#include <thread> /* for std::thread */
+#include <vector> /* for std::vector */
+
+//
+// Local disk tier of the compile cache: a directory that holds
+//
+//   index         an open-addressing hash table of all entries
+//   pack-XXXXXXXX append-only files of compressed records
+//   lock          taken with flock() by whoever modifies the above
+//
+// Both the index and the packs are accessed through mmap(), so lookups
+// need no system call once the files are mapped. Records repeat their
+// key in a small header, so a reader can tell a stale or torn entry from
+// a valid one. All integers are little endian, and nothing depends on
+// where the directory lives: it can be copied to another machine as is.
+//
+// Every slot remembers when it was last read. Once the packs exceed the
+// byte budget, a background thread compacts the store: it copies the
+// most recently used entries to new packs, renames a new index over the
+// old one, and deletes the old packs. Processes still reading the old
+// index notice it was retired and remap; their existing pack mappings
+// remain valid after the files are unlinked.
+//
+struct d3d4linux_pack
+{
+    d3d4linux_pack(std::string const &dir, uint64_t budget)
+      : m_dir(dir),
+        m_budget(budget),
+        m_compacting(std::make_shared<std::atomic<bool>>(false)),
+        m_lock_fd(-1),
+        m_index(nullptr),
+        m_index_size(0),
+        m_append_fd(-1),
+        m_append_pack(0)
+    {}
+
+    ~d3d4linux_pack()
+    {
+        unmap_index();
+        for (auto &p : m_packs)
+            munmap(p.second.first, p.second.second);
+        if (m_append_fd >= 0)
+            close(m_append_fd);
+        if (m_lock_fd >= 0)
+            close(m_lock_fd);
+    }
+
+    bool open()
+    {
+        if (!attach())
+            return false;
+
+        /* The budget may have been lowered since last time */
+        std::lock_guard<std::mutex> lock(m_mutex);
+        maybe_compact();
+        return true;
+    }
+
+    bool attach()
+    {
+        mkdir(m_dir.c_str(), 0777);
+        m_lock_fd = ::open((m_dir + "/lock").c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (m_lock_fd < 0)
+            return false;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (map_index())
+            return true;
+
+        /* No usable index yet: create one under the lock */
+        flock(m_lock_fd, LOCK_EX);
+        bool ok = map_index() || (write_index(INITIAL_CAPACITY, 0, std::vector<slot>()) && map_index());
+        flock(m_lock_fd, LOCK_UN);
+        return ok;
+    }
+
+    bool get(uint64_t h1, uint64_t h2, std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_index || (__atomic_load_n(&m_index->retired, __ATOMIC_ACQUIRE) && !map_index()))
+            return false;
+
+        slot *s = find(m_index, h1, h2);
+        if (!s || s->h1 == 0)
+            return false;
+
+        /* Minute resolution is enough, and spares most page writes */
+        uint32_t now = minutes();
+        if (__atomic_load_n(&s->atime, __ATOMIC_RELAXED) != now)
+            __atomic_store_n(&s->atime, now, __ATOMIC_RELAXED);
+
+        uint8_t const *data = pack_data(s->pack, s->offset, s->size);
+        if (!data)
+            return false;
+
+        /* Check the record header in case the index outlived its pack;
+         * records are not aligned, hence the copy */
+        record r;
+        memcpy(&r, data - sizeof(record), sizeof(r));
+        if (r.magic != RECORD_MAGIC || r.h1 != h1 || r.h2 != h2
+             || r.size != s->size || r.raw_size != s->raw_size)
+            return false;
+
+        value.resize(s->raw_size);
+        if (r.codec == CODEC_STORED)
+        {
+            memcpy(&value[0], data, s->size);
+            return true;
+        }
+        return decompress(data, s->size, (uint8_t *)&value[0], s->raw_size);
+    }
+
+    void put(uint64_t h1, uint64_t h2, std::string const &value)
+    {
+        /* The all-zero key marks empty slots */
+        if ((h1 | h2) == 0 || value.size() > 0xffffffffu)
+            return;
+
+        std::string packed;
+        bool compressed = compress((uint8_t const *)value.data(), value.size(), packed)
+                           && packed.size() < value.size();
+
+        record r;
+        r.magic = RECORD_MAGIC;
+        r.codec = compressed ? CODEC_LZ : CODEC_STORED;
+        r.raw_size = (uint32_t)value.size();
+        r.size = (uint32_t)(compressed ? packed.size() : value.size());
+        r.h1 = h1;
+        r.h2 = h2;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (!m_index)
+            return;
+
+        /* Writing to the cache is best effort: rather than wait for a
+         * long compaction to finish, drop the entry. */
+        if (!lock_store())
+            return;
+        if (__atomic_load_n(&m_index->retired, __ATOMIC_ACQUIRE))
+            map_index();
+
+        slot *s = m_index ? find(m_index, h1, h2) : nullptr;
+        if (s && s->h1 == 0)
+        {
+            int64_t offset = append(r, compressed ? packed.data() : value.data());
+            if (offset >= 0)
+            {
+                s->pack = m_append_pack;
+                s->offset = (uint64_t)offset;
+                s->size = r.size;
+                s->raw_size = r.raw_size;
+                s->atime = minutes();
+                /* Publish the key last; readers test h1 first */
+                __atomic_store_n(&s->h2, h2, __ATOMIC_RELEASE);
+                __atomic_store_n(&s->h1, h1, __ATOMIC_RELEASE);
+                ++m_index->count;
+                m_index->bytes += sizeof(record) + r.size;
+
+                if (m_index->count * 4 >= m_index->capacity * 3)
+                    grow();
+            }
+        }
+        flock(m_lock_fd, LOCK_UN);
+        maybe_compact();
+    }
+
+    //
+    // Keep the most recently used entries that fit in 3/4 of the budget,
+    // so that compactions do not follow each other too closely
+    //
+    void compact()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        flock(m_lock_fd, LOCK_EX);
+        if (m_index && __atomic_load_n(&m_index->retired, __ATOMIC_ACQUIRE))
+            map_index();
+
+        /* Someone else may have compacted while we waited for the lock */
+        if (!m_index || !m_budget || m_index->bytes <= m_budget)
+        {
+            flock(m_lock_fd, LOCK_UN);
+            return;
+        }
+
+        std::vector<slot> live;
+        for (uint32_t i = 0; i < m_index->capacity; ++i)
+            if (slots(m_index)[i].h1)
+                live.push_back(slots(m_index)[i]);
+        std::sort(live.begin(), live.end(), [](slot const &a, slot const &b)
+        {
+            return a.atime > b.atime;
+        });
+
+        uint64_t kept_bytes = 0;
+        size_t kept = 0;
+        while (kept < live.size()
+                && kept_bytes + sizeof(record) + live[kept].size <= m_budget / 4 * 3)
+            kept_bytes += sizeof(record) + live[kept++].size;
+        live.resize(kept);
+
+        /* Copy the survivors to brand new packs; pack ids are never
+         * reused, so no reader can confuse old and new records. */
+        uint32_t first = m_index->pack + 1, id = first;
+        int fd = -1;
+        uint64_t end = 0;
+        bool ok = true;
+        for (size_t i = 0; i < live.size() && ok; ++i)
+        {
+            slot &sl = live[i];
+            uint8_t const *data = pack_data(sl.pack, sl.offset, sl.size);
+            if (!data)
+            {
+                sl.h1 = 0; /* lost record, forget it */
+                continue;
+            }
+
+            if (fd >= 0 && end + sizeof(record) + sl.size > PACK_SIZE)
+            {
+                close(fd);
+                fd = -1;
+                ++id;
+            }
+            if (fd < 0)
+            {
+                fd = ::open(pack_name(id).c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+                end = 0;
+                ok = fd >= 0;
+            }
+
+            size_t len = sizeof(record) + sl.size;
+            ok = ok && pwrite(fd, data - sizeof(record), len, end) == (ssize_t)len;
+            sl.pack = id;
+            sl.offset = end + sizeof(record);
+            end += len;
+        }
+        if (fd >= 0)
+            close(fd);
+
+        live.erase(std::remove_if(live.begin(), live.end(),
+                                  [](slot const &sl) { return sl.h1 == 0; }),
+                   live.end());
+
+        uint32_t capacity = INITIAL_CAPACITY;
+        while (capacity < live.size() * 2)
+            capacity *= 2;
+
+        if (ok && write_index(capacity, id, live))
+        {
+            __atomic_store_n(&m_index->retired, 1, __ATOMIC_RELEASE);
+            map_index();
+            remove_packs(first);
+        }
+        else
+            remove_packs(0, first);
+
+        flock(m_lock_fd, LOCK_UN);
+    }
+
+    //
+    // A byte-oriented LZ77 codec in the spirit of LZ4: every sequence is a
+    // token (literal count and match length nibbles), the literals, then a
+    // 16-bit match offset. Counts of 15 or more continue in extra bytes.
+    //
+    static bool compress(uint8_t const *src, size_t size, std::string &out)
+    {
+        enum { HASH_BITS = 12, MIN_MATCH = 4 };
+        uint32_t table[1 << HASH_BITS];
+        memset(table, 0xff, sizeof(table));
+
+        out.clear();
+        out.reserve(size + size / 255 + 16);
+
+        size_t pos = 0, anchor = 0;
+        while (size >= MIN_MATCH && pos + MIN_MATCH <= size)
+        {
+            uint32_t seq;
+            memcpy(&seq, src + pos, 4);
+            uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+            uint32_t ref = table[h];
+            table[h] = (uint32_t)pos;
+
+            if (ref == 0xffffffffu || pos - ref > 0xffff
+                 || memcmp(src + ref, src + pos, MIN_MATCH) != 0)
+            {
+                ++pos;
+                continue;
+            }
+
+            size_t len = MIN_MATCH;
+            while (pos + len < size && src[ref + len] == src[pos + len])
+                ++len;
+
+            emit(out, src + anchor, pos - anchor, (uint32_t)(pos - ref), len);
+            pos += len;
+            anchor = pos;
+        }
+
+        emit(out, src + anchor, size - anchor, 0, 0);
+        return true;
+    }
+
+    static bool decompress(uint8_t const *src, size_t size, uint8_t *dst, size_t dst_size)
+    {
+        uint8_t const *end = src + size;
+        size_t pos = 0;
+
+        while (src < end)
+        {
+            uint8_t token = *src++;
+            size_t literals = token >> 4;
+            if (literals == 15 && !read_count(src, end, literals))
+                return false;
+            if (literals > (size_t)(end - src) || literals > dst_size - pos)
+                return false;
+            memcpy(dst + pos, src, literals);
+            src += literals;
+            pos += literals;
+
+            /* The last sequence has no match */
+            if (src == end)
+                break;
+
+            if (end - src < 2)
+                return false;
+            size_t offset = src[0] | (src[1] << 8);
+            src += 2;
+            size_t len = token & 15;
+            if (len == 15 && !read_count(src, end, len))
+                return false;
+            len += 4;
+            if (offset == 0 || offset > pos || len > dst_size - pos)
+                return false;
+
+            /* Overlapping copies are how runs are encoded */
+            for (size_t i = 0; i < len; ++i, ++pos)
+                dst[pos] = dst[pos - offset];
+        }
+
+        return pos == dst_size;
+    }
+
+private:
+    enum : uint32_t
+    {
+        INDEX_MAGIC = 0x494c3444, /* "D4LI" */
+        INDEX_VERSION = 1,
+        LOCK_ATTEMPTS = 100,
+        RECORD_MAGIC = 0x524c3444, /* "D4LR" */
+        CODEC_STORED = 0,
+        CODEC_LZ = 1,
+        INITIAL_CAPACITY = 1 << 16,
+        PACK_SIZE = 64 << 20,
+    };
+
+    struct header
+    {
+        uint32_t magic, version;
+        uint32_t capacity, count;
+        uint32_t retired, pack;
+        uint64_t bytes;
+    };
+
+    struct slot
+    {
+        uint64_t h1, h2;
+        uint32_t pack, size;
+        uint64_t offset;
+        uint32_t raw_size, atime;
+    };
+
+    struct record
+    {
+        uint32_t magic, codec;
+        uint32_t raw_size, size;
+        uint64_t h1, h2;
+    };
+
+    static slot *slots(header *h)
+    {
+        return (slot *)(h + 1);
+    }
+
+    //
+    // Return the slot holding the key, or the empty slot where it belongs
+    //
+    static slot *find(header *h, uint64_t h1, uint64_t h2)
+    {
+        uint32_t mask = h->capacity - 1;
+        for (uint32_t i = 0; i <= mask; ++i)
+        {
+            slot *s = slots(h) + ((h1 + i) & mask);
+            uint64_t k1 = __atomic_load_n(&s->h1, __ATOMIC_ACQUIRE);
+            if (k1 == 0 || (k1 == h1 && __atomic_load_n(&s->h2, __ATOMIC_ACQUIRE) == h2))
+                return s;
+        }
+        return nullptr;
+    }
+
+    std::string pack_name(uint32_t id) const
+    {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "/pack-%08x", id);
+        return m_dir + buf;
+    }
+
+    static uint32_t minutes()
+    {
+        return (uint32_t)(time(nullptr) / 60);
+    }
+
+    bool lock_store()
+    {
+        for (uint32_t i = 0; i < LOCK_ATTEMPTS; ++i)
+        {
+            if (flock(m_lock_fd, LOCK_EX | LOCK_NB) == 0)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    //
+    // Compact in a background thread, through a separate instance so that
+    // lookups from this process are not blocked meanwhile. Called with
+    // m_mutex held.
+    //
+    void maybe_compact()
+    {
+        if (!m_budget || !m_index || m_index->bytes <= m_budget || m_compacting->exchange(true))
+            return;
+
+        std::string dir = m_dir;
+        uint64_t budget = m_budget;
+        std::shared_ptr<std::atomic<bool>> compacting = m_compacting;
+        std::thread([dir, budget, compacting]()
+        {
+            d3d4linux_pack p(dir, budget);
+            if (p.attach())
+                p.compact();
+            *compacting = false;
+        }).detach();
+    }
+
+    //
+    // Delete the packs whose ids are outside [first, last)
+    //
+    void remove_packs(uint32_t first, uint32_t last = 0xffffffffu)
+    {
+        DIR *d = opendir(m_dir.c_str());
+        if (!d)
+            return;
+        for (dirent *e = readdir(d); e; e = readdir(d))
+        {
+            unsigned int id;
+            char tail;
+            if (sscanf(e->d_name, "pack-%8x%c", &id, &tail) == 1
+                 && (id < first || id >= last))
+                unlink((m_dir + "/" + e->d_name).c_str());
+        }
+        closedir(d);
+    }
+
+    bool map_index()
+    {
+        unmap_index();
+
+        /* Packs may have been compacted away; map them again lazily */
+        for (auto &p : m_packs)
+            munmap(p.second.first, p.second.second);
+        m_packs.clear();
+
+        int fd = ::open((m_dir + "/index").c_str(), O_RDWR | O_CLOEXEC);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(header))
+        {
+            if (fd >= 0)
+                close(fd);
+            return false;
+        }
+
+        void *p = mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED)
+            return false;
+
+        header *h = (header *)p;
+        if (h->magic != INDEX_MAGIC || h->version != INDEX_VERSION
+             || h->capacity == 0 || (h->capacity & (h->capacity - 1))
+             || sizeof(header) + (size_t)h->capacity * sizeof(slot) > (size_t)st.st_size)
+        {
+            munmap(p, st.st_size);
+            return false;
+        }
+
+        m_index = h;
+        m_index_size = st.st_size;
+        return true;
+    }
+
+    void unmap_index()
+    {
+        if (m_index)
+            munmap(m_index, m_index_size);
+        m_index = nullptr;
+        m_index_size = 0;
+    }
+
+    //
+    // Write a new index with the given entries and atomically replace the
+    // old one; callers then tell its readers to remap. Called with the
+    // lock held.
+    //
+    bool write_index(uint32_t capacity, uint32_t pack, std::vector<slot> const &entries)
+    {
+        std::string tmp = m_dir + "/index.tmp";
+        int fd = ::open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (fd < 0)
+            return false;
+
+        size_t size = sizeof(header) + (size_t)capacity * sizeof(slot);
+        void *p = ftruncate(fd, size) == 0
+                ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)
+                : MAP_FAILED;
+        close(fd);
+        if (p == MAP_FAILED)
+        {
+            unlink(tmp.c_str());
+            return false;
+        }
+
+        header *h = (header *)p;
+        h->magic = INDEX_MAGIC;
+        h->version = INDEX_VERSION;
+        h->capacity = capacity;
+        h->pack = pack;
+        for (size_t i = 0; i < entries.size(); ++i)
+        {
+            *find(h, entries[i].h1, entries[i].h2) = entries[i];
+            ++h->count;
+            h->bytes += sizeof(record) + entries[i].size;
+        }
+        munmap(p, size);
+
+        return rename(tmp.c_str(), (m_dir + "/index").c_str()) == 0;
+    }
+
+    void grow()
+    {
+        std::vector<slot> entries;
+        for (uint32_t i = 0; i < m_index->capacity; ++i)
+            if (slots(m_index)[i].h1)
+                entries.push_back(slots(m_index)[i]);
+
+        if (write_index(m_index->capacity * 2, m_index->pack, entries))
+        {
+            __atomic_store_n(&m_index->retired, 1, __ATOMIC_RELEASE);
+            map_index();
+        }
+    }
+
+    //
+    // Append a record to the current pack and return the offset of its
+    // data. Called with the lock held, so the end of file is ours.
+    //
+    int64_t append(record const &r, void const *data)
+    {
+        if (m_append_fd >= 0 && m_append_pack != m_index->pack)
+        {
+            close(m_append_fd);
+            m_append_fd = -1;
+        }
+
+        for (;;)
+        {
+            if (m_append_fd < 0)
+            {
+                m_append_pack = m_index->pack;
+                m_append_fd = ::open(pack_name(m_append_pack).c_str(),
+                                     O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+                if (m_append_fd < 0)
+                    return -1;
+            }
+
+            off_t end = lseek(m_append_fd, 0, SEEK_END);
+            if (end < 0)
+                return -1;
+            if (end == 0 || end + sizeof(record) + r.size <= PACK_SIZE)
+            {
+                std::string buf((char const *)&r, sizeof(r));
+                buf.append((char const *)data, r.size);
+                if (pwrite(m_append_fd, buf.data(), buf.size(), end) != (ssize_t)buf.size())
+                    return -1;
+                return end + sizeof(record);
+            }
+
+            /* The current pack is full; move on to the next one */
+            close(m_append_fd);
+            m_append_fd = -1;
+            ++m_index->pack;
+        }
+    }
+
+    //
+    // Pointer to the data of a record, mapping or remapping its pack as
+    // needed since packs grow after they were first mapped
+    //
+    uint8_t const *pack_data(uint32_t id, uint64_t offset, uint32_t size)
+    {
+        if (offset < sizeof(record))
+            return nullptr;
+
+        auto it = m_packs.find(id);
+        if (it == m_packs.end() || offset + size > it->second.second)
+        {
+            if (it != m_packs.end())
+            {
+                munmap(it->second.first, it->second.second);
+                m_packs.erase(it);
+            }
+
+            int fd = ::open(pack_name(id).c_str(), O_RDONLY | O_CLOEXEC);
+            struct stat st;
+            if (fd < 0 || fstat(fd, &st) < 0 || offset + size > (uint64_t)st.st_size)
+            {
+                if (fd >= 0)
+                    close(fd);
+                return nullptr;
+            }
+
+            void *p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                return nullptr;
+            it = m_packs.insert(std::make_pair(id, std::make_pair(p, (size_t)st.st_size))).first;
+        }
+
+        return (uint8_t const *)it->second.first + offset;
+    }
+
+    static void emit(std::string &out, uint8_t const *literals, size_t count,
+                     uint32_t offset, size_t len)
+    {
+        size_t match = len ? len - 4 : 0;
+        out += (char)((std::min(count, (size_t)15) << 4) | std::min(match, (size_t)15));
+        if (count >= 15)
+            write_count(out, count - 15);
+        out.append((char const *)literals, count);
+
+        if (len)
+        {
+            out += (char)(offset & 0xff);
+            out += (char)(offset >> 8);
+            if (match >= 15)
+                write_count(out, match - 15);
+        }
+    }
+
+    static void write_count(std::string &out, size_t n)
+    {
+        for (; n >= 255; n -= 255)
+            out += (char)255;
+        out += (char)n;
+    }
+
+    static bool read_count(uint8_t const *&src, uint8_t const *end, size_t &n)
+    {
+        for (;;)
+        {
+            if (src == end)
+                return false;
+            uint8_t b = *src++;
+            n += b;
+            if (b != 255)
+                return true;
+        }
+    }
+
+    std::string m_dir;
+    uint64_t m_budget;
+    std::shared_ptr<std::atomic<bool>> m_compacting;
+    std::mutex m_mutex;
+    int m_lock_fd;
+
+    header *m_index;
+    size_t m_index_size;
+
+    int m_append_fd;
+    uint32_t m_append_pack;
+
+    /* Mapped packs: id → (address, length) */
+    std::map<uint32_t, std::pair<void *, size_t>> m_packs;
+};
@@ -0,0 +1,1251 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for int64_t */
+#include <cstdlib> /* for strtoull() */
+#include <cstring> /* for strchr() */
+
+#include <algorithm> /* for std::min() */
+#include <fstream> /* for std::ifstream */
+#include <memory> /* for std::shared_ptr */
+#include <set> /* for std::set */
+#include <streambuf> /* for std::istreambuf_iterator */
+#include <string> /* for std::string */
+#include <unordered_map> /* for std::unordered_map */
+#include <vector> /* for std::vector */
+
+//
+// Native HLSL preprocessor, running on the client so that defines and
+// includes do not need to go through the protocol, and so that the
+// expanded source can be used as a cache key.
+//
+// It follows the C preprocessor as implemented by d3dcompiler: object
+// and function-like macros (including variadic ones, # and ##), #include
+// through an ID3DInclude handler, #if expressions, #line, #error and
+// #pragma once. Other pragmas are passed through to the compiler.
+//
+struct d3d4linux_preprocessor
+{
+    d3d4linux_preprocessor(ID3DInclude *include)
+      : m_include(include),
+        m_data(nullptr),
+        m_out_line(0),
+        m_line_delta(0),
+        m_depth(0),
+        m_failed(false),
+        m_expr_pos(0),
+        m_expr_line(0),
+        m_expr_skip(0),
+        m_expr_error(false)
+    {}
+
+    void define(char const *name, char const *value)
+    {
+        std::string line = std::string(name) + " " + (value ? value : "1");
+        std::vector<token> tokens;
+        tokenize(line, 0, tokens);
+        define_macro(tokens);
+    }
+
+    bool run(void const *data, size_t size, char const *filename,
+             std::string &output)
+    {
+        m_output.clear();
+        m_errors.clear();
+        m_failed = false;
+
+        std::string name = filename ? filename : "";
+        process_file((char const *)data, size, name);
+        if (!m_output.empty() && m_output.back() != '\n')
+            m_output += '\n';
+
+        output.swap(m_output);
+        return !m_failed;
+    }
+
+    std::string const &errors() const
+    {
+        return m_errors;
+    }
+
+    //
+    // Reduce a source to its tokens, for use in cache keys. Comments
+    // become whitespace and each run of whitespace becomes one space; it
+    // is not dropped, because it tells “#define F(x)” from “#define F (x)”
+    // and changes what # produces. Line breaks and #line directives
+    // disappear, unless line numbers can end up in the bytecode (debug
+    // information or __LINE__).
+    //
+    static void canonicalize(void const *data, size_t size, bool keep_lines,
+                             std::string &out)
+    {
+        static char const *line_macro = "__LINE__";
+        char const *src = (char const *)data;
+        if (std::search(src, src + size, line_macro, line_macro + 8) != src + size)
+            keep_lines = true;
+
+        std::vector<line> lines;
+        split_lines(src, size, lines);
+
+        out.clear();
+        std::vector<token> tokens;
+        for (size_t n = 0; n < lines.size(); ++n)
+        {
+            tokens.clear();
+            tokenize(lines[n].text, 0, tokens);
+
+            size_t i = skip_space(tokens, 0);
+            bool directive = i < tokens.size() && tokens[i].text == "#";
+            if (directive && !keep_lines)
+            {
+                size_t j = skip_space(tokens, i + 1);
+                if (j < tokens.size() && tokens[j].text == "line")
+                    continue;
+                if (!out.empty() && out.back() != '\n')
+                    out += '\n';
+            }
+
+            /* The line break before this line counts as whitespace */
+            bool space = true;
+            for (; i < tokens.size(); ++i)
+            {
+                if (tokens[i].type == T_SPACE)
+                {
+                    space = true;
+                    continue;
+                }
+                if (space && !out.empty() && out.back() != '\n')
+                    out += ' ';
+                out += tokens[i].text;
+                space = false;
+            }
+
+            if (keep_lines)
+                out.append(lines[n].count, '\n');
+            else if (directive)
+                out += '\n';
+        }
+    }
+
+private:
+    enum token_type
+    {
+        T_IDENT, T_NUMBER, T_STRING, T_CHAR, T_PUNCT, T_SPACE, T_NEWLINE,
+    };
+
+    typedef std::shared_ptr<std::set<std::string> const> hideset;
+
+    struct token
+    {
+        token() : type(T_SPACE), line(0) {}
+        token(int t, std::string const &s, int l) : type(t), text(s), line(l) {}
+
+        int type;
+        std::string text;
+        int line;
+        hideset hs;
+    };
+
+    struct macro
+    {
+        macro() : function_like(false), variadic(false) {}
+
+        bool function_like, variadic;
+        std::vector<std::string> params;
+        std::vector<token> body;
+    };
+
+    /* A logical line: comments removed and backslash-newlines spliced */
+    struct line
+    {
+        std::string text;
+        int number, count;
+    };
+
+    /* State of one #if / #elif / #else / #endif group */
+    struct conditional
+    {
+        bool active, taken, seen_else;
+    };
+
+    //
+    // Split a file into logical lines, replacing comments with a space
+    // as the C preprocessor does
+    //
+    static void split_lines(char const *p, size_t size, std::vector<line> &lines)
+    {
+        char const *end = p + size;
+        int number = 1;
+
+        while (p < end)
+        {
+            line l;
+            l.number = number;
+            char quote = 0;
+
+            while (p < end && *p != '\n')
+            {
+                if (*p == '\\' && (p + 1 < end && (p[1] == '\n' || (p[1] == '\r' && p + 2 < end && p[2] == '\n'))))
+                {
+                    p += p[1] == '\r' ? 3 : 2;
+                    ++number;
+                }
+                else if (quote)
+                {
+                    if (*p == '\\' && p + 1 < end && p[1] != '\n')
+                        l.text += *p++;
+                    else if (*p == quote)
+                        quote = 0;
+                    l.text += *p++;
+                }
+                else if (*p == '"' || *p == '\'')
+                {
+                    quote = *p;
+                    l.text += *p++;
+                }
+                else if (*p == '/' && p + 1 < end && p[1] == '/')
+                {
+                    /* Line comments may still be continued with a backslash */
+                    while (p < end && *p != '\n')
+                    {
+                        if (*p == '\\' && p + 1 < end && p[1] == '\n')
+                        {
+                            ++p;
+                            ++number;
+                        }
+                        ++p;
+                    }
+                }
+                else if (*p == '/' && p + 1 < end && p[1] == '*')
+                {
+                    for (p += 2; p < end && !(*p == '*' && p + 1 < end && p[1] == '/'); ++p)
+                        if (*p == '\n')
+                            ++number;
+                    p = p < end ? p + 2 : end;
+                    l.text += ' ';
+                }
+                else if (*p == '\r')
+                    ++p;
+                else
+                    l.text += *p++;
+            }
+
+            if (p < end)
+                ++p;
+            ++number;
+            l.count = number - l.number;
+            lines.push_back(l);
+        }
+    }
+
+    static bool is_ident(char ch, bool first)
+    {
+        return ch == '_' || (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+                || (!first && ch >= '0' && ch <= '9');
+    }
+
+    static void tokenize(std::string const &s, int lineno, std::vector<token> &out)
+    {
+        static char const *puncts[] =
+        {
+            "...", "<<=", ">>=", "##", "<<", ">>", "<=", ">=", "==", "!=",
+            "&&", "||", "++", "--", "+=", "-=", "*=", "/=", "%=", "&=",
+            "|=", "^=", "->", "::",
+        };
+
+        size_t i = 0;
+        while (i < s.size())
+        {
+            char ch = s[i];
+            size_t start = i;
+
+            if (ch == ' ' || ch == '\t' || ch == '\f' || ch == '\v')
+            {
+                while (i < s.size() && strchr(" \t\f\v", s[i]))
+                    ++i;
+                out.push_back(token(T_SPACE, " ", lineno));
+            }
+            else if (is_ident(ch, true))
+            {
+                while (i < s.size() && is_ident(s[i], false))
+                    ++i;
+                out.push_back(token(T_IDENT, s.substr(start, i - start), lineno));
+            }
+            else if ((ch >= '0' && ch <= '9') || (ch == '.' && i + 1 < s.size() && s[i + 1] >= '0' && s[i + 1] <= '9'))
+            {
+                /* pp-number: digits, letters, dots and signed exponents */
+                for (++i; i < s.size(); ++i)
+                {
+                    if ((s[i] == '+' || s[i] == '-') && strchr("eEpP", s[i - 1]))
+                        continue;
+                    if (!is_ident(s[i], false) && s[i] != '.')
+                        break;
+                }
+                out.push_back(token(T_NUMBER, s.substr(start, i - start), lineno));
+            }
+            else if (ch == '"' || ch == '\'')
+            {
+                for (++i; i < s.size() && s[i] != ch; ++i)
+                    if (s[i] == '\\')
+                        ++i;
+                i = i < s.size() ? i + 1 : s.size();
+                out.push_back(token(ch == '"' ? T_STRING : T_CHAR, s.substr(start, i - start), lineno));
+            }
+            else
+            {
+                size_t len = 1;
+                for (size_t k = 0; k < sizeof(puncts) / sizeof(*puncts); ++k)
+                {
+                    size_t n = strlen(puncts[k]);
+                    if (s.compare(i, n, puncts[k]) == 0)
+                    {
+                        len = n;
+                        break;
+                    }
+                }
+                i += len;
+                out.push_back(token(T_PUNCT, s.substr(start, len), lineno));
+            }
+        }
+    }
+
+    //
+    // Output, keeping the line numbers of the generated text in sync with
+    // the source either with blank lines or with #line directives
+    //
+    void emit(token const &t)
+    {
+        if (t.type == T_NEWLINE)
+        {
+            newline(t.line);
+            return;
+        }
+
+        if (t.type == T_SPACE)
+        {
+            if (!m_output.empty() && m_output.back() != ' ' && m_output.back() != '\n')
+                m_output += ' ';
+            return;
+        }
+
+        /* Make sure two tokens coming from different places cannot merge */
+        if (!m_output.empty() && !t.text.empty())
+        {
+            char prev = m_output.back(), next = t.text[0];
+            if ((is_ident(prev, false) && is_ident(next, false))
+                 || (t.type == T_PUNCT && strchr("+-*/%<>=!&|^.#:", prev)
+                      && strchr("+-*/%<>=&|^.#:", next)))
+                m_output += ' ';
+        }
+        m_output += t.text;
+    }
+
+    /* Line numbers are physical until mapped through the last #line */
+    int mapped(int lineno) const
+    {
+        return lineno + m_line_delta;
+    }
+
+    void newline(int next_line)
+    {
+        next_line = mapped(next_line);
+        m_output += '\n';
+        ++m_out_line;
+
+        if (next_line >= m_out_line && next_line - m_out_line < 8)
+        {
+            while (m_out_line < next_line)
+            {
+                m_output += '\n';
+                ++m_out_line;
+            }
+        }
+        else
+            line_directive(next_line);
+    }
+
+    void line_directive(int next_line)
+    {
+        if (!m_output.empty() && m_output.back() != '\n')
+            m_output += '\n';
+        m_output += "#line " + std::to_string(next_line) + " \"" + escape(m_file) + "\"\n";
+        m_out_line = next_line;
+    }
+
+    void error(int lineno, std::string const &message, char const *code = nullptr)
+    {
+        m_errors += m_file + "(" + std::to_string(mapped(lineno)) + ",1): error"
+                  + (code ? std::string(" ") + code : "") + ": " + message + "\n";
+        m_failed = true;
+    }
+
+    static std::string escape(std::string const &s)
+    {
+        std::string ret;
+        for (size_t i = 0; i < s.size(); ++i)
+        {
+            if (s[i] == '"' || s[i] == '\\')
+                ret += '\\';
+            ret += s[i];
+        }
+        return ret;
+    }
+
+    //
+    // Files
+    //
+    void process_file(char const *data, size_t size, std::string const &name)
+    {
+        std::string saved_file = m_file, saved_path = m_path;
+        void const *saved_data = m_data;
+        int saved_delta = m_line_delta;
+        m_file = m_path = name;
+        m_data = data;
+        m_line_delta = 0;
+
+        std::vector<line> lines;
+        split_lines(data, size, lines);
+
+        line_directive(1);
+
+        std::vector<conditional> stack;
+        bool active = true;
+
+        for (size_t i = 0; i < lines.size() && !m_failed; )
+        {
+            line const &l = lines[i];
+            size_t pos = l.text.find_first_not_of(" \t\f\v");
+
+            if (pos != std::string::npos && l.text[pos] == '#')
+            {
+                directive(l, pos + 1, stack, active);
+                if (i + 1 < lines.size() || l.count > 1)
+                    newline(l.number + l.count);
+                ++i;
+                continue;
+            }
+
+            if (!active)
+            {
+                if (i + 1 < lines.size())
+                    newline(l.number + l.count);
+                ++i;
+                continue;
+            }
+
+            /* Gather all text lines up to the next directive, so that
+             * macro invocations may span several lines. */
+            std::vector<token> tokens;
+            size_t j = i;
+            for (; j < lines.size(); ++j)
+            {
+                size_t p = lines[j].text.find_first_not_of(" \t\f\v");
+                if (p != std::string::npos && lines[j].text[p] == '#')
+                    break;
+                tokenize(lines[j].text, lines[j].number, tokens);
+                if (j + 1 < lines.size())
+                    tokens.push_back(token(T_NEWLINE, "\n", lines[j].number + lines[j].count));
+            }
+
+            std::vector<token> expanded;
+            expand(tokens, expanded);
+            for (size_t k = 0; k < expanded.size(); ++k)
+                emit(expanded[k]);
+            i = j;
+        }
+
+        if (!stack.empty() && !m_failed)
+            error(lines.empty() ? 1 : lines.back().number, "unterminated conditional directive");
+
+        m_file = saved_file;
+        m_path = saved_path;
+        m_data = saved_data;
+        m_line_delta = saved_delta;
+    }
+
+    void include_file(std::string const &name, bool system, int lineno)
+    {
+        if (m_depth >= 64)
+        {
+            error(lineno, "#include nested too deeply");
+            return;
+        }
+
+        void const *data = nullptr;
+        uint32_t bytes = 0;
+        std::string contents, path = name;
+
+        if (!m_include)
+        {
+            error(lineno, "failed to open source file: '" + name + "' (no include handler)", "X1507");
+            return;
+        }
+        else if (m_include == D3D_COMPILE_STANDARD_FILE_INCLUDE)
+        {
+            /* Local includes are looked up next to the including file first */
+            size_t slash = m_path.find_last_of("/\\");
+            if (!system && slash != std::string::npos && name[0] != '/')
+                path = m_path.substr(0, slash + 1) + name;
+            if (!read_file(path, contents) && !read_file(path = name, contents))
+            {
+                error(lineno, "failed to open source file: '" + name + "'", "X1507");
+                return;
+            }
+            data = contents.data();
+            bytes = (uint32_t)contents.size();
+        }
+        else if (FAILED(m_include->Open(system ? D3D_INCLUDE_SYSTEM : D3D_INCLUDE_LOCAL,
+                                        name.c_str(), m_data, &data, &bytes)))
+        {
+            error(lineno, "failed to open source file: '" + name + "'", "X1507");
+            return;
+        }
+
+        if (!m_once.count(path))
+        {
+            ++m_depth;
+            process_file((char const *)data, bytes, path);
+            --m_depth;
+
+            /* Resume on the #include line itself; the caller moves on */
+            line_directive(mapped(lineno));
+        }
+
+        if (m_include != D3D_COMPILE_STANDARD_FILE_INCLUDE)
+            m_include->Close(data);
+    }
+
+    static bool read_file(std::string const &name, std::string &out)
+    {
+        std::ifstream f(name, std::ios::binary);
+        if (!f)
+            return false;
+        out.assign((std::istreambuf_iterator<char>(f)),
+                   std::istreambuf_iterator<char>());
+        return true;
+    }
+
+    //
+    // Directives
+    //
+    void directive(line const &l, size_t pos, std::vector<conditional> &stack,
+                   bool &active)
+    {
+        std::vector<token> tokens;
+        tokenize(l.text.substr(pos), l.number, tokens);
+        size_t i = skip_space(tokens, 0);
+        if (i == tokens.size())
+            return; /* null directive */
+
+        std::string name = tokens[i].text;
+        i = skip_space(tokens, i + 1);
+        std::vector<token> args(tokens.begin() + i, tokens.end());
+        while (!args.empty() && args.back().type == T_SPACE)
+            args.pop_back();
+
+        /* Conditionals must be tracked even in inactive regions */
+        if (name == "if" || name == "ifdef" || name == "ifndef")
+        {
+            conditional c = { active, false, false };
+            if (active)
+            {
+                bool value = name == "if" ? evaluate(args, l.number)
+                           : (!args.empty() && m_macros.count(args[0].text)) == (name == "ifdef");
+                c.taken = value;
+                active = value;
+            }
+            stack.push_back(c);
+            return;
+        }
+        else if (name == "elif" || name == "else")
+        {
+            if (stack.empty() || stack.back().seen_else)
+            {
+                error(l.number, "#" + name + " without #if");
+                return;
+            }
+            conditional &c = stack.back();
+            c.seen_else = name == "else";
+            if (!c.active || c.taken)
+                active = false;
+            else
+            {
+                active = name == "else" || evaluate(args, l.number);
+                c.taken = active;
+            }
+            return;
+        }
+        else if (name == "endif")
+        {
+            if (stack.empty())
+            {
+                error(l.number, "#endif without #if");
+                return;
+            }
+            active = stack.back().active;
+            stack.pop_back();
+            return;
+        }
+
+        if (!active)
+            return;
+
+        if (name == "define")
+            define_macro(args);
+        else if (name == "undef")
+        {
+            if (!args.empty())
+                m_macros.erase(args[0].text);
+        }
+        else if (name == "include")
+        {
+            std::vector<token> expanded;
+            if (!args.empty() && args[0].type == T_IDENT)
+                expand(args, expanded);
+            else
+                expanded = args;
+
+            std::string target;
+            for (size_t k = 0; k < expanded.size(); ++k)
+                target += expanded[k].text;
+            while (!target.empty() && target.back() == ' ')
+                target.pop_back();
+
+            if (target.size() >= 2 && ((target[0] == '"' && target.back() == '"')
+                                        || (target[0] == '<' && target.back() == '>')))
+                include_file(target.substr(1, target.size() - 2), target[0] == '<',
+                             l.number);
+            else
+                error(l.number, "#include expects \"FILENAME\" or <FILENAME>");
+        }
+        else if (name == "line")
+        {
+            std::vector<token> expanded;
+            expand(args, expanded);
+            size_t k = skip_space(expanded, 0);
+            if (k == expanded.size() || expanded[k].type != T_NUMBER)
+            {
+                error(l.number, "#line expects a line number");
+                return;
+            }
+            int next_line = atoi(expanded[k].text.c_str());
+            k = skip_space(expanded, k + 1);
+            if (k < expanded.size() && expanded[k].type == T_STRING)
+                m_file = expanded[k].text.substr(1, expanded[k].text.size() - 2);
+            /* The line after the directive becomes next_line */
+            m_line_delta = next_line - (l.number + l.count);
+            line_directive(next_line - 1);
+        }
+        else if (name == "error")
+        {
+            std::string message;
+            for (size_t k = 0; k < args.size(); ++k)
+                message += args[k].text;
+            error(l.number, "#error " + message);
+        }
+        else if (name == "pragma")
+        {
+            if (!args.empty() && args[0].text == "once")
+                m_once.insert(m_path);
+            else
+                m_output += l.text.substr(l.text.find('#'));
+        }
+        else
+            error(l.number, "invalid preprocessor directive #" + name);
+    }
+
+    static size_t skip_space(std::vector<token> const &tokens, size_t i)
+    {
+        while (i < tokens.size() && tokens[i].type == T_SPACE)
+            ++i;
+        return i;
+    }
+
+    void define_macro(std::vector<token> const &tokens)
+    {
+        size_t i = skip_space(tokens, 0);
+        if (i == tokens.size() || tokens[i].type != T_IDENT)
+        {
+            error(tokens.empty() ? 0 : tokens[0].line, "#define expects a macro name");
+            return;
+        }
+
+        macro m;
+        std::string name = tokens[i++].text;
+
+        /* A parenthesis right after the name makes a function-like macro */
+        if (i < tokens.size() && tokens[i].text == "(")
+        {
+            m.function_like = true;
+            for (i = skip_space(tokens, i + 1); i < tokens.size() && tokens[i].text != ")"; )
+            {
+                if (tokens[i].text == "...")
+                {
+                    m.variadic = true;
+                    m.params.push_back("__VA_ARGS__");
+                }
+                else if (tokens[i].type == T_IDENT)
+                    m.params.push_back(tokens[i].text);
+                else if (tokens[i].text != ",")
+                {
+                    error(tokens[i].line, "invalid macro parameter list");
+                    return;
+                }
+                i = skip_space(tokens, i + 1);
+            }
+            ++i;
+        }
+
+        i = skip_space(tokens, i);
+        m.body.assign(tokens.begin() + std::min(i, tokens.size()), tokens.end());
+        while (!m.body.empty() && m.body.back().type == T_SPACE)
+            m.body.pop_back();
+        m_macros[name] = m;
+    }
+
+    //
+    // Macro expansion, following Dave Prosser’s algorithm: every token
+    // carries the set of macros it came from, which may not expand it
+    // again.
+    //
+    void expand(std::vector<token> const &in, std::vector<token> &out)
+    {
+        /* Remaining input, in reverse order so that we can push back the
+         * replacement of a macro for rescanning. */
+        std::vector<token> stack(in.rbegin(), in.rend());
+
+        while (!stack.empty())
+        {
+            token t = stack.back();
+            stack.pop_back();
+
+            if (t.type != T_IDENT || (t.hs && t.hs->count(t.text)))
+            {
+                out.push_back(t);
+                continue;
+            }
+
+            if (t.text == "__LINE__" || t.text == "__FILE__")
+            {
+                if (m_macros.count(t.text) == 0)
+                {
+                    out.push_back(t.text == "__LINE__"
+                        ? token(T_NUMBER, std::to_string(mapped(t.line)), t.line)
+                        : token(T_STRING, "\"" + escape(m_file) + "\"", t.line));
+                    continue;
+                }
+            }
+
+            auto it = m_macros.find(t.text);
+            if (it == m_macros.end())
+            {
+                out.push_back(t);
+                continue;
+            }
+
+            macro const &m = it->second;
+            std::vector<token> replacement;
+
+            if (!m.function_like)
+            {
+                subst(m, std::vector<std::vector<token>>(), add_to(t.hs, t.text), t.line, replacement);
+            }
+            else
+            {
+                /* Only an invocation if the next real token is '(' */
+                size_t k = stack.size();
+                while (k > 0 && (stack[k - 1].type == T_SPACE || stack[k - 1].type == T_NEWLINE))
+                    --k;
+                if (k == 0 || stack[k - 1].text != "(")
+                {
+                    out.push_back(t);
+                    continue;
+                }
+                stack.resize(k - 1);
+
+                std::vector<std::vector<token>> args;
+                token rparen;
+                if (!collect_args(m, stack, args, rparen, t.line))
+                    return;
+
+                /* The hide set is (HS(name) ∩ HS(rparen)) ∪ {name} */
+                hideset hs;
+                if (t.hs && rparen.hs)
+                {
+                    std::set<std::string> both;
+                    for (auto const &s : *t.hs)
+                        if (rparen.hs->count(s))
+                            both.insert(s);
+                    hs = std::make_shared<std::set<std::string> const>(both);
+                }
+                subst(m, args, add_to(hs, t.text), t.line, replacement);
+            }
+
+            stack.insert(stack.end(), replacement.rbegin(), replacement.rend());
+        }
+    }
+
+    bool collect_args(macro const &m, std::vector<token> &stack,
+                      std::vector<std::vector<token>> &args, token &rparen,
+                      int lineno)
+    {
+        int depth = 0;
+        args.push_back(std::vector<token>());
+
+        for (;;)
+        {
+            if (stack.empty())
+            {
+                error(lineno, "unexpected end of file in macro expansion");
+                return false;
+            }
+
+            token t = stack.back();
+            stack.pop_back();
+            if (t.type == T_NEWLINE)
+                t = token(T_SPACE, " ", t.line);
+
+            if (t.text == ")" && t.type == T_PUNCT && depth == 0)
+            {
+                rparen = t;
+                break;
+            }
+            if (t.text == "," && t.type == T_PUNCT && depth == 0
+                 && !(m.variadic && args.size() == m.params.size()))
+            {
+                args.push_back(std::vector<token>());
+                continue;
+            }
+            if (t.type == T_PUNCT && t.text == "(")
+                ++depth;
+            else if (t.type == T_PUNCT && t.text == ")")
+                --depth;
+            args.back().push_back(t);
+        }
+
+        for (size_t i = 0; i < args.size(); ++i)
+            trim(args[i]);
+
+        /* FOO() has no arguments rather than one empty argument */
+        if (m.params.empty() && args.size() == 1 && args[0].empty())
+            args.clear();
+        if (m.variadic && args.size() + 1 == m.params.size())
+            args.push_back(std::vector<token>());
+
+        if (args.size() != m.params.size())
+        {
+            error(lineno, "wrong number of macro arguments");
+            return false;
+        }
+        return true;
+    }
+
+    void subst(macro const &m, std::vector<std::vector<token>> const &args,
+               hideset const &hs, int lineno, std::vector<token> &out)
+    {
+        std::vector<token> const &body = m.body;
+
+        for (size_t i = 0; i < body.size(); ++i)
+        {
+            token const &t = body[i];
+            int param = find_param(m, t);
+
+            /* # param: stringize the unexpanded argument */
+            if (m.function_like && t.text == "#" && t.type == T_PUNCT)
+            {
+                size_t j = skip_space(body, i + 1);
+                int p = j < body.size() ? find_param(m, body[j]) : -1;
+                if (p >= 0)
+                {
+                    out.push_back(token(T_STRING, stringize(args[p]), lineno));
+                    i = j;
+                    continue;
+                }
+            }
+
+            /* ## token: paste with whatever was last output */
+            if (t.text == "##" && t.type == T_PUNCT)
+            {
+                size_t j = skip_space(body, i + 1);
+                if (j >= body.size())
+                    break;
+                int p = find_param(m, body[j]);
+                std::vector<token> rhs;
+                if (p >= 0)
+                    rhs = args[p];
+                else
+                    rhs.push_back(body[j]);
+                while (!out.empty() && out.back().type == T_SPACE)
+                    out.pop_back();
+                paste(out, rhs, lineno);
+                i = j;
+                continue;
+            }
+
+            if (param >= 0)
+            {
+                /* param ##: the argument is not expanded */
+                size_t j = skip_space(body, i + 1);
+                if (j < body.size() && body[j].text == "##")
+                {
+                    std::vector<token> const &a = args[param];
+                    if (a.empty())
+                    {
+                        /* Empty argument: the operand of ## is not pasted */
+                        size_t k = skip_space(body, j + 1);
+                        if (k < body.size())
+                        {
+                            int p = find_param(m, body[k]);
+                            if (p >= 0)
+                                append(out, args[p], lineno);
+                            else
+                                out.push_back(with_line(body[k], lineno));
+                        }
+                        i = k;
+                    }
+                    else
+                        append(out, a, lineno);
+                    continue;
+                }
+
+                std::vector<token> expanded;
+                expand(args[param], expanded);
+                append(out, expanded, lineno);
+                continue;
+            }
+
+            out.push_back(with_line(t, lineno));
+        }
+
+        for (size_t i = 0; i < out.size(); ++i)
+            out[i].hs = merge(out[i].hs, hs);
+    }
+
+    static int find_param(macro const &m, token const &t)
+    {
+        if (!m.function_like || t.type != T_IDENT)
+            return -1;
+        for (size_t i = 0; i < m.params.size(); ++i)
+            if (m.params[i] == t.text)
+                return (int)i;
+        return -1;
+    }
+
+    static token with_line(token t, int lineno)
+    {
+        t.line = lineno;
+        return t;
+    }
+
+    static void append(std::vector<token> &out, std::vector<token> const &in, int lineno)
+    {
+        for (size_t i = 0; i < in.size(); ++i)
+            out.push_back(with_line(in[i], lineno));
+    }
+
+    void paste(std::vector<token> &out, std::vector<token> const &rhs, int lineno)
+    {
+        if (rhs.empty())
+            return;
+        if (out.empty())
+        {
+            append(out, rhs, lineno);
+            return;
+        }
+
+        /* Re-lex the pasted text; it should form a single token */
+        std::string text = out.back().text + rhs[0].text;
+        hideset hs = out.back().hs;
+        out.pop_back();
+        std::vector<token> pasted;
+        tokenize(text, lineno, pasted);
+        for (size_t i = 0; i < pasted.size(); ++i)
+            pasted[i].hs = hs;
+        out.insert(out.end(), pasted.begin(), pasted.end());
+        out.insert(out.end(), rhs.begin() + 1, rhs.end());
+    }
+
+    static std::string stringize(std::vector<token> const &arg)
+    {
+        std::string ret = "\"";
+        for (size_t i = 0; i < arg.size(); ++i)
+        {
+            if (arg[i].type == T_SPACE)
+                ret += ' ';
+            else if (arg[i].type == T_STRING || arg[i].type == T_CHAR)
+                ret += escape(arg[i].text);
+            else
+                ret += arg[i].text;
+        }
+        return ret + "\"";
+    }
+
+    static void trim(std::vector<token> &tokens)
+    {
+        while (!tokens.empty() && tokens.back().type == T_SPACE)
+            tokens.pop_back();
+        size_t i = skip_space(tokens, 0);
+        tokens.erase(tokens.begin(), tokens.begin() + i);
+    }
+
+    static hideset add_to(hideset const &hs, std::string const &name)
+    {
+        std::set<std::string> s;
+        if (hs)
+            s = *hs;
+        s.insert(name);
+        return std::make_shared<std::set<std::string> const>(s);
+    }
+
+    static hideset merge(hideset const &a, hideset const &b)
+    {
+        if (!a || a == b)
+            return b;
+        if (!b)
+            return a;
+        std::set<std::string> s(*a);
+        s.insert(b->begin(), b->end());
+        return std::make_shared<std::set<std::string> const>(s);
+    }
+
+    //
+    // #if expressions
+    //
+    bool evaluate(std::vector<token> const &args, int lineno)
+    {
+        /* Resolve “defined” before macro expansion */
+        std::vector<token> tokens;
+        for (size_t i = 0; i < args.size(); ++i)
+        {
+            if (args[i].type == T_IDENT && args[i].text == "defined")
+            {
+                size_t j = skip_space(args, i + 1);
+                bool paren = j < args.size() && args[j].text == "(";
+                if (paren)
+                    j = skip_space(args, j + 1);
+                if (j >= args.size() || args[j].type != T_IDENT)
+                {
+                    error(lineno, "operator 'defined' requires an identifier");
+                    return false;
+                }
+                tokens.push_back(token(T_NUMBER, m_macros.count(args[j].text) ? "1" : "0", lineno));
+                if (paren)
+                {
+                    j = skip_space(args, j + 1);
+                    if (j >= args.size() || args[j].text != ")")
+                    {
+                        error(lineno, "missing ')' after 'defined'");
+                        return false;
+                    }
+                }
+                i = j;
+                continue;
+            }
+            tokens.push_back(args[i]);
+        }
+
+        std::vector<token> expanded;
+        expand(tokens, expanded);
+
+        m_expr.clear();
+        for (size_t i = 0; i < expanded.size(); ++i)
+            if (expanded[i].type != T_SPACE)
+                m_expr.push_back(expanded[i]);
+        m_expr_pos = 0;
+        m_expr_line = lineno;
+        m_expr_skip = 0;
+        m_expr_error = false;
+
+        int64_t value = expr_ternary();
+        if (!m_expr_error && m_expr_pos != m_expr.size())
+            expr_fail("unexpected token '" + m_expr[m_expr_pos].text + "' in #if expression");
+        return !m_expr_error && value != 0;
+    }
+
+    void expr_fail(std::string const &message)
+    {
+        if (!m_expr_error)
+            error(m_expr_line, message);
+        m_expr_error = true;
+    }
+
+    bool expr_accept(char const *op)
+    {
+        if (m_expr_pos < m_expr.size() && m_expr[m_expr_pos].type == T_PUNCT
+             && m_expr[m_expr_pos].text == op)
+        {
+            ++m_expr_pos;
+            return true;
+        }
+        return false;
+    }
+
+    int64_t expr_ternary()
+    {
+        int64_t cond = expr_binary(0);
+        if (!expr_accept("?"))
+            return cond;
+        m_expr_skip += !cond;
+        int64_t a = expr_ternary();
+        m_expr_skip -= !cond;
+        if (!expr_accept(":"))
+            expr_fail("expected ':' in #if expression");
+        m_expr_skip += !!cond;
+        int64_t b = expr_ternary();
+        m_expr_skip -= !!cond;
+        return cond ? a : b;
+    }
+
+    /* Precedence climbing over the binary operators, lowest first. The
+     * right operand of && and || is still parsed when the left one decides,
+     * but it is not evaluated: it may divide by zero, or call a macro that
+     * is not defined. */
+    int64_t expr_binary(int level)
+    {
+        static char const *levels[][5] =
+        {
+            { "||" }, { "&&" }, { "|" }, { "^" }, { "&" }, { "==", "!=" },
+            { "<", ">", "<=", ">=" }, { "<<", ">>" }, { "+", "-" },
+            { "*", "/", "%" },
+        };
+        int const count = sizeof(levels) / sizeof(*levels);
+
+        if (level == count)
+            return expr_unary();
+
+        int64_t lhs = expr_binary(level + 1);
+        for (;;)
+        {
+            char const *op = nullptr;
+            for (int i = 0; i < 5 && levels[level][i] && !op; ++i)
+                if (expr_accept(levels[level][i]))
+                    op = levels[level][i];
+            if (!op)
+                return lhs;
+
+            std::string o = op;
+            bool skip = (o == "&&" && !lhs) || (o == "||" && lhs);
+            m_expr_skip += skip;
+            int64_t rhs = expr_binary(level + 1);
+            m_expr_skip -= skip;
+            if (o == "||") lhs = lhs || rhs;
+            else if (o == "&&") lhs = lhs && rhs;
+            else if (o == "|") lhs |= rhs;
+            else if (o == "^") lhs ^= rhs;
+            else if (o == "&") lhs &= rhs;
+            else if (o == "==") lhs = lhs == rhs;
+            else if (o == "!=") lhs = lhs != rhs;
+            else if (o == "<") lhs = lhs < rhs;
+            else if (o == ">") lhs = lhs > rhs;
+            else if (o == "<=") lhs = lhs <= rhs;
+            else if (o == ">=") lhs = lhs >= rhs;
+            else if (o == "<<") lhs = (int64_t)((uint64_t)lhs << (rhs & 63));
+            else if (o == ">>") lhs >>= (rhs & 63);
+            else if (o == "+") lhs += rhs;
+            else if (o == "-") lhs -= rhs;
+            else if (o == "*") lhs *= rhs;
+            else if (rhs == 0)
+            {
+                if (!m_expr_skip)
+                {
+                    expr_fail("division by zero in #if expression");
+                    return 0;
+                }
+                lhs = 0;
+            }
+            /* INT64_MIN / -1 would trap */
+            else if (rhs == -1) lhs = o == "/" ? (int64_t)(0 - (uint64_t)lhs) : 0;
+            else if (o == "/") lhs /= rhs;
+            else lhs %= rhs;
+        }
+    }
+
+    int64_t expr_unary()
+    {
+        if (expr_accept("!"))
+            return !expr_unary();
+        if (expr_accept("~"))
+            return ~expr_unary();
+        if (expr_accept("-"))
+            return -expr_unary();
+        if (expr_accept("+"))
+            return expr_unary();
+        if (expr_accept("("))
+        {
+            int64_t value = expr_ternary();
+            if (!expr_accept(")"))
+                expr_fail("missing ')' in #if expression");
+            return value;
+        }
+
+        if (m_expr_pos >= m_expr.size())
+        {
+            expr_fail("unexpected end of #if expression");
+            return 0;
+        }
+
+        token const &t = m_expr[m_expr_pos++];
+        if (t.type == T_NUMBER)
+            return (int64_t)strtoull(t.text.c_str(), nullptr, 0);
+        if (t.type == T_CHAR && t.text.size() >= 3)
+            return t.text[1] == '\\' ? escape_value(t.text[2]) : (unsigned char)t.text[1];
+        if (t.type == T_IDENT)
+        {
+            /* Where it is not evaluated, an undefined function-like macro
+             * may be called */
+            if (m_expr_skip && expr_accept("("))
+            {
+                int depth = 1;
+                for (; depth > 0 && m_expr_pos < m_expr.size(); ++m_expr_pos)
+                    depth += m_expr[m_expr_pos].text == "(" ? 1
+                           : m_expr[m_expr_pos].text == ")" ? -1 : 0;
+                if (depth > 0)
+                    expr_fail("missing ')' in #if expression");
+            }
+            return t.text == "true" ? 1 : 0; /* undefined identifiers are 0 */
+        }
+
+        expr_fail("invalid token '" + t.text + "' in #if expression");
+        return 0;
+    }
+
+    static int64_t escape_value(char ch)
+    {
+        switch (ch)
+        {
+        case 'n': return '\n';
+        case 't': return '\t';
+        case 'r': return '\r';
+        case '0': return 0;
+        default: return (unsigned char)ch;
+        }
+    }
+
+    ID3DInclude *m_include;
+    std::unordered_map<std::string, macro> m_macros;
+    std::set<std::string> m_once;
+
+    /* m_file is what #line says, m_path where the file really is */
+    std::string m_output, m_errors, m_file, m_path;
+    void const *m_data;
+    int m_out_line, m_line_delta, m_depth;
+    bool m_failed;
+
+    std::vector<token> m_expr;
+    size_t m_expr_pos;
+    int m_expr_line;
+    /* Nonzero while parsing operands that are not evaluated */
+    int m_expr_skip;
+    bool m_expr_error;
+};
@@ -0,0 +1,272 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstdint> /* for uint32_t */
+
+#include <vector> /* for std::vector */
+
+#include <d3d4linux_abi.h>
+#include <d3d4linux_common.h>
+#include <d3d4linux_native.h>
+
+//
+// What struct d3d4linux becomes with D3D4LINUX_SHARED: everything that
+// talks to a server is forwarded to libd3d4linux, through the C functions
+// of d3d4linux_abi.h, so that all the users of d3d4linux in a process
+// share one server pool and one cache, and none of them has to build it.
+//
+struct d3d4linux : d3d4linux_native
+{
+    static int &compiler_version()
+    {
+        return *d3d4linux_compiler_version();
+    }
+
+    static int &priority()
+    {
+        return *d3d4linux_priority();
+    }
+
+    //
+    // Entry points for a given compiler DLL version, see d3d4linux_native.h
+    //
+    template<int V> using versioned = d3d4linux_versioned<d3d4linux, V>;
+
+    static HRESULT compile(int version,
+                           void const *pSrcData,
+                           size_t SrcDataSize,
+                           char const *pFileName,
+                           D3D_SHADER_MACRO const *pDefines,
+                           ID3DInclude *pInclude,
+                           char const *pEntrypoint,
+                           char const *pTarget,
+                           uint32_t Flags1,
+                           uint32_t Flags2,
+                           ID3DBlob **ppCode,
+                           ID3DBlob **ppErrorMsgs)
+    {
+        include_callbacks callbacks(pInclude);
+        d3d4linux_buffer code, errors;
+        HRESULT ret = d3d4linux_compile(version, pSrcData, SrcDataSize, pFileName,
+                                        (d3d4linux_define const *)pDefines,
+                                        callbacks.get(), pEntrypoint, pTarget,
+                                        Flags1, Flags2, &code, &errors);
+        *ppCode = take_blob(code);
+        if (ppErrorMsgs)
+            *ppErrorMsgs = take_blob(errors);
+        else
+            d3d4linux_free(errors.data);
+        return ret;
+    }
+
+    static HRESULT reflect(int version,
+                           void const *pSrcData,
+                           size_t SrcDataSize,
+                           REFIID pInterface,
+                           void **ppReflector)
+    {
+        d3d4linux_buffer snapshot;
+        void *handle = nullptr;
+        HRESULT ret = d3d4linux_reflect(version, pSrcData, SrcDataSize, pInterface,
+                                        &snapshot, &handle);
+        if (snapshot.data)
+        {
+            std::vector<uint8_t> data;
+            take(snapshot, data);
+            library_source *source = handle ? new library_source(handle) : nullptr;
+            *ppReflector = new ID3D11ShaderReflection(data, source);
+        }
+        return ret;
+    }
+
+    static HRESULT strip_shader(int version,
+                                void const *pShaderBytecode,
+                                size_t BytecodeLength,
+                                uint32_t uStripFlags,
+                                ID3DBlob **ppStrippedBlob)
+    {
+        d3d4linux_buffer out;
+        HRESULT ret = d3d4linux_strip(version, pShaderBytecode, BytecodeLength,
+                                      uStripFlags, &out);
+        *ppStrippedBlob = take_blob(out);
+        return ret;
+    }
+
+    static HRESULT disassemble(int version,
+                               void const *pSrcData,
+                               size_t SrcDataSize,
+                               uint32_t Flags,
+                               char const *szComments,
+                               ID3DBlob **ppDisassembly)
+    {
+        d3d4linux_buffer out;
+        HRESULT ret = d3d4linux_disassemble(version, pSrcData, SrcDataSize, Flags,
+                                            szComments, &out);
+        *ppDisassembly = take_blob(out);
+        return ret;
+    }
+
+    static HRESULT dll_compress_shaders(int version,
+                                        uint32_t uNumShaders,
+                                        D3D_SHADER_DATA *pShaderData,
+                                        uint32_t uFlags,
+                                        ID3DBlob **ppCompressedData)
+    {
+        d3d4linux_buffer out;
+        HRESULT ret = d3d4linux_dll_compress_shaders(version, uNumShaders,
+                                                     (d3d4linux_buffer const *)pShaderData,
+                                                     uFlags, &out);
+        *ppCompressedData = take_blob(out);
+        return ret;
+    }
+
+    static HRESULT dll_decompress_shaders(int version,
+                                          void const *pSrcData,
+                                          size_t SrcDataSize,
+                                          uint32_t uNumShaders,
+                                          uint32_t uStartIndex,
+                                          uint32_t *pIndices,
+                                          uint32_t uFlags,
+                                          ID3DBlob **ppShaders,
+                                          uint32_t *pTotalShaders)
+    {
+        std::vector<d3d4linux_buffer> out(uNumShaders);
+        HRESULT ret = d3d4linux_dll_decompress_shaders(version, pSrcData, SrcDataSize,
+                                                       uNumShaders, uStartIndex, pIndices,
+                                                       uFlags, out.data(), pTotalShaders);
+        for (uint32_t i = 0; i < uNumShaders; ++i)
+            ppShaders[i] = take_blob(out[i]);
+        return ret;
+    }
+
+    static HRESULT preprocess(int version,
+                              void const *pSrcData,
+                              size_t SrcDataSize,
+                              char const *pSourceName,
+                              D3D_SHADER_MACRO const *pDefines,
+                              ID3DInclude *pInclude,
+                              ID3DBlob **ppCodeText,
+                              ID3DBlob **ppErrorMsgs)
+    {
+        include_callbacks callbacks(pInclude);
+        d3d4linux_buffer text, errors;
+        HRESULT ret = d3d4linux_preprocess(version, pSrcData, SrcDataSize, pSourceName,
+                                           (d3d4linux_define const *)pDefines,
+                                           callbacks.get(), &text, &errors);
+        *ppCodeText = take_blob(text);
+        if (ppErrorMsgs)
+            *ppErrorMsgs = take_blob(errors);
+        else
+            d3d4linux_free(errors.data);
+        return ret;
+    }
+
+    struct startup_stats
+    {
+        int servers, prefixes;
+        double average_msecs, max_msecs;
+    };
+
+    /* How many servers this process started, and how long they took */
+    static startup_stats server_startup()
+    {
+        d3d4linux_startup st;
+        d3d4linux_server_startup(&st);
+        startup_stats ret;
+        ret.servers = st.servers;
+        ret.prefixes = st.prefixes;
+        ret.average_msecs = st.average_msecs;
+        ret.max_msecs = st.max_msecs;
+        return ret;
+    }
+
+private:
+    static_assert(sizeof(D3D_SHADER_MACRO) == sizeof(d3d4linux_define),
+                  "defines are passed as is");
+
+    static void take(d3d4linux_buffer &buf, std::vector<uint8_t> &out)
+    {
+        out.assign((uint8_t const *)buf.data, (uint8_t const *)buf.data + buf.size);
+        d3d4linux_free(buf.data);
+    }
+
+    static ID3DBlob *take_blob(d3d4linux_buffer &buf)
+    {
+        if (!buf.data)
+            return nullptr;
+        ID3DBlob *blob = make_blob(buf.data, buf.size);
+        d3d4linux_free(buf.data);
+        return blob;
+    }
+
+    /* Let the library call back into our ID3DInclude */
+    struct include_callbacks
+    {
+        include_callbacks(ID3DInclude *include)
+        {
+            m_callbacks.context = include;
+            m_callbacks.open = &open;
+            m_callbacks.close = &close;
+            m_include = include;
+        }
+
+        d3d4linux_include const *get() const
+        {
+            if (m_include == D3D_COMPILE_STANDARD_FILE_INCLUDE)
+                return D3D4LINUX_STANDARD_INCLUDE;
+            return m_include ? &m_callbacks : nullptr;
+        }
+
+    private:
+        static long open(void *context, int type, char const *name, void const *parent,
+                         void const **data, uint32_t *bytes)
+        {
+            return ((ID3DInclude *)context)->Open((D3D_INCLUDE_TYPE)type, name,
+                                                  parent, data, bytes);
+        }
+
+        static long close(void *context, void const *data)
+        {
+            return ((ID3DInclude *)context)->Close(data);
+        }
+
+        d3d4linux_include m_callbacks;
+        ID3DInclude *m_include;
+    };
+
+    /* Lazy reflection fetches the rest of the reflector through the
+     * library, which keeps the server side of it */
+    struct library_source : d3d4linux_snapshot::source
+    {
+        library_source(void *handle) : m_handle(handle) {}
+
+        ~library_source()
+        {
+            d3d4linux_reflect_close(m_handle);
+        }
+
+        virtual bool fetch(int64_t query, int64_t &index, char const *name,
+                           std::vector<uint8_t> &out)
+        {
+            d3d4linux_buffer buf;
+            if (!d3d4linux_reflect_fetch(m_handle, query, &index, name, &buf))
+                return false;
+            take(buf, out);
+            return true;
+        }
+
+    private:
+        void *m_handle;
+    };
+};
@@ -0,0 +1,207 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cstddef> /* for offsetof() */
+#include <cstdint> /* for uint32_t */
+#include <cstring> /* for memcpy(), memset() */
+
+#include <string> /* for std::string */
+#include <vector> /* for std::vector */
+
+//
+// Reflection snapshots: everything an ID3D11ShaderReflection can tell,
+// built by the server as one buffer that the client uses in place.
+//
+//   header:   magic, size, the offset of each record array, then the
+//             few values that are not desc structs
+//   records:  the shader desc, input parameters, output parameters,
+//             resource bindings, constant buffers, then for each buffer
+//             its variables followed by their types
+//   data:     NUL-terminated names and variable default values
+//
+// A record is a D3D desc struct, whose pointers are cleared, followed
+// by offsets relative to the record itself, so that the buffer needs no
+// fix-up wherever it is loaded and the same shader always gives the same
+// bytes. Both ends share the desc struct layouts, just like they did
+// when these structs were sent one by one.
+//
+// Lazy reflection (see d3d4linux_impl.h) fetches snapshots that only
+// hold some of these; the offsets of missing arrays are then 0.
+//
+/* What lazy reflection may ask the server for */
+#define D3D4LINUX_QUERY_SIGNATURES     0x42005000
+#define D3D4LINUX_QUERY_BUFFER         0x42005001
+#define D3D4LINUX_QUERY_BUFFER_BY_NAME 0x42005002
+
+struct d3d4linux_snapshot
+{
+    enum { MAGIC = 0x46523444 /* "D4RF" */ };
+
+    struct header
+    {
+        uint32_t magic, size;
+        uint32_t desc, inputs, outputs, binds, buffers;
+        uint32_t thread_group[3], thread_group_size, min_feature_level;
+    };
+
+    /* Anything that refers to other parts of the snapshot */
+    struct relative
+    {
+        char const *string(int32_t offset) const
+        {
+            return (char const *)this + offset;
+        }
+
+        void const *at(int32_t offset) const
+        {
+            return offset ? (uint8_t const *)this + offset : nullptr;
+        }
+    };
+
+    template<typename T> struct record : relative
+    {
+        T m_desc;
+        /* Offset of the name; then of the first variable of a constant
+         * buffer, of the default value of a variable, or of the member
+         * table of a type; then of the type of a variable (0 if none) */
+        int32_t m_name, m_extra, m_type;
+    };
+
+    /* Entry of the member table of a struct type */
+    struct member : relative
+    {
+        int32_t m_type, m_name;
+    };
+
+    /* Where lazy reflection gets the snapshots it needs. A query may ask
+     * for a constant buffer by name, in which case index is set. */
+    struct source
+    {
+        virtual ~source() {}
+        virtual bool fetch(int64_t query, int64_t &index, char const *name,
+                           std::vector<uint8_t> &out) = 0;
+    };
+
+    static bool valid(std::vector<uint8_t> const *data)
+    {
+        header h;
+        if (!data || data->size() < sizeof(h))
+            return false;
+        memcpy(&h, data->data(), sizeof(h));
+        return h.magic == MAGIC && h.size == data->size();
+    }
+
+    //
+    // Build a snapshot on the server side. A writer may be cleared and
+    // used again, in which case it keeps its memory.
+    //
+    struct writer
+    {
+        writer() : m_data(sizeof(header)) {}
+
+        void clear()
+        {
+            m_data.assign(sizeof(header), 0);
+            m_pending.clear();
+            m_strings.clear();
+        }
+
+        header &head() { return *(header *)m_data.data(); }
+
+        uint32_t size() const { return (uint32_t)m_data.size(); }
+
+        /* Zero-filled room for some records */
+        uint32_t reserve(size_t bytes)
+        {
+            uint32_t offset = size();
+            m_data.resize(offset + bytes);
+            return offset;
+        }
+
+        /* Append a record; “name” is the member of “desc” that holds it */
+        template<typename T> uint32_t add(T const &desc, char const *const &name)
+        {
+            uint32_t offset = reserve(sizeof(record<T>));
+            memcpy(m_data.data() + offset + offsetof(record<T>, m_desc), &desc, sizeof(desc));
+            add_string(offset, offset + offsetof(record<T>, m_name), name);
+            clear(offset, desc, name);
+            return offset;
+        }
+
+        /* Zero the copy of a pointer member of the desc of a record */
+        template<typename T, typename P> void clear(uint32_t offset, T const &desc, P const &member)
+        {
+            size_t field = (uint8_t const *)&member - (uint8_t const *)&desc;
+            memset(m_data.data() + offset + offsetof(record<T>, m_desc) + field, 0, sizeof(P));
+        }
+
+        /* Make the field at “field”, relative to “from”, point at “to” */
+        void point(uint32_t from, uint32_t field, uint32_t to)
+        {
+            int32_t delta = (int32_t)(to - from);
+            memcpy(m_data.data() + field, &delta, sizeof(delta));
+        }
+
+        /* Same, for a copy of a string or of some data, stored later */
+        void add_string(uint32_t from, uint32_t field, char const *s)
+        {
+            add_pending(from, field, s ? s : "", s ? strlen(s) + 1 : 1, false);
+        }
+
+        void add_data(uint32_t from, uint32_t field, void const *data, size_t size)
+        {
+            add_pending(from, field, data, size, true);
+        }
+
+        std::vector<uint8_t> &finish()
+        {
+            for (auto const &p : m_pending)
+            {
+                /* Keep variable default values aligned */
+                if (p.align)
+                    m_data.resize((m_data.size() + 7) & ~(size_t)7);
+                point(p.from, p.field, size());
+                m_data.insert(m_data.end(), m_strings.begin() + p.offset,
+                              m_strings.begin() + p.offset + p.size);
+            }
+            m_pending.clear();
+            m_strings.clear();
+
+            head().magic = MAGIC;
+            head().size = size();
+            return m_data;
+        }
+
+    private:
+        /* Copies wait in one string, rather than one string each */
+        struct pending
+        {
+            uint32_t from, field;
+            size_t offset, size;
+            bool align;
+        };
+
+        void add_pending(uint32_t from, uint32_t field, void const *data, size_t size,
+                         bool align)
+        {
+            pending p = { from, field, m_strings.size(), size, align };
+            m_pending.push_back(p);
+            m_strings.append((char const *)data, size);
+        }
+
+        std::vector<uint8_t> m_data;
+        std::vector<pending> m_pending;
+        std::string m_strings;
+    };
+};
@@ -0,0 +1,82 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+#pragma once
+
+#include <cerrno> /* for errno */
+#include <csignal> /* for sigset_t */
+#include <cstddef> /* for size_t */
+#include <cstdint> /* for int64_t */
+
+#include <unistd.h> /* for read() */
+#include <pthread.h> /* for pthread_sigmask() */
+#include <sys/socket.h> /* for send() */
+
+#include <chrono> /* for std::chrono */
+
+//
+// System helpers shared by the client headers and the tools; they only
+// exist on the Linux side.
+//
+struct d3d4linux_sys
+{
+    /* Milliseconds on a monotonic clock */
+    static int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /* Write all of “data” to a socket; a closed peer is an error, not a
+     * SIGPIPE */
+    static bool send_all(int fd, void const *data, size_t size)
+    {
+        char const *p = (char const *)data;
+        while (size > 0)
+        {
+            ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static bool read_all(int fd, void *data, size_t size)
+    {
+        char *p = (char *)data;
+        while (size > 0)
+        {
+            ssize_t n = read(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    /* Have writes from this thread to a dead pipe or socket fail with
+     * EPIPE instead of killing the process */
+    static void block_sigpipe()
+    {
+        sigset_t set;
+        sigemptyset(&set);
+        sigaddset(&set, SIGPIPE);
+        pthread_sigmask(SIG_BLOCK, &set, nullptr);
+    }
+};
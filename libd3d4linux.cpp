@@ -0,0 +1,216 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// libd3d4linux: the whole client behind the C interface of
+// d3d4linux_abi.h, for programs built with D3D4LINUX_SHARED
+//
+
+#include <cstdlib> /* for malloc() */
+#include <cstring> /* for memcpy() */
+
+#include <vector> /* for std::vector */
+
+#include <d3d4linux.h>
+#include <d3d4linux_abi.h>
+
+static void give(void const *data, size_t size, d3d4linux_buffer *out)
+{
+    out->data = malloc(size ? size : 1);
+    out->size = size;
+    memcpy(out->data, data, size);
+}
+
+static void give_blob(ID3DBlob *blob, d3d4linux_buffer *out)
+{
+    out->data = nullptr;
+    out->size = 0;
+    if (!blob)
+        return;
+    give(blob->GetBufferPointer(), blob->GetBufferSize(), out);
+    delete blob;
+}
+
+/* Calls back into the ID3DInclude of the program */
+struct abi_include : ID3DInclude
+{
+    abi_include(d3d4linux_include const *include) : m_include(include) {}
+
+    /* What to give d3d4linux for that include */
+    ID3DInclude *get()
+    {
+        if (m_include == D3D4LINUX_STANDARD_INCLUDE)
+            return D3D_COMPILE_STANDARD_FILE_INCLUDE;
+        return m_include ? this : nullptr;
+    }
+
+    virtual HRESULT Open(D3D_INCLUDE_TYPE IncludeType, char const *pFileName,
+                         void const *pParentData, void const **ppData,
+                         uint32_t *pBytes)
+    {
+        return m_include->open(m_include->context, IncludeType, pFileName,
+                               pParentData, ppData, pBytes);
+    }
+
+    virtual HRESULT Close(void const *pData)
+    {
+        return m_include->close(m_include->context, pData);
+    }
+
+private:
+    d3d4linux_include const *m_include;
+};
+
+extern "C" {
+
+int d3d4linux_abi_version(void)
+{
+    return D3D4LINUX_ABI_VERSION;
+}
+
+int *d3d4linux_compiler_version(void)
+{
+    return &d3d4linux::compiler_version();
+}
+
+int *d3d4linux_priority(void)
+{
+    return &d3d4linux::priority();
+}
+
+void d3d4linux_free(void *data)
+{
+    free(data);
+}
+
+long d3d4linux_compile(int version, void const *src, size_t size,
+                       char const *file, d3d4linux_define const *defines,
+                       d3d4linux_include const *include,
+                       char const *entry, char const *target,
+                       uint32_t flags1, uint32_t flags2,
+                       d3d4linux_buffer *code, d3d4linux_buffer *errors)
+{
+    abi_include inc(include);
+    ID3DBlob *code_blob = nullptr, *error_blob = nullptr;
+    HRESULT ret = d3d4linux::compile(version, src, size, file,
+                                     (D3D_SHADER_MACRO const *)defines, inc.get(),
+                                     entry, target, flags1, flags2,
+                                     &code_blob, &error_blob);
+    give_blob(code_blob, code);
+    give_blob(error_blob, errors);
+    return ret;
+}
+
+long d3d4linux_preprocess(int version, void const *src, size_t size,
+                          char const *file, d3d4linux_define const *defines,
+                          d3d4linux_include const *include,
+                          d3d4linux_buffer *text, d3d4linux_buffer *errors)
+{
+    abi_include inc(include);
+    ID3DBlob *text_blob = nullptr, *error_blob = nullptr;
+    HRESULT ret = d3d4linux::preprocess(version, src, size, file,
+                                        (D3D_SHADER_MACRO const *)defines, inc.get(),
+                                        &text_blob, &error_blob);
+    give_blob(text_blob, text);
+    give_blob(error_blob, errors);
+    return ret;
+}
+
+long d3d4linux_strip(int version, void const *code, size_t size,
+                     uint32_t flags, d3d4linux_buffer *out)
+{
+    ID3DBlob *blob = nullptr;
+    HRESULT ret = d3d4linux::strip_shader(version, code, size, flags, &blob);
+    give_blob(blob, out);
+    return ret;
+}
+
+long d3d4linux_disassemble(int version, void const *code, size_t size,
+                           uint32_t flags, char const *comments,
+                           d3d4linux_buffer *out)
+{
+    ID3DBlob *blob = nullptr;
+    HRESULT ret = d3d4linux::disassemble(version, code, size, flags, comments, &blob);
+    give_blob(blob, out);
+    return ret;
+}
+
+long d3d4linux_dll_compress_shaders(int version, uint32_t count,
+                                    d3d4linux_buffer const *shaders,
+                                    uint32_t flags, d3d4linux_buffer *out)
+{
+    ID3DBlob *blob = nullptr;
+    HRESULT ret = d3d4linux::dll_compress_shaders(version, count,
+                                                  (D3D_SHADER_DATA *)shaders,
+                                                  flags, &blob);
+    give_blob(blob, out);
+    return ret;
+}
+
+long d3d4linux_dll_decompress_shaders(int version, void const *data, size_t size,
+                                      uint32_t count, uint32_t start,
+                                      uint32_t const *indices, uint32_t flags,
+                                      d3d4linux_buffer *out, uint32_t *total)
+{
+    std::vector<ID3DBlob *> blobs(count);
+    HRESULT ret = d3d4linux::dll_decompress_shaders(version, data, size, count, start,
+                                                    (uint32_t *)indices, flags,
+                                                    blobs.data(), total);
+    for (uint32_t i = 0; i < count; ++i)
+        give_blob(blobs[i], &out[i]);
+    return ret;
+}
+
+long d3d4linux_reflect(int version, void const *code, size_t size,
+                       long iid, d3d4linux_buffer *snapshot, void **source)
+{
+    std::vector<uint8_t> data;
+    d3d4linux_snapshot::source *s = nullptr;
+    HRESULT ret = d3d4linux::reflect_snapshot(version, code, size, iid, data, s);
+    snapshot->data = nullptr;
+    snapshot->size = 0;
+    if (data.empty())
+    {
+        delete s;
+        s = nullptr;
+    }
+    else
+        give(data.data(), data.size(), snapshot);
+    *source = s;
+    return ret;
+}
+
+int d3d4linux_reflect_fetch(void *source, int64_t query, int64_t *index,
+                            char const *name, d3d4linux_buffer *out)
+{
+    std::vector<uint8_t> data;
+    if (!((d3d4linux_snapshot::source *)source)->fetch(query, *index, name, data))
+        return 0;
+    give(data.data(), data.size(), out);
+    return 1;
+}
+
+void d3d4linux_reflect_close(void *source)
+{
+    delete (d3d4linux_snapshot::source *)source;
+}
+
+void d3d4linux_server_startup(d3d4linux_startup *stats)
+{
+    d3d4linux::startup_stats st = d3d4linux::server_startup();
+    stats->servers = st.servers;
+    stats->prefixes = st.prefixes;
+    stats->average_msecs = st.average_msecs;
+    stats->max_msecs = st.max_msecs;
+}
+
+}
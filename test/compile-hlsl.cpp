@@ -152,6 +152,8 @@ int main(int argc, char *argv[])
                     }
                 }
             }
+
+            reflector->Release();
         }
 
         printf("Calling: D3DStripShader\n");
@@ -0,0 +1,233 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// Tests for the native DXBC code of d3d4linux_dxbc.h against containers
+// written by the compiler DLL: our checksum must match the one the DLL
+// stored, D3DSetBlobPart() / D3DGetBlobPart() must round-trip, and shader
+// libraries must be what the DLL writes and reads. The argument is either
+// a compiled shader, or a source that gets compiled through the server
+// first.
+//
+
+#include "d3d4linux.h"
+
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <streambuf>
+
+#include <cstdio>
+#include <cstring>
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    failures += !ok;
+}
+
+/* Whether the checksum stored in a container is the one we compute */
+static bool checksum_matches(void const *data, size_t size)
+{
+    uint8_t digest[16];
+    if (size < 20 || memcmp(data, "DXBC", 4))
+        return false;
+    d3d4linux_dxbc::checksum((uint8_t const *)data, size, digest);
+    return !memcmp((uint8_t const *)data + 4, digest, 16);
+}
+
+static std::string get_part(std::string const &shader, D3D_BLOB_PART part)
+{
+    ID3DBlob *blob = nullptr;
+    if (FAILED(D3DGetBlobPart(shader.data(), shader.size(), part, 0, &blob)))
+        return "";
+    std::string ret((char const *)blob->GetBufferPointer(), blob->GetBufferSize());
+    blob->Release();
+    return ret;
+}
+
+static std::string to_string(ID3DBlob *blob)
+{
+    std::string ret;
+    if (blob)
+    {
+        ret.assign((char const *)blob->GetBufferPointer(), blob->GetBufferSize());
+        blob->Release();
+    }
+    return ret;
+}
+
+/* Shaders 2, 0 and 1 of a library, read by us or by the DLL */
+static std::vector<std::string> decompress(std::string const &library, bool dll)
+{
+    uint32_t indices[3] = { 2, 0, 1 }, total = 0;
+    ID3DBlob *blobs[3] = { nullptr, nullptr, nullptr };
+    HRESULT ret = dll ? d3d4linux::dll_decompress_shaders(d3d4linux::compiler_version(),
+                                                          library.data(), library.size(),
+                                                          3, 0, indices, 0, blobs, &total)
+                      : D3DDecompressShaders(library.data(), library.size(),
+                                             3, 0, indices, 0, blobs, &total);
+    std::vector<std::string> shaders;
+    for (ID3DBlob *blob : blobs)
+        shaders.push_back(to_string(blob));
+    if (FAILED(ret) || total != 3)
+        shaders.clear();
+    return shaders;
+}
+
+static std::string set_part(std::string const &shader, D3D_BLOB_PART part,
+                            std::string const &data)
+{
+    ID3DBlob *blob = nullptr;
+    if (FAILED(D3DSetBlobPart(shader.data(), shader.size(), part, 0,
+                              data.data(), data.size(), &blob)))
+        return "";
+    std::string ret((char const *)blob->GetBufferPointer(), blob->GetBufferSize());
+    blob->Release();
+    return ret;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2 && argc != 4)
+    {
+        fprintf(stderr, "Usage: %s <shader.dxbc>\n"
+                        "       %s <shader.hlsl> <entry_point> <type>\n",
+                argv[0], argv[0]);
+        return -1;
+    }
+
+    std::ifstream t(argv[1], std::ios::binary);
+    std::string shader((std::istreambuf_iterator<char>(t)),
+                        std::istreambuf_iterator<char>());
+
+    if (shader.compare(0, 4, "DXBC") != 0)
+    {
+        if (argc != 4)
+        {
+            fprintf(stderr, "%s: not a compiled shader\n", argv[1]);
+            return -1;
+        }
+
+        ID3DBlob *shader_blob = nullptr, *error_blob = nullptr;
+        HRESULT ret = D3DCompile(shader.data(), shader.size(), argv[1],
+                                 nullptr, nullptr, argv[2], argv[3],
+                                 0, 0, &shader_blob, &error_blob);
+        if (FAILED(ret))
+        {
+            fprintf(stderr, "D3DCompile failed: 0x%x\n%s\n", (int)ret,
+                    error_blob ? (char const *)error_blob->GetBufferPointer() : "");
+            return -1;
+        }
+        shader.assign((char const *)shader_blob->GetBufferPointer(),
+                      shader_blob->GetBufferSize());
+        shader_blob->Release();
+    }
+
+    std::vector<d3d4linux_dxbc::chunk> chunks;
+    check(d3d4linux_dxbc::parse(shader.data(), shader.size(), chunks),
+          "container parses");
+    check(checksum_matches(shader.data(), shader.size()),
+          "checksum matches the compiler's");
+
+    /* The DLL also checksums what D3DStripShader() gives back */
+    ID3DBlob *strip_blob = nullptr;
+    if (SUCCEEDED(D3DStripShader(shader.data(), shader.size(),
+                                 D3DCOMPILER_STRIP_REFLECTION_DATA, &strip_blob)))
+    {
+        check(checksum_matches(strip_blob->GetBufferPointer(),
+                               strip_blob->GetBufferSize()),
+              "checksum matches the compiler's after D3DStripShader");
+        strip_blob->Release();
+    }
+
+    std::string signature = get_part(shader, D3D_BLOB_INPUT_SIGNATURE_BLOB);
+    check(checksum_matches(signature.data(), signature.size()),
+          "input signature blob is checksummed");
+    check(get_part(shader, D3D_BLOB_PRIVATE_DATA).empty(),
+          "no private data after compilation");
+
+    /* Add, then replace private data; nothing else may change */
+    std::string data1 = "private data", data2(1000, '\xa5');
+    std::string shader1 = set_part(shader, D3D_BLOB_PRIVATE_DATA, data1);
+    std::string shader2 = set_part(shader1, D3D_BLOB_PRIVATE_DATA, data2);
+
+    check(checksum_matches(shader1.data(), shader1.size()),
+          "checksum is valid after D3DSetBlobPart");
+    check(get_part(shader1, D3D_BLOB_PRIVATE_DATA) == data1,
+          "private data round-trips");
+    check(checksum_matches(shader2.data(), shader2.size()),
+          "checksum is valid after replacing private data");
+    check(get_part(shader2, D3D_BLOB_PRIVATE_DATA) == data2,
+          "replaced private data round-trips");
+    check(get_part(shader2, D3D_BLOB_INPUT_SIGNATURE_BLOB) == signature,
+          "other parts are left alone");
+
+    /* Signatures come from the compiler and cannot be set */
+    ID3DBlob *blob = nullptr;
+    check(FAILED(D3DSetBlobPart(shader.data(), shader.size(),
+                                D3D_BLOB_INPUT_SIGNATURE_BLOB, 0,
+                                data1.data(), data1.size(), &blob)),
+          "signatures cannot be set");
+
+    /* Shader libraries: ours must hold the same parts as the DLL's, and
+     * each side must read what the other wrote */
+    std::string raw = "not a shader";
+    D3D_SHADER_DATA library[3] =
+    {
+        { shader.data(), shader.size() },
+        { shader1.data(), shader1.size() },
+        { raw.data(), raw.size() },
+    };
+
+    for (uint32_t flags : { 0, D3D_COMPRESS_SHADER_KEEP_ALL_PARTS })
+    {
+        ID3DBlob *blob = nullptr;
+        HRESULT ret = D3DCompressShaders(3, library, flags, &blob);
+        std::string native = to_string(blob);
+        check(SUCCEEDED(ret), "D3DCompressShaders succeeds");
+        ret = d3d4linux::dll_compress_shaders(d3d4linux::compiler_version(), 3,
+                                              library, flags, &blob);
+        std::string dll = to_string(blob);
+        check(SUCCEEDED(ret), "the DLL's D3DCompressShaders succeeds");
+
+        std::vector<d3d4linux_cab::file> native_files, dll_files;
+        check(native.compare(0, 32, dll, 0, 32) == 0
+               && d3d4linux_cab::read(native.data() + 32, native.size() - 32, native_files)
+               && d3d4linux_cab::read(dll.data() + 32, dll.size() - 32, dll_files)
+               && native_files.size() == dll_files.size()
+               && std::equal(native_files.begin(), native_files.end(), dll_files.begin(),
+                             [](d3d4linux_cab::file const &a, d3d4linux_cab::file const &b)
+                             { return a.name == b.name && a.data == b.data; }),
+              "D3DCompressShaders writes the parts the DLL writes, in its order");
+
+        std::vector<std::string> expected = decompress(dll, true);
+        check(expected.size() == 3 && expected[0] == raw
+               && get_part(expected[2], D3D_BLOB_PRIVATE_DATA) == data1,
+              "the DLL reads back its own library");
+        check(decompress(dll, false) == expected,
+              "D3DDecompressShaders reads the DLL's library");
+        check(decompress(native, true) == expected,
+              "the DLL reads our library");
+        check(decompress(native, false) == expected,
+              "D3DDecompressShaders reads our library");
+        for (auto const &s : expected)
+            check(s == raw || checksum_matches(s.data(), s.size()),
+                  "decompressed shaders are checksummed");
+    }
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,202 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// Tests for the local cache store of d3d4linux_pack.h: its codec must
+// round-trip and reject truncated input, the store must survive being
+// reopened, must not trust a damaged pack, and must shrink to its budget
+// when compacted. They need neither Wine nor the compiler DLL.
+//
+
+#include "d3d4linux_pack.h"
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <dirent.h>
+#include <unistd.h>
+
+static int failures = 0;
+
+static void check(bool ok, char const *what)
+{
+    printf("%s: %s\n", ok ? "ok" : "FAIL", what);
+    failures += !ok;
+}
+
+static bool round_trips(std::string const &data)
+{
+    std::string packed, unpacked(data.size(), '\0');
+    return d3d4linux_pack::compress((uint8_t const *)data.data(), data.size(), packed)
+            && d3d4linux_pack::decompress((uint8_t const *)packed.data(), packed.size(),
+                                          (uint8_t *)&unpacked[0], unpacked.size())
+            && unpacked == data;
+}
+
+/* What put() stores for key i */
+static std::string value(int i, size_t size)
+{
+    std::mt19937 rng(i);
+    std::string ret(size, '\0');
+    for (auto &c : ret)
+        c = (char)rng();
+    return ret;
+}
+
+static std::vector<std::string> packs(std::string const &dir)
+{
+    std::vector<std::string> ret;
+    DIR *d = opendir(dir.c_str());
+    for (dirent *e = d ? readdir(d) : nullptr; e; e = readdir(d))
+        if (!strncmp(e->d_name, "pack-", 5))
+            ret.push_back(dir + "/" + e->d_name);
+    if (d)
+        closedir(d);
+    return ret;
+}
+
+static void remove_dir(std::string const &dir)
+{
+    DIR *d = opendir(dir.c_str());
+    for (dirent *e = d ? readdir(d) : nullptr; e; e = readdir(d))
+        if (strcmp(e->d_name, ".") && strcmp(e->d_name, ".."))
+            unlink((dir + "/" + e->d_name).c_str());
+    if (d)
+        closedir(d);
+    rmdir(dir.c_str());
+}
+
+int main()
+{
+    /* The codec, on input that compresses well, badly, or not at all */
+    std::string text;
+    for (int i = 0; text.size() < 100000; ++i)
+        text += "float4 color" + std::to_string(i % 37) + " : SV_Target;\n";
+    check(round_trips(""), "empty input round-trips");
+    check(round_trips("abc"), "input shorter than a match round-trips");
+    check(round_trips(std::string(70000, 'x')), "long runs round-trip");
+    check(round_trips(text), "text round-trips");
+    check(round_trips(value(0, 100000)), "random bytes round-trip");
+
+    std::string packed, unpacked(text.size(), '\0');
+    d3d4linux_pack::compress((uint8_t const *)text.data(), text.size(), packed);
+    check(packed.size() < text.size() / 4, "text compresses");
+    bool truncated_ok = true;
+    for (size_t len = 0; len < packed.size(); len += 1 + len / 8)
+        truncated_ok = truncated_ok
+                    && !d3d4linux_pack::decompress((uint8_t const *)packed.data(), len,
+                                                   (uint8_t *)&unpacked[0], unpacked.size());
+    check(truncated_ok, "truncated input is rejected");
+    check(!d3d4linux_pack::decompress((uint8_t const *)packed.data(), packed.size(),
+                                      (uint8_t *)&unpacked[0], unpacked.size() - 1),
+          "output larger than announced is rejected");
+
+    char tmpl[] = "/tmp/d3d4linux-pack-XXXXXX";
+    if (!mkdtemp(tmpl))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string dir = tmpl;
+
+    /* The store, across instances; odd sizes leave records unaligned */
+    enum { COUNT = 64, SIZE = 20001 };
+    auto fill = [&text](std::string const &dir)
+    {
+        d3d4linux_pack store(dir, 0);
+        bool ok = store.open();
+        for (int i = 1; i <= COUNT; ++i)
+            store.put(i, i, value(i, SIZE));
+        store.put(COUNT + 1, 0, text);
+        return ok;
+    };
+    check(fill(dir + "/a"), "a new store opens");
+
+    {
+        d3d4linux_pack store(dir + "/a", 0);
+        check(store.open(), "an existing store opens");
+        bool all = true;
+        std::string v;
+        for (int i = 1; i <= COUNT; ++i)
+            all = all && store.get(i, i, v) && v == value(i, SIZE);
+        check(all, "incompressible values survive a reopen");
+        check(store.get(COUNT + 1, 0, v) && v == text, "compressed values survive a reopen");
+        check(!store.get(COUNT + 2, 0, v), "unknown keys miss");
+        check(!store.get(1, 2, v), "keys match on all 128 bits");
+    }
+
+    /* Damage the first record's header, then cut the pack short */
+    std::vector<std::string> before = packs(dir + "/a");
+    check(before.size() == 1, "entries go to one pack");
+    FILE *f = before.empty() ? nullptr : fopen(before[0].c_str(), "r+b");
+    if (f)
+    {
+        fputc(0, f);
+        fclose(f);
+    }
+    {
+        d3d4linux_pack store(dir + "/a", 0);
+        store.open();
+        std::string v;
+        check(!store.get(1, 1, v), "a damaged record is not returned");
+        check(store.get(2, 2, v) && v == value(2, SIZE), "other records are still found");
+    }
+    if (!before.empty() && truncate(before[0].c_str(), SIZE * 3) != 0)
+        perror("truncate");
+    {
+        d3d4linux_pack store(dir + "/a", 0);
+        store.open();
+        std::string v;
+        check(!store.get(COUNT, COUNT, v), "records past the end of the pack are not returned");
+        check(store.get(2, 2, v) && v == value(2, SIZE), "records before it are still found");
+    }
+
+    /* Compaction keeps what fits in 3/4 of the budget, in new packs */
+    fill(dir + "/b");
+    before = packs(dir + "/b");
+    {
+        uint64_t budget = SIZE * COUNT / 4;
+        d3d4linux_pack store(dir + "/b", budget);
+        check(store.attach(), "the store attaches for compaction");
+        store.compact();
+
+        std::vector<std::string> after = packs(dir + "/b");
+        check(after.size() == 1 && after != before, "compaction replaces the packs");
+
+        size_t hits = 0;
+        bool right = true;
+        std::string v;
+        for (int i = 1; i <= COUNT; ++i)
+            if (store.get(i, i, v))
+            {
+                ++hits;
+                right = right && v == value(i, SIZE);
+            }
+        check(hits > 0 && hits * SIZE <= budget / 4 * 3, "compaction keeps what fits the budget");
+        check(right, "compacted values are intact");
+
+        store.put(COUNT + 3, 0, text);
+        check(store.get(COUNT + 3, 0, v) && v == text, "the compacted store takes new values");
+    }
+
+    remove_dir(dir + "/a");
+    remove_dir(dir + "/b");
+    rmdir(dir.c_str());
+
+    printf("%d failures\n", failures);
+    return failures ? 1 : 0;
+}
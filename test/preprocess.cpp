@@ -0,0 +1,309 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// Tests for the native preprocessor of d3d4linux_preprocess.h, which
+// replaces Microsoft's on every D3DCompile() with defines or includes.
+// They need neither Wine nor the compiler DLL.
+//
+
+#include "d3d4linux.h"
+
+#include <map>
+#include <string>
+
+#include <cstdio>
+#include <cstring>
+
+/* Files that the tests may include */
+static std::map<std::string, std::string> files =
+{
+    { "a.h", "int a = A;\n" },
+    { "nested.h", "#include \"a.h\"\nint n;\n" },
+    { "once.h", "#pragma once\nint once;\n" },
+    { "guarded.h", "#ifndef GUARDED\n#define GUARDED\nint guarded;\n#endif\n" },
+    { "macros.h", "#define FROM_HEADER(x) (x + 1)\n" },
+};
+
+struct include_handler : ID3DInclude
+{
+    HRESULT Open(D3D_INCLUDE_TYPE, char const *name, void const *,
+                 void const **data, uint32_t *bytes)
+    {
+        auto it = files.find(name);
+        if (it == files.end())
+            return E_FAIL;
+        *data = it->second.data();
+        *bytes = (uint32_t)it->second.size();
+        return S_OK;
+    }
+
+    HRESULT Close(void const *)
+    {
+        return S_OK;
+    }
+};
+
+struct test_case
+{
+    char const *name;
+    char const *source;
+    /* The non-blank output lines with their locations, or null if the
+     * source must fail to preprocess */
+    char const *expected;
+};
+
+static test_case const tests[] =
+{
+    /* # and ## */
+    { "stringize",
+      "#define S(x) #x\n"
+      "S( a  +  b ) S(\"q\") S()\n",
+      "main.hlsl:2 \"a + b\" \"\\\"q\\\"\" \"\"\n" },
+    { "paste",
+      "#define CAT(a, b) a##b\n"
+      "CAT(x, 1) CAT(, y) CAT(1, 2) CAT(<, <)\n",
+      "main.hlsl:2 x1 y 12 <<\n" },
+    { "stringize before expansion",
+      "#define STR(x) #x\n"
+      "#define XSTR(x) STR(x)\n"
+      "#define N 42\n"
+      "STR(N) XSTR(N)\n",
+      "main.hlsl:4 \"N\" \"42\"\n" },
+    { "paste before expansion",
+      "#define CAT(a, b) a##b\n"
+      "#define XCAT(a, b) CAT(a, b)\n"
+      "#define N 42\n"
+      "CAT(N, 1) XCAT(N, 1)\n",
+      "main.hlsl:4 N1 421\n" },
+
+    /* __VA_ARGS__ */
+    { "variadic",
+      "#define F(fmt, ...) f(fmt, __VA_ARGS__)\n"
+      "#define G(...) g(__VA_ARGS__)\n"
+      "F(a, b, (c, d)) G() G(1, 2)\n",
+      "main.hlsl:3 f(a, b, (c, d)) g() g(1, 2)\n" },
+    { "variadic stringize",
+      "#define S(...) #__VA_ARGS__\n"
+      "S(a, b,c)\n",
+      "main.hlsl:2 \"a, b,c\"\n" },
+
+    /* Hidesets: a macro is never expanded inside its own expansion */
+    { "self reference",
+      "#define foo foo bar\n"
+      "foo\n",
+      "main.hlsl:2 foo bar\n" },
+    { "mutual reference",
+      "#define x y\n"
+      "#define y x\n"
+      "x y\n",
+      "main.hlsl:3 x y\n" },
+    { "rescan with following tokens",
+      "#define f(a) a*g\n"
+      "#define g(a) f(a)\n"
+      "f(2)(9)\n",
+      "main.hlsl:3 2*9*g\n" },
+    { "function-like name alone",
+      "#define f(x) x\n"
+      "f + f(1)\n",
+      "main.hlsl:2 f + 1\n" },
+    { "object-like with parenthesis",
+      "#define F (x) + 1\n"
+      "F(2)\n",
+      "main.hlsl:2 (x) + 1(2)\n" },
+
+    /* #if arithmetic */
+    { "if arithmetic",
+      "#if (1 << 4) + 3 * 2 - 10 / 3 == 19 && (7 % 4) == 3 && (0x10 | 1) == 17\n"
+      "yes\n"
+      "#endif\n"
+      "#if -1 < 0 && ~0 == -1 && (6 ^ 3) == 5 && (6 & 3) == 2 && 16 >> 2 == 4\n"
+      "yes\n"
+      "#endif\n"
+      "#if 2 > 3 || 3 <= 2 || !(2 != 3) || '\\n' != 10\n"
+      "no\n"
+      "#endif\n",
+      "main.hlsl:2 yes\n"
+      "main.hlsl:5 yes\n" },
+    { "if ternary and defined",
+      "#define Y\n"
+      "#if (defined Y && !defined(Z) ? 5 : 6) == 5\n"
+      "yes\n"
+      "#elif 1\n"
+      "no\n"
+      "#else\n"
+      "no\n"
+      "#endif\n",
+      "main.hlsl:3 yes\n" },
+    { "if macros",
+      "#define TWO 2\n"
+      "#define ADD(a, b) ((a) + (b))\n"
+      "#if ADD(TWO, 3) == 5 && UNDEFINED == 0\n"
+      "yes\n"
+      "#endif\n",
+      "main.hlsl:4 yes\n" },
+    { "if short-circuit",
+      "#if 0 && (1 / 0)\n"
+      "no\n"
+      "#endif\n"
+      "#if 1 || 1 % 0\n"
+      "yes\n"
+      "#endif\n"
+      "#if defined(X) && X(1)\n"
+      "no\n"
+      "#endif\n"
+      "#if 1 ? 2 : 1 / 0\n"
+      "yes\n"
+      "#endif\n",
+      "main.hlsl:5 yes\n"
+      "main.hlsl:11 yes\n" },
+    { "if division by zero", "#if 1 / 0\n#endif\n", nullptr },
+    { "if syntax error", "#if 0 && (1\n#endif\n", nullptr },
+    { "if unterminated", "#if 1\n", nullptr },
+
+    /* Includes */
+    { "include",
+      "#define A 42\n"
+      "#include \"a.h\"\n"
+      "int b;\n",
+      "a.h:1 int a = 42;\n"
+      "main.hlsl:3 int b;\n" },
+    { "include nested",
+      "#define A 1\n"
+      "#include \"nested.h\"\n"
+      "int b;\n",
+      "a.h:1 int a = 1;\n"
+      "nested.h:2 int n;\n"
+      "main.hlsl:3 int b;\n" },
+    { "include once and guards",
+      "#include \"once.h\"\n"
+      "#include \"once.h\"\n"
+      "#include \"guarded.h\"\n"
+      "#include \"guarded.h\"\n"
+      "int b;\n",
+      "once.h:2 int once;\n"
+      "guarded.h:3 int guarded;\n"
+      "main.hlsl:5 int b;\n" },
+    { "include macros",
+      "#include \"macros.h\"\n"
+      "FROM_HEADER(2)\n",
+      "main.hlsl:2 (2 + 1)\n" },
+    { "include missing", "#include \"missing.h\"\n", nullptr },
+
+    /* Other directives */
+    { "line",
+      "a __LINE__\n"
+      "#line 10 \"other.hlsl\"\n"
+      "b __LINE__\n",
+      "main.hlsl:1 a 1\n"
+      "other.hlsl:10 b 10\n" },
+    { "undef",
+      "#define A 1\n"
+      "#undef A\n"
+      "A\n",
+      "main.hlsl:3 A\n" },
+    { "pragma passed through",
+      "#pragma pack_matrix(row_major)\n",
+      "main.hlsl:1 #pragma pack_matrix(row_major)\n" },
+    { "error", "#error stop here\n", nullptr },
+    { "skipped error", "#if 0\n#error not reached\n#endif\n", "" },
+};
+
+/* Pairs of sources that must, or must not, give the same cache key */
+struct canonical_case
+{
+    char const *a, *b;
+    bool same;
+};
+
+static canonical_case const canonical_tests[] =
+{
+    { "float4 f(float x) { return x; }",
+      "float4  f(float  x)\t{\n  return x; // identity\n}", true },
+    { "a /* comment */ b", "a b", true },
+    { "a\n\n\nb", "a\nb", true },
+    { "#define A 1\nA", "#define  A\t1 /* one */\n\nA", true },
+    { "#define F(x) x", "#define F (x) x", false },
+    { "S(a+b)", "S(a + b)", false },
+    { "a+ +b", "a++b", false },
+    { "a\n#line 10\nb", "a\nb", true },
+    { "a __LINE__\nb", "a __LINE__\n\nb", false },
+};
+
+/* Resolve the #line markers and prefix every non-blank line with the
+ * location the compiler will report for it */
+static std::string locate(std::string const &s)
+{
+    std::string ret, file = "?";
+    int line = 1;
+    for (size_t start = 0; start < s.size(); )
+    {
+        size_t end = s.find('\n', start);
+        end = end == std::string::npos ? s.size() : end + 1;
+        std::string text = s.substr(start, end - start);
+        start = end;
+
+        char name[256];
+        if (sscanf(text.c_str(), "#line %d \"%255[^\"]\"", &line, name) == 2)
+        {
+            file = name;
+            continue;
+        }
+        if (text.find_first_not_of(" \t\r\n") != std::string::npos)
+            ret += file + ":" + std::to_string(line) + " " + text;
+        ++line;
+    }
+    return ret;
+}
+
+int main()
+{
+    int failures = 0;
+    include_handler handler;
+
+    for (auto const &t : tests)
+    {
+        d3d4linux_preprocessor pp(&handler);
+        std::string output;
+        bool ok = pp.run(t.source, strlen(t.source), "main.hlsl", output);
+        output = locate(output);
+
+        bool passed = t.expected ? ok && output == t.expected : !ok;
+        if (!passed)
+        {
+            ++failures;
+            printf("FAIL: %s\n", t.name);
+            printf("  expected %s:\n%s", t.expected ? "output" : "failure",
+                   t.expected ? t.expected : "");
+            printf("  got %s:\n%s%s", ok ? "output" : "failure", output.c_str(),
+                   pp.errors().c_str());
+        }
+    }
+
+    for (auto const &t : canonical_tests)
+    {
+        std::string a, b;
+        d3d4linux_preprocessor::canonicalize(t.a, strlen(t.a), false, a);
+        d3d4linux_preprocessor::canonicalize(t.b, strlen(t.b), false, b);
+        if ((a == b) != t.same)
+        {
+            ++failures;
+            printf("FAIL: canonical forms should %s:\n  %s\n  %s\n",
+                   t.same ? "match" : "differ", a.c_str(), b.c_str());
+        }
+    }
+
+    int count = (int)(sizeof(tests) / sizeof(*tests)
+                       + sizeof(canonical_tests) / sizeof(*canonical_tests));
+    printf("%d/%d preprocessor tests passed\n", count - failures, count);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,490 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// Compile every job of a manifest in parallel and store the results in a
+// single indexed archive.
+//
+// The manifest has one JSON object per line:
+//
+//   {"name": "BasePass_PS", "file": "shaders/base.hlsl", "entry": "main",
+//    "target": "ps_5_0", "flags": 4096, "defines": {"USE_FOG": "1"}}
+//
+// Only "file", "entry" and "target" are mandatory. The archive layout is:
+//
+//   header:  "D4LA", u32 version (1), u32 entry count, u64 index offset
+//   data:    the code blobs of all successful jobs, back to back
+//   index:   for each job, u32 name length, name, i64 HRESULT,
+//            u64 data offset, u64 data size
+//
+// All integers are little endian.
+//
+
+#include "d3d4linux.h"
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cctype>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+struct job
+{
+    job() : flags1(0), flags2(0), predicted(0), ret(E_FAIL), offset(0), size(0), msecs(0) {}
+
+    std::string name, file, entry, target;
+    uint32_t flags1, flags2;
+    std::vector<std::pair<std::string, std::string>> defines;
+    double predicted;
+
+    HRESULT ret;
+    uint64_t offset, size;
+    double msecs;
+    std::string errors;
+};
+
+//
+// Just enough JSON to read flat manifest objects: string, number and
+// boolean values, plus one level of nested object for the defines.
+//
+struct json_reader
+{
+    json_reader(std::string const &s) : m_s(s), m_pos(0) {}
+
+    bool parse(job &j)
+    {
+        if (!expect('{'))
+            return false;
+        if (peek() == '}')
+            return expect('}');
+
+        for (;;)
+        {
+            std::string key, value;
+            if (!read_string(key) || !expect(':'))
+                return false;
+
+            if (key == "defines")
+            {
+                if (!read_object(j.defines))
+                    return false;
+            }
+            else if (!read_scalar(value))
+                return false;
+
+            if (key == "name")
+                j.name = value;
+            else if (key == "file")
+                j.file = value;
+            else if (key == "entry")
+                j.entry = value;
+            else if (key == "target")
+                j.target = value;
+            else if (key == "flags")
+                j.flags1 = (uint32_t)strtoul(value.c_str(), nullptr, 0);
+            else if (key == "flags2")
+                j.flags2 = (uint32_t)strtoul(value.c_str(), nullptr, 0);
+
+            if (peek() == ',')
+            {
+                expect(',');
+                continue;
+            }
+            return expect('}');
+        }
+    }
+
+private:
+    char peek()
+    {
+        while (m_pos < m_s.size() && isspace((unsigned char)m_s[m_pos]))
+            ++m_pos;
+        return m_pos < m_s.size() ? m_s[m_pos] : '\0';
+    }
+
+    bool expect(char ch)
+    {
+        if (peek() != ch)
+            return false;
+        ++m_pos;
+        return true;
+    }
+
+    bool read_string(std::string &out)
+    {
+        if (!expect('"'))
+            return false;
+        while (m_pos < m_s.size() && m_s[m_pos] != '"')
+        {
+            char ch = m_s[m_pos++];
+            if (ch == '\\' && m_pos < m_s.size())
+            {
+                ch = m_s[m_pos++];
+                switch (ch)
+                {
+                case 'n': ch = '\n'; break;
+                case 't': ch = '\t'; break;
+                case 'r': ch = '\r'; break;
+                case 'u': /* only ASCII escapes are supported */
+                    ch = (char)strtol(m_s.substr(m_pos, 4).c_str(), nullptr, 16);
+                    m_pos += 4;
+                    break;
+                }
+            }
+            out += ch;
+        }
+        return expect('"');
+    }
+
+    bool read_scalar(std::string &out)
+    {
+        if (peek() == '"')
+            return read_string(out);
+        while (m_pos < m_s.size() && (isalnum((unsigned char)m_s[m_pos])
+                                       || strchr("+-.", m_s[m_pos])))
+            out += m_s[m_pos++];
+        return !out.empty();
+    }
+
+    bool read_object(std::vector<std::pair<std::string, std::string>> &out)
+    {
+        if (!expect('{'))
+            return false;
+        if (peek() == '}')
+            return expect('}');
+        for (;;)
+        {
+            std::string key, value;
+            if (!read_string(key) || !expect(':') || !read_scalar(value))
+                return false;
+            out.push_back(std::make_pair(key, value));
+            if (peek() != ',')
+                return expect('}');
+            expect(',');
+        }
+    }
+
+    std::string const &m_s;
+    size_t m_pos;
+};
+
+struct archive
+{
+    archive() : m_file(nullptr), m_offset(0) {}
+
+    bool open(char const *name)
+    {
+        m_file = fopen(name, "wb");
+        if (!m_file)
+            return false;
+
+        /* Header is rewritten once the index offset is known */
+        write_header(0, 0);
+        m_offset = ftell(m_file);
+        return true;
+    }
+
+    /* Append a result; called concurrently by the workers */
+    void add(job &j, ID3DBlob *code)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        j.offset = m_offset;
+        j.size = code ? code->GetBufferSize() : 0;
+        if (code)
+            fwrite(code->GetBufferPointer(), j.size, 1, m_file);
+        m_offset += j.size;
+    }
+
+    bool close(std::vector<job> const &jobs)
+    {
+        uint64_t index_offset = m_offset;
+        for (size_t i = 0; i < jobs.size(); ++i)
+        {
+            uint32_t len = (uint32_t)jobs[i].name.size();
+            int64_t ret = jobs[i].ret;
+            fwrite(&len, sizeof(len), 1, m_file);
+            fwrite(jobs[i].name.data(), len, 1, m_file);
+            fwrite(&ret, sizeof(ret), 1, m_file);
+            fwrite(&jobs[i].offset, sizeof(jobs[i].offset), 1, m_file);
+            fwrite(&jobs[i].size, sizeof(jobs[i].size), 1, m_file);
+        }
+        fseek(m_file, 0, SEEK_SET);
+        write_header((uint32_t)jobs.size(), index_offset);
+        return fclose(m_file) == 0;
+    }
+
+private:
+    void write_header(uint32_t count, uint64_t index_offset)
+    {
+        uint32_t version = 1;
+        fwrite("D4LA", 4, 1, m_file);
+        fwrite(&version, sizeof(version), 1, m_file);
+        fwrite(&count, sizeof(count), 1, m_file);
+        fwrite(&index_offset, sizeof(index_offset), 1, m_file);
+    }
+
+    FILE *m_file;
+    uint64_t m_offset;
+    std::mutex m_mutex;
+};
+
+static bool read_file(std::string const &name, std::string &out)
+{
+    std::ifstream t(name);
+    if (!t)
+        return false;
+    out.assign((std::istreambuf_iterator<char>(t)),
+               std::istreambuf_iterator<char>());
+    return true;
+}
+
+static std::vector<D3D_SHADER_MACRO> make_defines(job const &j)
+{
+    std::vector<D3D_SHADER_MACRO> defines;
+    for (size_t i = 0; i < j.defines.size(); ++i)
+        defines.push_back({ j.defines[i].first.c_str(), j.defines[i].second.c_str() });
+    defines.push_back({ nullptr, nullptr });
+    return defines;
+}
+
+static void run_job(job &j, archive &ar)
+{
+    std::string source;
+    if (!read_file(j.file, source))
+    {
+        j.errors = "cannot read " + j.file;
+        return;
+    }
+
+    std::vector<D3D_SHADER_MACRO> defines = make_defines(j);
+
+    ID3DBlob *code = nullptr, *errors = nullptr;
+    auto start = std::chrono::steady_clock::now();
+    j.ret = D3DCompile(source.c_str(), source.size(), j.file.c_str(),
+                       defines.data(), D3D_COMPILE_STANDARD_FILE_INCLUDE,
+                       j.entry.c_str(), j.target.c_str(),
+                       j.flags1, j.flags2, &code, &errors);
+    j.msecs = std::chrono::duration<double, std::milli>(
+                  std::chrono::steady_clock::now() - start).count();
+
+    if (errors)
+        j.errors.assign((char const *)errors->GetBufferPointer(), errors->GetBufferSize());
+    if (SUCCEEDED(j.ret))
+        ar.add(j, code);
+
+    if (code)
+        code->Release();
+    if (errors)
+        errors->Release();
+}
+
+//
+// One queue of jobs per worker, and thus per server. Jobs are dealt
+// longest predicted first, each to the queue with the least predicted
+// work, so that no long job is left to start at the very end. Since
+// predictions can be wrong, a worker whose queue runs dry takes the last
+// job of the queue that has the most work left.
+//
+struct scheduler
+{
+    scheduler(std::vector<job> &jobs, int workers)
+      : m_queues(workers),
+        m_load(workers, 0.0)
+    {
+        std::vector<size_t> order;
+        for (size_t i = 0; i < jobs.size(); ++i)
+            order.push_back(i);
+        std::stable_sort(order.begin(), order.end(), [&jobs](size_t a, size_t b)
+        {
+            return jobs[a].predicted > jobs[b].predicted;
+        });
+
+        for (size_t i = 0; i < order.size(); ++i)
+        {
+            size_t q = std::min_element(m_load.begin(), m_load.end()) - m_load.begin();
+            m_queues[q].push_back(std::make_pair(order[i], jobs[order[i]].predicted));
+            m_load[q] += jobs[order[i]].predicted;
+        }
+    }
+
+    /* Return the next job for a worker, or false when all are taken */
+    bool next(int worker, size_t &index)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        std::deque<std::pair<size_t, double>> *q = &m_queues[worker];
+        bool steal = q->empty();
+        if (steal)
+        {
+            int busiest = std::max_element(m_load.begin(), m_load.end()) - m_load.begin();
+            q = &m_queues[busiest];
+            worker = busiest;
+            if (q->empty())
+                return false;
+        }
+
+        auto entry = steal ? q->back() : q->front();
+        if (steal)
+            q->pop_back();
+        else
+            q->pop_front();
+        m_load[worker] -= entry.second;
+        index = entry.first;
+        return true;
+    }
+
+private:
+    std::vector<std::deque<std::pair<size_t, double>>> m_queues;
+    std::vector<double> m_load;
+    std::mutex m_mutex;
+};
+
+int main(int argc, char *argv[])
+{
+    char const *output = "shaders.d4la";
+    char const *timings = nullptr;
+    int threads = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "j:o:t:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'j': threads = atoi(optarg); break;
+        case 'o': output = optarg; break;
+        case 't': timings = optarg; break;
+        default:
+            optind = argc + 1;
+            break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-j <jobs>] [-o <archive>] [-t <timings.tsv>] <manifest.jsonl>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::ifstream manifest(argv[optind]);
+    if (!manifest)
+    {
+        fprintf(stderr, "%s: cannot open %s\n", argv[0], argv[optind]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<job> jobs;
+    std::string line;
+    for (int lineno = 1; std::getline(manifest, line); ++lineno)
+    {
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+            continue;
+
+        job j;
+        if (!json_reader(line).parse(j) || j.file.empty()
+             || j.entry.empty() || j.target.empty())
+        {
+            fprintf(stderr, "%s:%d: invalid job\n", argv[optind], lineno);
+            return EXIT_FAILURE;
+        }
+        if (j.name.empty())
+            j.name = j.file + ":" + j.entry + ":" + j.target;
+
+        struct stat st;
+        std::vector<D3D_SHADER_MACRO> defines = make_defines(j);
+        j.predicted = d3d4linux_cost_model::get().predict(
+            d3d4linux_cost_model::describe(j.file.c_str(), j.entry.c_str(),
+                                           j.target.c_str(), j.flags1, j.flags2,
+                                           defines.data(),
+                                           stat(j.file.c_str(), &st) == 0 ? st.st_size : 0));
+        jobs.push_back(j);
+    }
+
+    /* One worker per server; make the pool match if -j was given */
+    if (threads > 0)
+        setenv("D3D4LINUX_SERVERS", std::to_string(threads).c_str(), 1);
+    else
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(1, std::min(threads, (int)jobs.size()));
+
+    archive ar;
+    if (!ar.open(output))
+    {
+        fprintf(stderr, "%s: cannot create %s\n", argv[0], output);
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    scheduler sched(jobs, threads);
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.push_back(std::thread([&, t]()
+        {
+            for (size_t i; sched.next(t, i); )
+                run_job(jobs[i], ar);
+        }));
+    for (size_t t = 0; t < workers.size(); ++t)
+        workers[t].join();
+    double total = std::chrono::duration<double>(
+                       std::chrono::steady_clock::now() - start).count();
+
+    if (!ar.close(jobs))
+    {
+        fprintf(stderr, "%s: cannot write %s\n", argv[0], output);
+        return EXIT_FAILURE;
+    }
+
+    /* Let pending cache write-backs reach the server before we exit; the
+     * cost model saves itself then */
+    d3d4linux_cache::get().flush();
+
+    FILE *report = timings ? fopen(timings, "w") : nullptr;
+    if (report)
+        fprintf(report, "name\tmsecs\tresult\tbytes\tpredicted\n");
+
+    int failed = 0;
+    for (size_t i = 0; i < jobs.size(); ++i)
+    {
+        job const &j = jobs[i];
+        if (report)
+            fprintf(report, "%s\t%.3f\t0x%08x\t%llu\t%.3f\n", j.name.c_str(), j.msecs,
+                    (unsigned)j.ret, (unsigned long long)j.size, j.predicted);
+        if (FAILED(j.ret))
+        {
+            ++failed;
+            fprintf(stderr, "%s: failed (0x%08x)\n%s\n", j.name.c_str(),
+                    (unsigned)j.ret, j.errors.c_str());
+        }
+    }
+    if (report)
+        fclose(report);
+
+    printf("%d jobs, %d failed, %.2fs on %d threads\n",
+           (int)jobs.size(), failed, total, threads);
+
+    /* Server startup gets slower as more servers share a wineserver */
+    d3d4linux::startup_stats st = d3d4linux::server_startup();
+    if (st.servers > 0)
+        printf("%d servers started in %d prefixes, %.0f ms on average, %.0f ms at most\n",
+               st.servers, st.prefixes, st.average_msecs, st.max_msecs);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,252 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// A shared compile cache server for build farms. Clients point
+// D3D4LINUX_CACHE_REMOTE at it; entries live in memory and the least
+// recently used ones are evicted when the size budget is exceeded.
+//
+// There is no authentication: anyone who can reach the port can store
+// bytecode that every client will then use. It listens on the loopback
+// interface unless told otherwise, and must only ever be exposed to a
+// trusted network.
+//
+
+#include "d3d4linux.h"
+
+#include <list>
+#include <map>
+#include <mutex>
+#include <new>
+#include <string>
+#include <thread>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#include <signal.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/* Limits on what one request may ask us to allocate; clients send at
+ * most 256 keys at once */
+enum
+{
+    MAX_KEYS = 4096,
+    MAX_VALUE = 64 << 20,
+};
+
+struct store
+{
+    store(size_t budget)
+      : m_budget(budget),
+        m_size(0)
+    {}
+
+    bool get(d3d4linux_cache::key const &k, std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(k);
+        if (it == m_entries.end())
+            return false;
+        m_lru.splice(m_lru.begin(), m_lru, it->second.m_lru);
+        value = it->second.m_value;
+        return true;
+    }
+
+    void put(d3d4linux_cache::key const &k, std::string &value)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto it = m_entries.find(k);
+        if (it != m_entries.end())
+        {
+            m_lru.splice(m_lru.begin(), m_lru, it->second.m_lru);
+            return;
+        }
+
+        entry &e = m_entries[k];
+        e.m_value.swap(value);
+        m_lru.push_front(k);
+        e.m_lru = m_lru.begin();
+        m_size += e.m_value.size();
+
+        while (m_size > m_budget && m_lru.size() > 1)
+        {
+            auto victim = m_entries.find(m_lru.back());
+            m_size -= victim->second.m_value.size();
+            m_entries.erase(victim);
+            m_lru.pop_back();
+        }
+    }
+
+private:
+    struct entry
+    {
+        std::string m_value;
+        std::list<d3d4linux_cache::key>::iterator m_lru;
+    };
+
+    size_t m_budget, m_size;
+    std::mutex m_mutex;
+    std::map<d3d4linux_cache::key, entry> m_entries;
+    std::list<d3d4linux_cache::key> m_lru;
+};
+
+static void serve(int fd, store *s, int verbose)
+{
+    FILE *in = fdopen(fd, "r");
+    FILE *out = fdopen(dup(fd), "w");
+    interop p(in, out);
+
+    /* Running out of memory only costs this client its connection */
+    try
+    {
+        while (!feof(in) && !ferror(in))
+        {
+            int64_t op = p.read_i64();
+            int64_t count = p.read_i64();
+            if (feof(in) || count < 0 || count > MAX_KEYS)
+                break;
+
+            if (op == D3D4LINUX_OP_CACHE_GET)
+            {
+                std::vector<d3d4linux_cache::key> keys(count);
+                for (int64_t i = 0; i < count; ++i)
+                    p.read_raw(&keys[i], sizeof(keys[i]));
+                if (p.read_i64() != D3D4LINUX_FINISHED || feof(in) || ferror(in))
+                    break;
+
+                int hits = 0;
+                std::string value;
+                for (int64_t i = 0; i < count; ++i)
+                {
+                    if (s->get(keys[i], value))
+                    {
+                        p.write_i64(value.size());
+                        p.write_raw(value.data(), value.size());
+                        ++hits;
+                    }
+                    else
+                        p.write_i64(-1);
+                }
+                p.write_i64(D3D4LINUX_FINISHED);
+
+                if (verbose)
+                    fprintf(stderr, "[D3D4LINUX] get: %d/%d hits\n", hits, (int)count);
+            }
+            else if (op == D3D4LINUX_OP_CACHE_PUT)
+            {
+                /* Only store entries that arrived whole */
+                bool ok = true;
+                for (int64_t i = 0; i < count && ok; ++i)
+                {
+                    d3d4linux_cache::key k;
+                    p.read_raw(&k, sizeof(k));
+                    int64_t len = p.read_i64();
+                    ok = len >= 0 && len <= MAX_VALUE && !feof(in) && !ferror(in);
+                    if (!ok)
+                        break;
+                    std::string value(len, '\0');
+                    p.read_raw(&value[0], len);
+                    ok = !feof(in) && !ferror(in);
+                    if (ok)
+                        s->put(k, value);
+                }
+                if (!ok || p.read_i64() != D3D4LINUX_FINISHED)
+                    break;
+                p.write_i64(D3D4LINUX_FINISHED);
+
+                if (verbose)
+                    fprintf(stderr, "[D3D4LINUX] put: %d entries\n", (int)count);
+            }
+            else
+            {
+                fprintf(stderr, "[D3D4LINUX] Bad message received: 0x%x\n", (int)op);
+                break;
+            }
+        }
+    }
+    catch (std::bad_alloc const &)
+    {
+        fprintf(stderr, "[D3D4LINUX] Out of memory, dropping client\n");
+    }
+
+    fclose(in);
+    fclose(out);
+}
+
+int main(int argc, char *argv[])
+{
+    char const *address = "127.0.0.1";
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'b': address = optarg; break;
+        default: optind = argc; break;
+        }
+    }
+
+    if (optind >= argc)
+    {
+        fprintf(stderr, "Usage: %s [-b <address>] <port> [<budget_in_MiB>]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+    int verbose = verbose_var && *verbose_var == '1';
+
+    char const *port = argv[optind];
+    size_t budget = (size_t)(optind + 1 < argc ? atoi(argv[optind + 1]) : 1024) << 20;
+
+    /* A client that disconnects mid-reply must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_NUMERICHOST;
+    int err = getaddrinfo(address, port, &hints, &res);
+    if (err != 0)
+    {
+        fprintf(stderr, "cache-server: %s: %s\n", address, gai_strerror(err));
+        return EXIT_FAILURE;
+    }
+
+    int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(fd, res->ai_addr, res->ai_addrlen) < 0 || listen(fd, 64) < 0)
+    {
+        perror("cache-server");
+        return EXIT_FAILURE;
+    }
+    freeaddrinfo(res);
+
+    store s(budget);
+
+    for (;;)
+    {
+        int client = accept(fd, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        setsockopt(client, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::thread(serve, client, &s, verbose).detach();
+    }
+}
@@ -0,0 +1,442 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// A server pool shared by all the processes of a machine. Clients point
+// D3D4LINUX_DAEMON at its socket; each lease hands them the pipes of one
+// of our servers, which they then talk to directly (see daemon_client in
+// d3d4linux_impl.h). Queued requests are served by priority lane, then
+// to the client process that holds the fewest servers, so that an editor
+// does not wait behind a cook running on the same machine.
+//
+// The daemon also keeps metrics in the Prometheus text format: the state
+// of the pool, the cache lookups reported by clients, and how long
+// requests wait for a server and then hold it. They are sent back to
+// “tools/daemon --status <socket>”, and written every few seconds to the
+// file given with --metrics, e.g. for the node exporter’s textfile
+// collector.
+//
+
+#include "d3d4linux.h"
+
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+//
+// Durations in logarithmic buckets, four per octave from 1 ms, which is
+// precise enough for quantiles and never grows
+//
+struct histogram
+{
+    enum { BUCKETS = 96 };
+
+    histogram()
+      : m_count(0),
+        m_sum(0)
+    {
+        memset(m_buckets, 0, sizeof(m_buckets));
+    }
+
+    void add(double msecs)
+    {
+        int i = msecs > 1 ? (int)ceil(4 * log2(msecs)) : 0;
+        ++m_buckets[std::min(i, BUCKETS - 1)];
+        ++m_count;
+        m_sum += msecs;
+    }
+
+    /* Upper bound of the bucket holding that quantile, in milliseconds */
+    double quantile(double q) const
+    {
+        int64_t rank = (int64_t)ceil(q * m_count), seen = 0;
+        for (int i = 0; i < BUCKETS; ++i)
+            if ((seen += m_buckets[i]) >= rank && seen > 0)
+                return exp2(i / 4.0);
+        return 0;
+    }
+
+    int64_t m_buckets[BUCKETS], m_count;
+    double m_sum;
+};
+
+struct d3d4linux_daemon
+{
+    typedef d3d4linux::server_pool server_pool;
+    typedef d3d4linux::fork_process fork_process;
+
+    static d3d4linux_daemon &get()
+    {
+        static d3d4linux_daemon *daemon = new d3d4linux_daemon();
+        return *daemon;
+    }
+
+    d3d4linux_daemon()
+      : m_start(d3d4linux_sys::now()),
+        m_leases(server_pool::get().current_usage().size, 0)
+    {
+        memset(m_cache, 0, sizeof(m_cache));
+    }
+
+    static void serve(int fd, int verbose)
+    {
+        /* Fair share is between client processes */
+        ucred cred;
+        socklen_t len = sizeof(cred);
+        int owner = getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == 0
+                  ? (int)cred.pid : -fd;
+        server_pool &pool = server_pool::get();
+        d3d4linux_daemon &daemon = get();
+
+        int64_t op;
+        while (d3d4linux_sys::read_all(fd, &op, sizeof(op)))
+        {
+            int64_t args[3];
+            if (op == D3D4LINUX_OP_DAEMON_REPORT && d3d4linux_sys::read_all(fd, args, sizeof(args)))
+            {
+                daemon.report(args);
+                continue;
+            }
+            if (op == D3D4LINUX_OP_DAEMON_STATUS)
+            {
+                std::string text = daemon.status();
+                int64_t len = text.size();
+                if (!d3d4linux_sys::send_all(fd, &len, sizeof(len)) || !d3d4linux_sys::send_all(fd, text.data(), len))
+                    break;
+                continue;
+            }
+            if (op != D3D4LINUX_OP_DAEMON_ACQUIRE || !d3d4linux_sys::read_all(fd, args, sizeof(args)))
+            {
+                fprintf(stderr, "[D3D4LINUX] Bad message received: 0x%x\n", (int)op);
+                break;
+            }
+
+            int lane = (int)std::max<int64_t>(D3D4LINUX_PRIORITY_INTERACTIVE,
+                                              std::min<int64_t>(args[0], D3D4LINUX_PRIORITY_BACKGROUND));
+            int64_t start = d3d4linux_sys::now();
+            int index = pool.acquire(args[1] / 1e3, lane, owner);
+            daemon.waited(lane, d3d4linux_sys::now() - start);
+            if (index < 0)
+            {
+                int64_t ret = E_FAIL;
+                if (!d3d4linux_sys::send_all(fd, &ret, sizeof(ret)))
+                    break;
+                continue;
+            }
+
+            if (!send_server(fd, pool.process(index)))
+            {
+                pool.release(index, true);
+                break;
+            }
+
+            /* The client talks to the server until it releases it; if it
+             * goes away in the middle of a request, the server is in an
+             * unknown state and may be stuck, so it goes too. */
+            daemon.leased(index, d3d4linux_sys::now());
+            int64_t release[2];
+            bool done = d3d4linux_sys::read_all(fd, release, sizeof(release))
+                         && release[0] == D3D4LINUX_OP_DAEMON_RELEASE;
+            daemon.released(index, (int)args[2], d3d4linux_sys::now());
+            if (!done)
+            {
+                if (verbose)
+                    fprintf(stderr, "[D3D4LINUX] client %d lost server %d\n", owner, index);
+                kill(pool.process(index)->m_pid, SIGKILL);
+                pool.release(index, false);
+                break;
+            }
+            pool.release(index, release[1] != 0);
+        }
+
+        close(fd);
+    }
+
+    /* Rewrite the metrics file every few seconds; the rename makes each
+     * update atomic for readers */
+    void write_metrics(std::string const &path)
+    {
+        std::string tmp = path + ".tmp";
+        for (;;)
+        {
+            std::string text = status();
+            FILE *f = fopen(tmp.c_str(), "w");
+            if (f)
+            {
+                bool ok = fwrite(text.data(), text.size(), 1, f) == 1;
+                if (fclose(f) == 0 && ok)
+                    rename(tmp.c_str(), path.c_str());
+            }
+            std::this_thread::sleep_for(std::chrono::seconds(METRICS_SECONDS));
+        }
+    }
+
+    /* Ask a running daemon for its metrics */
+    static int query(char const *path)
+    {
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        sockaddr_un addr = address(path);
+        int64_t op = D3D4LINUX_OP_DAEMON_STATUS, len;
+        if (connect(fd, (sockaddr *)&addr, sizeof(addr)) < 0
+             || !d3d4linux_sys::send_all(fd, &op, sizeof(op)) || !d3d4linux_sys::read_all(fd, &len, sizeof(len)))
+        {
+            perror("daemon");
+            return EXIT_FAILURE;
+        }
+        std::string text(len, '\0');
+        if (!d3d4linux_sys::read_all(fd, &text[0], len))
+            return EXIT_FAILURE;
+        fwrite(text.data(), text.size(), 1, stdout);
+        return EXIT_SUCCESS;
+    }
+
+    static sockaddr_un address(char const *path)
+    {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+        return addr;
+    }
+
+private:
+    enum { METRICS_SECONDS = 5 };
+
+    /* Ops that go through the daemon, see D3D4LINUX_OP_COMPILE */
+    enum { OPS = 6 };
+
+    void waited(int lane, int64_t msecs)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_wait[lane].add((double)msecs);
+    }
+
+    void leased(int index, int64_t when)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_leases[index] = when;
+    }
+
+    void released(int index, int op, int64_t when)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        op -= D3D4LINUX_OP_COMPILE;
+        m_hold[op >= 0 && op < OPS ? op : OPS].add((double)(when - m_leases[index]));
+        m_leases[index] = 0;
+    }
+
+    void report(int64_t const *lookups)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (int i = 0; i < 3; ++i)
+            m_cache[i] += lookups[i];
+    }
+
+    //
+    // The metrics, in the Prometheus text exposition format
+    //
+    std::string status()
+    {
+        static char const *lanes[] = { "interactive", "normal", "background" };
+        static char const *ops[] = { "compile", "reflect", "strip", "disassemble",
+                                     "preprocess", "reflect_open", "other" };
+        static char const *lookups[] = { "local_hit", "remote_hit", "miss" };
+
+        server_pool &pool = server_pool::get();
+        server_pool::usage use = pool.current_usage();
+        server_pool::stats const &st = pool.spawn_stats();
+
+        std::string ret;
+        metric(ret, "d3d4linux_uptime_seconds", "gauge", "Time since the daemon started.");
+        sample(ret, "d3d4linux_uptime_seconds", "", (d3d4linux_sys::now() - m_start) / 1e3);
+        metric(ret, "d3d4linux_servers", "gauge", "Servers, by state; size is the most the pool runs.");
+        sample(ret, "d3d4linux_servers", "state=\"size\"", use.size);
+        sample(ret, "d3d4linux_servers", "state=\"busy\"", use.busy);
+        sample(ret, "d3d4linux_servers", "state=\"idle\"", use.idle);
+        sample(ret, "d3d4linux_servers", "state=\"spare\"", use.spares);
+        metric(ret, "d3d4linux_queue_depth", "gauge", "Requests waiting for a server, by priority.");
+        for (int i = 0; i < 3; ++i)
+            sample(ret, "d3d4linux_queue_depth", label("priority", lanes[i]), use.queued[i]);
+        metric(ret, "d3d4linux_server_spawns_total", "counter", "Servers started.");
+        sample(ret, "d3d4linux_server_spawns_total", "", st.spawns.load());
+        metric(ret, "d3d4linux_server_recycles_total", "counter", "Servers replaced by a spare.");
+        sample(ret, "d3d4linux_server_recycles_total", "", st.recycles.load());
+        metric(ret, "d3d4linux_server_failures_total", "counter", "Servers lost or killed.");
+        sample(ret, "d3d4linux_server_failures_total", "", st.failures.load());
+        metric(ret, "d3d4linux_server_startup_seconds_max", "gauge", "Longest server startup.");
+        sample(ret, "d3d4linux_server_startup_seconds_max", "", st.max_msecs.load() / 1e3);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        metric(ret, "d3d4linux_cache_lookups_total", "counter",
+               "Cache lookups reported by clients, by result.");
+        for (int i = 0; i < 3; ++i)
+            sample(ret, "d3d4linux_cache_lookups_total", label("result", lookups[i]), m_cache[i]);
+
+        /* A server held for long may be stuck */
+        int64_t oldest = 0, t = d3d4linux_sys::now();
+        for (int64_t start : m_leases)
+            if (start)
+                oldest = std::max(oldest, t - start);
+        metric(ret, "d3d4linux_oldest_lease_seconds", "gauge",
+               "How long the longest running request has held its server.");
+        sample(ret, "d3d4linux_oldest_lease_seconds", "", oldest / 1e3);
+
+        metric(ret, "d3d4linux_wait_seconds", "summary",
+               "Time spent waiting for a server, by priority.");
+        for (int i = 0; i < 3; ++i)
+            summary(ret, "d3d4linux_wait_seconds", label("priority", lanes[i]), m_wait[i]);
+        metric(ret, "d3d4linux_request_seconds", "summary",
+               "Time a server was held, by request.");
+        for (int i = 0; i <= OPS; ++i)
+            if (m_hold[i].m_count)
+                summary(ret, "d3d4linux_request_seconds", label("op", ops[i]), m_hold[i]);
+        return ret;
+    }
+
+    static std::string label(char const *name, char const *value)
+    {
+        return std::string(name) + "=\"" + value + "\"";
+    }
+
+    static void metric(std::string &out, char const *name, char const *type, char const *help)
+    {
+        out += std::string("# HELP ") + name + " " + help + "\n";
+        out += std::string("# TYPE ") + name + " " + type + "\n";
+    }
+
+    static void sample(std::string &out, char const *name, std::string const &labels,
+                       double value)
+    {
+        char buf[256];
+        snprintf(buf, sizeof(buf), labels.empty() ? "%s%s %.6g\n" : "%s{%s} %.6g\n",
+                 name, labels.c_str(), value);
+        out += buf;
+    }
+
+    static void summary(std::string &out, char const *name, std::string const &labels,
+                        histogram const &h)
+    {
+        static double const quantiles[] = { 0.5, 0.9, 0.99 };
+        for (double q : quantiles)
+        {
+            char buf[64];
+            snprintf(buf, sizeof(buf), ",quantile=\"%g\"", q);
+            sample(out, name, labels + buf, h.quantile(q) / 1e3);
+        }
+        sample(out, (std::string(name) + "_sum").c_str(), labels, h.m_sum / 1e3);
+        sample(out, (std::string(name) + "_count").c_str(), labels, (double)h.m_count);
+    }
+
+    /* Send S_OK with the server’s stdout and stdin */
+    static bool send_server(int fd, fork_process *process)
+    {
+        int64_t ret = S_OK;
+        int fds[2] = { fileno(process->m_in), fileno(process->m_out) };
+
+        char control[CMSG_SPACE(sizeof(fds))];
+        memset(control, 0, sizeof(control));
+        iovec iov = { &ret, sizeof(ret) };
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+        ssize_t n;
+        while ((n = sendmsg(fd, &msg, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+            ;
+        return n == (ssize_t)sizeof(ret);
+    }
+
+    int64_t m_start;
+    std::mutex m_mutex;
+    /* When each slot was leased, or 0 */
+    std::vector<int64_t> m_leases;
+    histogram m_wait[3], m_hold[OPS + 1];
+    int64_t m_cache[3];
+};
+
+int main(int argc, char *argv[])
+{
+    char const *metrics = nullptr;
+    bool status = false;
+    int i = 1;
+    for (; i < argc - 1 && argv[i][0] == '-'; ++i)
+    {
+        if (!strcmp(argv[i], "--status"))
+            status = true;
+        else if (!strcmp(argv[i], "--metrics") && i + 1 < argc - 1)
+            metrics = argv[++i];
+        else
+            break;
+    }
+
+    char const *path = i < argc ? argv[i] : getenv("D3D4LINUX_DAEMON");
+    if (!path || !*path || (i < argc && argv[i][0] == '-'))
+    {
+        fprintf(stderr, "Usage: %s [--metrics <file>] <socket>\n"
+                        "       %s --status <socket>\n", argv[0], argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (status)
+        return d3d4linux_daemon::query(path);
+
+    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+    int verbose = verbose_var && *verbose_var == '1';
+
+    /* A client that disconnects mid-reply must not kill the daemon */
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un addr = d3d4linux_daemon::address(path);
+
+    /* Servers must not inherit the socket or its clients */
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(path);
+    if (bind(fd, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(fd, 64) < 0)
+    {
+        perror("daemon");
+        return EXIT_FAILURE;
+    }
+
+    /* Start the uptime clock now, not at the first client */
+    d3d4linux_daemon &daemon = d3d4linux_daemon::get();
+    if (metrics)
+        std::thread(&d3d4linux_daemon::write_metrics, &daemon,
+                    std::string(metrics)).detach();
+
+    for (;;)
+    {
+        int client = accept4(fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (client < 0)
+            continue;
+        std::thread(&d3d4linux_daemon::serve, client, verbose).detach();
+    }
+}
@@ -0,0 +1,360 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// A stand-in for d3d4linux.exe that needs neither Wine nor the compiler
+// DLL: it answers every request with the result recorded for the same
+// request in a capture (see d3d4linux_capture.h), after the recorded
+// duration. Clients run it with
+//
+//   D3D4LINUX_WINE=/usr/bin/env D3D4LINUX_EXE=tools/mock-server
+//   D3D4LINUX_MOCK_CAPTURE=<capture> [D3D4LINUX_MOCK_SPEED=<speed>]
+//
+// so that tools/replay can be run offline. Durations are divided by
+// <speed>, and with 0 answers are immediate; they include any wait for
+// a server at capture time. Compilations are matched whatever composite
+// steps they ask for, and these steps fail, since the capture does not
+// have their results; so does everything that is not in the capture.
+//
+
+#include "d3d4linux.h"
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+struct mock_server
+{
+    mock_server(int verbose) : m_verbose(verbose) {}
+
+    /* Index the records of a capture by their request */
+    bool load(char const *path)
+    {
+        FILE *f = fopen(path, "rb");
+        if (!f)
+            return false;
+
+        d3d4linux_capture::record r;
+        while (d3d4linux_capture::read(f, r))
+        {
+            std::string const &s = r.request;
+            size_t pos = 0;
+            parser in([&s, &pos](void *p, size_t len)
+            {
+                if (len > s.size() - pos)
+                    return false;
+                memcpy(p, s.data() + pos, len);
+                pos += len;
+                return true;
+            });
+            if (!in.request())
+                continue;
+            m_results[in.key()].push_back(m_records.size());
+            m_records.push_back(r);
+        }
+        fclose(f);
+
+        if (m_verbose)
+            fprintf(stderr, "[D3D4LINUX] mock server: %d records from %s\n",
+                    (int)m_records.size(), path);
+        return true;
+    }
+
+    /* Answer requests until the client goes away */
+    void serve(double speed)
+    {
+        parser in([](void *p, size_t len)
+        {
+            return fread(p, len, 1, stdin) == 1;
+        });
+        interop p(stdin, stdout);
+
+        /* Tell the client that we are ready */
+        p.write_i64(D3D4LINUX_FINISHED);
+
+        while (in.request())
+        {
+            int64_t op = in.op();
+            d3d4linux_capture::record const *r = find(in.key());
+            if (m_verbose && !r && op != D3D4LINUX_OP_REFLECT_CLOSE)
+                fprintf(stderr, "[D3D4LINUX] mock server: request 0x%x is not in the capture\n",
+                        (int)op);
+
+            if (r && speed > 0)
+                std::this_thread::sleep_for(std::chrono::microseconds(
+                    (int64_t)(r->h.duration_us / speed)));
+
+            HRESULT ret = r ? (HRESULT)r->h.ret : E_FAIL;
+            switch (op)
+            {
+            case D3D4LINUX_OP_COMPILE:
+                p.write_i64(ret);
+                write(p, r && r->has_output, r ? r->output : "");
+                write(p, !r || r->has_errors,
+                      r ? r->errors : "mock server: request not in the capture");
+                if (SUCCEEDED(ret) && r && r->has_output)
+                    fail_composite(p, in.steps());
+                break;
+            case D3D4LINUX_OP_REFLECT:
+            case D3D4LINUX_OP_REFLECT_OPEN:
+                p.write_i64(ret);
+                if (SUCCEEDED(ret) && in.iid() == IID_ID3D11ShaderReflection)
+                {
+                    /* Nothing can be fetched from that handle later */
+                    if (op == D3D4LINUX_OP_REFLECT_OPEN)
+                        p.write_i64(1);
+                    write(p, r->has_output, r->output);
+                }
+                break;
+            case D3D4LINUX_OP_STRIP:
+            case D3D4LINUX_OP_DISASSEMBLE:
+                p.write_i64(ret);
+                write(p, r && r->has_output, r ? r->output : "");
+                break;
+            case D3D4LINUX_OP_PREPROCESS:
+                p.write_i64(D3D4LINUX_OP_PREPROCESS);
+                p.write_i64(ret);
+                write(p, r && r->has_output, r ? r->output : "");
+                write(p, r && r->has_errors, r ? r->errors : "");
+                break;
+            case D3D4LINUX_OP_REFLECT_QUERY:
+                p.write_i64(E_FAIL);
+                break;
+            case D3D4LINUX_OP_COMPRESS_SHADERS:
+                p.write_i64(E_FAIL);
+                p.write_i64(-1);
+                break;
+            case D3D4LINUX_OP_DECOMPRESS_SHADERS:
+                p.write_i64(E_FAIL);
+                p.write_i64(0);
+                for (int64_t i = 0; i < in.count(); ++i)
+                    p.write_i64(-1);
+                break;
+            case D3D4LINUX_OP_REFLECT_CLOSE:
+                /* No answer is expected */
+                continue;
+            }
+            p.write_i64(D3D4LINUX_FINISHED);
+        }
+    }
+
+private:
+    //
+    // Reads one request the way d3d4linux.exe does, keeping the bytes
+    // that identify it: all of them but the composite steps of a
+    // compilation. The same parser reads requests from the client and
+    // from the capture, so that both give the same keys.
+    //
+    struct parser
+    {
+        typedef std::function<bool(void *, size_t)> source;
+
+        parser(source const &src) : m_src(src) {}
+
+        bool request()
+        {
+            m_key.clear();
+            m_ok = true;
+            m_op = i64();
+            i64(); /* version */
+            m_steps = m_iid = m_count = 0;
+
+            switch (m_op)
+            {
+            case D3D4LINUX_OP_COMPILE:
+                data();
+                if (i64())
+                    data();
+                data(); /* entry point */
+                data(); /* target */
+                i64();
+                i64();
+                m_steps = i64(false);
+                i64(false); /* strip flags */
+                break;
+            case D3D4LINUX_OP_REFLECT:
+            case D3D4LINUX_OP_REFLECT_OPEN:
+                data();
+                m_iid = i64();
+                break;
+            case D3D4LINUX_OP_STRIP:
+                data();
+                i64();
+                break;
+            case D3D4LINUX_OP_DISASSEMBLE:
+                data();
+                i64();
+                if (i64())
+                    data();
+                break;
+            case D3D4LINUX_OP_PREPROCESS:
+            {
+                data();
+                if (i64())
+                    data();
+                int64_t count = i64();
+                for (int64_t i = 0; i < count && m_ok; ++i)
+                {
+                    data();
+                    if (i64())
+                        data();
+                }
+                i64(); /* include mode */
+                break;
+            }
+            case D3D4LINUX_OP_REFLECT_QUERY:
+                i64();
+                i64();
+                i64();
+                data();
+                break;
+            case D3D4LINUX_OP_REFLECT_CLOSE:
+                i64();
+                break;
+            case D3D4LINUX_OP_COMPRESS_SHADERS:
+            {
+                int64_t count = i64();
+                for (int64_t i = 0; i < count && m_ok; ++i)
+                    data();
+                i64();
+                break;
+            }
+            case D3D4LINUX_OP_DECOMPRESS_SHADERS:
+                data();
+                m_count = i64();
+                i64();
+                if (i64())
+                    for (int64_t i = 0; i < m_count && m_ok; ++i)
+                        i64();
+                i64();
+                break;
+            default:
+                /* We could not find where it ends */
+                return false;
+            }
+
+            return m_ok && i64() == D3D4LINUX_FINISHED;
+        }
+
+        std::string const &key() const { return m_key; }
+        int64_t op() const { return m_op; }
+        int64_t steps() const { return m_steps; }
+        int64_t iid() const { return m_iid; }
+        int64_t count() const { return m_count; }
+
+    private:
+        int64_t i64(bool keep = true)
+        {
+            int64_t x = 0;
+            raw(&x, sizeof(x), keep);
+            return x;
+        }
+
+        void data()
+        {
+            int64_t len = i64();
+            if (len <= 0 || !m_ok)
+                return;
+            if ((uint64_t)len > MAX_DATA)
+            {
+                m_ok = false;
+                return;
+            }
+            std::string buf((size_t)len, '\0');
+            raw(&buf[0], buf.size(), true);
+        }
+
+        void raw(void *p, size_t len, bool keep)
+        {
+            if (!m_ok || !m_src(p, len))
+            {
+                m_ok = false;
+                return;
+            }
+            if (keep)
+                m_key.append((char const *)p, len);
+        }
+
+        enum : uint64_t { MAX_DATA = (uint64_t)1 << 32 };
+
+        source m_src;
+        std::string m_key;
+        bool m_ok;
+        int64_t m_op, m_steps, m_iid, m_count;
+    };
+
+    /* The next of the records for that request, in turn */
+    d3d4linux_capture::record const *find(std::string const &key)
+    {
+        auto it = m_results.find(key);
+        if (it == m_results.end())
+            return nullptr;
+        std::deque<size_t> &indices = it->second;
+        indices.push_back(indices.front());
+        indices.pop_front();
+        return &m_records[indices.back()];
+    }
+
+    static void write(interop &p, bool present, std::string const &data)
+    {
+        p.write_i64(present ? (int64_t)data.size() : -1);
+        if (present)
+            p.write_raw(data.data(), data.size());
+    }
+
+    /* Results of composite steps, in the order run_composite() sends them */
+    static void fail_composite(interop &p, int64_t steps)
+    {
+        for (int step : { D3D4LINUX_COMPOSITE_REFLECT, D3D4LINUX_COMPOSITE_STRIP,
+                          D3D4LINUX_COMPOSITE_DISASSEMBLE })
+        {
+            if (steps & step)
+            {
+                p.write_i64(E_FAIL);
+                p.write_i64(-1);
+            }
+        }
+    }
+
+    int m_verbose;
+    std::vector<d3d4linux_capture::record> m_records;
+    std::map<std::string, std::deque<size_t>> m_results;
+};
+
+int main()
+{
+    char const *verbose_var = getenv("D3D4LINUX_VERBOSE");
+    int verbose = verbose_var && *verbose_var == '1';
+
+    char const *capture_var = getenv("D3D4LINUX_MOCK_CAPTURE");
+    char const *speed_var = getenv("D3D4LINUX_MOCK_SPEED");
+    double speed = speed_var ? atof(speed_var) : 1.0;
+
+    mock_server server(verbose);
+    if (!capture_var || !server.load(capture_var))
+    {
+        fprintf(stderr, "[D3D4LINUX] mock server: cannot read D3D4LINUX_MOCK_CAPTURE\n");
+        return EXIT_FAILURE;
+    }
+
+    server.serve(speed);
+    return EXIT_SUCCESS;
+}
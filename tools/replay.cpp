@@ -0,0 +1,382 @@
+//
+//  D3D4Linux — access Direct3D DLLs from Linux programs
+//
+//  Copyright © 2016 Sam Hocevar <sam@hocevar.net>
+//
+//  This library is free software. It comes without any warranty, to
+//  the extent permitted by applicable law. You can redistribute it
+//  and/or modify it under the terms of the Do What the Fuck You Want
+//  to Public License, Version 2, as published by the WTFPL Task Force.
+//  See http://www.wtfpl.net/ for more details.
+//
+
+//
+// Replay a capture made with D3D4LINUX_CAPTURE (see d3d4linux_capture.h)
+// against the servers that the environment configures:
+//
+//   tools/replay [-s <speed>] [-j <threads>] [-v] <capture>
+//
+// These are the real ones, or tools/mock-server to replay without Wine.
+//
+// Requests are issued at the pace they arrived, or <speed> times faster;
+// with -s 0 they go as fast as the <threads> replay threads allow. They
+// bypass the compile cache. The report compares the recorded and replayed
+// latencies of each op, and counts the results that are not identical to
+// the recorded ones; -v describes each of them.
+//
+
+#include "d3d4linux.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+
+#include <unistd.h>
+
+struct d3d4linux_replay
+{
+    typedef d3d4linux_capture::record record;
+
+    struct result
+    {
+        int64_t ret;
+        bool has_output;
+        std::string output;
+        double msecs;
+    };
+
+    /* Issue a recorded request; false if it could not be decoded */
+    static bool run(record const &r, result &out)
+    {
+        reader in(r.request);
+        int64_t op = in.i64();
+        int version = (int)in.i64();
+        std::string src = in.data();
+
+        ID3DBlob *output = nullptr, *errors = nullptr;
+        std::vector<uint8_t> snapshot;
+        HRESULT ret = E_FAIL;
+
+        if (op == D3D4LINUX_OP_COMPILE)
+        {
+            std::string file = in.i64() ? in.data() : std::string();
+            std::string entry = in.data(), target = in.data();
+            uint32_t flags1 = (uint32_t)in.i64(), flags2 = (uint32_t)in.i64();
+            if (!in.ok())
+                return false;
+            char const *name = file.empty() ? nullptr : file.c_str();
+            d3d4linux_cost_model::shader shader
+                = d3d4linux_cost_model::describe(name, entry.c_str(), target.c_str(),
+                                                 flags1, flags2, nullptr, src.size());
+            ret = d3d4linux::compile_remote(version, src.data(), src.size(), name,
+                                            entry.c_str(), target.c_str(), flags1, flags2,
+                                            shader, &output, &errors);
+        }
+        else if (op == D3D4LINUX_OP_REFLECT || op == D3D4LINUX_OP_REFLECT_OPEN)
+        {
+            long iid = (long)in.i64();
+            if (!in.ok())
+                return false;
+            /* Ask for the same kind of reflector, unless a daemon forbids */
+            bool lazy = op == D3D4LINUX_OP_REFLECT_OPEN
+                         && !d3d4linux::daemon_client::get().enabled();
+            d3d4linux_snapshot::source *source = nullptr;
+            ret = d3d4linux::reflect_remote(version, src.data(), src.size(), iid, lazy,
+                                            snapshot, source);
+            delete source;
+        }
+        else if (op == D3D4LINUX_OP_STRIP)
+        {
+            uint32_t flags = (uint32_t)in.i64();
+            if (!in.ok())
+                return false;
+            ret = d3d4linux::strip_shader(version, src.data(), src.size(), flags, &output);
+        }
+        else if (op == D3D4LINUX_OP_DISASSEMBLE)
+        {
+            uint32_t flags = (uint32_t)in.i64();
+            bool has_comments = in.i64() != 0;
+            std::string comments = has_comments ? in.data() : std::string();
+            if (!in.ok())
+                return false;
+            ret = d3d4linux::disassemble(version, src.data(), src.size(), flags,
+                                         has_comments ? comments.c_str() : nullptr, &output);
+        }
+        else if (op == D3D4LINUX_OP_PREPROCESS)
+        {
+            std::string file = in.i64() ? in.data() : std::string();
+            int64_t count = in.i64();
+            std::vector<std::string> strings;
+            std::vector<int> has_definition;
+            for (int64_t i = 0; i < count && in.ok(); ++i)
+            {
+                strings.push_back(in.data());
+                has_definition.push_back(in.i64() != 0);
+                strings.push_back(has_definition.back() ? in.data() : std::string());
+            }
+            int64_t include_mode = in.i64();
+            if (!in.ok() || in.i64() != D3D4LINUX_FINISHED)
+                return false;
+
+            std::vector<D3D_SHADER_MACRO> defines;
+            for (size_t i = 0; i < has_definition.size(); ++i)
+            {
+                D3D_SHADER_MACRO m = { strings[2 * i].c_str(),
+                                       has_definition[i] ? strings[2 * i + 1].c_str() : nullptr };
+                defines.push_back(m);
+            }
+            D3D_SHADER_MACRO end = { nullptr, nullptr };
+            defines.push_back(end);
+
+            /* Files come from the capture, in the order they were opened */
+            recorded_include include(in);
+            ret = d3d4linux::preprocess(version, src.data(), src.size(),
+                                        file.empty() ? nullptr : file.c_str(),
+                                        defines.data(),
+                                        include_mode == 1 ? D3D_COMPILE_STANDARD_FILE_INCLUDE
+                                        : include_mode == 2 ? &include : nullptr,
+                                        &output, &errors);
+        }
+        else
+            return false;
+
+        out.ret = ret;
+        out.has_output = output || !snapshot.empty();
+        if (output)
+            out.output.assign((char const *)output->GetBufferPointer(), output->GetBufferSize());
+        else
+            out.output.assign(snapshot.begin(), snapshot.end());
+        delete output;
+        delete errors;
+        return true;
+    }
+
+private:
+    /* Reads the fields of a recorded request */
+    struct reader
+    {
+        reader(std::string const &s) : m_s(s), m_pos(0), m_ok(true) {}
+
+        int64_t i64()
+        {
+            int64_t x = 0;
+            raw(&x, sizeof(x));
+            return x;
+        }
+
+        std::string data()
+        {
+            int64_t len = i64();
+            if (len < 0 || (uint64_t)len > m_s.size() - m_pos)
+            {
+                m_ok = false;
+                return std::string();
+            }
+            m_pos += (size_t)len;
+            return m_s.substr(m_pos - (size_t)len, (size_t)len);
+        }
+
+        void raw(void *p, size_t len)
+        {
+            if (len > m_s.size() - m_pos)
+                m_ok = false;
+            else
+            {
+                memcpy(p, m_s.data() + m_pos, len);
+                m_pos += len;
+            }
+        }
+
+        bool ok() const { return m_ok; }
+
+    private:
+        std::string const &m_s;
+        size_t m_pos;
+        bool m_ok;
+    };
+
+    /* Serves the include files that the client sent during the capture */
+    struct recorded_include : ID3DInclude
+    {
+        recorded_include(reader &in) : m_in(in) {}
+
+        virtual HRESULT Open(D3D_INCLUDE_TYPE IncludeType, char const *pFileName,
+                             void const *pParentData, void const **ppData,
+                             uint32_t *pBytes)
+        {
+            HRESULT ret = (HRESULT)m_in.i64();
+            if (SUCCEEDED(ret))
+            {
+                m_files.push_back(m_in.data());
+                *ppData = m_files.back().data();
+                *pBytes = (uint32_t)m_files.back().size();
+            }
+            if (!m_in.ok() || m_in.i64() != D3D4LINUX_FINISHED)
+                return E_FAIL;
+            return ret;
+        }
+
+        virtual HRESULT Close(void const *pData)
+        {
+            return S_OK;
+        }
+
+    private:
+        reader &m_in;
+        /* Never reallocated while the DLL points into it */
+        std::deque<std::string> m_files;
+    };
+};
+
+static char const *op_name(int64_t op)
+{
+    static char const *names[] = { "compile", "reflect", "strip", "disassemble",
+                                   "preprocess", "reflect" };
+    int64_t i = op - D3D4LINUX_OP_COMPILE;
+    return i >= 0 && i < 6 ? names[i] : "unknown";
+}
+
+static double quantile(std::vector<double> &v, double q)
+{
+    if (v.empty())
+        return 0;
+    size_t i = std::min(v.size() - 1, (size_t)(q * v.size()));
+    std::nth_element(v.begin(), v.begin() + i, v.end());
+    return v[i];
+}
+
+int main(int argc, char *argv[])
+{
+    double speed = 1;
+    int threads = 64;
+    bool verbose = false;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "s:j:v")) != -1)
+    {
+        switch (opt)
+        {
+        case 's': speed = atof(optarg); break;
+        case 'j': threads = std::max(1, atoi(optarg)); break;
+        case 'v': verbose = true; break;
+        default: optind = argc + 1; break;
+        }
+    }
+
+    if (optind != argc - 1)
+    {
+        fprintf(stderr, "Usage: %s [-s <speed>] [-j <threads>] [-v] <capture>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *f = fopen(argv[optind], "rb");
+    if (!f)
+    {
+        perror(argv[optind]);
+        return EXIT_FAILURE;
+    }
+    std::vector<d3d4linux_capture::record> records;
+    d3d4linux_capture::record r;
+    while (d3d4linux_capture::read(f, r))
+        records.push_back(r);
+    bool torn = !feof(f) && fgetc(f) != EOF;
+    fclose(f);
+    if (torn)
+        fprintf(stderr, "%s: ignoring data after record %d\n", argv[optind], (int)records.size());
+    if (records.empty())
+        return EXIT_SUCCESS;
+
+    /* Processes append concurrently, so records may be slightly out of
+     * order */
+    std::stable_sort(records.begin(), records.end(),
+                     [](d3d4linux_capture::record const &a, d3d4linux_capture::record const &b)
+                     { return a.h.start_us < b.h.start_us; });
+
+    std::vector<d3d4linux_replay::result> results(records.size());
+    std::vector<char> decoded(records.size());
+    std::atomic<size_t> next(0);
+    auto start = std::chrono::steady_clock::now();
+    int64_t first_us = records.front().h.start_us;
+
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t)
+        workers.emplace_back([&]()
+        {
+            for (size_t i; (i = next++) < records.size(); )
+            {
+                /* Latency counts from when the request was due, so that
+                 * falling behind shows, as it would in a client */
+                auto due = std::chrono::steady_clock::now();
+                if (speed > 0)
+                {
+                    due = start + std::chrono::microseconds(
+                              (int64_t)((records[i].h.start_us - first_us) / speed));
+                    std::this_thread::sleep_until(due);
+                }
+                decoded[i] = d3d4linux_replay::run(records[i], results[i]);
+                results[i].msecs = std::chrono::duration<double, std::milli>(
+                                       std::chrono::steady_clock::now() - due).count();
+            }
+        });
+    for (auto &w : workers)
+        w.join();
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    /* Latencies and mismatches by op */
+    struct stats
+    {
+        std::vector<double> recorded, replayed;
+        int mismatches = 0, undecoded = 0;
+    };
+    std::map<std::string, stats> by_op;
+    int total_mismatches = 0;
+    for (size_t i = 0; i < records.size(); ++i)
+    {
+        d3d4linux_capture::record const &rec = records[i];
+        d3d4linux_replay::result const &res = results[i];
+        stats &s = by_op[op_name(rec.h.op)];
+        if (!decoded[i])
+        {
+            ++s.undecoded;
+            continue;
+        }
+        s.recorded.push_back(rec.h.duration_us / 1e3);
+        s.replayed.push_back(res.msecs);
+        if (res.ret != rec.h.ret || res.has_output != rec.has_output || res.output != rec.output)
+        {
+            ++s.mismatches;
+            ++total_mismatches;
+            if (verbose)
+                fprintf(stderr, "record %d (%s): recorded 0x%x with %d bytes, replayed 0x%x with %d bytes\n",
+                        (int)i, op_name(rec.h.op), (int)rec.h.ret, (int)rec.output.size(),
+                        (int)res.ret, (int)res.output.size());
+        }
+    }
+
+    printf("%-12s %7s %26s %26s %10s\n", "op", "count", "recorded p50/p90/p99 ms",
+           "replayed p50/p90/p99 ms", "mismatches");
+    for (auto &it : by_op)
+    {
+        stats &s = it.second;
+        printf("%-12s %7d %8.1f %8.1f %8.1f %8.1f %8.1f %8.1f %10d\n", it.first.c_str(),
+               (int)s.recorded.size(),
+               quantile(s.recorded, 0.5), quantile(s.recorded, 0.9), quantile(s.recorded, 0.99),
+               quantile(s.replayed, 0.5), quantile(s.replayed, 0.9), quantile(s.replayed, 0.99),
+               s.mismatches);
+        if (s.undecoded)
+            printf("%-12s %7d requests could not be decoded\n", "", s.undecoded);
+    }
+    double span = (records.back().h.start_us + records.back().h.duration_us - first_us) / 1e6;
+    printf("recorded span %.1f s, replayed in %.1f s\n", span, wall);
+
+    return total_mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}